@@ -0,0 +1,1457 @@
+#include "lab.hpp"
+
+// ******* Benchmarks *******
+
+// spheres and triangles spread uniformly through a box in front of the camera
+static std::vector<std::shared_ptr<Shape>> makeRandomScene(std::size_t count, unsigned seed)
+{
+	std::mt19937 generator(seed);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+	// keep the density roughly constant as the count grows
+	float size = 400.0f / std::cbrt(static_cast<float>(count));
+
+	std::vector<std::shared_ptr<Shape>> scene;
+	scene.reserve(count);
+
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		atlas::math::Point p{ 800.0f * unit(generator) - 400.0f,
+			800.0f * unit(generator) - 400.0f,
+			-600.0f - 800.0f * unit(generator) };
+
+		if (i % 2 == 0)
+		{
+			scene.push_back(std::make_shared<Sphere>(p, size * (0.25f + 0.5f * unit(generator))));
+		}
+		else
+		{
+			auto offset = [&] {
+				return atlas::math::Vector{ unit(generator) - 0.5f,
+					unit(generator) - 0.5f,
+					unit(generator) - 0.5f } * (2.0f * size);
+			};
+			scene.push_back(std::make_shared<Triangle>(p, p + offset(), p + offset()));
+		}
+	}
+
+	return scene;
+}
+
+// rays/sec of the linear scene loop against each BVH traversal
+static void benchmarkBVH()
+{
+	using Clock = std::chrono::steady_clock;
+
+	Pinhole camera{};
+	camera.setEye({ 0, 0, 1 });
+	camera.computeUVW();
+
+	std::size_t const side{ 256 };
+	std::vector<atlas::math::Ray<atlas::math::Vector>> rays;
+	for (std::size_t r = 0; r < side; ++r)
+	{
+		for (std::size_t c = 0; c < side; ++c)
+		{
+			atlas::math::Point p{ 600.0f * (c + 0.5f) / side - 300.0f, 600.0f * (r + 0.5f) / side - 300.0f, 0.0f };
+			rays.push_back({ { 0, 0, 1 }, camera.rayDirection(p) });
+		}
+	}
+
+	auto raysPerSecond = [&](std::size_t numRays, auto&& trace) {
+		auto start = Clock::now();
+		std::size_t hits{ 0 };
+		for (std::size_t i = 0; i < numRays; ++i)
+		{
+			ShadeRec sr{};
+			sr.t = std::numeric_limits<float>::max();
+			hits += trace(rays[i], sr) ? 1 : 0;
+		}
+		std::chrono::duration<double> elapsed = Clock::now() - start;
+		return hits > numRays ? 0.0 : numRays / elapsed.count();
+	};
+
+	fmt::print("AVX2 {}\n", cpuHasAVX2() ? "available" : "not available");
+	fmt::print("rays/sec\n{:>10} {:>10} {:>12} {:>12} {:>12} {:>12} {:>12}\n",
+		"prims", "build ms", "linear", "flat", "binary", "wide", "wide avx2");
+
+	for (std::size_t count : { 10, 100, 1000, 10000, 100000, 1000000 })
+	{
+		std::vector<std::shared_ptr<Shape>> scene{ makeRandomScene(count, 7) };
+
+		auto start = Clock::now();
+		BVH bvh{ scene };
+		std::chrono::duration<double, std::milli> build = Clock::now() - start;
+
+		// the linear loop gets fewer rays on big scenes to keep the run short
+		std::size_t linearRays = std::clamp<std::size_t>(20000000 / count, 64, rays.size());
+		double linear = raysPerSecond(linearRays, [&](auto const& ray, ShadeRec& sr) {
+			bool hit{};
+			for (auto const& obj : scene)
+				hit |= obj->hit(ray, sr);
+			return hit;
+		});
+
+		double flat = raysPerSecond(linearRays, [&](auto const& ray, ShadeRec& sr) {
+			return bvh.getStore().hit(ray, sr);
+		});
+
+		double perTraversal[3];
+		for (int t = 0; t < 3; ++t)
+		{
+			bvh.setTraversal(static_cast<BVH::Traversal>(t));
+			perTraversal[t] = raysPerSecond(rays.size(), [&](auto const& ray, ShadeRec& sr) {
+				return bvh.hit(ray, sr);
+			});
+		}
+
+		fmt::print("{:>10} {:>10.1f} {:>12.0f} {:>12.0f} {:>12.0f} {:>12.0f} {:>12.0f}\n",
+			count, build.count(), linear, flat, perTraversal[0], perTraversal[1], perTraversal[2]);
+	}
+}
+
+// shadow rays/sec towards one point light: the Shape::hit loop, a closest
+// hit through the BVH, and the any-hit query with and without the cache
+static void benchmarkShadows()
+{
+	using Clock = std::chrono::steady_clock;
+	using Ray = atlas::math::Ray<atlas::math::Vector>;
+
+	Pinhole camera{};
+	camera.setEye({ 0, 0, 1 });
+	camera.computeUVW();
+
+	atlas::math::Point const light{ 500.0f, 500.0f, -200.0f };
+
+	fmt::print("shadow rays/sec\n{:>10} {:>8} {:>12} {:>12} {:>12} {:>12}\n",
+		"prims", "blocked", "shape hit", "closest", "any-hit", "cached");
+
+	for (std::size_t count : { 100, 1000, 10000, 100000, 1000000 })
+	{
+		std::vector<std::shared_ptr<Shape>> scene{ makeRandomScene(count, 7) };
+		BVH bvh{ scene };
+
+		// shadow rays from the visible points, in scanline order
+		std::size_t const side{ 256 };
+		std::vector<Ray> rays;
+		std::vector<float> distances;
+		for (std::size_t r = 0; r < side; ++r)
+		{
+			for (std::size_t c = 0; c < side; ++c)
+			{
+				atlas::math::Point p{ 600.0f * (c + 0.5f) / side - 300.0f, 600.0f * (r + 0.5f) / side - 300.0f, 0.0f };
+				Ray primary{ { 0, 0, 1 }, camera.rayDirection(p) };
+
+				ShadeRec sr{};
+				sr.t = std::numeric_limits<float>::max();
+				if (!bvh.hit(primary, sr))
+					continue;
+
+				atlas::math::Vector wi = glm::normalize(light - sr.hit_point);
+				atlas::math::Point origin = sr.hit_point + 0.01f * glm::normalize(sr.normal) *
+					(glm::dot(sr.normal, wi) >= 0.0f ? 1.0f : -1.0f);
+				rays.push_back({ origin, wi });
+				distances.push_back(glm::length(light - origin));
+			}
+		}
+
+		auto raysPerSecond = [&](std::size_t numRays, auto&& occluded, std::size_t& blocked) {
+			auto start = Clock::now();
+			blocked = 0;
+			for (std::size_t i = 0; i < numRays; ++i)
+				blocked += occluded(rays[i], distances[i]) ? 1 : 0;
+			std::chrono::duration<double> elapsed = Clock::now() - start;
+			return numRays / elapsed.count();
+		};
+
+		std::size_t linearRays = std::clamp<std::size_t>(20000000 / count, 64, rays.size());
+		std::size_t blocked[4];
+
+		double shapeHit = raysPerSecond(linearRays, [&](Ray const& ray, float tMax) {
+			for (auto const& obj : scene)
+			{
+				ShadeRec probe{};
+				probe.t = tMax;
+				if (obj->hit(ray, probe) && probe.t < tMax)
+					return true;
+			}
+			return false;
+		}, blocked[0]);
+
+		double closest = raysPerSecond(rays.size(), [&](Ray const& ray, float tMax) {
+			Hit hit{ tMax, Hit::none };
+			return bvh.closestHit(ray, hit);
+		}, blocked[1]);
+
+		double anyHit = raysPerSecond(rays.size(), [&](Ray const& ray, float tMax) {
+			return bvh.occluded(ray, tMax);
+		}, blocked[2]);
+
+		std::uint32_t lastOccluder{ Hit::none };
+		double cached = raysPerSecond(rays.size(), [&](Ray const& ray, float tMax) {
+			return bvh.occluded(ray, tMax, lastOccluder);
+		}, blocked[3]);
+
+		if (blocked[1] != blocked[2] || blocked[1] != blocked[3])
+			fmt::print("mismatch: closest {} any-hit {} cached {}\n", blocked[1], blocked[2], blocked[3]);
+
+		fmt::print("{:>10} {:>7.1f}% {:>12.0f} {:>12.0f} {:>12.0f} {:>12.0f}\n",
+			count, 100.0 * blocked[1] / std::max<std::size_t>(rays.size(), 1),
+			shapeHit, closest, anyHit, cached);
+	}
+}
+
+// frame time and noise at 4 spp with one light sample per shading point,
+// against visiting every light; the noise is relative RMSE against the
+// exact sum over lights (or a 64 light sample estimate where that is too
+// slow), with the same camera samples so only the light choice differs
+static void benchmarkLights()
+{
+	using Clock = std::chrono::steady_clock;
+
+	std::shared_ptr<World> world{ makeShadingScene() };
+	world->width = 200;
+	world->height = 200;
+	world->sampler = std::make_shared<Sobol>(4);
+
+	Pinhole camera{};
+	camera.setEye({ 0, 0, 1 });
+	camera.setZoom(1.0f / 3.0f);
+	camera.computeUVW();
+
+	auto render = [&](int lightSamples, LightSampler::Strategy strategy) {
+		world->lightSamples = lightSamples;
+		world->lightSampler = lightSamples > 0
+			? std::make_shared<LightSampler>(world->lights, strategy)
+			: nullptr;
+
+		auto start = Clock::now();
+		camera.renderScene(world);
+		std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+		return elapsed.count();
+	};
+
+	auto rmse = [&](std::vector<Colour> const& reference) {
+		double sum{ 0.0 };
+		double norm{ 0.0 };
+		for (std::size_t i = 0; i < reference.size(); ++i)
+		{
+			Colour d = world->image[i] - reference[i];
+			sum += glm::dot(d, d);
+			norm += glm::dot(reference[i], reference[i]);
+		}
+		return std::sqrt(sum / std::max(norm, 1e-12));
+	};
+
+	fmt::print("relative rmse\n{:>8} {:>10} {:>10} {:>10} {:>10} {:>10}\n",
+		"lights", "all ms", "power ms", "rmse", "tree ms", "rmse");
+
+	for (std::size_t count : { 10, 100, 1000, 10000, 100000 })
+	{
+		// the same total power spread over count lights around the scene
+		std::mt19937 generator(11);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+		world->lights.clear();
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			std::shared_ptr<PointLight> light{ std::make_shared<PointLight>() };
+			light->setLocation({ 1200.0f * unit(generator) - 600.0f,
+				1200.0f * unit(generator) - 600.0f,
+				1200.0f * unit(generator) - 900.0f });
+			light->setColour({ unit(generator), unit(generator), unit(generator) });
+			light->scaleRadiance(3.0f * unit(generator) / count);
+			light->setShadows(true);
+			world->lights.push_back(light);
+		}
+
+		std::string all{ "-" };
+		if (count <= 1000)
+			all = fmt::format("{:.1f}", render(0, LightSampler::Strategy::Power));
+		else
+			render(64, LightSampler::Strategy::Hierarchy);
+
+		std::vector<Colour> reference{ world->image };
+
+		double powerMs = render(1, LightSampler::Strategy::Power);
+		double powerError = rmse(reference);
+		double treeMs = render(1, LightSampler::Strategy::Hierarchy);
+		double treeError = rmse(reference);
+
+		fmt::print("{:>8} {:>10} {:>10.1f} {:>10.3f} {:>10.1f} {:>10.3f}\n",
+			count, all, powerMs, powerError, treeMs, treeError);
+	}
+}
+
+// RMSE against a high sample count reference for every sampler, at a
+// reduced resolution to keep the reference affordable
+static void benchmarkSamplers()
+{
+	using Clock = std::chrono::steady_clock;
+
+	std::shared_ptr<World> world{ makeShadingScene() };
+	world->width = 200;
+	world->height = 200;
+
+	Pinhole camera{};
+	camera.setEye({ 0, 0, 1 });
+	camera.setZoom(1.0f / 3.0f);
+	camera.computeUVW();
+
+	world->sampler = std::make_shared<Jitter>(4096, 0x5eedu);
+	camera.renderScene(world);
+	std::vector<Colour> reference{ world->image };
+
+	using Factory = std::function<std::shared_ptr<Sampler>(int)>;
+	std::vector<std::pair<char const*, Factory>> samplers{
+		{ "regular", [](int n) { return std::make_shared<Regular>(n); } },
+		{ "random", [](int n) { return std::make_shared<Random>(n); } },
+		{ "jitter", [](int n) { return std::make_shared<Jitter>(n); } },
+		{ "halton", [](int n) { return std::make_shared<Halton>(n); } },
+		{ "sobol", [](int n) { return std::make_shared<Sobol>(n); } },
+		{ "pmj02", [](int n) { return std::make_shared<PMJ02>(n); } },
+	};
+
+	fmt::print("{:>8} {:>6} {:>10} {:>12}\n", "sampler", "spp", "ms", "rmse");
+
+	for (auto const& [name, make] : samplers)
+	{
+		for (int spp : { 1, 4, 16, 64, 256 })
+		{
+			world->sampler = make(spp);
+
+			auto start = Clock::now();
+			camera.renderScene(world);
+			std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+
+			double sum{ 0.0 };
+			for (std::size_t i = 0; i < reference.size(); ++i)
+			{
+				Colour d = world->image[i] - reference[i];
+				sum += glm::dot(d, d) / 3.0;
+			}
+
+			fmt::print("{:>8} {:>6} {:>10.1f} {:>12.6f}\n",
+				name, spp, elapsed.count(), std::sqrt(sum / reference.size()));
+		}
+	}
+}
+
+// load times of a random scene of count spheres and triangles in both file
+// forms, next to building the same scene from Shape objects
+static void benchmarkSceneFiles(std::size_t count)
+{
+	using Clock = std::chrono::steady_clock;
+	using Milliseconds = std::chrono::duration<double, std::milli>;
+
+	std::mt19937 generator(7);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	float size = 400.0f / std::cbrt(static_cast<float>(count));
+
+	SceneFile scene{};
+	for (std::uint32_t m = 0; m < 8; ++m)
+		scene.addMaterial({ 0.25f, 0.65f, { unit(generator), unit(generator), unit(generator) } });
+	scene.addLight({ static_cast<std::uint32_t>(LightType::Ambient), 0, 1.0f, { 1, 1, 1 }, { 0, 0, 0 } });
+	scene.addLight({ static_cast<std::uint32_t>(LightType::Point), 1, 1.5f, { 1, 1, 1 }, { -300, 150, 150 } });
+
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		float p[3]{ 800.0f * unit(generator) - 400.0f,
+			800.0f * unit(generator) - 400.0f,
+			-600.0f - 800.0f * unit(generator) };
+		std::uint32_t material{ static_cast<std::uint32_t>(i % 8) };
+
+		if (i % 2 == 0)
+		{
+			scene.addSphere({ { p[0], p[1], p[2] }, size * (0.25f + 0.5f * unit(generator)), material });
+		}
+		else
+		{
+			SceneTriangle t{ { p[0], p[1], p[2] }, {}, {}, material };
+			for (int k = 0; k < 3; ++k)
+			{
+				t.b[k] = p[k] + (unit(generator) - 0.5f) * 2.0f * size;
+				t.c[k] = p[k] + (unit(generator) - 0.5f) * 2.0f * size;
+			}
+			scene.addTriangle(t);
+		}
+	}
+
+	std::string const textFile{ "bench_scene.scn" };
+	std::string const binaryFile{ "bench_scene.scb" };
+
+	auto time = [](auto&& run) {
+		auto start = Clock::now();
+		bool ok = run();
+		return ok ? Milliseconds{ Clock::now() - start }.count() : -1.0;
+	};
+
+	fmt::print("{} primitives\n", count);
+	fmt::print("{:>24} {:>10.1f} ms\n", "save text", time([&] { return scene.saveText(textFile); }));
+	fmt::print("{:>24} {:>10.1f} ms\n", "save binary", time([&] { return scene.saveBinary(binaryFile); }));
+
+	auto matches = [&scene](SceneFile const& other) {
+		return other.spheres().size == scene.spheres().size &&
+			other.triangles().size == scene.triangles().size &&
+			std::memcmp(other.spheres().data, scene.spheres().data,
+				scene.spheres().size * sizeof(SceneSphere)) == 0 &&
+			std::memcmp(other.triangles().data, scene.triangles().data,
+				scene.triangles().size * sizeof(SceneTriangle)) == 0;
+	};
+
+	SceneFile loaded{};
+	fmt::print("{:>24} {:>10.1f} ms\n", "load text", time([&] { return loaded.load(textFile); }));
+	bool sameText{ matches(loaded) };
+
+	// best of a few, the first load also pays for reading the file from disk
+	double best{ std::numeric_limits<double>::max() };
+	for (int run = 0; run < 5; ++run)
+		best = std::min(best, time([&] { return loaded.load(binaryFile); }));
+	fmt::print("{:>24} {:>10.3f} ms\n", "load binary (mapped)", best);
+
+	bool sameBinary{ matches(loaded) };
+
+	std::vector<std::shared_ptr<Shape>> shapes;
+	fmt::print("{:>24} {:>10.1f} ms\n", "Shape objects", time([&] {
+		std::vector<std::shared_ptr<Material>> materials;
+		for (SceneMaterial const& m : loaded.materials())
+		{
+			std::shared_ptr<Matte> matte{ std::make_shared<Matte>() };
+			matte->set_ka(m.ka);
+			matte->set_kd(m.kd);
+			matte->set_cd({ m.colour[0], m.colour[1], m.colour[2] });
+			materials.push_back(matte);
+		}
+
+		shapes.reserve(loaded.spheres().size + loaded.triangles().size);
+		for (SceneSphere const& p : loaded.spheres())
+		{
+			shapes.push_back(std::make_shared<Sphere>(atlas::math::Point{ p.centre[0], p.centre[1], p.centre[2] }, p.radius));
+			shapes.back()->setMaterial(materials[p.material]);
+		}
+		for (SceneTriangle const& p : loaded.triangles())
+		{
+			shapes.push_back(std::make_shared<Triangle>(atlas::math::Point{ p.a[0], p.a[1], p.a[2] },
+				atlas::math::Point{ p.b[0], p.b[1], p.b[2] },
+				atlas::math::Point{ p.c[0], p.c[1], p.c[2] }));
+			shapes.back()->setMaterial(materials[p.material]);
+		}
+		return true;
+	}));
+
+	Pinhole camera{};
+	std::shared_ptr<World> world;
+	fmt::print("{:>24} {:>10.1f} ms\n", "world and BVH from file", time([&] {
+		world = loaded.makeWorld(camera);
+		return true;
+	}));
+
+	fmt::print("round trip exact: text {}, binary {}\n", sameText ? "yes" : "NO", sameBinary ? "yes" : "NO");
+
+	std::remove(textFile.c_str());
+	std::remove(binaryFile.c_str());
+}
+
+// a sphere of about count triangles with vertex normals and a usemtl group
+// per band, written the way exporters do
+static bool writeSphereOBJ(std::string const& filename, std::size_t count)
+{
+	std::size_t rings{ std::max<std::size_t>(2, static_cast<std::size_t>(std::sqrt(count / 2.0))) };
+	std::size_t segments{ std::max<std::size_t>(3, count / (2 * rings)) };
+
+	std::ofstream file{ filename, std::ios::binary };
+	file << "# " << rings << " rings, " << segments << " segments\n";
+	for (std::size_t r = 0; r <= rings; ++r)
+	{
+		float theta{ 3.14159265f * r / rings };
+		for (std::size_t s = 0; s < segments; ++s)
+		{
+			float phi{ 6.28318531f * s / segments };
+			float x{ std::sin(theta) * std::cos(phi) };
+			float y{ std::cos(theta) };
+			float z{ std::sin(theta) * std::sin(phi) };
+			file << fmt::format("v {:.6f} {:.6f} {:.6f}\nvn {:.6f} {:.6f} {:.6f}\n",
+				100 * x, 100 * y, 100 * z, x, y, z);
+		}
+	}
+
+	for (std::size_t r = 0; r < rings; ++r)
+	{
+		file << "usemtl band" << r % 4 << "\n";
+		for (std::size_t s = 0; s < segments; ++s)
+		{
+			std::size_t a{ r * segments + s + 1 };
+			std::size_t b{ r * segments + (s + 1) % segments + 1 };
+			std::size_t c{ a + segments };
+			std::size_t d{ b + segments };
+			file << fmt::format("f {0}//{0} {1}//{1} {2}//{2}\nf {1}//{1} {3}//{3} {2}//{2}\n", a, c, b, d);
+		}
+	}
+
+	return static_cast<bool>(file);
+}
+
+static void benchmarkOBJ(std::size_t count)
+{
+	using Clock = std::chrono::steady_clock;
+	using Milliseconds = std::chrono::duration<double, std::milli>;
+
+	std::string const filename{ "bench_mesh.obj" };
+	if (!writeSphereOBJ(filename, count))
+	{
+		fmt::print("could not write {}\n", filename);
+		return;
+	}
+
+	std::shared_ptr<TriangleMesh> mesh;
+	std::vector<std::string> names;
+	for (std::size_t threads : { std::size_t{ 1 }, std::size_t{ 0 } })
+	{
+		// best of a few, the first load also pays for reading the file from disk
+		double best{ std::numeric_limits<double>::max() };
+		for (int run = 0; run < 3; ++run)
+		{
+			auto start = Clock::now();
+			mesh = TriangleMesh::loadOBJ(filename, &names, threads);
+			best = std::min(best, Milliseconds{ Clock::now() - start }.count());
+		}
+		fmt::print("{:>24} {:>10.1f} ms\n", threads == 1 ? "load OBJ, 1 thread" : "load OBJ, all threads", best);
+	}
+	std::remove(filename.c_str());
+
+	if (!mesh)
+	{
+		fmt::print("could not read {}\n", filename);
+		return;
+	}
+
+	// a Triangle behind a shared_ptr: the object, the control block of
+	// make_shared and the pointer in World::scene
+	std::size_t faces{ mesh->numFaces() };
+	double meshBytes{ static_cast<double>(mesh->memoryUsed()) / faces };
+	double shapeBytes{ static_cast<double>(sizeof(Triangle) + 16 + sizeof(std::shared_ptr<Shape>)) };
+
+	fmt::print("{} vertices, {} faces, {} materials\n", mesh->numVertices(), faces, names.size());
+	fmt::print("{:>24} {:>10.1f} bytes\n", "TriangleMesh per face", meshBytes);
+	fmt::print("{:>24} {:>10.1f} bytes, {} allocations\n", "Triangle per face", shapeBytes, faces);
+
+	std::vector<std::shared_ptr<Shape>> scene{ mesh };
+	auto start = Clock::now();
+	BVH bvh{ scene, 0 };
+	fmt::print("{:>24} {:>10.1f} ms\n", "BVH over the mesh", Milliseconds{ Clock::now() - start }.count());
+}
+
+// a unit sphere of triangles with vertex normals, optionally transformed
+static std::shared_ptr<TriangleMesh> makeSphereMesh(std::size_t rings,
+	std::size_t segments,
+	Transform const& transform = {})
+{
+	Transform const inverse{ transform.inverse() };
+	std::vector<atlas::math::Point> vertices;
+	std::vector<Normal> normals;
+	std::vector<TriangleMesh::Face> faces;
+	for (std::size_t r = 0; r <= rings; ++r)
+	{
+		float theta{ 3.14159265f * r / rings };
+		for (std::size_t s = 0; s < segments; ++s)
+		{
+			float phi{ 6.28318531f * s / segments };
+			atlas::math::Point p{ std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi) };
+
+			// on the unit sphere the position is the normal
+			vertices.push_back(transform.point(p));
+			normals.push_back(glm::normalize(inverse.normal(p)));
+		}
+	}
+
+	for (std::uint32_t r = 0; r < rings; ++r)
+	{
+		for (std::uint32_t s = 0; s < segments; ++s)
+		{
+			std::uint32_t a{ static_cast<std::uint32_t>(r * segments + s) };
+			std::uint32_t b{ static_cast<std::uint32_t>(r * segments + (s + 1) % segments) };
+			std::uint32_t c{ a + static_cast<std::uint32_t>(segments) };
+			std::uint32_t d{ b + static_cast<std::uint32_t>(segments) };
+			faces.push_back({ { a, c, b }, { a, c, b }, 0 });
+			faces.push_back({ { b, c, d }, { b, c, d }, 0 });
+		}
+	}
+
+	return std::make_shared<TriangleMesh>(std::move(vertices), std::move(normals), faces);
+}
+
+// count copies of a small tree, as instances of one prototype and as
+// separate shapes with their geometry transformed
+static void benchmarkInstances(std::size_t count)
+{
+	using Clock = std::chrono::steady_clock;
+	using Milliseconds = std::chrono::duration<double, std::milli>;
+
+	std::shared_ptr<Matte> leaves{ std::make_shared<Matte>() };
+	leaves->set_ka(0.25f);
+	leaves->set_kd(0.65f);
+	leaves->set_cd({ 0.2f, 0.6f, 0.2f });
+
+	std::shared_ptr<Matte> bark{ std::make_shared<Matte>() };
+	bark->set_ka(0.25f);
+	bark->set_kd(0.65f);
+	bark->set_cd({ 0.5f, 0.3f, 0.1f });
+
+	// crown of triangles above a trunk sphere, in object space
+	Transform const crownPlacement{ Transform::translate({ 0, 1.5f, 0 }) };
+	std::shared_ptr<TriangleMesh> crown{ makeSphereMesh(12, 24, crownPlacement) };
+	crown->setColour({ 0.2f, 0.6f, 0.2f });
+	crown->setMaterial(leaves);
+
+	std::shared_ptr<Sphere> trunk{ std::make_shared<Sphere>(atlas::math::Point{ 0, 0, 0 }, 0.5f) };
+	trunk->setColour({ 0.5f, 0.3f, 0.1f });
+	trunk->setMaterial(bark);
+
+	// trees on a square grid, each turned and scaled at random
+	std::mt19937 generator(11);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	std::size_t side{ static_cast<std::size_t>(std::ceil(std::sqrt(static_cast<double>(count)))) };
+	std::vector<Transform> placements;
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		atlas::math::Vector position{ 4.0f * (i % side) - 2.0f * side, -6.0f, -8.0f - 4.0f * (i / side) };
+		placements.push_back(Transform::translate(position) *
+			Transform::rotate({ 0, 1, 0 }, 6.28318531f * unit(generator)) *
+			Transform::scale(atlas::math::Vector{ 0.7f + 0.6f * unit(generator) }));
+	}
+
+	auto render = [](std::shared_ptr<World> const& world) {
+		world->width = 300;
+		world->height = 300;
+		world->background = { 0.6f, 0.7f, 0.9f };
+		world->sampler = std::make_shared<Jitter>(1);
+
+		std::shared_ptr<Ambient> ambient{ std::make_shared<Ambient>() };
+		ambient->scaleRadiance(1.0f);
+		ambient->setColour({ 1, 1, 1 });
+		world->ambient = ambient;
+
+		std::shared_ptr<PointLight> light{ std::make_shared<PointLight>() };
+		light->setLocation({ -200, 300, 100 });
+		light->scaleRadiance(1.5f);
+		light->setShadows(true);
+		world->lights.push_back(light);
+
+		Pinhole camera{};
+		camera.setEye({ 0, 4, 10 });
+		camera.setLookAt({ 0, -6, -40 });
+		camera.setZoom(0.5f);
+		camera.computeUVW();
+
+		auto start = Clock::now();
+		camera.renderScene(world);
+		return Milliseconds{ Clock::now() - start }.count();
+	};
+
+	fmt::print("{} trees of {} triangles and a sphere\n", count, crown->numFaces());
+	fmt::print("{:>12} {:>12} {:>12} {:>12} {:>12}\n", "", "build ms", "primitives", "shape MB", "render ms");
+
+	// the prototype is built once, every tree is an instance of it
+	std::shared_ptr<World> instanced{ std::make_shared<World>() };
+	auto start = Clock::now();
+	std::shared_ptr<BVH const> tree{ std::make_shared<BVH>(std::vector<std::shared_ptr<Shape>>{ crown, trunk }) };
+	for (Transform const& placement : placements)
+		instanced->scene.push_back(std::make_shared<Instance>(tree, placement));
+	instanced->bvh = std::make_shared<BVH>(instanced->scene, instanced->numThreads);
+	double build{ Milliseconds{ Clock::now() - start }.count() };
+
+	std::size_t primitives{ crown->numFaces() + 1 + count };
+	double bytes{ static_cast<double>(crown->memoryUsed() + sizeof(Sphere) + count * sizeof(Instance)) };
+	double time{ render(instanced) };
+	fmt::print("{:>12} {:>12.1f} {:>12} {:>12.2f} {:>12.1f}\n", "instanced", build, primitives, bytes / (1 << 20), time);
+
+	// the same forest with every tree's geometry copied, when it fits
+	if (count * crown->numFaces() > 4000000)
+	{
+		fmt::print("{:>12} skipped above 4M triangles\n", "copies");
+		return;
+	}
+
+	std::shared_ptr<World> copies{ std::make_shared<World>() };
+	start = Clock::now();
+	bytes = 0;
+	for (Transform const& placement : placements)
+	{
+		std::shared_ptr<TriangleMesh> mesh{ makeSphereMesh(12, 24, placement * crownPlacement) };
+		mesh->setColour(crown->getColour());
+		mesh->setMaterial(leaves);
+		copies->scene.push_back(mesh);
+		bytes += mesh->memoryUsed() + sizeof(TriangleMesh);
+
+		atlas::math::Point centre{ placement.point({ 0, 0, 0 }) };
+		float radius{ 0.5f * glm::length(placement.x) };
+		copies->scene.push_back(std::make_shared<Sphere>(centre, radius));
+		copies->scene.back()->setColour(trunk->getColour());
+		copies->scene.back()->setMaterial(bark);
+		bytes += sizeof(Sphere);
+	}
+	copies->bvh = std::make_shared<BVH>(copies->scene, copies->numThreads);
+	build = Milliseconds{ Clock::now() - start }.count();
+
+	primitives = count * (crown->numFaces() + 1);
+	time = render(copies);
+	fmt::print("{:>12} {:>12.1f} {:>12} {:>12.2f} {:>12.1f}\n", "copies", build, primitives, bytes / (1 << 20), time);
+
+	// both describe the same geometry, up to rounding at silhouettes
+	std::size_t differing{ 0 };
+	for (std::size_t i = 0; i < instanced->pixels.size(); i += 3)
+	{
+		for (std::size_t k = i; k < i + 3; ++k)
+		{
+			if (std::abs(instanced->pixels[k] - copies->pixels[k]) > 4)
+			{
+				++differing;
+				break;
+			}
+		}
+	}
+	fmt::print("pixels differing: {:.2f}%\n", 300.0 * differing / instanced->pixels.size());
+}
+
+// makeShadingScene as a StaticScene, for the same image without virtual
+// calls
+static auto makeStaticShadingScene()
+{
+	using atlas::math::Point;
+
+	StaticMatte const red{ 25, 65, { 1, 0, 0 } };
+	StaticMatte const blue{ 25, 65, { 0, 0, 1 } };
+	StaticMatte const green{ 25, 65, { 0, 1, 0 } };
+	StaticMatte const white{ 25, 65, { 1, 1, 1 } };
+	StaticMatte const black{ 25, 65, { 0, 0, 0 } };
+
+	return StaticScene<1, Sphere, Sphere, Sphere, Plane, Plane, Triangle>{
+		Colour{ 1.5f },
+		{ StaticPointLight{ { -300, 150, 150 }, Colour{ 1.5f }, true } },
+		{ red, blue, green, white, white, black },
+		Sphere{ { 0, 0, -600 }, 128.0f },
+		Sphere{ { 128, 32, -700 }, 64.0f },
+		Sphere{ { -128, 32, -700 }, 64.0f },
+		Plane{ { 0, 0, -800 }, { 0, 2, 1 } },
+		Plane{ { 0, 0, -800 }, { 0, -2, 1 } },
+		Triangle{ { -50, 0, -200 }, { 50, 0, -200 }, { 0, 50, -200 } } };
+}
+
+// the shading scene rendered on one thread through World (BVH, virtual
+// shapes, materials and lights) and as a StaticScene
+static void benchmarkStaticScene()
+{
+	using Clock = std::chrono::steady_clock;
+	using Milliseconds = std::chrono::duration<double, std::milli>;
+
+	Pinhole camera{};
+	camera.setEye({ 0, 0, 1 });
+	camera.computeUVW();
+
+	auto best = [](auto&& render) {
+		double fastest{ std::numeric_limits<double>::max() };
+		for (int run = 0; run < 5; ++run)
+		{
+			auto start = Clock::now();
+			render();
+			fastest = std::min(fastest, Milliseconds{ Clock::now() - start }.count());
+		}
+		return fastest;
+	};
+
+	std::shared_ptr<World> world{ makeShadingScene() };
+	world->numThreads = 1;
+	double dynamic{ best([&] { camera.renderScene(world); }) };
+
+	auto scene = makeStaticShadingScene();
+	Jitter sampler{ 4 };
+	World image{};
+	image.width = world->width;
+	image.height = world->height;
+	double fixed{ best([&] { camera.renderStatic(scene, sampler, image); }) };
+
+	double rays{ static_cast<double>(world->width * world->height * sampler.getNumSamples()) };
+	fmt::print("{:>10} {:>10} {:>10}\n", "", "ms", "Mrays/s");
+	fmt::print("{:>10} {:>10.1f} {:>10.2f}\n", "World", dynamic, rays / (1e3 * dynamic));
+	fmt::print("{:>10} {:>10.1f} {:>10.2f}\n", "static", fixed, rays / (1e3 * fixed));
+
+	std::size_t differing{ 0 };
+	for (std::size_t i = 0; i < image.pixels.size(); ++i)
+		differing += std::abs(image.pixels[i] - world->pixels[i]) > 1 ? 1 : 0;
+	fmt::print("bytes differing by more than 1: {}\n", differing);
+}
+
+// the shading scene through every camera model, saved as
+// camera_<model>.bmp
+static void benchmarkCameras()
+{
+	using Clock = std::chrono::steady_clock;
+	using Milliseconds = std::chrono::duration<double, std::milli>;
+
+	std::shared_ptr<World> world{ makeShadingScene() };
+	world->numThreads = 1;
+
+	Pinhole pinhole{};
+	Orthographic orthographic{};
+	ThinLens thinLens{};
+	thinLens.setFocalDistance(600.0f);
+	thinLens.setLensRadius(20.0f);
+	Fisheye fisheye{};
+	fisheye.setFieldOfView(180.0f);
+
+	std::pair<char const*, Camera*> const cameras[]{
+		{ "pinhole", &pinhole },
+		{ "orthographic", &orthographic },
+		{ "thinlens", &thinLens },
+		{ "fisheye", &fisheye },
+	};
+
+	auto render = [&world](Camera const& camera) {
+		auto start = Clock::now();
+		camera.renderScene(world);
+		return Milliseconds{ Clock::now() - start }.count();
+	};
+
+	double rays{ static_cast<double>(world->width * world->height * world->sampler->getNumSamples()) };
+	fmt::print("{:>14} {:>10} {:>10}\n", "", "ms", "Mrays/s");
+
+	for (auto const& [name, camera] : cameras)
+	{
+		camera->setEye({ 0, 0, 1 });
+		camera->computeUVW();
+
+		double ms{ render(*camera) };
+		fmt::print("{:>14} {:>10.1f} {:>10.2f}\n", name, ms, rays / (1e3 * ms));
+		saveToFile(fmt::format("camera_{}.bmp", name), world->width, world->height, world->pixels);
+	}
+}
+
+// one timing of the benchmark suite; rays/sec is derived from raysPerOp,
+// which is 0 for ops that trace nothing
+struct SuiteResult
+{
+	std::string name;
+	double nsPerOp;
+	double raysPerOp;
+	std::size_t ops;
+};
+
+// fastest run of body, which does ops operations and returns something
+// computed from them so none of the work is optimised away; runs at least
+// 3 times and 0.25 s, at most 2 s unless a single run takes longer
+template <typename Body>
+static double bestNsPerOp(std::size_t ops, Body&& body)
+{
+	using Clock = std::chrono::steady_clock;
+
+	volatile std::size_t sink{ body() };
+	double best{ std::numeric_limits<double>::max() };
+	double total{ 0.0 };
+	for (int run = 0; (run < 3 || total < 0.25) && total < 2.0; ++run)
+	{
+		auto start = Clock::now();
+		sink = sink + body();
+		std::chrono::duration<double> elapsed = Clock::now() - start;
+		best = std::min(best, 1e9 * elapsed.count() / ops);
+		total += elapsed.count();
+	}
+	return best;
+}
+
+// times the intersection kernels, camera ray generation, the samplers and
+// Matte::shade on fixed batches, then full renders of the 02_Sphere,
+// 03_Camera and 04_Shading scenes at several resolutions
+static std::vector<SuiteResult> benchmarkSuite()
+{
+	using Ray = atlas::math::Ray<atlas::math::Vector>;
+
+	std::vector<SuiteResult> results;
+	auto record = [&results](std::string name, double nsPerOp, double raysPerOp, std::size_t ops, std::string detail = {}) {
+		std::string raysPerSecond{ raysPerOp > 0.0 ? fmt::format("{:.0f}", raysPerOp * 1e9 / nsPerOp) : "-" };
+		fmt::print("{:<32} {:>12.2f} {:>14}  {}\n", name, nsPerOp, raysPerSecond, detail);
+		results.push_back({ std::move(name), nsPerOp, raysPerOp, ops });
+	};
+
+	fmt::print("{:<32} {:>12} {:>14}\n", "", "ns/op", "rays/sec");
+
+	std::mt19937 generator(13);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	auto inBox = [&](float size) {
+		return atlas::math::Vector{ unit(generator) - 0.5f, unit(generator) - 0.5f, unit(generator) - 0.5f } * size;
+	};
+
+	// unit-sized primitives at the origin, shot at from a distance of 10 by
+	// rays aimed at a point on them (hit-heavy) or at a point drawn by
+	// offPrimitive (miss-heavy); directions are unnormalised like camera rays
+	atlas::math::Point const a{ -1, -1, 0 }, b{ 1, -1, 0 }, c{ 0, 1, 0 };
+	Normal const triangleNormal{ glm::cross(a - b, a - c) };
+	Normal const planeNormal{ 0, 0, 1 };
+
+	auto makeRays = [&](auto&& onPrimitive, auto&& offPrimitive, bool hitHeavy) {
+		std::vector<Ray> rays(1 << 16);
+		for (Ray& ray : rays)
+		{
+			ray.o = 10.0f * glm::normalize(inBox(1.0f) + atlas::math::Vector{ 0, 0, 1e-3f });
+			ray.d = (hitHeavy ? onPrimitive() : offPrimitive(ray.o)) - ray.o;
+		}
+		return rays;
+	};
+
+	// anywhere in a box of side 16 mostly misses the sphere and triangle;
+	// the plane is only missed by rays leaving it
+	auto inWideBox = [&](atlas::math::Point const&) { return atlas::math::Point{ inBox(16.0f) }; };
+	auto awayFromPlane = [&](atlas::math::Point const& o) {
+		atlas::math::Point p{ inBox(16.0f) };
+		p.z = o.z + std::copysign(std::fabs(p.z), o.z);
+		return p;
+	};
+
+	auto onSphere = [&] { return inBox(1.2f); };
+	auto onTriangle = [&] {
+		float u{ unit(generator) }, v{ unit(generator) };
+		if (u + v > 1.0f)
+		{
+			u = 1.0f - u;
+			v = 1.0f - v;
+		}
+		return a + u * (b - a) + v * (c - a);
+	};
+	auto onPlane = [&] { return atlas::math::Point{ 10.0f * unit(generator) - 5.0f, 10.0f * unit(generator) - 5.0f, 0.0f }; };
+
+	Sphere sphere{ { 0, 0, 0 }, 1.0f };
+	Triangle triangle{ a, b, c };
+	Plane plane{ { 0, 0, 0 }, planeNormal };
+
+	// the kernels Shape::intersectRay forwards to, then Shape::hit with the
+	// shade record filled in on a hit
+	auto timeShape = [&](char const* name, Shape const& shape, auto&& onPrimitive, auto&& offPrimitive, auto&& intersect) {
+		for (bool hitHeavy : { true, false })
+		{
+			std::vector<Ray> rays{ makeRays(onPrimitive, offPrimitive, hitHeavy) };
+			char const* kind{ hitHeavy ? "hit-heavy" : "miss-heavy" };
+
+			std::size_t hits{ 0 };
+			double ns = bestNsPerOp(rays.size(), [&] {
+				hits = 0;
+				for (Ray const& ray : rays)
+				{
+					float t{ std::numeric_limits<float>::max() };
+					hits += intersect(ray, t) ? 1 : 0;
+				}
+				return hits;
+			});
+			std::string detail{ fmt::format("{:.0f}% hit", 100.0 * hits / rays.size()) };
+			record(fmt::format("{}.intersect.{}", name, kind), ns, 1.0, rays.size(), detail);
+
+			ns = bestNsPerOp(rays.size(), [&] {
+				std::size_t n{ 0 };
+				for (Ray const& ray : rays)
+				{
+					ShadeRec sr{};
+					sr.t = std::numeric_limits<float>::max();
+					n += shape.hit(ray, sr) ? 1 : 0;
+				}
+				return n;
+			});
+			record(fmt::format("{}.hit.{}", name, kind), ns, 1.0, rays.size(), detail);
+		}
+	};
+
+	timeShape("sphere", sphere, onSphere, inWideBox, [](Ray const& ray, float& t) {
+		return intersectSphere({ 0, 0, 0 }, 1.0f, ray, t);
+	});
+	timeShape("plane", plane, onPlane, awayFromPlane, [&](Ray const& ray, float& t) {
+		return intersectPlane({ 0, 0, 0 }, planeNormal, ray, t);
+	});
+	timeShape("triangle", triangle, onTriangle, inWideBox, [&](Ray const& ray, float& t) {
+		return intersectTriangle(a, b, c, triangleNormal, ray, t);
+	});
+
+	// a 512x512 batch of primary ray directions over the 600x600 view
+	{
+		Pinhole camera{};
+		camera.setEye({ 0, 0, 1 });
+		camera.computeUVW();
+
+		std::size_t const side{ 512 };
+		std::vector<atlas::math::Vector> directions(side * side);
+		double ns = bestNsPerOp(directions.size(), [&] {
+			for (std::size_t r = 0; r < side; ++r)
+			{
+				for (std::size_t col = 0; col < side; ++col)
+				{
+					atlas::math::Point p{ 600.0f * (col + 0.5f) / side - 300.0f, 600.0f * (r + 0.5f) / side - 300.0f, 0.0f };
+					directions[r * side + col] = camera.rayDirection(p);
+				}
+			}
+			return static_cast<std::size_t>(directions[side * side / 2].z < 0.0f);
+		});
+		record("pinhole.raydirection", ns, 1.0, directions.size());
+	}
+
+	// the same view through generateRays for every camera model, 16 rays a
+	// call with their sampler points included
+	{
+		World world{};
+		world.width = 512;
+		world.height = 512;
+		world.sampler = std::make_shared<Jitter>(1);
+
+		std::pair<char const*, std::unique_ptr<Camera>> cameras[]{
+			{ "pinhole", std::make_unique<Pinhole>() },
+			{ "orthographic", std::make_unique<Orthographic>() },
+			{ "thinlens", std::make_unique<ThinLens>() },
+			{ "fisheye", std::make_unique<Fisheye>() },
+		};
+
+		for (auto& [name, camera] : cameras)
+		{
+			camera->setEye({ 0, 0, 1 });
+			camera->computeUVW();
+
+			RayBatch batch{};
+			double ns = bestNsPerOp(world.width * world.height, [&] {
+				float sum{ 0.0f };
+				for (std::uint32_t r = 0; r < world.height; ++r)
+				{
+					for (std::uint32_t col = 0; col < world.width; col += RayBatch::capacity)
+					{
+						for (std::uint32_t i = 0; i < RayBatch::capacity; ++i)
+						{
+							batch.row[i] = r;
+							batch.column[i] = col + i;
+							batch.sample[i] = 0;
+						}
+						batch.count = RayBatch::capacity;
+						camera->generateRays(world, batch);
+						sum += batch.dz[0];
+					}
+				}
+				return static_cast<std::size_t>(sum < 0.0f);
+			});
+			record(fmt::format("camera.{}.rays", name), ns, 1.0, world.width * world.height);
+		}
+	}
+
+	// 16 samples for each of 4096 pixels
+	{
+		using Factory = std::function<std::shared_ptr<Sampler>(int)>;
+		std::vector<std::pair<char const*, Factory>> samplers{
+			{ "regular", [](int n) { return std::make_shared<Regular>(n); } },
+			{ "random", [](int n) { return std::make_shared<Random>(n); } },
+			{ "jitter", [](int n) { return std::make_shared<Jitter>(n); } },
+			{ "halton", [](int n) { return std::make_shared<Halton>(n); } },
+			{ "sobol", [](int n) { return std::make_shared<Sobol>(n); } },
+			{ "pmj02", [](int n) { return std::make_shared<PMJ02>(n); } },
+		};
+
+		for (auto const& [name, make] : samplers)
+		{
+			std::shared_ptr<Sampler> sampler{ make(16) };
+			double ns = bestNsPerOp(4096 * 16, [&] {
+				float sum{ 0.0f };
+				for (std::uint64_t pixel = 0; pixel < 4096; ++pixel)
+				{
+					for (std::uint32_t index = 0; index < 16; ++index)
+					{
+						atlas::math::Point p{ sampler->sampleUnitSquare(pixel, index) };
+						sum += p.x + p.y;
+					}
+				}
+				return static_cast<std::size_t>(sum);
+			});
+			record(fmt::format("sampler.{}", name), ns, 0.0, 4096 * 16);
+		}
+	}
+
+	// Matte::shade at the visible points of the shading scene, with point
+	// lights spread around it; each light costs at most one shadow ray
+	{
+		std::shared_ptr<World> world{ makeShadingScene() };
+		world->bvh = std::make_shared<BVH>(world->scene);
+
+		Pinhole camera{};
+		camera.setEye({ 0, 0, 1 });
+		camera.computeUVW();
+
+		ShadowCache shadows{};
+		std::vector<ShadeRec> records;
+		for (std::size_t r = 0; r < 64; ++r)
+		{
+			for (std::size_t col = 0; col < 64; ++col)
+			{
+				ShadeRec sr{};
+				sr.world = world.get();
+				sr.shadows = &shadows;
+				sr.t = std::numeric_limits<float>::max();
+
+				atlas::math::Point p{ 600.0f * (col + 0.5f) / 64 - 300.0f, 600.0f * (r + 0.5f) / 64 - 300.0f, 0.0f };
+				Ray ray{ { 0, 0, 1 }, camera.rayDirection(p) };
+				if (world->bvh->hit(ray, sr) && sr.material != nullptr)
+					records.push_back(sr);
+			}
+		}
+
+		for (std::size_t count : { 1, 10, 100, 1000 })
+		{
+			world->lights.clear();
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				std::shared_ptr<PointLight> light{ std::make_shared<PointLight>() };
+				light->setLocation({ 1200.0f * unit(generator) - 600.0f,
+					1200.0f * unit(generator) - 600.0f,
+					1200.0f * unit(generator) - 900.0f });
+				light->scaleRadiance(1.5f / count);
+				light->setShadows(true);
+				world->lights.push_back(light);
+			}
+			shadows.lastOccluder.assign(count, Hit::none);
+
+			double ns = bestNsPerOp(records.size(), [&] {
+				Colour sum{ 0, 0, 0 };
+				for (ShadeRec const& stored : records)
+				{
+					ShadeRec sr{ stored };
+					sum += sr.material->shade(sr);
+				}
+				return static_cast<std::size_t>(sum.r + sum.g + sum.b);
+			});
+			record(fmt::format("matte.shade.lights{}", count), ns, static_cast<double>(count), records.size());
+		}
+	}
+
+	// whole frames, ns/op per primary ray, zoomed to keep each scene's
+	// framing at every resolution
+	for (std::size_t side : { 128, 256, 512 })
+	{
+		// 02_Sphere
+		{
+			std::vector<Colour> image;
+			double ns = bestNsPerOp(side * side, [&] { return renderSphereLab(side, image); });
+			record(fmt::format("render.sphere.{}", side), ns, 1.0, side * side);
+		}
+
+		// 03_Camera
+		{
+			Pinhole camera{};
+			std::shared_ptr<World> world{ makeCameraLabScene(side, camera) };
+			double ns = bestNsPerOp(side * side * 16, [&] {
+				camera.renderScene(world);
+				return static_cast<std::size_t>(world->pixels[world->pixels.size() / 2]);
+			});
+			record(fmt::format("render.camera.{}", side), ns, 1.0, side * side * 16);
+		}
+
+		// 04_Shading, the default render
+		{
+			std::shared_ptr<World> world{ makeShadingScene() };
+			world->width = side;
+			world->height = side;
+
+			Pinhole camera{};
+			camera.setEye({ 0, 0, 1 });
+			camera.setZoom(side / 600.0f);
+			camera.computeUVW();
+
+			std::size_t ops{ side * side * static_cast<std::size_t>(world->sampler->getNumSamples()) };
+			double ns = bestNsPerOp(ops, [&] {
+				camera.renderScene(world);
+				return static_cast<std::size_t>(world->pixels[world->pixels.size() / 2]);
+			});
+			record(fmt::format("render.shading.{}", side), ns, 1.0, ops);
+		}
+	}
+
+	return results;
+}
+
+// one result per line, so readSuiteResults can pick them out again
+static bool writeSuiteResults(std::string const& filename, std::vector<SuiteResult> const& results)
+{
+	std::string json{ "{\n  \"results\": [\n" };
+	for (std::size_t i = 0; i < results.size(); ++i)
+	{
+		SuiteResult const& result = results[i];
+		json += fmt::format("    {{ \"name\": \"{}\", \"ns_per_op\": {:.4f}, \"rays_per_sec\": {:.0f}, \"ops\": {} }}{}\n",
+			result.name, result.nsPerOp, result.raysPerOp * 1e9 / result.nsPerOp, result.ops,
+			i + 1 < results.size() ? "," : "");
+	}
+	json += "  ]\n}\n";
+
+	std::ofstream file{ filename };
+	file << json;
+	return static_cast<bool>(file);
+}
+
+// reads the names and ns/op back from a file writeSuiteResults wrote
+static bool readSuiteResults(std::string const& filename, std::vector<SuiteResult>& results)
+{
+	std::ifstream file{ filename };
+	if (!file)
+		return false;
+
+	std::string line;
+	while (std::getline(file, line))
+	{
+		std::size_t name{ line.find("\"name\": \"") };
+		std::size_t ns{ line.find("\"ns_per_op\": ") };
+		if (name == std::string::npos || ns == std::string::npos)
+			continue;
+
+		name += 9;
+		std::size_t end{ line.find('"', name) };
+		if (end == std::string::npos)
+			return false;
+		results.push_back({ line.substr(name, end - name), std::strtod(line.c_str() + ns + 13, nullptr), 0.0, 0 });
+	}
+
+	return !results.empty();
+}
+
+// prints every result against the baseline and returns how many got slower
+// by more than threshold percent
+static std::size_t compareSuiteResults(std::vector<SuiteResult> const& baseline,
+	std::vector<SuiteResult> const& results,
+	double threshold)
+{
+	fmt::print("\n{:<32} {:>12} {:>12} {:>9}\n", "", "baseline ns", "ns/op", "change");
+
+	std::size_t regressions{ 0 };
+	for (SuiteResult const& result : results)
+	{
+		auto base = std::find_if(baseline.begin(), baseline.end(),
+			[&](SuiteResult const& b) { return b.name == result.name; });
+		if (base == baseline.end() || base->nsPerOp <= 0.0)
+		{
+			fmt::print("{:<32} {:>12} {:>12.2f} {:>9}\n", result.name, "-", result.nsPerOp, "new");
+			continue;
+		}
+
+		double change{ 100.0 * (result.nsPerOp - base->nsPerOp) / base->nsPerOp };
+		bool regressed{ change > threshold };
+		regressions += regressed ? 1 : 0;
+		fmt::print("{:<32} {:>12.2f} {:>12.2f} {:>+8.1f}%{}\n",
+			result.name, base->nsPerOp, result.nsPerOp, change, regressed ? "  REGRESSION" : "");
+	}
+
+	fmt::print("{} of {} slower by more than {}%\n", regressions, results.size(), threshold);
+	return regressions;
+}
+
+// generated scenes of 10 to maxCount primitives in each layout, built and
+// rendered (256x256, one sample a pixel) at 1, 2, 4... threads up to the
+// hardware's; one CSV row per run for plotting. Scene memory is the
+// generated records, BVH memory the BVH with its primitive store
+static void benchmarkSweep(std::vector<SceneLayout> const& layouts,
+	std::size_t maxCount,
+	std::string const& csvFile)
+{
+	using Clock = std::chrono::steady_clock;
+	using Milliseconds = std::chrono::duration<double, std::milli>;
+
+	std::vector<std::size_t> threadCounts{ 1 };
+	std::size_t hardware{ std::max<std::size_t>(1, std::thread::hardware_concurrency()) };
+	while (threadCounts.back() * 2 <= hardware)
+		threadCounts.push_back(threadCounts.back() * 2);
+	if (threadCounts.back() != hardware)
+		threadCounts.push_back(hardware);
+
+	std::ofstream csv{ csvFile };
+	csv << "layout,primitives,threads,generate_ms,build_ms,render_ms,scene_mb,bvh_mb,mrays_per_sec\n";
+
+	fmt::print("{:>10} {:>10} {:>8} {:>12} {:>10} {:>10} {:>10} {:>10} {:>10}\n", "layout", "prims",
+		"threads", "generate ms", "build ms", "render ms", "scene MB", "BVH MB", "Mrays/s");
+
+	for (SceneLayout layout : layouts)
+	{
+		for (std::size_t count = 10; count <= maxCount; count *= 10)
+		{
+			SceneFile scene{};
+			auto start = Clock::now();
+			generateScene(mixedSceneSpec(layout, count, 7), scene);
+			double generate{ Milliseconds{ Clock::now() - start }.count() };
+
+			scene.settings().width = 256;
+			scene.settings().height = 256;
+			scene.settings().numSamples = 1;
+
+			double sceneBytes = static_cast<double>(scene.spheres().size * sizeof(SceneSphere) +
+				scene.triangles().size * sizeof(SceneTriangle) + scene.planes().size * sizeof(ScenePlane));
+
+			for (std::size_t threads : threadCounts)
+			{
+				Pinhole camera{};
+				start = Clock::now();
+				std::shared_ptr<World> world{ scene.makeWorld(camera, threads) };
+				double build{ Milliseconds{ Clock::now() - start }.count() };
+				double bvhBytes{ static_cast<double>(world->bvh->memoryUsed()) };
+
+				start = Clock::now();
+				camera.renderScene(world);
+				double render{ Milliseconds{ Clock::now() - start }.count() };
+				double mrays{ 256.0 * 256.0 / (1e3 * render) };
+
+				char const* name{ sceneLayoutName(layout) };
+				fmt::print("{:>10} {:>10} {:>8} {:>12.1f} {:>10.1f} {:>10.1f} {:>10.2f} {:>10.2f} {:>10.2f}\n", name,
+					count, threads, generate, build, render, sceneBytes / (1 << 20), bvhBytes / (1 << 20), mrays);
+				csv << fmt::format("{},{},{},{:.3f},{:.3f},{:.3f},{:.3f},{:.3f},{:.3f}\n", name, count, threads,
+					generate, build, render, sceneBytes / (1 << 20), bvhBytes / (1 << 20), mrays);
+			}
+		}
+	}
+
+	if (!csv)
+		fmt::print("could not write {}\n", csvFile);
+}
+
+// ******* Driver Code *******
+
+int main(int argc, char* argv[])
+{
+	if (argc > 1 && std::string{ argv[1] } == "--bench-bvh")
+	{
+		benchmarkBVH();
+		return 0;
+	}
+
+	if (argc > 1 && std::string{ argv[1] } == "--bench-shadows")
+	{
+		benchmarkShadows();
+		return 0;
+	}
+
+	if (argc > 1 && std::string{ argv[1] } == "--bench-lights")
+	{
+		benchmarkLights();
+		return 0;
+	}
+
+	if (argc > 1 && std::string{ argv[1] } == "--bench-samplers")
+	{
+		benchmarkSamplers();
+		return 0;
+	}
+
+	if (argc > 1 && std::string{ argv[1] } == "--bench-scene")
+	{
+		std::size_t count{ 1000000 };
+		if (argc > 3 ||
+			(argc > 2 && (!parseArgument(argv[2], std::numeric_limits<std::uint32_t>::max(), count) || count == 0)))
+		{
+			fmt::print("usage: --bench-scene [primitives]\n");
+			return -1;
+		}
+
+		benchmarkSceneFiles(count);
+		return 0;
+	}
+
+	if (argc > 1 && std::string{ argv[1] } == "--bench-instances")
+	{
+		std::size_t count{ 1000 };
+		if (argc > 3 ||
+			(argc > 2 && (!parseArgument(argv[2], std::numeric_limits<std::uint32_t>::max(), count) || count == 0)))
+		{
+			fmt::print("usage: --bench-instances [copies]\n");
+			return -1;
+		}
+
+		benchmarkInstances(count);
+		return 0;
+	}
+
+	if (argc > 1 && std::string{ argv[1] } == "--bench-static")
+	{
+		benchmarkStaticScene();
+		return 0;
+	}
+
+	if (argc > 1 && std::string{ argv[1] } == "--bench-cameras")
+	{
+		benchmarkCameras();
+		return 0;
+	}
+
+	if (argc > 1 && std::string{ argv[1] } == "--bench-obj")
+	{
+		std::size_t count{ 1000000 };
+		if (argc > 3 ||
+			(argc > 2 && (!parseArgument(argv[2], std::numeric_limits<std::uint32_t>::max(), count) || count == 0)))
+		{
+			fmt::print("usage: --bench-obj [faces]\n");
+			return -1;
+		}
+
+		benchmarkOBJ(count);
+		return 0;
+	}
+
+	// --bench-suite [out.json [baseline.json [threshold %]]]: kernel and
+	// full render timings to out.json (bench.json), compared against a
+	// saved run; exits with 1 if anything got slower than the threshold (5%)
+	if (argc > 1 && std::string{ argv[1] } == "--bench-suite")
+	{
+		double threshold{ 5.0 };
+		if (argc > 5 || (argc > 4 && !parseArgument(argv[4], std::numeric_limits<double>::max(), threshold)))
+		{
+			fmt::print("usage: --bench-suite [out.json [baseline.json [threshold %]]]\n");
+			return -1;
+		}
+
+		std::string out{ argc > 2 ? argv[2] : "bench.json" };
+		std::vector<SuiteResult> results{ benchmarkSuite() };
+		if (!writeSuiteResults(out, results))
+		{
+			fmt::print("could not write {}\n", out);
+			return -1;
+		}
+
+		if (argc > 3)
+		{
+			std::vector<SuiteResult> baseline;
+			if (!readSuiteResults(argv[3], baseline))
+			{
+				fmt::print("could not read {}\n", argv[3]);
+				return -1;
+			}
+
+			if (compareSuiteResults(baseline, results, threshold) > 0)
+				return 1;
+		}
+
+		return 0;
+	}
+
+	// --sweep [layout|all [max primitives [out.csv]]]: build and render times
+	// and memory of generated scenes by size and thread count
+	if (argc > 1 && std::string{ argv[1] } == "--sweep")
+	{
+		std::size_t maxCount{ 1000000 };
+		if (argc > 5 ||
+			(argc > 3 && (!parseArgument(argv[3], std::numeric_limits<std::uint32_t>::max(), maxCount) || maxCount == 0)))
+		{
+			fmt::print("usage: --sweep [layout|all [max primitives [out.csv]]]\n");
+			return -1;
+		}
+
+		std::vector<SceneLayout> layouts{ SceneLayout::Uniform, SceneLayout::Clustered, SceneLayout::Uneven };
+		if (argc > 2 && std::string{ argv[2] } != "all")
+		{
+			layouts.resize(1);
+			if (!parseSceneLayout(argv[2], layouts[0]))
+			{
+				fmt::print("unknown layout {}\n", argv[2]);
+				return -1;
+			}
+		}
+
+		benchmarkSweep(layouts, maxCount, argc > 4 ? argv[4] : "sweep.csv");
+		return 0;
+	}
+
+	fmt::print("usage: --bench-bvh | --bench-shadows | --bench-lights | --bench-samplers | --bench-static |\n"
+		"       --bench-cameras | --bench-scene [primitives] | --bench-obj [faces] |\n"
+		"       --bench-instances [copies] | --bench-suite [out.json [baseline.json [threshold %]]] |\n"
+		"       --sweep [layout|all [max primitives [out.csv]]]\n");
+	return -1;
+}
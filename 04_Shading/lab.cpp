@@ -0,0 +1,6788 @@
+#include "lab.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RT_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define RT_TARGET_AVX2
+#else
+#define RT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define RT_X86 0
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RT_POSIX 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define RT_POSIX 0
+#endif
+
+// ******* Function Member Implementation *******
+
+// ***** Shape function members *****
+Shape::Shape() : mColour{0, 0, 0}
+{}
+
+void Shape::setColour(Colour const& col)
+{
+    mColour = col;
+}
+
+Colour Shape::getColour() const
+{
+    return mColour;
+}
+
+void Shape::setMaterial(std::shared_ptr<Material> const& material)
+{
+    mMaterial = material;
+}
+
+std::shared_ptr<Material> Shape::getMaterial() const
+{
+    return mMaterial;
+}
+
+bool Shape::isBounded() const
+{
+    return true;
+}
+
+void Shape::flatten(PrimitiveStore& store, std::uint32_t shape) const
+{
+    store.addOther(shape);
+}
+
+bool Shape::closestHit(atlas::math::Ray<atlas::math::Vector> const& ray, float& t) const
+{
+    ShadeRec probe{};
+    probe.t = t;
+    if (!hit(ray, probe) || probe.t >= t)
+        return false;
+
+    t = probe.t;
+    return true;
+}
+
+bool Shape::occluded(atlas::math::Ray<atlas::math::Vector> const& ray, float tMax) const
+{
+    return closestHit(ray, tMax);
+}
+
+// ***** BBox function members *****
+void BBox::expand(atlas::math::Point const& p)
+{
+	min = glm::min(min, p);
+	max = glm::max(max, p);
+}
+
+void BBox::expand(BBox const& box)
+{
+	min = glm::min(min, box.min);
+	max = glm::max(max, box.max);
+}
+
+atlas::math::Point BBox::centroid() const
+{
+	return 0.5f * (min + max);
+}
+
+float BBox::surfaceArea() const
+{
+	if (min.x > max.x)
+		return 0.0f;
+
+	atlas::math::Vector d = max - min;
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+bool BBox::intersect(atlas::math::Point const& origin,
+	atlas::math::Vector const& invDir,
+	float tMax,
+	float& tEntry) const
+{
+	float tNear{ 0.0f };
+	float tFar{ tMax };
+
+	for (int a = 0; a < 3; ++a)
+	{
+		float t0 = (min[a] - origin[a]) * invDir[a];
+		float t1 = (max[a] - origin[a]) * invDir[a];
+
+		// written so that NaNs from 0 * inf leave the interval unchanged
+		tNear = std::max(tNear, std::min(t0, t1));
+		tFar = std::min(tFar, std::max(t0, t1));
+	}
+
+	tEntry = tNear;
+	return tNear <= tFar;
+}
+
+// ***** Transform function members *****
+Transform Transform::translate(atlas::math::Vector const& offset)
+{
+	Transform transform{};
+	transform.t = offset;
+	return transform;
+}
+
+Transform Transform::scale(atlas::math::Vector const& factors)
+{
+	Transform transform{};
+	transform.x = { factors.x, 0, 0 };
+	transform.y = { 0, factors.y, 0 };
+	transform.z = { 0, 0, factors.z };
+	return transform;
+}
+
+Transform Transform::rotate(atlas::math::Vector const& axis, float radians)
+{
+	// Rodrigues' formula, column by column
+	float c{ std::cos(radians) };
+	float s{ std::sin(radians) };
+	auto column = [&](atlas::math::Vector const& e) {
+		return c * e + s * glm::cross(axis, e) + (1.0f - c) * glm::dot(axis, e) * axis;
+	};
+
+	Transform transform{};
+	transform.x = column({ 1, 0, 0 });
+	transform.y = column({ 0, 1, 0 });
+	transform.z = column({ 0, 0, 1 });
+	return transform;
+}
+
+Transform Transform::operator*(Transform const& other) const
+{
+	return { vector(other.x), vector(other.y), vector(other.z), point(other.t) };
+}
+
+Transform Transform::inverse() const
+{
+	// rows of the inverse linear part are the cross products of the columns
+	// over the determinant
+	atlas::math::Vector r0 = glm::cross(y, z);
+	atlas::math::Vector r1 = glm::cross(z, x);
+	atlas::math::Vector r2 = glm::cross(x, y);
+	float inv{ 1.0f / glm::dot(x, r0) };
+	r0 = r0 * inv;
+	r1 = r1 * inv;
+	r2 = r2 * inv;
+
+	Transform transform{};
+	transform.x = { r0.x, r1.x, r2.x };
+	transform.y = { r0.y, r1.y, r2.y };
+	transform.z = { r0.z, r1.z, r2.z };
+	transform.t = -transform.vector(t);
+	return transform;
+}
+
+atlas::math::Point Transform::point(atlas::math::Point const& p) const
+{
+	return p.x * x + p.y * y + p.z * z + t;
+}
+
+atlas::math::Vector Transform::vector(atlas::math::Vector const& v) const
+{
+	return v.x * x + v.y * y + v.z * z;
+}
+
+atlas::math::Normal Transform::normal(atlas::math::Normal const& n) const
+{
+	return { glm::dot(x, n), glm::dot(y, n), glm::dot(z, n) };
+}
+
+BBox Transform::bounds(BBox const& box) const
+{
+	if (box.min.x > box.max.x)
+		return box;
+
+	BBox result;
+	for (int corner = 0; corner < 8; ++corner)
+	{
+		result.expand(point({ corner & 1 ? box.max.x : box.min.x,
+			corner & 2 ? box.max.y : box.min.y,
+			corner & 4 ? box.max.z : box.min.z }));
+	}
+	return result;
+}
+
+// ***** Camera function members *****
+Camera::Camera() :
+	mEye{ 0.0f, 0.0f, 500.0f },
+	mLookAt{ 0.0f },
+	mUp{ 0.0f, 1.0f, 0.0f },
+	mU{ 1.0f, 0.0f, 0.0f },
+	mV{ 0.0f, 1.0f, 0.0f },
+	mW{ 0.0f, 0.0f, 1.0f },
+	mZoom{ 1.0f }
+{}
+
+void Camera::setEye(atlas::math::Point const& eye)
+{
+	mEye = eye;
+}
+
+void Camera::setLookAt(atlas::math::Point const& lookAt)
+{
+	mLookAt = lookAt;
+}
+
+void Camera::setUpVector(atlas::math::Vector const& up)
+{
+	mUp = up;
+}
+
+void Camera::setZoom(float zoom)
+{
+	mZoom = zoom;
+}
+
+void Camera::pixelPoints(World const& world, RayBatch const& batch, float* x, float* y) const
+{
+	std::uint64_t pixels[RayBatch::capacity];
+	for (std::size_t i = 0; i < batch.count; ++i)
+		pixels[i] = static_cast<std::uint64_t>(batch.row[i]) * world.width + batch.column[i];
+
+	world.sampler->sampleUnitSquares(pixels, batch.sample, batch.count, Sampler::pixelDimension, x, y);
+
+	for (std::size_t i = 0; i < batch.count; ++i)
+	{
+		x[i] = batch.column[i] - 0.5f * world.width + x[i];
+		y[i] = batch.row[i] - 0.5f * world.height + y[i];
+	}
+
+	for (std::size_t i = batch.count; i < RayBatch::capacity; ++i)
+	{
+		x[i] = 0.0f;
+		y[i] = 0.0f;
+	}
+}
+
+void Camera::computeUVW()
+{
+	mW = glm::normalize(mEye - mLookAt);
+	mU = glm::normalize(glm::cross(mUp, mW));
+	mV = glm::cross(mW, mU);
+
+	if (areEqual(mEye.x, mLookAt.x) && areEqual(mEye.z, mLookAt.z) &&
+		mEye.y > mLookAt.y)
+	{
+		mU = { 0.0f, 0.0f, 1.0f };
+		mV = { 1.0f, 0.0f, 0.0f };
+		mW = { 0.0f, 1.0f, 0.0f };
+	}
+
+	if (areEqual(mEye.x, mLookAt.x) && areEqual(mEye.z, mLookAt.z) &&
+		mEye.y < mLookAt.y)
+	{
+		mU = { 1.0f, 0.0f, 0.0f };
+		mV = { 0.0f, 0.0f, 1.0f };
+		mW = { 0.0f, -1.0f, 0.0f };
+	}
+}
+
+// ***** RayBatch function members *****
+atlas::math::Ray<atlas::math::Vector> RayBatch::ray(std::size_t i) const
+{
+	return { { ox[i], oy[i], oz[i] }, { dx[i], dy[i], dz[i] } };
+}
+
+// ***** TileRays function members *****
+atlas::math::Ray<atlas::math::Vector> TileRays::ray(std::size_t r, std::size_t c, std::uint32_t j) const
+{
+	std::size_t i{ ((r - tile.y0) * (tile.x1 - tile.x0) + (c - tile.x0)) * numSamples + j };
+	return batches[i / RayBatch::capacity].ray(i % RayBatch::capacity);
+}
+
+// ***** ThreadPool function members *****
+ThreadPool::ThreadPool(std::size_t numThreads) :
+	mQueued{ 0 }, mPending{ 0 }, mNext{ 0 }, mStop{ false }
+{
+	if (numThreads == 0)
+		numThreads = std::max<std::size_t>(1, std::thread::hardware_concurrency());
+
+	for (std::size_t i = 0; i < numThreads; ++i)
+		mQueues.push_back(std::make_unique<Queue>());
+
+	for (std::size_t i = 0; i < numThreads; ++i)
+		mThreads.emplace_back([this, i] { workerLoop(i); });
+}
+
+ThreadPool::~ThreadPool()
+{
+	wait();
+
+	{
+		std::lock_guard<std::mutex> lock{ mMutex };
+		mStop = true;
+	}
+	mWake.notify_all();
+
+	for (auto& thread : mThreads)
+		thread.join();
+}
+
+std::size_t ThreadPool::size() const
+{
+	return mQueues.size();
+}
+
+// Each thread remembers which pool it works for so that tasks spawned from a
+// worker land on that worker's own deque.
+static thread_local ThreadPool const* tlsPool{ nullptr };
+static thread_local std::size_t tlsWorker{ 0 };
+
+std::size_t ThreadPool::currentWorker() const
+{
+	return tlsPool == this ? tlsWorker : size();
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+	std::size_t worker = currentWorker();
+	if (worker == size())
+		worker = mNext++ % size();
+
+	// counted before it is queued, or a thief taking it straight away
+	// would take mQueued below zero
+	++mPending;
+	{
+		std::lock_guard<std::mutex> lock{ mMutex };
+		++mQueued;
+	}
+	{
+		std::lock_guard<std::mutex> lock{ mQueues[worker]->mutex };
+		mQueues[worker]->tasks.push_back(std::move(task));
+	}
+	mWake.notify_one();
+}
+
+bool ThreadPool::popTask(std::size_t worker, std::function<void()>& task)
+{
+	std::size_t n = size();
+
+	// own work first, newest task for locality
+	if (worker < n)
+	{
+		Queue& own = *mQueues[worker];
+		std::lock_guard<std::mutex> lock{ own.mutex };
+		if (!own.tasks.empty())
+		{
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			--mQueued;
+			return true;
+		}
+	}
+
+	// otherwise steal the oldest task from someone else
+	for (std::size_t k = 1; k <= n; ++k)
+	{
+		Queue& victim = *mQueues[(worker + k) % n];
+		std::lock_guard<std::mutex> lock{ victim.mutex };
+		if (!victim.tasks.empty())
+		{
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			--mQueued;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void ThreadPool::runTask(std::function<void()>& task)
+{
+	task();
+	task = nullptr;
+
+	if (mPending.fetch_sub(1) == 1)
+	{
+		std::lock_guard<std::mutex> lock{ mMutex };
+		mDone.notify_all();
+	}
+}
+
+void ThreadPool::workerLoop(std::size_t worker)
+{
+	tlsPool = this;
+	tlsWorker = worker;
+
+	std::function<void()> task;
+	for (;;)
+	{
+		if (popTask(worker, task))
+		{
+			runTask(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock{ mMutex };
+		mWake.wait(lock, [this] { return mStop || mQueued > 0; });
+		if (mStop && mQueued == 0)
+			return;
+	}
+}
+
+void ThreadPool::wait()
+{
+	std::function<void()> task;
+	while (mPending > 0)
+	{
+		if (popTask(currentWorker(), task))
+		{
+			runTask(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock{ mMutex };
+		mDone.wait(lock, [this] { return mPending == 0 || mQueued > 0; });
+	}
+}
+
+// ***** Telemetry function members *****
+#if RT_TELEMETRY
+Telemetry::Block& Telemetry::attach()
+{
+	// gives the block back when the thread exits
+	struct Release
+	{
+		~Release() { Telemetry::detach(); }
+	};
+	static thread_local Release release;
+
+	std::lock_guard<std::mutex> lock{ mRegistry.mutex };
+	for (std::unique_ptr<Block>& block : mRegistry.blocks)
+	{
+		if (!block->inUse)
+		{
+			mThreadBlock = block.get();
+			break;
+		}
+	}
+
+	if (mThreadBlock == nullptr)
+	{
+		mRegistry.blocks.push_back(std::make_unique<Block>());
+		mThreadBlock = mRegistry.blocks.back().get();
+	}
+
+	mThreadBlock->inUse = true;
+	return *mThreadBlock;
+}
+
+void Telemetry::detach()
+{
+	std::lock_guard<std::mutex> lock{ mRegistry.mutex };
+	if (mThreadBlock != nullptr)
+		mThreadBlock->inUse = false;
+	mThreadBlock = nullptr;
+}
+
+void Telemetry::addTime(Phase phase, std::chrono::nanoseconds time)
+{
+	Block& b = block();
+	std::size_t i{ static_cast<std::size_t>(phase) };
+	b.nanoseconds[i].store(b.nanoseconds[i].load(std::memory_order_relaxed) +
+		static_cast<std::uint64_t>(std::max<std::int64_t>(time.count(), 0)), std::memory_order_relaxed);
+	b.calls[i].store(b.calls[i].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+std::string Telemetry::report()
+{
+	constexpr std::size_t numCounters{ static_cast<std::size_t>(Counter::Count) };
+	constexpr std::size_t numPhases{ static_cast<std::size_t>(Phase::Count) };
+	static char const* const counterNames[numCounters]{ "primary_rays", "shadow_rays",
+		"shadow_cache_hits", "node_tests", "primitive_tests", "shape_queries", "shade_calls" };
+	static char const* const phaseNames[numPhases]{ "setup", "build", "render", "encode" };
+
+	std::uint64_t counters[numCounters]{};
+	std::uint64_t nanoseconds[numPhases]{};
+	std::uint64_t calls[numPhases]{};
+	std::size_t threads{ 0 };
+	{
+		std::lock_guard<std::mutex> lock{ mRegistry.mutex };
+		threads = mRegistry.blocks.size();
+		for (std::unique_ptr<Block> const& block : mRegistry.blocks)
+		{
+			for (std::size_t i = 0; i < numCounters; ++i)
+				counters[i] += block->counters[i].load(std::memory_order_relaxed);
+			for (std::size_t i = 0; i < numPhases; ++i)
+			{
+				nanoseconds[i] += block->nanoseconds[i].load(std::memory_order_relaxed);
+				calls[i] += block->calls[i].load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	auto counter = [&counters](Counter c) { return counters[static_cast<std::size_t>(c)]; };
+	auto ratio = [](std::uint64_t a, std::uint64_t b) { return b > 0 ? static_cast<double>(a) / b : 0.0; };
+	std::uint64_t rays{ counter(Counter::PrimaryRays) + counter(Counter::ShadowRays) };
+
+	std::string json{ "{\n  \"telemetry\": true,\n" };
+	json += fmt::format("  \"threads\": {},\n  \"phases\": {{\n", threads);
+	for (std::size_t i = 0; i < numPhases; ++i)
+	{
+		json += fmt::format("    \"{}\": {{ \"seconds\": {:.6f}, \"calls\": {} }}{}\n", phaseNames[i],
+			nanoseconds[i] * 1e-9, calls[i], i + 1 < numPhases ? "," : "");
+	}
+	json += "  },\n  \"counters\": {\n";
+	for (std::size_t i = 0; i < numCounters; ++i)
+		json += fmt::format("    \"{}\": {}{}\n", counterNames[i], counters[i], i + 1 < numCounters ? "," : "");
+	json += "  },\n  \"per_ray\": {\n";
+	json += fmt::format("    \"node_tests\": {:.3f},\n", ratio(counter(Counter::NodeTests), rays));
+	json += fmt::format("    \"primitive_tests\": {:.3f},\n", ratio(counter(Counter::PrimitiveTests), rays));
+	json += fmt::format("    \"shadow_rays_per_primary\": {:.3f}\n", ratio(counter(Counter::ShadowRays), counter(Counter::PrimaryRays)));
+	json += "  }\n}\n";
+	return json;
+}
+
+void Telemetry::reset()
+{
+	std::lock_guard<std::mutex> lock{ mRegistry.mutex };
+	for (std::unique_ptr<Block>& block : mRegistry.blocks)
+	{
+		for (auto& value : block->counters)
+			value.store(0, std::memory_order_relaxed);
+		for (auto& value : block->nanoseconds)
+			value.store(0, std::memory_order_relaxed);
+		for (auto& value : block->calls)
+			value.store(0, std::memory_order_relaxed);
+	}
+}
+
+// ***** ScopedTimer function members *****
+ScopedTimer::ScopedTimer(Phase phase) :
+	mPhase{ phase },
+	mStart{ std::chrono::steady_clock::now() },
+	mInner{ 0 },
+	mOuter{ mInnermost }
+{
+	mInnermost = this;
+}
+
+ScopedTimer::~ScopedTimer()
+{
+	std::chrono::nanoseconds elapsed{ std::chrono::steady_clock::now() - mStart };
+	Telemetry::addTime(mPhase, elapsed - mInner);
+	if (mOuter != nullptr)
+		mOuter->mInner += elapsed;
+	mInnermost = mOuter;
+}
+#endif
+
+bool Telemetry::writeReport(std::string const& filename)
+{
+	std::ofstream file{ filename };
+	file << report();
+	return static_cast<bool>(file);
+}
+
+// ***** Tracer function members *****
+void Tracer::start(std::size_t eventsPerThread)
+{
+	std::size_t capacity{ 1 };
+	while (capacity < eventsPerThread)
+		capacity <<= 1;
+
+	std::lock_guard<std::mutex> lock{ mRegistry.mutex };
+	mCapacity = capacity;
+	mRegistry.epoch = std::chrono::steady_clock::now();
+	for (std::unique_ptr<Buffer>& buffer : mRegistry.buffers)
+	{
+		buffer->events.assign(capacity, Event{});
+		buffer->written.store(0, std::memory_order_relaxed);
+	}
+	mEnabled.store(true, std::memory_order_release);
+}
+
+void Tracer::stop()
+{
+	mEnabled.store(false, std::memory_order_release);
+}
+
+Tracer::Buffer& Tracer::attach()
+{
+	// gives the buffer back when the thread exits
+	struct Release
+	{
+		~Release() { Tracer::detach(); }
+	};
+	static thread_local Release release;
+
+	std::lock_guard<std::mutex> lock{ mRegistry.mutex };
+	for (std::unique_ptr<Buffer>& buffer : mRegistry.buffers)
+	{
+		if (!buffer->inUse)
+		{
+			mThreadBuffer = buffer.get();
+			break;
+		}
+	}
+
+	if (mThreadBuffer == nullptr)
+	{
+		mRegistry.buffers.push_back(std::make_unique<Buffer>());
+		mThreadBuffer = mRegistry.buffers.back().get();
+		mThreadBuffer->events.assign(mCapacity, Event{});
+		mThreadBuffer->track = mRegistry.buffers.size() - 1;
+	}
+
+	mThreadBuffer->inUse = true;
+	return *mThreadBuffer;
+}
+
+void Tracer::detach()
+{
+	std::lock_guard<std::mutex> lock{ mRegistry.mutex };
+	if (mThreadBuffer != nullptr)
+		mThreadBuffer->inUse = false;
+	mThreadBuffer = nullptr;
+}
+
+void Tracer::record(char const* name,
+	std::chrono::steady_clock::time_point start,
+	std::chrono::steady_clock::time_point end,
+	std::int32_t x,
+	std::int32_t y)
+{
+	Buffer& buffer = mThreadBuffer != nullptr ? *mThreadBuffer : attach();
+
+	// only this thread writes the buffer; the release store publishes the
+	// event to write
+	std::uint64_t n{ buffer.written.load(std::memory_order_relaxed) };
+	buffer.events[n & (buffer.events.size() - 1)] = { name,
+		std::chrono::duration_cast<std::chrono::nanoseconds>(start - mRegistry.epoch).count(),
+		std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(), x, y };
+	buffer.written.store(n + 1, std::memory_order_release);
+}
+
+bool Tracer::write(std::string const& filename)
+{
+	std::ofstream file{ filename };
+	if (!file)
+		return false;
+
+	std::lock_guard<std::mutex> lock{ mRegistry.mutex };
+	file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	file << fmt::format("{{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{{\"name\":\"shading\"}}}}");
+
+	for (std::unique_ptr<Buffer> const& buffer : mRegistry.buffers)
+	{
+		file << fmt::format(",\n{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":{0},"
+			"\"args\":{{\"name\":\"thread {0}\"}}}}", buffer->track);
+
+		// the newest events, oldest first, once the ring has wrapped
+		std::uint64_t written{ buffer->written.load(std::memory_order_acquire) };
+		std::uint64_t capacity{ buffer->events.size() };
+		for (std::uint64_t i = written > capacity ? written - capacity : 0; i < written; ++i)
+		{
+			Event const& e = buffer->events[i & (capacity - 1)];
+			file << fmt::format(",\n{{\"name\":\"{}\",\"ph\":\"X\",\"pid\":1,\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f}",
+				e.name, buffer->track, e.start * 1e-3, e.duration * 1e-3);
+			if (e.x >= 0)
+				file << fmt::format(",\"args\":{{\"x\":{},\"y\":{}}}", e.x, e.y);
+			file << "}";
+		}
+	}
+
+	file << "\n]}\n";
+	return static_cast<bool>(file);
+}
+
+// ***** TraceScope function members *****
+TraceScope::TraceScope(char const* name, std::int32_t x, std::int32_t y) :
+	mName{ name },
+	mX{ x },
+	mY{ y },
+	mActive{ Tracer::enabled() }
+{
+	if (mActive)
+		mStart = std::chrono::steady_clock::now();
+}
+
+TraceScope::~TraceScope()
+{
+	if (mActive)
+		Tracer::record(mName, mStart, std::chrono::steady_clock::now(), mX, mY);
+}
+
+// ***** Post-process functions *****
+std::vector<float> makeEncodingLUT(Encoding encoding, std::size_t size)
+{
+	std::vector<float> lut(size);
+
+	for (std::size_t i = 0; i < size; ++i)
+	{
+		float x = static_cast<float>(i) / (size - 1);
+		if (encoding == Encoding::sRGB)
+			x = x <= 0.0031308f ? 12.92f * x : 1.055f * std::pow(x, 1.0f / 2.4f) - 0.055f;
+		lut[i] = 255.0f * x;
+	}
+
+	return lut;
+}
+
+// one row of interleaved rgb, the operator is a template argument so the
+// loop body has no branches and vectorises
+template <ToneMap op>
+static void toneMapRowScalar(float* values, std::size_t count, Colour const& scale)
+{
+	float const s[3]{ scale.r, scale.g, scale.b };
+
+	for (std::size_t i = 0; i < count; i += 3)
+	{
+		for (std::size_t k = 0; k < 3; ++k)
+		{
+			float x = values[i + k] * s[k];
+
+			if constexpr (op == ToneMap::Reinhard)
+				x = x / (1.0f + x);
+			else if constexpr (op == ToneMap::ACES)
+				x = (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+
+			// NaN becomes 0
+			values[i + k] = std::min(std::max(0.0f, x), 1.0f);
+		}
+	}
+}
+
+// encoding and rounding to bytes, linear output skips the table lookup;
+// dithering adds triangular noise of +-1 step, hashed from the byte's
+// index, to hide banding in gradients
+template <bool encode, bool dither>
+static void quantiseRowScalar(float const* values,
+	std::size_t count,
+	std::vector<float> const& lut,
+	std::size_t first,
+	unsigned char* out)
+{
+	float lutScale = static_cast<float>(lut.size() - 1);
+
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		float v;
+		if constexpr (encode)
+			v = lut[static_cast<std::size_t>(values[i] * lutScale + 0.5f)];
+		else
+			v = values[i] * 255.0f;
+
+		if constexpr (dither)
+		{
+			std::uint32_t h = static_cast<std::uint32_t>(first + i) * 0x9e3779b9u;
+			h ^= h >> 16;
+			h *= 0x7feb352du;
+			h ^= h >> 15;
+			v += static_cast<int>((h & 0xffffu) + (h >> 16)) * (1.0f / 65536.0f) - 1.0f;
+			v = std::min(std::max(v, 0.0f), 255.0f);
+		}
+
+		out[i] = static_cast<unsigned char>(v + 0.5f);
+	}
+}
+
+#if RT_X86
+
+template <ToneMap op>
+RT_TARGET_AVX2 static void toneMapRowAVX2(float* values, std::size_t count, Colour const& scale)
+{
+	// the per-channel scale repeats every 3 floats, 24 floats line up with it
+	alignas(32) float pattern[24];
+	for (int i = 0; i < 24; ++i)
+		pattern[i] = scale[i % 3];
+
+	__m256 const s[3]{ _mm256_load_ps(pattern), _mm256_load_ps(pattern + 8), _mm256_load_ps(pattern + 16) };
+	__m256 const zero = _mm256_setzero_ps();
+	__m256 const one = _mm256_set1_ps(1.0f);
+
+	std::size_t i{ 0 };
+	for (; i + 24 <= count; i += 24)
+	{
+		for (std::size_t k = 0; k < 3; ++k)
+		{
+			__m256 x = _mm256_mul_ps(_mm256_loadu_ps(values + i + 8 * k), s[k]);
+
+			if constexpr (op == ToneMap::Reinhard)
+			{
+				x = _mm256_div_ps(x, _mm256_add_ps(one, x));
+			}
+			else if constexpr (op == ToneMap::ACES)
+			{
+				__m256 n = _mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.51f), x), _mm256_set1_ps(0.03f)));
+				__m256 d = _mm256_add_ps(_mm256_mul_ps(x,
+					_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.43f), x), _mm256_set1_ps(0.59f))), _mm256_set1_ps(0.14f));
+				x = _mm256_div_ps(n, d);
+			}
+
+			// max returns its second operand for NaN, so NaN becomes 0
+			_mm256_storeu_ps(values + i + 8 * k, _mm256_min_ps(_mm256_max_ps(x, zero), one));
+		}
+	}
+
+	toneMapRowScalar<op>(values + i, count - i, scale);
+}
+
+template <bool encode, bool dither>
+RT_TARGET_AVX2 static void quantiseRowAVX2(float const* values,
+	std::size_t count,
+	std::vector<float> const& lut,
+	std::size_t first,
+	unsigned char* out)
+{
+	__m256 const lutScale = _mm256_set1_ps(static_cast<float>(lut.size() - 1));
+	__m256 const half = _mm256_set1_ps(0.5f);
+	__m256 const zero = _mm256_setzero_ps();
+	__m256 const top = _mm256_set1_ps(255.0f);
+	__m256i const lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+	std::size_t i{ 0 };
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256 x = _mm256_loadu_ps(values + i);
+		__m256 v;
+
+		if constexpr (encode)
+		{
+			__m256i index = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(x, lutScale), half));
+			v = _mm256_i32gather_ps(lut.data(), index, 4);
+		}
+		else
+		{
+			v = _mm256_mul_ps(x, top);
+		}
+
+		if constexpr (dither)
+		{
+			// same hash as quantiseRowScalar, lane by lane
+			__m256i h = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(first + i)), lanes);
+			h = _mm256_mullo_epi32(h, _mm256_set1_epi32(static_cast<int>(0x9e3779b9u)));
+			h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+			h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x7feb352d));
+			h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+
+			__m256i sum = _mm256_add_epi32(_mm256_and_si256(h, _mm256_set1_epi32(0xffff)), _mm256_srli_epi32(h, 16));
+			__m256 noise = _mm256_sub_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(sum), _mm256_set1_ps(1.0f / 65536.0f)),
+				_mm256_set1_ps(1.0f));
+			v = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(v, noise), zero), top);
+		}
+
+		// 8 x int32 to 8 bytes
+		__m256i q = _mm256_cvttps_epi32(_mm256_add_ps(v, half));
+		__m128i words = _mm_packus_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(words, words));
+	}
+
+	quantiseRowScalar<encode, dither>(values + i, count - i, lut, first + i, out + i);
+}
+
+#else
+
+template <ToneMap op>
+static void toneMapRowAVX2(float* values, std::size_t count, Colour const& scale)
+{
+	toneMapRowScalar<op>(values, count, scale);
+}
+
+template <bool encode, bool dither>
+static void quantiseRowAVX2(float const* values,
+	std::size_t count,
+	std::vector<float> const& lut,
+	std::size_t first,
+	unsigned char* out)
+{
+	quantiseRowScalar<encode, dither>(values, count, lut, first, out);
+}
+
+#endif
+
+template <bool avx2>
+static void postProcessRows(World& world,
+	Tile const& tile,
+	Colour const& scale,
+	std::vector<float> const& lut)
+{
+	std::size_t count{ 3 * (tile.x1 - tile.x0) };
+	std::vector<float> row(count);
+
+	for (std::size_t r{ tile.y0 }; r < tile.y1; ++r)
+	{
+		// the dither hash uses the pixel's place in the full image, the
+		// buffers only hold rows from imageY0 on
+		std::size_t first{ r * world.width + tile.x0 };
+		std::size_t slot{ (r - world.imageY0) * world.width + tile.x0 };
+		std::copy_n(&world.image[slot].x, count, row.data());
+
+		switch (world.toneMap)
+		{
+		case ToneMap::Reinhard:
+			avx2 ? toneMapRowAVX2<ToneMap::Reinhard>(row.data(), count, scale)
+			     : toneMapRowScalar<ToneMap::Reinhard>(row.data(), count, scale);
+			break;
+		case ToneMap::ACES:
+			avx2 ? toneMapRowAVX2<ToneMap::ACES>(row.data(), count, scale)
+			     : toneMapRowScalar<ToneMap::ACES>(row.data(), count, scale);
+			break;
+		default:
+			avx2 ? toneMapRowAVX2<ToneMap::Clamp>(row.data(), count, scale)
+			     : toneMapRowScalar<ToneMap::Clamp>(row.data(), count, scale);
+			break;
+		}
+
+		unsigned char* out = world.pixels.data() + 3 * slot;
+		bool encode{ world.encoding != Encoding::Linear };
+
+		if (encode && world.dither)
+			avx2 ? quantiseRowAVX2<true, true>(row.data(), count, lut, 3 * first, out)
+			     : quantiseRowScalar<true, true>(row.data(), count, lut, 3 * first, out);
+		else if (encode)
+			avx2 ? quantiseRowAVX2<true, false>(row.data(), count, lut, 3 * first, out)
+			     : quantiseRowScalar<true, false>(row.data(), count, lut, 3 * first, out);
+		else if (world.dither)
+			avx2 ? quantiseRowAVX2<false, true>(row.data(), count, lut, 3 * first, out)
+			     : quantiseRowScalar<false, true>(row.data(), count, lut, 3 * first, out);
+		else
+			avx2 ? quantiseRowAVX2<false, false>(row.data(), count, lut, 3 * first, out)
+			     : quantiseRowScalar<false, false>(row.data(), count, lut, 3 * first, out);
+	}
+}
+
+void postProcessTile(World& world,
+	Tile const& tile,
+	Colour const& scale,
+	std::vector<float> const& lut)
+{
+	TraceScope trace{ "post-process", static_cast<std::int32_t>(tile.x0), static_cast<std::int32_t>(tile.y0) };
+	if (cpuHasAVX2())
+		postProcessRows<true>(world, tile, scale, lut);
+	else
+		postProcessRows<false>(world, tile, scale, lut);
+}
+
+// ***** Tile functions *****
+std::vector<Tile> makeTiles(std::size_t width, std::size_t height, std::size_t tileSize)
+{
+	std::vector<Tile> tiles;
+	tileSize = std::max<std::size_t>(1, tileSize);
+
+	for (std::size_t y = 0; y < height; y += tileSize)
+	{
+		for (std::size_t x = 0; x < width; x += tileSize)
+		{
+			tiles.push_back({ x, y,
+				std::min(x + tileSize, width),
+				std::min(y + tileSize, height) });
+		}
+	}
+
+	return tiles;
+}
+
+void printTileStats(std::vector<TileStats> const& stats)
+{
+	if (stats.empty())
+		return;
+
+	std::vector<TileStats> sorted{ stats };
+	std::sort(sorted.begin(), sorted.end(),
+		[](TileStats const& a, TileStats const& b) { return a.milliseconds > b.milliseconds; });
+
+	double total{ 0 };
+	std::size_t numThreads{ 0 };
+	for (auto const& s : stats)
+	{
+		total += s.milliseconds;
+		numThreads = std::max(numThreads, s.thread + 1);
+	}
+
+	std::vector<double> busy(numThreads, 0.0);
+	for (auto const& s : stats)
+		busy[s.thread] += s.milliseconds;
+
+	double mean{ total / stats.size() };
+	fmt::print("tiles: {}  mean {:.3f} ms  min {:.3f} ms  max {:.3f} ms  max/mean {:.2f}\n",
+		stats.size(), mean, sorted.back().milliseconds, sorted.front().milliseconds,
+		mean > 0 ? sorted.front().milliseconds / mean : 0.0);
+
+	fmt::print("busy time per thread:");
+	for (std::size_t i = 0; i < busy.size(); ++i)
+		fmt::print(" [{}] {:.1f} ms", i, busy[i]);
+	fmt::print("\n");
+
+	fmt::print("slowest tiles:\n");
+	for (std::size_t i = 0; i < std::min<std::size_t>(5, sorted.size()); ++i)
+	{
+		Tile const& t = sorted[i].tile;
+		fmt::print("  ({:4}, {:4}) - ({:4}, {:4})  {:.3f} ms  thread {}\n",
+			t.x0, t.y0, t.x1, t.y1, sorted[i].milliseconds, sorted[i].thread);
+	}
+}
+
+// ***** Sampler function members *****
+Sampler::Sampler(int numSamples, std::uint32_t seed) :
+    mNumSamples{numSamples}, mSeed{seed}
+{}
+
+int Sampler::getNumSamples() const
+{
+    return mNumSamples;
+}
+
+void Sampler::setSeed(std::uint32_t seed)
+{
+    mSeed = seed;
+}
+
+std::uint32_t Sampler::getSeed() const
+{
+    return mSeed;
+}
+
+void Sampler::sampleUnitSquares(std::uint64_t const* pixels,
+                                std::uint32_t const* indices,
+                                std::size_t count,
+                                std::uint32_t dimension,
+                                float* x,
+                                float* y) const
+{
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        atlas::math::Point p{ sampleUnitSquare(pixels[i], indices[i], dimension) };
+        x[i] = p.x;
+        y[i] = p.y;
+    }
+}
+
+// PCG-RXS-M-XS output permutation of one LCG step
+static std::uint32_t pcgHash(std::uint32_t v)
+{
+    std::uint32_t state = v * 747796405u + 2891336453u;
+    std::uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+std::uint32_t Sampler::hash(std::uint32_t seed,
+                            std::uint64_t pixel,
+                            std::uint32_t index,
+                            std::uint32_t dimension)
+{
+    std::uint32_t h = pcgHash(seed);
+    h = pcgHash(h ^ static_cast<std::uint32_t>(pixel));
+    h = pcgHash(h ^ static_cast<std::uint32_t>(pixel >> 32));
+    h = pcgHash(h ^ index);
+    return pcgHash(h ^ dimension);
+}
+
+float Sampler::random(std::uint64_t pixel, std::uint32_t index, std::uint32_t dimension) const
+{
+    // top 24 bits so the result is exactly representable and below 1
+    return (hash(mSeed, pixel, index, dimension) >> 8) * (1.0f / 16777216.0f);
+}
+
+
+
+// ***** BRDF function members *****
+
+Lambertian::Lambertian() : kd{ 1 }, cd{ 1 }
+{}
+
+Lambertian::Lambertian(float k, float c) : kd{ k }, cd{c}
+{}
+
+void Lambertian::set_kd(float ka) {
+	kd = ka;
+}
+void Lambertian::set_cd(Colour c) {
+	cd = c;
+}
+
+Colour Lambertian::fn([[maybe_unused]] ShadeRec const& sr,
+	[[maybe_unused]] atlas::math::Vector const& reflected,
+	[[maybe_unused]] atlas::math::Vector const& incoming) const {
+	return kd * cd / (float) M_PI;
+}
+Colour Lambertian::rho([[maybe_unused]] ShadeRec const& sr,
+	[[maybe_unused]] atlas::math::Vector const& reflected) const {
+	return kd * cd;
+}
+
+
+
+// ***** Material function members *****
+
+Matte::Matte() :
+	Material(),
+	ambient_brdf(new Lambertian),
+	diffuse_brdf(new Lambertian)
+{}
+
+void Matte::set_ka(const float ka) {
+	ambient_brdf->set_kd(ka);
+}
+
+void Matte::set_kd(const float kd) {
+	diffuse_brdf->set_kd(kd);
+}
+
+void Matte::set_cd(const Colour& c) {
+	ambient_brdf->set_cd(c);
+	diffuse_brdf->set_cd(c);
+}
+
+Colour Matte::shade(ShadeRec& sr) {
+	Telemetry::count(Counter::ShadeCalls);
+	atlas::math::Vector wo = -sr.ray.d;
+	Colour L = ambient_brdf->rho(sr, wo) * sr.world->ambient->L(sr);
+	size_t numLights = sr.world->lights.size();
+
+	int lightSamples = sr.world->lightSamples;
+	if (lightSamples > 0 && sr.world->lightSampler) {
+		// the camera's sampler dimensions come first, one per light sample after them
+		for (int k = 0; k < lightSamples; k++) {
+			float u = sr.world->sampler->sampleUnitSquare(sr.pixel, sr.sample,
+				Sampler::firstLightDimension + static_cast<std::uint32_t>(k)).x;
+			float pdf;
+			std::uint32_t j = sr.world->lightSampler->sample(sr.hit_point, sr.normal, u, pdf);
+
+			if (j != LightSampler::none)
+				L += direct(sr, wo, j) / (pdf * lightSamples);
+		}
+		return L;
+	}
+
+	for (int j = 0; j < numLights; j++)
+		L += direct(sr, wo, j);
+
+	return L;
+}
+
+Colour Matte::direct(ShadeRec& sr, atlas::math::Vector const& wo, std::size_t j) const {
+	Light& light = *sr.world->lights[j];
+	atlas::math::Vector wi = light.getDirection(sr);
+	float ndotwi = glm::dot(sr.normal, wi);
+
+	if (ndotwi <= 0.0f)
+		return Colour{ 0, 0, 0 };
+
+	if (light.castsShadows()) {
+		// start just off the surface, on the side facing the light
+		const float kShadowOffset{ 0.01f };
+		atlas::math::Ray<atlas::math::Vector> shadowRay{
+			sr.hit_point + kShadowOffset * glm::normalize(sr.normal), wi };
+
+		std::uint32_t scratch{ Hit::none };
+		std::uint32_t& occluder = sr.shadows ? sr.shadows->lastOccluder[j] : scratch;
+		if (light.inShadow(shadowRay, sr, occluder))
+			return Colour{ 0, 0, 0 };
+	}
+
+	return diffuse_brdf->fn(sr, wo, wi) * light.L(sr) * ndotwi;
+}
+
+
+
+
+// ***** Light function members *****
+Light::Light() :
+	mColour{ 1,1,1 },
+	mRadiance{ 1 },
+	mShadows{ false }
+{}
+
+Colour Light::L([[maybe_unused]] ShadeRec& sr)
+{
+    return Colour{0.0f};
+}
+
+void Light::scaleRadiance([[maybe_unused]] float b)
+{}
+
+void Light::setColour([[maybe_unused]] Colour const& c)
+{}
+
+void Light::setShadows(bool shadows)
+{
+	mShadows = shadows;
+}
+
+bool Light::castsShadows() const
+{
+	return mShadows;
+}
+
+float Light::power() const
+{
+	return mRadiance * (0.2126f * mColour.r + 0.7152f * mColour.g + 0.0722f * mColour.b);
+}
+
+BBox Light::getBBox() const
+{
+	BBox box;
+	box.min = atlas::math::Point{ std::numeric_limits<float>::lowest() };
+	box.max = atlas::math::Point{ std::numeric_limits<float>::max() };
+	return box;
+}
+
+bool Light::inShadow([[maybe_unused]] atlas::math::Ray<atlas::math::Vector> const& ray,
+	[[maybe_unused]] ShadeRec const& sr,
+	[[maybe_unused]] std::uint32_t& lastOccluder) const
+{
+	return false;
+}
+
+// ***** Ambient function members *****
+
+Ambient::Ambient() 
+	: Light()
+{
+	scaleRadiance({ 1.0 });
+	setColour({ 1,1,1 });
+}
+
+void Ambient::scaleRadiance(float b) {
+	mRadiance = b;
+}
+
+void Ambient::setColour(Colour const& c) {
+	mColour = c;
+}
+
+atlas::math::Vector Ambient::getDirection([[maybe_unused]] ShadeRec& sr) {
+	return (atlas::math::Vector({ 0,0,0 }));
+}
+
+Colour Ambient::L([[maybe_unused]] ShadeRec& sr) {
+	return mRadiance * mColour;
+}
+
+// ***** PointLight function members *****
+
+PointLight::PointLight()
+	: Light(), mLocation{0,0,0}
+{
+	scaleRadiance({ 1.0 });
+	setColour({ 1,1,1 });
+}
+
+void PointLight::scaleRadiance(float b) {
+	mRadiance = b;
+}
+
+void PointLight::setColour(Colour const& c) {
+	mColour = c;
+}
+
+atlas::math::Vector PointLight::getDirection(ShadeRec& sr) {
+	return glm::normalize(mLocation - sr.hit_point);
+}
+
+Colour PointLight::L([[maybe_unused]] ShadeRec& sr) {
+	return mRadiance * mColour;
+}
+
+bool PointLight::inShadow(atlas::math::Ray<atlas::math::Vector> const& ray,
+	ShadeRec const& sr,
+	std::uint32_t& lastOccluder) const
+{
+	float d{ glm::length(mLocation - ray.o) };
+	Telemetry::count(Counter::ShadowRays);
+
+	if (sr.world->bvh)
+		return sr.world->bvh->occluded(ray, d, lastOccluder);
+
+	// no acceleration structure yet, ask every shape
+	for (auto const& shape : sr.world->scene)
+	{
+		ShadeRec probe{};
+		probe.t = d;
+		if (shape->hit(ray, probe) && probe.t < d)
+			return true;
+	}
+
+	return false;
+}
+
+void PointLight::setLocation(atlas::math::Point location) {
+	mLocation = location;
+}
+
+BBox PointLight::getBBox() const
+{
+	BBox box;
+	box.expand(mLocation);
+	return box;
+}
+
+// ***** LightSampler function members *****
+
+LightSampler::LightSampler(std::vector<std::shared_ptr<Light>> const& lights, Strategy strategy) :
+	mTotalPower{ 0 },
+	mStrategy{ strategy }
+{
+	std::uint32_t count = static_cast<std::uint32_t>(lights.size());
+
+	mBounds.reserve(count);
+	mPower.reserve(count);
+	for (auto const& light : lights)
+	{
+		mBounds.push_back(light->getBBox());
+		mPower.push_back(std::max(light->power(), 0.0f));
+		mTotalPower += mPower.back();
+	}
+
+	if (count == 0 || mTotalPower <= 0.0f)
+		return;
+
+	// Vose's alias method: pair each under-full bucket with an over-full one
+	mProbability.resize(count);
+	mAlias.resize(count);
+
+	std::vector<float> scaled(count);
+	std::vector<std::uint32_t> small, large;
+	for (std::uint32_t i = 0; i < count; ++i)
+	{
+		scaled[i] = mPower[i] * count / mTotalPower;
+		(scaled[i] < 1.0f ? small : large).push_back(i);
+	}
+
+	while (!small.empty() && !large.empty())
+	{
+		std::uint32_t s = small.back();
+		std::uint32_t l = large.back();
+		small.pop_back();
+		large.pop_back();
+
+		mProbability[s] = scaled[s];
+		mAlias[s] = l;
+
+		scaled[l] = (scaled[l] + scaled[s]) - 1.0f;
+		(scaled[l] < 1.0f ? small : large).push_back(l);
+	}
+
+	// whatever is left is full up to rounding
+	for (std::uint32_t i : large)
+	{
+		mProbability[i] = 1.0f;
+		mAlias[i] = i;
+	}
+	for (std::uint32_t i : small)
+	{
+		mProbability[i] = 1.0f;
+		mAlias[i] = i;
+	}
+
+	// the hierarchy only holds lights that can be picked
+	for (std::uint32_t i = 0; i < count; ++i)
+	{
+		if (mPower[i] > 0.0f)
+			mOrder.push_back(i);
+	}
+
+	mNodes.reserve(2 * mOrder.size());
+	mNodes.push_back({});
+	build(0, 0, static_cast<std::uint32_t>(mOrder.size()));
+}
+
+void LightSampler::build(std::uint32_t node, std::uint32_t begin, std::uint32_t end)
+{
+	BBox bounds;
+	BBox centroids;
+	float power{ 0 };
+
+	for (std::uint32_t i = begin; i < end; ++i)
+	{
+		BBox const& box = mBounds[mOrder[i]];
+		bounds.expand(box);
+		power += mPower[mOrder[i]];
+
+		// unbounded lights sort as if they sat at the origin
+		if (box.max.x - box.min.x < std::numeric_limits<float>::max())
+			centroids.expand(box.centroid());
+		else
+			centroids.expand(atlas::math::Point{ 0, 0, 0 });
+	}
+
+	mNodes[node].bounds = bounds;
+	mNodes[node].power = power;
+
+	if (end - begin == 1)
+	{
+		mNodes[node].offset = begin;
+		mNodes[node].count = 1;
+		return;
+	}
+
+	// median split on the widest axis of the centroids
+	atlas::math::Vector extent = centroids.max - centroids.min;
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	std::uint32_t mid = begin + (end - begin) / 2;
+
+	auto key = [this, axis](std::uint32_t light) {
+		BBox const& box = mBounds[light];
+		if (box.max.x - box.min.x < std::numeric_limits<float>::max())
+			return box.centroid()[axis];
+		return 0.0f;
+	};
+
+	std::nth_element(mOrder.begin() + begin, mOrder.begin() + mid, mOrder.begin() + end,
+		[&key](std::uint32_t a, std::uint32_t b) { return key(a) < key(b); });
+
+	std::uint32_t left = static_cast<std::uint32_t>(mNodes.size());
+	mNodes.push_back({});
+	mNodes.push_back({});
+
+	mNodes[node].offset = left;
+	mNodes[node].count = 0;
+
+	build(left, begin, mid);
+	build(left + 1, mid, end);
+}
+
+float LightSampler::importance(Node const& node, atlas::math::Point const& p, Normal const& n) const
+{
+	BBox const& box = node.bounds;
+	if (!(box.max.x - box.min.x < std::numeric_limits<float>::max()))
+		return node.power;
+
+	// bound the angle to the normal over the sphere around the box:
+	// cos(max(0, theta - thetaBox)), zero only when all of it is behind
+	atlas::math::Vector d = box.centroid() - p;
+	float distance = glm::length(d);
+	float radius = 0.5f * glm::length(box.max - box.min);
+
+	if (distance <= radius)
+		return node.power;
+
+	float cosTheta = glm::dot(glm::normalize(n), d) / distance;
+	float sinBox = radius / distance;
+	float cosBox = std::sqrt(std::max(0.0f, 1.0f - sinBox * sinBox));
+
+	if (cosTheta >= cosBox)
+		return node.power;
+
+	float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+	float cosBound = cosTheta * cosBox + sinTheta * sinBox;
+
+	return node.power * std::max(cosBound, 0.0f);
+}
+
+std::uint32_t LightSampler::sample(atlas::math::Point const& p,
+	Normal const& n,
+	float u,
+	float& pdf) const
+{
+	pdf = 0.0f;
+	if (mOrder.empty())
+		return none;
+
+	if (mStrategy == Strategy::Power)
+	{
+		float scaled = u * mProbability.size();
+		std::uint32_t i = std::min(static_cast<std::uint32_t>(scaled),
+			static_cast<std::uint32_t>(mProbability.size() - 1));
+		std::uint32_t light = (scaled - i) < mProbability[i] ? i : mAlias[i];
+
+		pdf = mPower[light] / mTotalPower;
+		return light;
+	}
+
+	// descend choosing children by importance, reusing u at every level
+	std::uint32_t node{ 0 };
+	pdf = 1.0f;
+
+	while (mNodes[node].count == 0)
+	{
+		Node const& left = mNodes[mNodes[node].offset];
+		Node const& right = mNodes[mNodes[node].offset + 1];
+
+		float wLeft = importance(left, p, n);
+		float wRight = importance(right, p, n);
+		float total = wLeft + wRight;
+
+		if (total <= 0.0f)
+		{
+			pdf = 0.0f;
+			return none;
+		}
+
+		float pLeft = wLeft / total;
+		if (u < pLeft)
+		{
+			u = std::min(u / pLeft, 0x1.fffffep-1f);
+			pdf *= pLeft;
+			node = mNodes[node].offset;
+		}
+		else
+		{
+			u = std::min((u - pLeft) / (1.0f - pLeft), 0x1.fffffep-1f);
+			pdf *= 1.0f - pLeft;
+			node = mNodes[node].offset + 1;
+		}
+	}
+
+	return mOrder[mNodes[node].offset];
+}
+
+LightSampler::Strategy LightSampler::getStrategy() const
+{
+	return mStrategy;
+}
+
+// ***** Plane function members *****
+
+Plane::Plane(atlas::math::Point point, Normal normal) :
+	mPoint{ point }, mNormal{ normal }
+{}
+
+bool Plane::hit(atlas::math::Ray<atlas::math::Vector> const& ray,
+	ShadeRec& sr) const
+{
+	float t{ std::numeric_limits<float>::max() };
+	bool intersect{ Plane::intersectRay(ray, t) };
+
+	// update ShadeRec info about new closest hit
+	if (intersect && t < sr.t)
+	{
+		sr.normal = mNormal;
+		sr.ray = ray;
+		sr.color = mColour;
+		sr.t = t;
+		sr.hit_point = ray.o + t * ray.d;
+		sr.material = mMaterial.get();
+	}
+
+	return intersect;
+
+}
+
+BBox Plane::getBBox() const
+{
+	BBox box;
+	box.min = atlas::math::Point{ std::numeric_limits<float>::lowest() };
+	box.max = atlas::math::Point{ std::numeric_limits<float>::max() };
+	return box;
+}
+
+bool Plane::isBounded() const
+{
+	return false;
+}
+
+bool Plane::intersectRay(atlas::math::Ray<atlas::math::Vector> const& ray,
+	float& tMin) const {
+	return intersectPlane(mPoint, mNormal, ray, tMin);
+}
+
+void Plane::flatten(PrimitiveStore& store, std::uint32_t shape) const
+{
+	store.addPlane(mPoint, mNormal, shape);
+}
+
+// ***** Triangle function members *****
+
+Triangle::Triangle(atlas::math::Point a, atlas::math::Point b, atlas::math::Point c) :
+	mA{ a }, mB{ b }, mC{c}, mNormal{ glm::cross(a - b, a - c) }
+{}
+
+bool Triangle::hit(atlas::math::Ray<atlas::math::Vector> const& ray,
+	ShadeRec& sr) const
+{
+	float t{ std::numeric_limits<float>::max() };
+	bool intersect{ Triangle::intersectRay(ray, t) };
+
+	// update ShadeRec info about new closest hit
+	if (intersect && t < sr.t)
+	{
+		sr.normal = mNormal;
+		sr.ray = ray;
+		sr.color = mColour;
+		sr.t = t;
+		sr.hit_point = ray.o + t * ray.d;
+		sr.material = mMaterial.get();
+	}
+
+	return intersect;
+}
+
+BBox Triangle::getBBox() const
+{
+	BBox box;
+	box.expand(mA);
+	box.expand(mB);
+	box.expand(mC);
+	return box;
+}
+
+bool Triangle::intersectRay(atlas::math::Ray<atlas::math::Vector> const& ray,
+	float& tMin) const {
+	return intersectTriangle(mA, mB, mC, mNormal, ray, tMin);
+}
+
+void Triangle::flatten(PrimitiveStore& store, std::uint32_t shape) const
+{
+	store.addTriangle(mA, mB, mC, shape);
+}
+
+// ***** Sphere function members *****
+Sphere::Sphere(atlas::math::Point center, float radius) :
+    mCentre{center}, mRadius{radius}, mRadiusSqr{radius * radius}
+{}
+
+bool Sphere::hit(atlas::math::Ray<atlas::math::Vector> const& ray,
+                 ShadeRec& sr) const
+{
+    atlas::math::Vector tmp = ray.o - mCentre;
+    float t{std::numeric_limits<float>::max()};
+    bool intersect{Sphere::intersectRay(ray, t)};
+
+    // update ShadeRec info about new closest hit
+    if (intersect && t < sr.t)
+    {
+        sr.normal    = (tmp + t * ray.d) / mRadius;
+        sr.ray       = ray;
+        sr.color     = mColour;
+        sr.t         = t;
+        sr.hit_point = ray.o + t * ray.d;
+        sr.material  = mMaterial.get();
+    }
+
+    return intersect;
+}
+
+BBox Sphere::getBBox() const
+{
+    BBox box;
+    box.min = mCentre - atlas::math::Vector{mRadius};
+    box.max = mCentre + atlas::math::Vector{mRadius};
+    return box;
+}
+
+bool Sphere::intersectRay(atlas::math::Ray<atlas::math::Vector> const& ray,
+                          float& tMin) const
+{
+    return intersectSphere(mCentre, mRadiusSqr, ray, tMin);
+}
+
+void Sphere::flatten(PrimitiveStore& store, std::uint32_t shape) const
+{
+    store.addSphere(mCentre, mRadius, shape);
+}
+
+// ***** TriangleMesh function members *****
+TriangleMesh::TriangleMesh(std::vector<atlas::math::Point> vertices,
+	std::vector<Normal> normals,
+	std::vector<Face> const& faces) :
+	mVertices{ std::move(vertices) },
+	mIndices(3 * faces.size()),
+	mEdges(2 * faces.size())
+{
+	bool smooth{ false };
+	bool materials{ false };
+	for (std::size_t i = 0; i < faces.size(); ++i)
+	{
+		Face const& face = faces[i];
+		std::copy(face.vertex, face.vertex + 3, &mIndices[3 * i]);
+
+		atlas::math::Point const& a = mVertices[face.vertex[0]];
+		mEdges[2 * i] = mVertices[face.vertex[1]] - a;
+		mEdges[2 * i + 1] = mVertices[face.vertex[2]] - a;
+
+		smooth = smooth || face.normal[0] != none;
+		materials = materials || face.material != none;
+	}
+
+	if (smooth)
+	{
+		mNormals = std::move(normals);
+		mNormalIndices.resize(3 * faces.size());
+		for (std::size_t i = 0; i < faces.size(); ++i)
+			std::copy(faces[i].normal, faces[i].normal + 3, &mNormalIndices[3 * i]);
+	}
+
+	if (materials)
+	{
+		mFaceMaterials.resize(faces.size());
+		for (std::size_t i = 0; i < faces.size(); ++i)
+			mFaceMaterials[i] = faces[i].material;
+	}
+
+	for (atlas::math::Point const& p : mVertices)
+		mBounds.expand(p);
+}
+
+void TriangleMesh::setMaterials(std::vector<std::shared_ptr<Material>> const& materials)
+{
+	mMaterials = materials;
+}
+
+std::size_t TriangleMesh::numVertices() const
+{
+	return mVertices.size();
+}
+
+std::size_t TriangleMesh::numFaces() const
+{
+	return mEdges.size() / 2;
+}
+
+std::size_t TriangleMesh::memoryUsed() const
+{
+	return mVertices.capacity() * sizeof(atlas::math::Point) +
+		mIndices.capacity() * sizeof(std::uint32_t) +
+		mEdges.capacity() * sizeof(atlas::math::Vector) +
+		mNormals.capacity() * sizeof(Normal) +
+		mNormalIndices.capacity() * sizeof(std::uint32_t) +
+		mFaceMaterials.capacity() * sizeof(std::uint32_t);
+}
+
+bool TriangleMesh::intersectFace(std::size_t face,
+	atlas::math::Ray<atlas::math::Vector> const& ray,
+	float& t,
+	float& u,
+	float& v) const
+{
+	atlas::math::Vector const& e1 = mEdges[2 * face];
+	atlas::math::Vector const& e2 = mEdges[2 * face + 1];
+
+	atlas::math::Vector p = glm::cross(ray.d, e2);
+	float det{ glm::dot(e1, p) };
+	if (std::fabs(det) < 1e-12f)
+		return false;
+
+	float inv{ 1.0f / det };
+	atlas::math::Vector s = ray.o - mVertices[mIndices[3 * face]];
+	u = glm::dot(s, p) * inv;
+	if (u < 0.0f || u > 1.0f)
+		return false;
+
+	atlas::math::Vector q = glm::cross(s, e1);
+	v = glm::dot(ray.d, q) * inv;
+	if (v < 0.0f || u + v > 1.0f)
+		return false;
+
+	t = glm::dot(e2, q) * inv;
+	return t >= 0.0f;
+}
+
+Normal TriangleMesh::faceNormal(std::size_t face, float u, float v) const
+{
+	Normal n = glm::cross(mEdges[2 * face], mEdges[2 * face + 1]);
+	if (!mNormalIndices.empty() && mNormalIndices[3 * face] != none)
+	{
+		std::uint32_t const* i = &mNormalIndices[3 * face];
+		n = (1.0f - u - v) * mNormals[i[0]] + u * mNormals[i[1]] + v * mNormals[i[2]];
+	}
+
+	float length{ glm::length(n) };
+	return length > 0.0f ? n / length : n;
+}
+
+std::uint32_t TriangleMesh::faceMaterial(std::size_t face) const
+{
+	return mFaceMaterials.empty() ? none : mFaceMaterials[face];
+}
+
+BBox TriangleMesh::faceBBox(std::size_t face) const
+{
+	BBox box;
+	for (std::size_t k = 3 * face; k < 3 * face + 3; ++k)
+		box.expand(mVertices[mIndices[k]]);
+	return box;
+}
+
+float const* TriangleMesh::vertexData() const
+{
+	return reinterpret_cast<float const*>(mVertices.data());
+}
+
+std::uint32_t const* TriangleMesh::indexData() const
+{
+	return mIndices.data();
+}
+
+float const* TriangleMesh::edgeData() const
+{
+	return reinterpret_cast<float const*>(mEdges.data());
+}
+
+bool TriangleMesh::hit(atlas::math::Ray<atlas::math::Vector> const& ray,
+	ShadeRec& sr) const
+{
+	float tBest{ std::numeric_limits<float>::max() };
+	float uBest{ 0 }, vBest{ 0 };
+	std::size_t best{ numFaces() };
+
+	for (std::size_t i = 0; i < numFaces(); ++i)
+	{
+		float t, u, v;
+		if (intersectFace(i, ray, t, u, v) && t < tBest)
+		{
+			tBest = t;
+			uBest = u;
+			vBest = v;
+			best = i;
+		}
+	}
+
+	if (best == numFaces())
+		return false;
+
+	// update ShadeRec info about new closest hit
+	if (tBest < sr.t)
+	{
+		std::uint32_t material{ faceMaterial(best) };
+		sr.normal = faceNormal(best, uBest, vBest);
+		sr.ray = ray;
+		sr.color = mColour;
+		sr.t = tBest;
+		sr.hit_point = ray.o + tBest * ray.d;
+		sr.material = material < mMaterials.size() && mMaterials[material] ?
+			mMaterials[material].get() : mMaterial.get();
+	}
+
+	return true;
+}
+
+BBox TriangleMesh::getBBox() const
+{
+	return mBounds;
+}
+
+bool TriangleMesh::intersectRay(atlas::math::Ray<atlas::math::Vector> const& ray,
+	float& tMin) const
+{
+	bool intersect{ false };
+	for (std::size_t i = 0; i < numFaces(); ++i)
+	{
+		float t, u, v;
+		if (intersectFace(i, ray, t, u, v) && t < tMin)
+		{
+			tMin = t;
+			intersect = true;
+		}
+	}
+	return intersect;
+}
+
+void TriangleMesh::flatten(PrimitiveStore& store, std::uint32_t shape) const
+{
+	// a store surface per material set, faces without one use the mesh's
+	std::vector<std::uint32_t> surfaces(mMaterials.size(), shape);
+	for (std::size_t i = 0; i < mMaterials.size(); ++i)
+	{
+		if (mMaterials[i])
+			surfaces[i] = store.addSurface(mColour, mMaterials[i]);
+	}
+
+	store.addMesh(*this, surfaces, shape);
+}
+
+// ***** OBJ import *****
+// a whole file, mapped read-only where possible
+class MappedFile
+{
+public:
+	explicit MappedFile(std::string const& filename)
+	{
+#if RT_POSIX
+		int file = open(filename.c_str(), O_RDONLY);
+		if (file < 0)
+			return;
+
+		struct stat info{};
+		if (fstat(file, &info) == 0 && info.st_size > 0)
+		{
+			void* data = mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+			if (data != MAP_FAILED)
+			{
+				mData = static_cast<char const*>(data);
+				mSize = static_cast<std::size_t>(info.st_size);
+				mMapped = true;
+			}
+		}
+		close(file);
+#else
+		std::ifstream file{ filename, std::ios::binary | std::ios::ate };
+		if (!file)
+			return;
+		mBuffer.resize(static_cast<std::size_t>(file.tellg()));
+		file.seekg(0);
+		if (file.read(mBuffer.data(), static_cast<std::streamsize>(mBuffer.size())))
+		{
+			mData = mBuffer.data();
+			mSize = mBuffer.size();
+		}
+#endif
+	}
+
+	~MappedFile()
+	{
+#if RT_POSIX
+		if (mMapped)
+			munmap(const_cast<char*>(mData), mSize);
+#endif
+	}
+
+	MappedFile(MappedFile const&) = delete;
+	MappedFile& operator=(MappedFile const&) = delete;
+
+	bool good() const { return mData != nullptr; }
+	char const* data() const { return mData; }
+	std::size_t size() const { return mSize; }
+
+private:
+	char const* mData{ nullptr };
+	std::size_t mSize{ 0 };
+	bool mMapped{ false };
+	std::vector<char> mBuffer;
+};
+
+// A face as read from one chunk of an OBJ file. Indices are zero-based and
+// absolute, or relative to the chunk's first vertex (normal) when the file
+// gave a negative index; relative has bit k set for vertex[k] and bit 3 + k
+// for normal[k]. material indexes the chunk's usemtl names.
+struct OBJFace
+{
+	std::int64_t vertex[3];
+	std::int64_t normal[3];
+	std::uint32_t material;
+	std::uint8_t relative;
+	bool hasNormals;
+};
+
+struct OBJChunk
+{
+	char const* begin{ nullptr };
+	char const* end{ nullptr };
+
+	std::vector<atlas::math::Point> vertices;
+	std::vector<Normal> normals;
+	std::vector<OBJFace> faces;
+
+	// usemtl names in order of first use, pointing into the file, and the
+	// one still active at the end of the chunk
+	std::vector<std::string_view> materials;
+	std::uint32_t lastMaterial{ TriangleMesh::none };
+
+	bool failed{ false };
+};
+
+static bool isBlank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static void skipBlanks(char const*& p, char const* end)
+{
+	while (p < end && isBlank(*p))
+		++p;
+}
+
+// decimal number with optional exponent; reads up to end only, so it works
+// on a mapped file with no terminator
+static bool parseFloat(char const*& p, char const* end, float& value)
+{
+	static double const powers[]{ 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	char const* s{ p };
+	bool negative{ false };
+	if (s < end && (*s == '-' || *s == '+'))
+		negative = *s++ == '-';
+
+	// digits past the 18th only move the exponent
+	std::uint64_t mantissa{ 0 };
+	int exponent{ 0 };
+	int digits{ 0 };
+	for (; s < end && *s >= '0' && *s <= '9'; ++s, ++digits)
+	{
+		if (mantissa < 100000000000000000ull)
+			mantissa = 10 * mantissa + static_cast<std::uint64_t>(*s - '0');
+		else
+			++exponent;
+	}
+	if (s < end && *s == '.')
+	{
+		for (++s; s < end && *s >= '0' && *s <= '9'; ++s, ++digits)
+		{
+			if (mantissa < 100000000000000000ull)
+			{
+				mantissa = 10 * mantissa + static_cast<std::uint64_t>(*s - '0');
+				--exponent;
+			}
+		}
+	}
+	if (digits == 0)
+		return false;
+
+	if (s < end && (*s == 'e' || *s == 'E'))
+	{
+		char const* e{ s + 1 };
+		bool negativeExponent{ false };
+		if (e < end && (*e == '-' || *e == '+'))
+			negativeExponent = *e++ == '-';
+
+		int power{ 0 };
+		if (e < end && *e >= '0' && *e <= '9')
+		{
+			for (; e < end && *e >= '0' && *e <= '9'; ++e)
+				power = std::min(10 * power + (*e - '0'), 1000);
+			exponent += negativeExponent ? -power : power;
+			s = e;
+		}
+	}
+
+	double v{ static_cast<double>(mantissa) };
+	if (exponent >= 0)
+		v = exponent <= 22 ? v * powers[exponent] : v * std::pow(10.0, exponent);
+	else
+		v = exponent >= -22 ? v / powers[-exponent] : v * std::pow(10.0, exponent);
+
+	value = static_cast<float>(negative ? -v : v);
+	p = s;
+	return true;
+}
+
+static bool parseIndex(char const*& p, char const* end, std::int64_t& value)
+{
+	char const* s{ p };
+	bool negative{ s < end && *s == '-' };
+	if (negative)
+		++s;
+
+	std::int64_t v{ 0 };
+	char const* first{ s };
+	for (; s < end && *s >= '0' && *s <= '9'; ++s)
+		v = std::min<std::int64_t>(10 * v + (*s - '0'), std::numeric_limits<std::uint32_t>::max());
+	if (s == first)
+		return false;
+
+	value = negative ? -v : v;
+	p = s;
+	return true;
+}
+
+// true if the line at p starts with keyword followed by a blank
+static bool isKeyword(char const*& p, char const* end, std::string_view keyword)
+{
+	std::size_t n{ keyword.size() };
+	if (static_cast<std::size_t>(end - p) <= n || std::string_view{ p, n } != keyword || !isBlank(p[n]))
+		return false;
+	p += n;
+	return true;
+}
+
+static void parseOBJChunk(OBJChunk& chunk)
+{
+	// corners of the current polygon, kept across lines to avoid allocating
+	std::vector<std::int64_t> vertices, normals;
+	std::uint32_t material{ TriangleMesh::none };
+
+	for (char const* line{ chunk.begin }; line < chunk.end;)
+	{
+		char const* end = static_cast<char const*>(
+			std::memchr(line, '\n', static_cast<std::size_t>(chunk.end - line)));
+		if (end == nullptr)
+			end = chunk.end;
+
+		char const* p{ line };
+		line = end + 1;
+		skipBlanks(p, end);
+
+		if (isKeyword(p, end, "v") || isKeyword(p, end, "vn"))
+		{
+			bool normal{ p[-1] == 'n' };
+			float xyz[3];
+			for (float& x : xyz)
+			{
+				skipBlanks(p, end);
+				if (!parseFloat(p, end, x))
+				{
+					chunk.failed = true;
+					return;
+				}
+			}
+
+			if (normal)
+				chunk.normals.push_back({ xyz[0], xyz[1], xyz[2] });
+			else
+				chunk.vertices.push_back({ xyz[0], xyz[1], xyz[2] });
+		}
+		else if (isKeyword(p, end, "f"))
+		{
+			// corners are v, v/vt, v//vn or v/vt/vn; negative indices count
+			// back from the last element read
+			vertices.clear();
+			normals.clear();
+			for (skipBlanks(p, end); p < end; skipBlanks(p, end))
+			{
+				std::int64_t v{ 0 }, t{ 0 }, n{ 0 };
+				if (!parseIndex(p, end, v) || v == 0)
+				{
+					chunk.failed = true;
+					return;
+				}
+				if (p < end && *p == '/')
+				{
+					++p;
+					if (p < end && *p != '/' && !parseIndex(p, end, t))
+					{
+						chunk.failed = true;
+						return;
+					}
+					if (p < end && *p == '/' && (++p, !parseIndex(p, end, n) || n == 0))
+					{
+						chunk.failed = true;
+						return;
+					}
+				}
+				vertices.push_back(v);
+				normals.push_back(n);
+			}
+
+			if (vertices.size() < 3)
+			{
+				chunk.failed = true;
+				return;
+			}
+
+			bool hasNormals{ std::find(normals.begin(), normals.end(), 0) == normals.end() };
+			std::int64_t vertexCount{ static_cast<std::int64_t>(chunk.vertices.size()) };
+			std::int64_t normalCount{ static_cast<std::int64_t>(chunk.normals.size()) };
+
+			// a fan around the first corner
+			for (std::size_t k = 1; k + 1 < vertices.size(); ++k)
+			{
+				OBJFace face{ {}, {}, material, 0, hasNormals };
+				std::size_t corners[3]{ 0, k, k + 1 };
+				for (int j = 0; j < 3; ++j)
+				{
+					std::int64_t v{ vertices[corners[j]] };
+					std::int64_t n{ normals[corners[j]] };
+					face.vertex[j] = v > 0 ? v - 1 : vertexCount + v;
+					face.normal[j] = n > 0 ? n - 1 : normalCount + n;
+					face.relative |= static_cast<std::uint8_t>((v < 0 ? 1 << j : 0) | (n < 0 ? 8 << j : 0));
+				}
+				chunk.faces.push_back(face);
+			}
+		}
+		else if (isKeyword(p, end, "usemtl"))
+		{
+			skipBlanks(p, end);
+			char const* last{ end };
+			while (last > p && isBlank(last[-1]))
+				--last;
+
+			std::string_view name{ p, static_cast<std::size_t>(last - p) };
+			auto it = std::find(chunk.materials.begin(), chunk.materials.end(), name);
+			material = static_cast<std::uint32_t>(it - chunk.materials.begin());
+			if (it == chunk.materials.end())
+				chunk.materials.push_back(name);
+			chunk.lastMaterial = material;
+		}
+	}
+}
+
+std::shared_ptr<TriangleMesh> TriangleMesh::loadOBJ(std::string const& filename,
+	std::vector<std::string>* materialNames,
+	std::size_t numThreads)
+{
+	ScopedTimer timer{ Phase::Setup };
+	TraceScope trace{ "obj load" };
+	MappedFile file{ filename };
+	if (!file.good())
+		return nullptr;
+
+	// chunks of about 4 MB, each ending after a line end
+	std::size_t const chunkSize{ std::size_t{ 1 } << 22 };
+	std::vector<OBJChunk> chunks;
+	char const* end{ file.data() + file.size() };
+	for (char const* p{ file.data() }; p < end;)
+	{
+		char const* cut{ p + std::min<std::size_t>(chunkSize, static_cast<std::size_t>(end - p)) };
+		if (cut < end)
+		{
+			cut = static_cast<char const*>(std::memchr(cut, '\n', static_cast<std::size_t>(end - cut)));
+			cut = cut ? cut + 1 : end;
+		}
+		chunks.emplace_back();
+		chunks.back().begin = p;
+		chunks.back().end = cut;
+		p = cut;
+	}
+
+	ThreadPool pool{ numThreads };
+	for (OBJChunk& chunk : chunks)
+		pool.submit([&chunk] {
+			TraceScope trace{ "obj chunk" };
+			parseOBJChunk(chunk);
+		});
+	pool.wait();
+
+	// where each chunk's elements start in the mesh, and its usemtl names
+	// numbered by first use in the whole file; faces before a chunk's first
+	// usemtl keep the material active at the end of the chunks before it
+	std::size_t numChunks{ chunks.size() };
+	std::vector<std::size_t> firstVertex(numChunks), firstNormal(numChunks), firstFace(numChunks);
+	std::vector<std::uint32_t> inherited(numChunks);
+	std::vector<std::vector<std::uint32_t>> materialIndex(numChunks);
+	std::vector<std::string_view> names;
+
+	std::size_t numVertices{ 0 }, numNormals{ 0 }, numFaces{ 0 };
+	std::uint32_t current{ none };
+	for (std::size_t c = 0; c < numChunks; ++c)
+	{
+		OBJChunk const& chunk = chunks[c];
+		if (chunk.failed)
+			return nullptr;
+
+		firstVertex[c] = numVertices;
+		firstNormal[c] = numNormals;
+		firstFace[c] = numFaces;
+		numVertices += chunk.vertices.size();
+		numNormals += chunk.normals.size();
+		numFaces += chunk.faces.size();
+
+		inherited[c] = current;
+		for (std::string_view name : chunk.materials)
+		{
+			auto it = std::find(names.begin(), names.end(), name);
+			materialIndex[c].push_back(static_cast<std::uint32_t>(it - names.begin()));
+			if (it == names.end())
+				names.push_back(name);
+		}
+		if (chunk.lastMaterial != none)
+			current = materialIndex[c][chunk.lastMaterial];
+	}
+
+	if (numFaces == 0 || numVertices >= none || numNormals >= none)
+		return nullptr;
+
+	std::vector<atlas::math::Point> vertices(numVertices);
+	std::vector<Normal> normals(numNormals);
+	std::vector<Face> faces(numFaces);
+	std::atomic<bool> valid{ true };
+
+	for (std::size_t c = 0; c < numChunks; ++c)
+	{
+		pool.submit([&, c] {
+			OBJChunk& chunk = chunks[c];
+			std::copy(chunk.vertices.begin(), chunk.vertices.end(), vertices.begin() + firstVertex[c]);
+			std::copy(chunk.normals.begin(), chunk.normals.end(), normals.begin() + firstNormal[c]);
+
+			Face* out = faces.data() + firstFace[c];
+			for (OBJFace const& face : chunk.faces)
+			{
+				for (int j = 0; j < 3; ++j)
+				{
+					std::int64_t v{ face.vertex[j] };
+					std::int64_t n{ face.normal[j] };
+					if ((face.relative >> j) & 1)
+						v += static_cast<std::int64_t>(firstVertex[c]);
+					if ((face.relative >> (3 + j)) & 1)
+						n += static_cast<std::int64_t>(firstNormal[c]);
+					if (v < 0 || v >= static_cast<std::int64_t>(numVertices) ||
+						(face.hasNormals && (n < 0 || n >= static_cast<std::int64_t>(numNormals))))
+						valid = false;
+
+					out->vertex[j] = static_cast<std::uint32_t>(v);
+					out->normal[j] = face.hasNormals ? static_cast<std::uint32_t>(n) : none;
+				}
+				out->material = face.material == none ? inherited[c] : materialIndex[c][face.material];
+				++out;
+			}
+
+			chunk.vertices = {};
+			chunk.normals = {};
+			chunk.faces = {};
+		});
+	}
+	pool.wait();
+
+	if (!valid)
+		return nullptr;
+
+	if (materialNames != nullptr)
+		materialNames->assign(names.begin(), names.end());
+
+	return std::make_shared<TriangleMesh>(std::move(vertices), std::move(normals), faces);
+}
+
+// ***** Instance function members *****
+Instance::Instance(std::shared_ptr<BVH const> prototype, Transform const& transform) :
+	mPrototype{ std::move(prototype) },
+	mTransform{ transform },
+	mInverse{ transform.inverse() },
+	mBounds{ mTransform.bounds(mPrototype->getBBox()) },
+	mBounded{ mPrototype->getStore().isBounded() }
+{}
+
+atlas::math::Ray<atlas::math::Vector> Instance::toObject(atlas::math::Ray<atlas::math::Vector> const& ray) const
+{
+	return { mInverse.point(ray.o), mInverse.vector(ray.d) };
+}
+
+bool Instance::hit(atlas::math::Ray<atlas::math::Vector> const& ray,
+	ShadeRec& sr) const
+{
+	if (!mPrototype->hit(toObject(ray), sr))
+		return false;
+
+	// sr.t carries over, the rest comes back to world space
+	sr.normal = glm::normalize(mInverse.normal(sr.normal));
+	sr.ray = ray;
+	sr.hit_point = ray.o + sr.t * ray.d;
+	if (mMaterial)
+	{
+		sr.color = mColour;
+		sr.material = mMaterial.get();
+	}
+
+	return true;
+}
+
+bool Instance::closestHit(atlas::math::Ray<atlas::math::Vector> const& ray, float& t) const
+{
+	Hit hit{ t, Hit::none };
+	if (!mPrototype->closestHit(toObject(ray), hit))
+		return false;
+
+	t = hit.t;
+	return true;
+}
+
+bool Instance::occluded(atlas::math::Ray<atlas::math::Vector> const& ray, float tMax) const
+{
+	return mPrototype->occluded(toObject(ray), tMax);
+}
+
+BBox Instance::getBBox() const
+{
+	return mBounds;
+}
+
+bool Instance::isBounded() const
+{
+	return mBounded;
+}
+
+std::shared_ptr<BVH const> const& Instance::getPrototype() const
+{
+	return mPrototype;
+}
+
+Transform const& Instance::getTransform() const
+{
+	return mTransform;
+}
+
+bool Instance::intersectRay(atlas::math::Ray<atlas::math::Vector> const& ray,
+	float& tMin) const
+{
+	return closestHit(ray, tMin);
+}
+
+// ***** Pinhole function members *****
+Pinhole::Pinhole() : Camera{}, mDistance{ 750.0f }
+{}
+
+void Pinhole::setDistance(float distance)
+{
+	mDistance = distance;
+}
+
+atlas::math::Vector Pinhole::rayDirection(atlas::math::Point const& p) const
+{
+	const auto dir = p.x * mU + p.y * mV - (mDistance * mZoom) * mW;
+	return glm::normalize(dir);
+}
+
+// scales every lane of batch's directions to unit length
+static void normaliseDirectionsScalar(RayBatch& batch)
+{
+	for (std::size_t i = 0; i < RayBatch::capacity; ++i)
+	{
+		float length2{ batch.dx[i] * batch.dx[i] + batch.dy[i] * batch.dy[i] + batch.dz[i] * batch.dz[i] };
+		float inverse{ 1.0f / std::sqrt(length2) };
+		batch.dx[i] *= inverse;
+		batch.dy[i] *= inverse;
+		batch.dz[i] *= inverse;
+	}
+}
+
+#if RT_X86
+
+RT_TARGET_AVX2 static void normaliseDirectionsAVX2(RayBatch& batch)
+{
+	__m256 const one = _mm256_set1_ps(1.0f);
+
+	for (std::size_t i = 0; i < RayBatch::capacity; i += 8)
+	{
+		__m256 x = _mm256_load_ps(batch.dx + i);
+		__m256 y = _mm256_load_ps(batch.dy + i);
+		__m256 z = _mm256_load_ps(batch.dz + i);
+
+		__m256 length2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z));
+		__m256 inverse = _mm256_div_ps(one, _mm256_sqrt_ps(length2));
+
+		_mm256_store_ps(batch.dx + i, _mm256_mul_ps(x, inverse));
+		_mm256_store_ps(batch.dy + i, _mm256_mul_ps(y, inverse));
+		_mm256_store_ps(batch.dz + i, _mm256_mul_ps(z, inverse));
+	}
+}
+
+#endif
+
+static void normaliseDirections(RayBatch& batch)
+{
+#if RT_X86
+	if (cpuHasAVX2())
+	{
+		normaliseDirectionsAVX2(batch);
+		return;
+	}
+#endif
+
+	normaliseDirectionsScalar(batch);
+}
+
+void Pinhole::generateRays(World const& world, RayBatch& batch) const
+{
+	alignas(32) float x[RayBatch::capacity];
+	alignas(32) float y[RayBatch::capacity];
+	pixelPoints(world, batch, x, y);
+
+	float d{ mDistance * mZoom };
+	for (std::size_t i = 0; i < RayBatch::capacity; ++i)
+	{
+		batch.ox[i] = mEye.x;
+		batch.oy[i] = mEye.y;
+		batch.oz[i] = mEye.z;
+		batch.dx[i] = x[i] * mU.x + y[i] * mV.x - d * mW.x;
+		batch.dy[i] = x[i] * mU.y + y[i] * mV.y - d * mW.y;
+		batch.dz[i] = x[i] * mU.z + y[i] * mV.z - d * mW.z;
+	}
+
+	normaliseDirections(batch);
+}
+
+std::unique_ptr<Camera> Pinhole::clone() const
+{
+	return std::make_unique<Pinhole>(*this);
+}
+
+// ***** Orthographic function members *****
+Orthographic::Orthographic() : Camera{}
+{}
+
+void Orthographic::generateRays(World const& world, RayBatch& batch) const
+{
+	alignas(32) float x[RayBatch::capacity];
+	alignas(32) float y[RayBatch::capacity];
+	pixelPoints(world, batch, x, y);
+
+	float scale{ 1.0f / mZoom };
+	for (std::size_t i = 0; i < RayBatch::capacity; ++i)
+	{
+		batch.ox[i] = mEye.x + scale * (x[i] * mU.x + y[i] * mV.x);
+		batch.oy[i] = mEye.y + scale * (x[i] * mU.y + y[i] * mV.y);
+		batch.oz[i] = mEye.z + scale * (x[i] * mU.z + y[i] * mV.z);
+		batch.dx[i] = -mW.x;
+		batch.dy[i] = -mW.y;
+		batch.dz[i] = -mW.z;
+	}
+}
+
+std::unique_ptr<Camera> Orthographic::clone() const
+{
+	return std::make_unique<Orthographic>(*this);
+}
+
+// ***** ThinLens function members *****
+ThinLens::ThinLens() :
+	Camera{},
+	mDistance{ 750.0f },
+	mFocalDistance{ 1000.0f },
+	mLensRadius{ 1.0f }
+{}
+
+void ThinLens::setDistance(float distance)
+{
+	mDistance = distance;
+}
+
+void ThinLens::setFocalDistance(float focalDistance)
+{
+	mFocalDistance = focalDistance;
+}
+
+void ThinLens::setLensRadius(float lensRadius)
+{
+	mLensRadius = lensRadius;
+}
+
+void ThinLens::generateRays(World const& world, RayBatch& batch) const
+{
+	alignas(32) float x[RayBatch::capacity];
+	alignas(32) float y[RayBatch::capacity];
+	pixelPoints(world, batch, x, y);
+
+	// lens samples, mapped concentrically from the square to the unit disc
+	alignas(32) float lx[RayBatch::capacity]{};
+	alignas(32) float ly[RayBatch::capacity]{};
+	std::uint64_t pixels[RayBatch::capacity];
+	for (std::size_t i = 0; i < batch.count; ++i)
+		pixels[i] = static_cast<std::uint64_t>(batch.row[i]) * world.width + batch.column[i];
+	world.sampler->sampleUnitSquares(pixels, batch.sample, batch.count, Sampler::lensDimension, lx, ly);
+
+	for (std::size_t i = 0; i < batch.count; ++i)
+	{
+		float a{ 2.0f * lx[i] - 1.0f };
+		float b{ 2.0f * ly[i] - 1.0f };
+		float r, phi;
+		if (a == 0.0f && b == 0.0f)
+		{
+			r = 0.0f;
+			phi = 0.0f;
+		}
+		else if (std::abs(a) > std::abs(b))
+		{
+			r = a;
+			phi = 0.25f * 3.14159265f * (b / a);
+		}
+		else
+		{
+			r = b;
+			phi = 0.5f * 3.14159265f - 0.25f * 3.14159265f * (a / b);
+		}
+		lx[i] = mLensRadius * r * std::cos(phi);
+		ly[i] = mLensRadius * r * std::sin(phi);
+	}
+
+	// the pinhole ray through the sample meets the focal plane at
+	// focal / (distance * zoom) of the sample's view-plane point
+	float focus{ mFocalDistance / (mDistance * mZoom) };
+	for (std::size_t i = 0; i < RayBatch::capacity; ++i)
+	{
+		float px{ focus * x[i] - lx[i] };
+		float py{ focus * y[i] - ly[i] };
+		batch.ox[i] = mEye.x + lx[i] * mU.x + ly[i] * mV.x;
+		batch.oy[i] = mEye.y + lx[i] * mU.y + ly[i] * mV.y;
+		batch.oz[i] = mEye.z + lx[i] * mU.z + ly[i] * mV.z;
+		batch.dx[i] = px * mU.x + py * mV.x - mFocalDistance * mW.x;
+		batch.dy[i] = px * mU.y + py * mV.y - mFocalDistance * mW.y;
+		batch.dz[i] = px * mU.z + py * mV.z - mFocalDistance * mW.z;
+	}
+
+	normaliseDirections(batch);
+}
+
+std::unique_ptr<Camera> ThinLens::clone() const
+{
+	return std::make_unique<ThinLens>(*this);
+}
+
+// ***** Fisheye function members *****
+Fisheye::Fisheye() : Camera{}, mHalfAngle{ 0.5f * 3.14159265f }
+{}
+
+void Fisheye::setFieldOfView(float degrees)
+{
+	mHalfAngle = 0.5f * std::min(degrees, 360.0f) * 3.14159265f / 180.0f;
+}
+
+void Fisheye::generateRays(World const& world, RayBatch& batch) const
+{
+	alignas(32) float x[RayBatch::capacity];
+	alignas(32) float y[RayBatch::capacity];
+	pixelPoints(world, batch, x, y);
+
+	// the disc's radius is 1 in these units
+	float scale{ 2.0f / static_cast<float>(std::max<std::size_t>(std::min(world.width, world.height), 1)) };
+	for (std::size_t i = 0; i < RayBatch::capacity; ++i)
+	{
+		batch.ox[i] = mEye.x;
+		batch.oy[i] = mEye.y;
+		batch.oz[i] = mEye.z;
+
+		float nx{ scale * x[i] };
+		float ny{ scale * y[i] };
+		float r2{ nx * nx + ny * ny };
+		if (r2 > 1.0f)
+		{
+			batch.dx[i] = 0.0f;
+			batch.dy[i] = 0.0f;
+			batch.dz[i] = 0.0f;
+			continue;
+		}
+
+		// angle psi from -w, turned by alpha around it
+		float r{ std::sqrt(r2) };
+		float psi{ r * mHalfAngle };
+		float sinPsi{ std::sin(psi) };
+		float cosPsi{ std::cos(psi) };
+		float sinAlpha{ r > 0.0f ? ny / r : 0.0f };
+		float cosAlpha{ r > 0.0f ? nx / r : 1.0f };
+
+		batch.dx[i] = sinPsi * (cosAlpha * mU.x + sinAlpha * mV.x) - cosPsi * mW.x;
+		batch.dy[i] = sinPsi * (cosAlpha * mU.y + sinAlpha * mV.y) - cosPsi * mW.y;
+		batch.dz[i] = sinPsi * (cosAlpha * mU.z + sinAlpha * mV.z) - cosPsi * mW.z;
+	}
+}
+
+std::unique_ptr<Camera> Fisheye::clone() const
+{
+	return std::make_unique<Fisheye>(*this);
+}
+
+// ***** Camera rendering *****
+
+static void prepareWorld(World& world)
+{
+	if (!world.bvh)
+		world.bvh = std::make_shared<BVH>(world.scene, world.numThreads);
+
+	if (world.lightSamples > 0 && !world.lightSampler)
+		world.lightSampler = std::make_shared<LightSampler>(world.lights);
+}
+
+// samples every pixel takes before adaptive sampling may stop it
+static int minimumSamples(World const& world, int numSamples)
+{
+	if (world.adaptiveMinSamples > 0)
+		return std::min(world.adaptiveMinSamples, numSamples);
+	return numSamples;
+}
+
+// one per worker plus one for the thread waiting on the pool
+static std::vector<ShadowCache> makeShadowCaches(World const& world, ThreadPool const& pool)
+{
+	std::vector<ShadowCache> shadowCaches(pool.size() + 1);
+	for (ShadowCache& cache : shadowCaches)
+		cache.lastOccluder.assign(world.lights.size(), Hit::none);
+	return shadowCaches;
+}
+
+void Camera::renderScene(std::shared_ptr<World> world) const
+{
+	ScopedTimer timer{ Phase::Render };
+	TraceScope trace{ "render" };
+	prepareWorld(*world);
+
+	ThreadPool pool{ world->numThreads };
+	std::vector<ShadowCache> shadowCaches{ makeShadowCaches(*world, pool) };
+
+	renderRows(world, 0, world->height, 0, world->sampler->getNumSamples(), pool, shadowCaches, nullptr);
+}
+
+bool Camera::renderStreaming(std::shared_ptr<World> world,
+	ImageWriter& writer,
+	std::size_t memoryBudget) const
+{
+	ScopedTimer timer{ Phase::Render };
+	TraceScope trace{ "render streaming" };
+	prepareWorld(*world);
+
+	// radiance, bytes and sample count per pixel; bands are whole tiles high
+	// unless the budget is smaller than that
+	std::size_t rowBytes{ world->width * (sizeof(Colour) + 3 + sizeof(std::uint32_t)) };
+	std::size_t bandRows{ std::clamp<std::size_t>(memoryBudget / std::max<std::size_t>(rowBytes, 1),
+		1, std::max<std::size_t>(world->height, 1)) };
+	if (bandRows > world->tileSize)
+		bandRows -= bandRows % world->tileSize;
+
+	Colour scale{ world->exposure };
+	if (world->toneMap == ToneMap::MaxNormalise)
+		scale = scale / previewMaximum(world);
+
+	ThreadPool pool{ world->numThreads };
+	std::vector<ShadowCache> shadowCaches{ makeShadowCaches(*world, pool) };
+
+	for (std::size_t y0 = 0; y0 < world->height; y0 += bandRows)
+	{
+		std::size_t y1{ std::min(world->height, y0 + bandRows) };
+		renderRows(world, y0, y1, 0, world->sampler->getNumSamples(), pool, shadowCaches, &scale);
+
+		if (!writer.writeRows(world->pixels.data(), y1 - y0))
+			return false;
+	}
+
+	return writer.finish();
+}
+
+// post-processes the whole of world.image, normalising by its maximum for
+// max-normalise
+static void postProcessImage(World& world, std::vector<Tile> const& tiles, ThreadPool& pool)
+{
+	Colour scale{ world.exposure };
+	if (world.toneMap == ToneMap::MaxNormalise)
+	{
+		Colour max{ 1, 1, 1 };
+		for (Colour const& col : world.image)
+		{
+			max.r = std::max(max.r, col.r);
+			max.g = std::max(max.g, col.g);
+			max.b = std::max(max.b, col.b);
+		}
+		scale = scale / max;
+	}
+
+	std::vector<float> lut{ makeEncodingLUT(world.encoding) };
+	for (Tile const& tile : tiles)
+		pool.submit([&world, &tile, &lut, scale] { postProcessTile(world, tile, scale, lut); });
+	pool.wait();
+}
+
+bool Camera::renderProgressive(std::shared_ptr<World> world,
+	ProgressiveSettings const& settings) const
+{
+	ScopedTimer timer{ Phase::Render };
+	TraceScope trace{ "render progressive" };
+	prepareWorld(*world);
+
+	std::size_t count{ world->width * world->height };
+	std::uint32_t total{ static_cast<std::uint32_t>(world->sampler->getNumSamples()) };
+	std::uint32_t perPass{ static_cast<std::uint32_t>(std::max(settings.samplesPerPass, 1)) };
+
+	// running radiance sums and sample counts; sampler indices [0, done)
+	// are in them
+	std::vector<Colour> sum(count, Colour{ 0, 0, 0 });
+	std::vector<std::uint32_t> counts(count, 0);
+	std::uint32_t done{ 0 };
+
+	std::unique_ptr<Checkpoint> checkpoint;
+	if (!settings.checkpointFile.empty())
+	{
+		checkpoint = std::make_unique<Checkpoint>(settings.checkpointFile,
+			world->width, world->height, *world->sampler);
+		if (!checkpoint->good())
+			return false;
+		done = std::min(checkpoint->load(sum, counts), total);
+	}
+
+	ThreadPool pool{ world->numThreads };
+	std::vector<ShadowCache> shadowCaches{ makeShadowCaches(*world, pool) };
+	std::vector<Tile> tiles{ makeTiles(world->width, world->height, world->tileSize) };
+
+	world->imageY0 = 0;
+	world->image.assign(count, Colour{ 0, 0, 0 });
+	world->sampleCounts.assign(count, 0);
+	world->pixels.assign(3 * count, 0);
+	world->tileStats.clear();
+
+	// renderRows post-processes each pass on its own; that is cheap next to
+	// the pass and is redone below from the running average
+	Colour exposure{ world->exposure };
+	auto lastSave = std::chrono::steady_clock::now();
+
+	for (;;)
+	{
+		bool rendered{ done < total };
+		if (rendered)
+		{
+			std::uint32_t n{ std::min(perPass, total - done) };
+			renderRows(world, 0, world->height, done, static_cast<int>(n), pool, shadowCaches, &exposure);
+			done += n;
+
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				sum[i] += world->image[i] * static_cast<float>(world->sampleCounts[i]);
+				counts[i] += world->sampleCounts[i];
+			}
+		}
+
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			world->image[i] = counts[i] > 0 ? sum[i] / static_cast<float>(counts[i]) : Colour{ 0, 0, 0 };
+			world->sampleCounts[i] = counts[i];
+		}
+		postProcessImage(*world, tiles, pool);
+
+		if (!settings.previewFile.empty())
+		{
+			ImageWriter preview{ settings.previewFile, world->width, world->height };
+			if (!preview.good() || !preview.writeRows(world->pixels.data(), world->height) ||
+				!preview.finish())
+				return false;
+		}
+
+		std::chrono::duration<double> sinceSave = std::chrono::steady_clock::now() - lastSave;
+		if (checkpoint && rendered && (done == total || sinceSave.count() >= settings.checkpointSeconds))
+		{
+			if (!checkpoint->save(done, sum, counts))
+				return false;
+			lastSave = std::chrono::steady_clock::now();
+		}
+
+		if (done >= total)
+			return true;
+	}
+}
+
+Refinement Camera::renderTimed(std::shared_ptr<World> world,
+	std::chrono::steady_clock::duration budget) const
+{
+	auto start{ std::chrono::steady_clock::now() };
+	ScopedTimer timer{ Phase::Render };
+	TraceScope trace{ "render timed" };
+	prepareWorld(*world);
+
+	std::size_t count{ world->width * world->height };
+	std::uint32_t total{ static_cast<std::uint32_t>(world->sampler->getNumSamples()) };
+
+	// every pixel holds samples [0, counts[i]) of the sampler, summed in
+	// world->image until the image is finished; the last render's counts
+	// lend their buffer
+	std::vector<std::uint32_t> counts{ std::move(world->sampleCounts) };
+	counts.assign(count, 0);
+
+	ThreadPool pool{ world->numThreads };
+	std::vector<ShadowCache> shadowCaches{ makeShadowCaches(*world, pool) };
+	std::vector<Tile> tiles{ makeTiles(world->width, world->height, world->tileSize) };
+
+	// finishing writes every pixel, so a world rendered at this size
+	// before keeps its buffers as they are
+	world->imageY0 = 0;
+	world->image.resize(count);
+	world->pixels.resize(3 * count);
+	world->tileStats.clear();
+
+	std::size_t const coarsestStride{ 16 };
+
+	// finishing takes two passes over the tiles: sampled pixels are divided
+	// into their average, then the others take the finest grid pixel above
+	// and to the left of them that has a sample. That pixel may lie in
+	// another tile, so the second pass only starts once the first is done.
+	// Strides are powers of two, so it is found by masking off low
+	// coordinate bits
+	auto averageTile = [&world, &counts](Tile const& tile) {
+		for (std::size_t r{ tile.y0 }; r < tile.y1; ++r)
+		{
+			for (std::size_t i{ r * world->width + tile.x0 }; i < r * world->width + tile.x1; ++i)
+			{
+				if (counts[i] > 1)
+					world->image[i] /= static_cast<float>(counts[i]);
+			}
+		}
+	};
+
+	auto fillTile = [&world, &counts](Tile const& tile) {
+		std::size_t width{ world->width };
+		Colour* image{ world->image.data() };
+
+		for (std::size_t r{ tile.y0 }; r < tile.y1; ++r)
+		{
+			for (std::size_t c{ tile.x0 }; c < tile.x1; ++c)
+			{
+				if (counts[r * width + c] > 0)
+					continue;
+
+				std::size_t source{ r * width + c };
+				for (std::size_t mask{ 1 }; counts[source] == 0 && mask < coarsestStride; mask = 2 * mask + 1)
+					source = (r & ~mask) * width + (c & ~mask);
+
+				image[r * width + c] = counts[source] > 0 ? image[source] : world->background;
+			}
+		}
+	};
+
+	// finishing the image has to fit in the budget too. It is timed on one
+	// tile up front, before any pixel has a sample so every one is filled,
+	// and set aside for as many tiles as a thread finishes; max-normalise
+	// also scans the whole image, which this leaves out
+	std::vector<float> lut{ makeEncodingLUT(world->encoding) };
+	Colour exposure{ world->exposure };
+	bool normalise{ world->toneMap == ToneMap::MaxNormalise };
+
+	std::chrono::steady_clock::duration finishTime{ 0 };
+	if (!tiles.empty())
+	{
+		auto finishStart{ std::chrono::steady_clock::now() };
+		averageTile(tiles.front());
+		fillTile(tiles.front());
+		postProcessTile(*world, tiles.front(), exposure, lut);
+		std::size_t perThread{ (tiles.size() + pool.size() - 1) / pool.size() };
+		finishTime = (std::chrono::steady_clock::now() - finishStart) * perThread;
+	}
+	auto deadline{ start + budget - finishTime };
+
+	Refinement reached{ 0, 0, 0 };
+
+	// the first worker to see the deadline pass stops the others; with no
+	// time left over the image is only finished
+	std::atomic<bool> expired{ std::chrono::steady_clock::now() >= deadline };
+	auto timeLeft = [&expired, deadline] {
+		if (expired.load(std::memory_order_relaxed))
+			return false;
+		if (std::chrono::steady_clock::now() < deadline)
+			return true;
+		expired.store(true, std::memory_order_relaxed);
+		return false;
+	};
+
+	// grid levels take sample 0 on the pixels whose coordinates are both
+	// multiples of stride, skipping those a coarser level already has
+	for (std::size_t stride{ coarsestStride }; stride > 0 && !expired; stride /= 2)
+	{
+		std::size_t coarser{ stride == coarsestStride ? 0 : 2 * stride };
+		for (Tile const& tile : tiles)
+		{
+			pool.submit([this, &world, &pool, &shadowCaches, &counts, &timeLeft,
+			             &tile, stride, coarser] {
+				ShadowCache& shadows{ shadowCaches[pool.currentWorker()] };
+				for (std::size_t r{ tile.y0 + (stride - tile.y0 % stride) % stride }; r < tile.y1; r += stride)
+				{
+					for (std::size_t c{ tile.x0 + (stride - tile.x0 % stride) % stride }; c < tile.x1; c += stride)
+					{
+						if (coarser != 0 && r % coarser == 0 && c % coarser == 0)
+							continue;
+						if (!timeLeft())
+							return;
+
+						std::size_t pixel{ r * world->width + c };
+						world->image[pixel] = samplePixel(*world, r, c, 0, shadows);
+						counts[pixel] = 1;
+					}
+				}
+			});
+		}
+		pool.wait();
+
+		if (!expired)
+			reached = { reached.level + 1, stride, 1 };
+	}
+
+	// sample levels double the samples of every pixel, sample by sample
+	// across a tile so a cut-short tile stays evenly sampled
+	for (std::uint32_t done{ 1 }; done < total && !expired; done = reached.samples)
+	{
+		std::uint32_t next{ std::min(2 * done, total) };
+		for (Tile const& tile : tiles)
+		{
+			pool.submit([this, &world, &pool, &shadowCaches, &counts, &timeLeft,
+			             &tile, done, next] {
+				ShadowCache& shadows{ shadowCaches[pool.currentWorker()] };
+				for (std::uint32_t k{ done }; k < next; ++k)
+				{
+					for (std::size_t r{ tile.y0 }; r < tile.y1; ++r)
+					{
+						for (std::size_t c{ tile.x0 }; c < tile.x1; ++c)
+						{
+							if (!timeLeft())
+								return;
+
+							std::size_t pixel{ r * world->width + c };
+							world->image[pixel] += samplePixel(*world, r, c, k, shadows);
+							++counts[pixel];
+						}
+					}
+				}
+			});
+		}
+		pool.wait();
+
+		if (!expired)
+			reached = { reached.level + 1, 1, next };
+	}
+
+	// only sample levels leave sums to divide, and they start once the
+	// finest grid is done
+	if (reached.stride == 1)
+	{
+		for (Tile const& tile : tiles)
+			pool.submit([&averageTile, &tile] { averageTile(tile); });
+		pool.wait();
+	}
+
+	for (Tile const& tile : tiles)
+	{
+		pool.submit([&world, &fillTile, &lut, &tile, exposure, normalise] {
+			fillTile(tile);
+			if (!normalise)
+				postProcessTile(*world, tile, exposure, lut);
+		});
+	}
+	pool.wait();
+
+	if (normalise)
+		postProcessImage(*world, tiles, pool);
+	world->sampleCounts = std::move(counts);
+	return reached;
+}
+
+Colour Camera::previewMaximum(std::shared_ptr<World> const& world) const
+{
+	// at most previewSize pixels on the longer side, one sample each; the
+	// camera zooms out by the same factor to keep the framing
+	std::size_t const previewSize{ 256 };
+	float factor{ std::max(1.0f,
+		static_cast<float>(std::max(world->width, world->height)) / previewSize) };
+
+	std::shared_ptr<World> preview{ std::make_shared<World>(*world) };
+	preview->width = std::max<std::size_t>(1, static_cast<std::size_t>(world->width / factor));
+	preview->height = std::max<std::size_t>(1, static_cast<std::size_t>(world->height / factor));
+	preview->sampler = std::make_shared<Regular>(1);
+	preview->adaptiveMinSamples = 0;
+	preview->toneMap = ToneMap::Clamp;
+
+	std::unique_ptr<Camera> camera{ clone() };
+	camera->setZoom(mZoom / factor);
+	camera->renderScene(preview);
+
+	Colour max{ 1, 1, 1 };
+	for (Colour const& col : preview->image)
+	{
+		max.r = std::max(max.r, col.r);
+		max.g = std::max(max.g, col.g);
+		max.b = std::max(max.b, col.b);
+	}
+
+	return max;
+}
+
+void Camera::renderRows(std::shared_ptr<World> const& world,
+	std::size_t y0,
+	std::size_t y1,
+	std::uint32_t firstSample,
+	int numSamples,
+	ThreadPool& pool,
+	std::vector<ShadowCache>& shadowCaches,
+	Colour const* scale) const
+{
+	std::vector<Tile> tiles{ makeTiles(world->width, y1 - y0, world->tileSize) };
+	for (Tile& tile : tiles)
+	{
+		tile.y0 += y0;
+		tile.y1 += y0;
+	}
+
+	std::vector<Colour> tileMax(tiles.size(), Colour{ 1, 1, 1 });
+	std::size_t count{ world->width * (y1 - y0) };
+
+	world->imageY0 = y0;
+	world->image.assign(count, Colour{ 0, 0, 0 });
+	world->sampleCounts.assign(count, 0);
+	world->pixels.assign(3 * count, 0);
+
+	// only these rows' tiles, so streaming and progressive renders keep
+	// one band or pass of them rather than one per tile rendered
+	world->tileStats.assign(tiles.size(), TileStats{});
+
+	// per-pixel operators post-process each tile as soon as it is rendered,
+	// max-normalise needs the whole image first unless given a scale
+	std::vector<float> lut{ makeEncodingLUT(world->encoding) };
+	bool deferred{ world->toneMap == ToneMap::MaxNormalise && scale == nullptr };
+	Colour tileScale{ scale ? *scale : Colour{ world->exposure } };
+
+	for (std::size_t i = 0; i < tiles.size(); ++i)
+	{
+		pool.submit([this, &world, &tiles, &tileMax, &pool, &shadowCaches, &lut,
+		             deferred, tileScale, firstSample, numSamples, i] {
+			auto start = std::chrono::steady_clock::now();
+			tileMax[i] = renderTile(world, tiles[i], firstSample, numSamples,
+				shadowCaches[pool.currentWorker()]);
+			if (!deferred)
+				postProcessTile(*world, tiles[i], tileScale, lut);
+			std::chrono::duration<double, std::milli> elapsed =
+				std::chrono::steady_clock::now() - start;
+
+			world->tileStats[i] = { tiles[i], elapsed.count(), pool.currentWorker() };
+		});
+	}
+	pool.wait();
+
+	if (!deferred)
+		return;
+
+	// tiles finish in any order, so the maxima are reduced in tile order
+	Colour max{ 1, 1, 1 };
+	for (Colour const& m : tileMax)
+	{
+		max.r = std::max(max.r, m.r);
+		max.g = std::max(max.g, m.g);
+		max.b = std::max(max.b, m.b);
+	}
+
+	Colour normalise{ tileScale / max };
+	for (Tile const& tile : tiles)
+		pool.submit([&world, &tile, &lut, normalise] { postProcessTile(*world, tile, normalise, lut); });
+	pool.wait();
+}
+
+Colour Camera::renderTile(std::shared_ptr<World> const& world,
+	Tile const& tile,
+	std::uint32_t firstSample,
+	int numSamples,
+	ShadowCache& shadows) const
+{
+	TraceScope scope{ "tile", static_cast<std::int32_t>(tile.x0), static_cast<std::int32_t>(tile.y0) };
+	Colour tileMax{ 1, 1, 1 };
+
+	int minSamples{ minimumSamples(*world, numSamples) };
+	float threshold2{ world->adaptiveThreshold * world->adaptiveThreshold };
+
+	// rays of every pixel's first minSamples samples, made a row at a time;
+	// adaptive samples past them are made one at a time, as most pixels stop
+	// before needing them
+	TileRays rays{};
+	for (std::size_t r{ tile.y0 }; r < tile.y1; ++r)
+	{
+		generateTileRays(*world, Tile{ tile.x0, r, tile.x1, r + 1 }, firstSample,
+			static_cast<std::uint32_t>(minSamples), rays);
+
+		for (std::size_t c{ tile.x0 }; c < tile.x1; ++c)
+		{
+			std::size_t pixel{ r * world->width + c };
+			std::size_t slot{ pixel - world->imageY0 * world->width };
+			Colour pixelAverage{ 0, 0, 0 };
+
+			// running luminance mean and squared deviation (Welford)
+			float mean{ 0 };
+			float m2{ 0 };
+			int j{ 0 };
+
+			while (j < numSamples)
+			{
+				std::uint32_t sample{ firstSample + static_cast<std::uint32_t>(j) };
+				Colour L{ j < minSamples ?
+					trace(*world, rays.ray(r, c, static_cast<std::uint32_t>(j)), pixel, sample, shadows) :
+					samplePixel(*world, r, c, sample, shadows) };
+				pixelAverage += L;
+				++j;
+
+				float y{ 0.2126f * L.r + 0.7152f * L.g + 0.0722f * L.b };
+				float delta{ y - mean };
+				mean += delta / j;
+				m2 += delta * (y - mean);
+
+				// variance of the mean is m2 / (j (j - 1)); a small floor on
+				// the mean keeps black pixels from chasing a relative error
+				if (j >= minSamples && j > 1)
+				{
+					float scale{ std::max(mean, 1e-3f) };
+					if (m2 <= threshold2 * scale * scale * j * (j - 1))
+						break;
+				}
+			}
+
+			float avg{ 1.0f / j };
+			world->sampleCounts[slot] = static_cast<std::uint32_t>(j);
+
+			Colour pix{ pixelAverage * avg };
+
+			tileMax.r = std::max(tileMax.r, pix.r);
+			tileMax.g = std::max(tileMax.g, pix.g);
+			tileMax.b = std::max(tileMax.b, pix.b);
+
+			world->image[slot] = pix;
+		}
+	}
+
+	return tileMax;
+}
+
+Colour Camera::samplePixel(World const& world,
+	std::size_t r,
+	std::size_t c,
+	std::uint32_t sample,
+	ShadowCache& shadows) const
+{
+	RayBatch batch;
+	batch.row[0] = static_cast<std::uint32_t>(r);
+	batch.column[0] = static_cast<std::uint32_t>(c);
+	batch.sample[0] = sample;
+	batch.count = 1;
+	generateRays(world, batch);
+
+	return trace(world, batch.ray(0), r * world.width + c, sample, shadows);
+}
+
+void Camera::generateTileRays(World const& world,
+	Tile const& tile,
+	std::uint32_t firstSample,
+	std::uint32_t numSamples,
+	TileRays& rays) const
+{
+	std::size_t count{ (tile.x1 - tile.x0) * (tile.y1 - tile.y0) * numSamples };
+	rays.tile = tile;
+	rays.firstSample = firstSample;
+	rays.numSamples = numSamples;
+	rays.batches.resize((count + RayBatch::capacity - 1) / RayBatch::capacity);
+
+	std::size_t i{ 0 };
+	for (std::size_t r{ tile.y0 }; r < tile.y1; ++r)
+	{
+		for (std::size_t c{ tile.x0 }; c < tile.x1; ++c)
+		{
+			for (std::uint32_t j = 0; j < numSamples; ++j, ++i)
+			{
+				RayBatch& batch{ rays.batches[i / RayBatch::capacity] };
+				std::size_t lane{ i % RayBatch::capacity };
+				batch.row[lane] = static_cast<std::uint32_t>(r);
+				batch.column[lane] = static_cast<std::uint32_t>(c);
+				batch.sample[lane] = firstSample + j;
+				batch.count = lane + 1;
+
+				if (batch.count == RayBatch::capacity)
+					generateRays(world, batch);
+			}
+		}
+	}
+
+	if (count % RayBatch::capacity != 0)
+		generateRays(world, rays.batches.back());
+}
+
+Colour Camera::trace(World const& world,
+	atlas::math::Ray<atlas::math::Vector> const& ray,
+	std::uint64_t pixel,
+	std::uint32_t sample,
+	ShadowCache& shadows) const
+{
+	Telemetry::count(Counter::PrimaryRays);
+	if (ray.d.x == 0.0f && ray.d.y == 0.0f && ray.d.z == 0.0f)
+		return Colour{ 0, 0, 0 };
+
+	ShadeRec trace_data{};
+	trace_data.world = &world;
+	trace_data.shadows = &shadows;
+	trace_data.pixel = pixel;
+	trace_data.sample = sample;
+	trace_data.t = std::numeric_limits<float>::max();
+
+	Colour L{ 0, 0, 0 };
+	if (world.bvh->hit(ray, trace_data))
+	{
+		if (trace_data.material != nullptr)
+			L = trace_data.material->shade(trace_data);
+	}
+
+	return L;
+}
+
+// ***** PrimitiveStore function members *****
+PrimitiveStore::PrimitiveStore(std::vector<std::shared_ptr<Shape>> const& scene) :
+	mScene{ scene }
+{
+	ScopedTimer timer{ Phase::Build };
+	TraceScope trace{ "flatten" };
+	mColours.reserve(scene.size());
+	mMaterials.reserve(scene.size());
+
+	for (std::uint32_t i = 0; i < scene.size(); ++i)
+	{
+		mColours.push_back(scene[i]->getColour());
+		mMaterials.push_back(scene[i]->getMaterial().get());
+	}
+
+	// after every shape has its slot, shapes can add surfaces of their own
+	for (std::uint32_t i = 0; i < scene.size(); ++i)
+		scene[i]->flatten(*this, i);
+}
+
+std::uint32_t PrimitiveStore::makeId(Type type, std::uint32_t index)
+{
+	return (static_cast<std::uint32_t>(type) << 29) | index;
+}
+
+PrimitiveStore::Type PrimitiveStore::typeOf(std::uint32_t id)
+{
+	return static_cast<Type>(id >> 29);
+}
+
+std::uint32_t PrimitiveStore::indexOf(std::uint32_t id)
+{
+	return id & 0x1fffffffu;
+}
+
+void PrimitiveStore::addSphere(atlas::math::Point const& centre, float radius, std::uint32_t shape)
+{
+	mSpheres.cx.push_back(centre.x);
+	mSpheres.cy.push_back(centre.y);
+	mSpheres.cz.push_back(centre.z);
+	mSpheres.radius.push_back(radius);
+	mSpheres.r2.push_back(radius * radius);
+	mSpheres.shape.push_back(shape);
+}
+
+void PrimitiveStore::addPlane(atlas::math::Point const& point, Normal const& normal, std::uint32_t shape)
+{
+	mPlanes.px.push_back(point.x);
+	mPlanes.py.push_back(point.y);
+	mPlanes.pz.push_back(point.z);
+	mPlanes.nx.push_back(normal.x);
+	mPlanes.ny.push_back(normal.y);
+	mPlanes.nz.push_back(normal.z);
+	mPlanes.shape.push_back(shape);
+}
+
+void PrimitiveStore::addTriangle(atlas::math::Point const& a,
+	atlas::math::Point const& b,
+	atlas::math::Point const& c,
+	std::uint32_t shape)
+{
+	atlas::math::Vector n = glm::cross(a - b, a - c);
+
+	mTriangles.ax.push_back(a.x);
+	mTriangles.ay.push_back(a.y);
+	mTriangles.az.push_back(a.z);
+	mTriangles.bx.push_back(b.x);
+	mTriangles.by.push_back(b.y);
+	mTriangles.bz.push_back(b.z);
+	mTriangles.cx.push_back(c.x);
+	mTriangles.cy.push_back(c.y);
+	mTriangles.cz.push_back(c.z);
+	mTriangles.nx.push_back(n.x);
+	mTriangles.ny.push_back(n.y);
+	mTriangles.nz.push_back(n.z);
+	mTriangles.shape.push_back(shape);
+
+	if (!mTriangles.smooth.empty())
+		mTriangles.smooth.push_back(Hit::none);
+}
+
+void PrimitiveStore::addTriangle(atlas::math::Point const& a,
+	atlas::math::Point const& b,
+	atlas::math::Point const& c,
+	Normal const& na,
+	Normal const& nb,
+	Normal const& nc,
+	std::uint32_t shape)
+{
+	// the unit face normal intersects as Triangle's does, only the
+	// threshold on grazing rays becomes independent of the triangle's size
+	atlas::math::Vector n = glm::cross(a - b, a - c);
+	float length = glm::length(n);
+	if (length > 0.0f)
+		n = n / length;
+
+	// vertex normals that all match the face normal add nothing
+	bool flat{ na == nb && nb == nc && glm::dot(glm::normalize(na), n) > 0.9999f };
+
+	std::size_t index{ mTriangles.shape.size() };
+	addTriangle(a, b, c, shape);
+	mTriangles.nx[index] = n.x;
+	mTriangles.ny[index] = n.y;
+	mTriangles.nz[index] = n.z;
+
+	if (flat)
+		return;
+
+	mTriangles.smooth.resize(index + 1, Hit::none);
+	mTriangles.smooth[index] = static_cast<std::uint32_t>(mTriangles.vertexNormals.size() / 3);
+	mTriangles.vertexNormals.push_back(na);
+	mTriangles.vertexNormals.push_back(nb);
+	mTriangles.vertexNormals.push_back(nc);
+}
+
+void PrimitiveStore::addMesh(TriangleMesh const& mesh,
+	std::vector<std::uint32_t> const& surfaces,
+	std::uint32_t shape)
+{
+	mMeshes.mesh.push_back(&mesh);
+	mMeshes.first.push_back(mMeshes.numFaces);
+	mMeshes.shape.push_back(shape);
+	mMeshes.firstSurface.push_back(static_cast<std::uint32_t>(mMeshes.surfaces.size()));
+	mMeshes.surfaces.insert(mMeshes.surfaces.end(), surfaces.begin(), surfaces.end());
+	mMeshes.numFaces += static_cast<std::uint32_t>(mesh.numFaces());
+}
+
+void PrimitiveStore::addOther(std::uint32_t shape)
+{
+	if (!mScene[shape]->isBounded())
+		mUnbounded.push_back(static_cast<std::uint32_t>(mOthers.size()));
+	mOthers.push_back(shape);
+}
+
+std::uint32_t PrimitiveStore::addSurface(Colour const& colour, std::shared_ptr<Material> const& material)
+{
+	mColours.push_back(colour);
+	mMaterials.push_back(material.get());
+	mSurfaces.push_back(material);
+	return static_cast<std::uint32_t>(mColours.size() - 1);
+}
+
+void PrimitiveStore::reserve(std::size_t spheres, std::size_t planes, std::size_t triangles)
+{
+	for (auto* v : { &mSpheres.cx, &mSpheres.cy, &mSpheres.cz, &mSpheres.radius, &mSpheres.r2 })
+		v->reserve(v->size() + spheres);
+	mSpheres.shape.reserve(mSpheres.shape.size() + spheres);
+
+	for (auto* v : { &mPlanes.px, &mPlanes.py, &mPlanes.pz, &mPlanes.nx, &mPlanes.ny, &mPlanes.nz })
+		v->reserve(v->size() + planes);
+	mPlanes.shape.reserve(mPlanes.shape.size() + planes);
+
+	for (auto* v : { &mTriangles.ax, &mTriangles.ay, &mTriangles.az, &mTriangles.bx, &mTriangles.by,
+	                 &mTriangles.bz, &mTriangles.cx, &mTriangles.cy, &mTriangles.cz, &mTriangles.nx,
+	                 &mTriangles.ny, &mTriangles.nz })
+		v->reserve(v->size() + triangles);
+	mTriangles.shape.reserve(mTriangles.shape.size() + triangles);
+}
+
+template <typename T>
+static std::size_t bytesHeld(std::vector<T> const& v)
+{
+	return v.capacity() * sizeof(T);
+}
+
+std::size_t PrimitiveStore::memoryUsed() const
+{
+	std::size_t bytes{ 0 };
+	for (auto* v : { &mSpheres.cx, &mSpheres.cy, &mSpheres.cz, &mSpheres.radius, &mSpheres.r2,
+	                 &mPlanes.px, &mPlanes.py, &mPlanes.pz, &mPlanes.nx, &mPlanes.ny, &mPlanes.nz,
+	                 &mTriangles.ax, &mTriangles.ay, &mTriangles.az, &mTriangles.bx, &mTriangles.by,
+	                 &mTriangles.bz, &mTriangles.cx, &mTriangles.cy, &mTriangles.cz, &mTriangles.nx,
+	                 &mTriangles.ny, &mTriangles.nz })
+		bytes += bytesHeld(*v);
+	for (auto* v : { &mSpheres.shape, &mPlanes.shape, &mTriangles.shape, &mTriangles.smooth, &mMeshes.first,
+	                 &mMeshes.shape, &mMeshes.firstSurface, &mMeshes.surfaces, &mOthers, &mUnbounded })
+		bytes += bytesHeld(*v);
+	bytes += bytesHeld(mMeshes.mesh);
+
+	return bytes + bytesHeld(mTriangles.vertexNormals) + bytesHeld(mScene) + bytesHeld(mColours) +
+		bytesHeld(mMaterials) + bytesHeld(mSurfaces);
+}
+
+bool PrimitiveStore::isBounded() const
+{
+	return mPlanes.shape.empty() && mUnbounded.empty();
+}
+
+std::vector<std::uint32_t> PrimitiveStore::boundedPrimitives() const
+{
+	std::vector<std::uint32_t> ids;
+	ids.reserve(mSpheres.shape.size() + mTriangles.shape.size() + mMeshes.numFaces + mOthers.size());
+
+	for (std::uint32_t i = 0; i < mSpheres.shape.size(); ++i)
+		ids.push_back(makeId(Type::Sphere, i));
+
+	for (std::uint32_t i = 0; i < mTriangles.shape.size(); ++i)
+		ids.push_back(makeId(Type::Triangle, i));
+
+	for (std::uint32_t i = 0; i < mMeshes.numFaces; ++i)
+		ids.push_back(makeId(Type::Mesh, i));
+
+	for (std::uint32_t i = 0; i < mOthers.size(); ++i)
+	{
+		if (mScene[mOthers[i]]->isBounded())
+			ids.push_back(makeId(Type::Other, i));
+	}
+
+	return ids;
+}
+
+BBox PrimitiveStore::getBBox(std::uint32_t id) const
+{
+	std::uint32_t i = indexOf(id);
+	BBox box;
+
+	switch (typeOf(id))
+	{
+	case Type::Sphere:
+	{
+		atlas::math::Point c{ mSpheres.cx[i], mSpheres.cy[i], mSpheres.cz[i] };
+		box.min = c - atlas::math::Vector{ mSpheres.radius[i] };
+		box.max = c + atlas::math::Vector{ mSpheres.radius[i] };
+		break;
+	}
+	case Type::Triangle:
+		box.expand(atlas::math::Point{ mTriangles.ax[i], mTriangles.ay[i], mTriangles.az[i] });
+		box.expand(atlas::math::Point{ mTriangles.bx[i], mTriangles.by[i], mTriangles.bz[i] });
+		box.expand(atlas::math::Point{ mTriangles.cx[i], mTriangles.cy[i], mTriangles.cz[i] });
+		break;
+	case Type::Mesh:
+	{
+		std::uint32_t m{ meshOf(i) };
+		box = mMeshes.mesh[m]->faceBBox(i - mMeshes.first[m]);
+		break;
+	}
+	case Type::Other:
+		box = mScene[mOthers[i]]->getBBox();
+		break;
+	default:
+		box.min = atlas::math::Point{ std::numeric_limits<float>::lowest() };
+		box.max = atlas::math::Point{ std::numeric_limits<float>::max() };
+		break;
+	}
+
+	return box;
+}
+
+bool PrimitiveStore::intersect(std::uint32_t id,
+	atlas::math::Ray<atlas::math::Vector> const& ray,
+	Hit& hit) const
+{
+	std::uint32_t i = indexOf(id);
+	float t{ std::numeric_limits<float>::max() };
+	bool intersect{ false };
+
+	switch (typeOf(id))
+	{
+	case Type::Sphere:
+		intersect = intersectSphere({ mSpheres.cx[i], mSpheres.cy[i], mSpheres.cz[i] },
+			mSpheres.r2[i], ray, t);
+		break;
+	case Type::Plane:
+		intersect = intersectPlane({ mPlanes.px[i], mPlanes.py[i], mPlanes.pz[i] },
+			{ mPlanes.nx[i], mPlanes.ny[i], mPlanes.nz[i] }, ray, t);
+		break;
+	case Type::Triangle:
+		intersect = intersectTriangle({ mTriangles.ax[i], mTriangles.ay[i], mTriangles.az[i] },
+			{ mTriangles.bx[i], mTriangles.by[i], mTriangles.bz[i] },
+			{ mTriangles.cx[i], mTriangles.cy[i], mTriangles.cz[i] },
+			{ mTriangles.nx[i], mTriangles.ny[i], mTriangles.nz[i] }, ray, t);
+		break;
+	case Type::Mesh:
+	{
+		std::uint32_t m{ meshOf(i) };
+		float u, v;
+		intersect = mMeshes.mesh[m]->intersectFace(i - mMeshes.first[m], ray, t, u, v);
+		break;
+	}
+	default:
+	{
+		Telemetry::count(Counter::ShapeQueries);
+		t = hit.t;
+		intersect = mScene[mOthers[i]]->closestHit(ray, t);
+		break;
+	}
+	}
+
+	if (intersect && t < hit.t)
+	{
+		hit = { t, id };
+		return true;
+	}
+
+	return false;
+}
+
+bool PrimitiveStore::occludes(std::uint32_t id,
+	atlas::math::Ray<atlas::math::Vector> const& ray,
+	float tMax) const
+{
+	if (typeOf(id) == Type::Other)
+	{
+		Telemetry::count(Counter::ShapeQueries);
+		return mScene[mOthers[indexOf(id)]]->occluded(ray, tMax);
+	}
+
+	Hit hit{ tMax, Hit::none };
+	return intersect(id, ray, hit);
+}
+
+bool PrimitiveStore::occludedUnbounded(atlas::math::Ray<atlas::math::Vector> const& ray,
+	float tMax,
+	std::uint32_t& occluder) const
+{
+	for (std::uint32_t i = 0; i < mPlanes.shape.size(); ++i)
+	{
+		float t;
+		atlas::math::Point point{ mPlanes.px[i], mPlanes.py[i], mPlanes.pz[i] };
+		Normal normal{ mPlanes.nx[i], mPlanes.ny[i], mPlanes.nz[i] };
+		if (intersectPlane(point, normal, ray, t) && t < tMax)
+		{
+			occluder = makeId(Type::Plane, i);
+			return true;
+		}
+	}
+
+	for (std::uint32_t i : mUnbounded)
+	{
+		std::uint32_t id{ makeId(Type::Other, i) };
+		if (occludes(id, ray, tMax))
+		{
+			occluder = id;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool PrimitiveStore::occluded(atlas::math::Ray<atlas::math::Vector> const& ray,
+	float tMax,
+	std::uint32_t& occluder) const
+{
+	for (std::uint32_t i = 0; i < mSpheres.shape.size(); ++i)
+	{
+		float t;
+		atlas::math::Point centre{ mSpheres.cx[i], mSpheres.cy[i], mSpheres.cz[i] };
+		if (intersectSphere(centre, mSpheres.r2[i], ray, t) && t < tMax)
+		{
+			occluder = makeId(Type::Sphere, i);
+			return true;
+		}
+	}
+
+	for (std::uint32_t i = 0; i < mTriangles.shape.size(); ++i)
+	{
+		float t;
+		atlas::math::Point a{ mTriangles.ax[i], mTriangles.ay[i], mTriangles.az[i] };
+		atlas::math::Point b{ mTriangles.bx[i], mTriangles.by[i], mTriangles.bz[i] };
+		atlas::math::Point c{ mTriangles.cx[i], mTriangles.cy[i], mTriangles.cz[i] };
+		atlas::math::Vector normal{ mTriangles.nx[i], mTriangles.ny[i], mTriangles.nz[i] };
+		if (intersectTriangle(a, b, c, normal, ray, t) && t < tMax)
+		{
+			occluder = makeId(Type::Triangle, i);
+			return true;
+		}
+	}
+
+	for (std::uint32_t m = 0; m < mMeshes.mesh.size(); ++m)
+	{
+		TriangleMesh const& mesh = *mMeshes.mesh[m];
+		for (std::uint32_t i = 0; i < mesh.numFaces(); ++i)
+		{
+			float t, u, v;
+			if (mesh.intersectFace(i, ray, t, u, v) && t < tMax)
+			{
+				occluder = makeId(Type::Mesh, mMeshes.first[m] + i);
+				return true;
+			}
+		}
+	}
+
+	for (std::uint32_t i = 0; i < mOthers.size(); ++i)
+	{
+		std::uint32_t id{ makeId(Type::Other, i) };
+		if (mScene[mOthers[i]]->isBounded() && occludes(id, ray, tMax))
+		{
+			occluder = id;
+			return true;
+		}
+	}
+
+	return occludedUnbounded(ray, tMax, occluder);
+}
+
+bool PrimitiveStore::closestHitUnbounded(atlas::math::Ray<atlas::math::Vector> const& ray, Hit& hit) const
+{
+	float tStart{ hit.t };
+
+	for (std::uint32_t i = 0; i < mPlanes.shape.size(); ++i)
+	{
+		float t;
+		atlas::math::Point point{ mPlanes.px[i], mPlanes.py[i], mPlanes.pz[i] };
+		Normal normal{ mPlanes.nx[i], mPlanes.ny[i], mPlanes.nz[i] };
+		if (intersectPlane(point, normal, ray, t) && t < hit.t)
+			hit = { t, makeId(Type::Plane, i) };
+	}
+
+	for (std::uint32_t i : mUnbounded)
+		intersect(makeId(Type::Other, i), ray, hit);
+
+	return hit.t < tStart;
+}
+
+bool PrimitiveStore::closestHit(atlas::math::Ray<atlas::math::Vector> const& ray, Hit& hit) const
+{
+	float tStart{ hit.t };
+
+	for (std::uint32_t i = 0; i < mSpheres.shape.size(); ++i)
+	{
+		float t;
+		atlas::math::Point centre{ mSpheres.cx[i], mSpheres.cy[i], mSpheres.cz[i] };
+		if (intersectSphere(centre, mSpheres.r2[i], ray, t) && t < hit.t)
+			hit = { t, makeId(Type::Sphere, i) };
+	}
+
+	for (std::uint32_t i = 0; i < mTriangles.shape.size(); ++i)
+	{
+		float t;
+		atlas::math::Point a{ mTriangles.ax[i], mTriangles.ay[i], mTriangles.az[i] };
+		atlas::math::Point b{ mTriangles.bx[i], mTriangles.by[i], mTriangles.bz[i] };
+		atlas::math::Point c{ mTriangles.cx[i], mTriangles.cy[i], mTriangles.cz[i] };
+		atlas::math::Vector normal{ mTriangles.nx[i], mTriangles.ny[i], mTriangles.nz[i] };
+		if (intersectTriangle(a, b, c, normal, ray, t) && t < hit.t)
+			hit = { t, makeId(Type::Triangle, i) };
+	}
+
+	for (std::uint32_t m = 0; m < mMeshes.mesh.size(); ++m)
+	{
+		TriangleMesh const& mesh = *mMeshes.mesh[m];
+		for (std::uint32_t i = 0; i < mesh.numFaces(); ++i)
+		{
+			float t, u, v;
+			if (mesh.intersectFace(i, ray, t, u, v) && t < hit.t)
+				hit = { t, makeId(Type::Mesh, mMeshes.first[m] + i) };
+		}
+	}
+
+	for (std::uint32_t i = 0; i < mOthers.size(); ++i)
+	{
+		if (mScene[mOthers[i]]->isBounded())
+			intersect(makeId(Type::Other, i), ray, hit);
+	}
+
+	closestHitUnbounded(ray, hit);
+
+	return hit.t < tStart;
+}
+
+void PrimitiveStore::fillShadeRec(Hit const& hit,
+	atlas::math::Ray<atlas::math::Vector> const& ray,
+	ShadeRec& sr) const
+{
+	std::uint32_t i = indexOf(hit.primitive);
+	std::uint32_t shape{ 0 };
+
+	switch (typeOf(hit.primitive))
+	{
+	case Type::Sphere:
+	{
+		atlas::math::Point centre{ mSpheres.cx[i], mSpheres.cy[i], mSpheres.cz[i] };
+		sr.normal = (ray.o - centre + hit.t * ray.d) / mSpheres.radius[i];
+		shape = mSpheres.shape[i];
+		break;
+	}
+	case Type::Plane:
+		sr.normal = { mPlanes.nx[i], mPlanes.ny[i], mPlanes.nz[i] };
+		shape = mPlanes.shape[i];
+		break;
+	case Type::Triangle:
+		sr.normal = { mTriangles.nx[i], mTriangles.ny[i], mTriangles.nz[i] };
+		shape = mTriangles.shape[i];
+		if (!mTriangles.smooth.empty() && mTriangles.smooth[i] != Hit::none)
+		{
+			// barycentric coordinates of the hit point weight the normals
+			atlas::math::Point a{ mTriangles.ax[i], mTriangles.ay[i], mTriangles.az[i] };
+			atlas::math::Vector e1{ mTriangles.bx[i] - a.x, mTriangles.by[i] - a.y, mTriangles.bz[i] - a.z };
+			atlas::math::Vector e2{ mTriangles.cx[i] - a.x, mTriangles.cy[i] - a.y, mTriangles.cz[i] - a.z };
+			atlas::math::Vector p = ray.o + hit.t * ray.d - a;
+
+			float d11{ glm::dot(e1, e1) }, d12{ glm::dot(e1, e2) }, d22{ glm::dot(e2, e2) };
+			float p1{ glm::dot(p, e1) }, p2{ glm::dot(p, e2) };
+			float denom{ d11 * d22 - d12 * d12 };
+			float u{ denom != 0.0f ? (d22 * p1 - d12 * p2) / denom : 0.0f };
+			float v{ denom != 0.0f ? (d11 * p2 - d12 * p1) / denom : 0.0f };
+
+			Normal const* n = &mTriangles.vertexNormals[3 * mTriangles.smooth[i]];
+			Normal smooth{ (1.0f - u - v) * n[0] + u * n[1] + v * n[2] };
+			float length{ glm::length(smooth) };
+			if (length > 0.0f)
+				sr.normal = smooth / length;
+		}
+		break;
+	case Type::Mesh:
+	{
+		// the face is hit again for its barycentric coordinates
+		std::uint32_t m{ meshOf(i) };
+		std::uint32_t face{ i - mMeshes.first[m] };
+		TriangleMesh const& mesh = *mMeshes.mesh[m];
+		float t, u, v;
+		if (!mesh.intersectFace(face, ray, t, u, v))
+			u = v = 0.0f;
+		sr.normal = mesh.faceNormal(face, u, v);
+
+		std::uint32_t material{ mesh.faceMaterial(face) };
+		std::uint32_t first{ mMeshes.firstSurface[m] };
+		std::uint32_t last{ m + 1 < mMeshes.mesh.size() ? mMeshes.firstSurface[m + 1] :
+			static_cast<std::uint32_t>(mMeshes.surfaces.size()) };
+		shape = material < last - first ? mMeshes.surfaces[first + material] : mMeshes.shape[m];
+		break;
+	}
+	default:
+		Telemetry::count(Counter::ShapeQueries);
+		sr.t = std::numeric_limits<float>::max();
+		mScene[mOthers[i]]->hit(ray, sr);
+		sr.hit_point = ray.o + sr.t * ray.d;
+		return;
+	}
+
+	sr.ray = ray;
+	sr.t = hit.t;
+	sr.hit_point = ray.o + hit.t * ray.d;
+	sr.color = mColours[shape];
+	sr.material = mMaterials[shape];
+}
+
+bool PrimitiveStore::hit(atlas::math::Ray<atlas::math::Vector> const& ray, ShadeRec& sr) const
+{
+	Hit hit{ sr.t, Hit::none };
+
+	if (!closestHit(ray, hit))
+		return false;
+
+	fillShadeRec(hit, ray, sr);
+	return true;
+}
+
+PrimitiveStore::Spheres const& PrimitiveStore::spheres() const
+{
+	return mSpheres;
+}
+
+PrimitiveStore::Planes const& PrimitiveStore::planes() const
+{
+	return mPlanes;
+}
+
+PrimitiveStore::Triangles const& PrimitiveStore::triangles() const
+{
+	return mTriangles;
+}
+
+PrimitiveStore::Meshes const& PrimitiveStore::meshes() const
+{
+	return mMeshes;
+}
+
+std::uint32_t PrimitiveStore::meshOf(std::uint32_t i) const
+{
+	// a scene rarely has more than a few meshes
+	auto next = std::upper_bound(mMeshes.first.begin(), mMeshes.first.end(), i);
+	return static_cast<std::uint32_t>(next - mMeshes.first.begin() - 1);
+}
+
+// ***** BVH function members *****
+BVH::BVH(std::vector<std::shared_ptr<Shape>> const& scene, std::size_t numThreads) :
+	BVH{ PrimitiveStore{ scene }, numThreads }
+{}
+
+BVH::BVH(PrimitiveStore store, std::size_t numThreads) :
+	mStore{ std::move(store) },
+	mPrimitives{ mStore.boundedPrimitives() },
+	mNodeCount{ 0 },
+	mTraversal{ cpuHasAVX2() ? Traversal::WideAVX2 : Traversal::WideScalar }
+{
+	ScopedTimer timer{ Phase::Build };
+	TraceScope trace{ "bvh build" };
+	if (mPrimitives.empty())
+		return;
+
+	std::uint32_t count = static_cast<std::uint32_t>(mPrimitives.size());
+
+	mBounds.reserve(count);
+	for (std::uint32_t id : mPrimitives)
+		mBounds.push_back(mStore.getBBox(id));
+
+	mOrder.resize(count);
+	for (std::uint32_t i = 0; i < count; ++i)
+		mOrder[i] = i;
+
+	mNodes.resize(2 * count - 1);
+	mNodeCount = 1;
+
+	if (count > parallelThreshold)
+	{
+		ThreadPool pool{ numThreads };
+		build(0, 0, count, 0, &pool);
+		pool.wait();
+	}
+	else
+	{
+		build(0, 0, count, 0, nullptr);
+	}
+
+	mNodes.resize(mNodeCount);
+
+	// store the primitives in leaf order so leaves are contiguous ranges
+	std::vector<std::uint32_t> primitives(count);
+	std::vector<BBox> bounds(count);
+	for (std::uint32_t i = 0; i < count; ++i)
+	{
+		primitives[i] = mPrimitives[mOrder[i]];
+		bounds[i] = mBounds[mOrder[i]];
+	}
+	mPrimitives.swap(primitives);
+	mBounds.swap(bounds);
+	mOrder.clear();
+	mOrder.shrink_to_fit();
+
+	// children are always allocated after their parent, so a reverse sweep
+	// sees both children before the node itself
+	mFirst.resize(mNodes.size());
+	mCount.resize(mNodes.size());
+	for (std::size_t i = mNodes.size(); i-- > 0;)
+	{
+		Node const& node = mNodes[i];
+		if (node.count > 0)
+		{
+			mFirst[i] = node.offset;
+			mCount[i] = node.count;
+		}
+		else
+		{
+			mFirst[i] = mFirst[node.offset];
+			mCount[i] = mCount[node.offset] + mCount[node.offset + 1];
+		}
+	}
+
+	collapse(0);
+
+	mFirst.clear();
+	mFirst.shrink_to_fit();
+	mCount.clear();
+	mCount.shrink_to_fit();
+}
+
+void BVH::setTraversal(Traversal traversal)
+{
+	if (traversal == Traversal::WideAVX2 && !cpuHasAVX2())
+		traversal = Traversal::WideScalar;
+
+	mTraversal = traversal;
+}
+
+BVH::Traversal BVH::getTraversal() const
+{
+	return mTraversal;
+}
+
+std::int32_t BVH::collapse(std::uint32_t root)
+{
+	auto expandable = [this](std::uint32_t node) {
+		return mNodes[node].count == 0 && mCount[node] > 8;
+	};
+
+	// open up the largest interior child until all eight slots are used
+	std::uint32_t children[8]{ root };
+	std::size_t numChildren{ 1 };
+
+	while (numChildren < 8)
+	{
+		std::size_t best{ numChildren };
+		float bestArea{ -1.0f };
+		for (std::size_t i = 0; i < numChildren; ++i)
+		{
+			float area = mNodes[children[i]].bounds.surfaceArea();
+			if (expandable(children[i]) && area > bestArea)
+			{
+				best = i;
+				bestArea = area;
+			}
+		}
+
+		if (best == numChildren)
+			break;
+
+		std::uint32_t node = children[best];
+		children[best] = mNodes[node].offset;
+		children[numChildren++] = mNodes[node].offset + 1;
+	}
+
+	std::int32_t index = static_cast<std::int32_t>(mWideNodes.size());
+	mWideNodes.emplace_back();
+
+	for (std::size_t i = 0; i < 8; ++i)
+	{
+		for (int a = 0; a < 3; ++a)
+		{
+			mWideNodes[index].bounds[2 * a][i] = std::numeric_limits<float>::infinity();
+			mWideNodes[index].bounds[2 * a + 1][i] = -std::numeric_limits<float>::infinity();
+		}
+		mWideNodes[index].child[i] = 0;
+	}
+
+	for (std::size_t i = 0; i < numChildren; ++i)
+	{
+		std::uint32_t node = children[i];
+		std::int32_t child = expandable(node) ? collapse(node) : makeLeaf(mFirst[node], mCount[node]);
+
+		BBox const& box = mNodes[node].bounds;
+		for (int a = 0; a < 3; ++a)
+		{
+			mWideNodes[index].bounds[2 * a][i] = box.min[a];
+			mWideNodes[index].bounds[2 * a + 1][i] = box.max[a];
+		}
+		mWideNodes[index].child[i] = child;
+	}
+
+	return index;
+}
+
+std::int32_t BVH::makeLeaf(std::uint32_t first, std::uint32_t count)
+{
+	SpherePack spheres{};
+	TrianglePack triangles{};
+	MeshPack meshes{};
+
+	// empty sphere lanes get a negative infinite radius so they never hit,
+	// empty triangle lanes a zero normal
+	for (std::size_t i = 0; i < 8; ++i)
+		spheres.r2[i] = -std::numeric_limits<float>::infinity();
+
+	BVH8Leaf leaf{ noPack, noPack, noPack, static_cast<std::uint32_t>(mOthers.size()), 0 };
+
+	PrimitiveStore::Spheres const& storeSpheres = mStore.spheres();
+	PrimitiveStore::Triangles const& storeTriangles = mStore.triangles();
+
+	for (std::uint32_t i = first; i < first + count; ++i)
+	{
+		std::uint32_t id = mPrimitives[i];
+		std::uint32_t k = PrimitiveStore::indexOf(id);
+		PrimitiveStore::Type type = PrimitiveStore::typeOf(id);
+
+		if (type == PrimitiveStore::Type::Sphere && spheres.count < 8)
+		{
+			std::uint32_t lane = spheres.count++;
+			spheres.cx[lane] = storeSpheres.cx[k];
+			spheres.cy[lane] = storeSpheres.cy[k];
+			spheres.cz[lane] = storeSpheres.cz[k];
+			spheres.r2[lane] = storeSpheres.r2[k];
+			spheres.primitive[lane] = id;
+		}
+		else if (type == PrimitiveStore::Type::Triangle && triangles.count < 8)
+		{
+			std::uint32_t lane = triangles.count++;
+			triangles.ax[lane] = storeTriangles.ax[k];
+			triangles.ay[lane] = storeTriangles.ay[k];
+			triangles.az[lane] = storeTriangles.az[k];
+			triangles.bx[lane] = storeTriangles.bx[k];
+			triangles.by[lane] = storeTriangles.by[k];
+			triangles.bz[lane] = storeTriangles.bz[k];
+			triangles.cx[lane] = storeTriangles.cx[k];
+			triangles.cy[lane] = storeTriangles.cy[k];
+			triangles.cz[lane] = storeTriangles.cz[k];
+			triangles.nx[lane] = storeTriangles.nx[k];
+			triangles.ny[lane] = storeTriangles.ny[k];
+			triangles.nz[lane] = storeTriangles.nz[k];
+			triangles.primitive[lane] = id;
+		}
+		else if (type == PrimitiveStore::Type::Mesh && meshes.count < 8 &&
+			(meshes.count == 0 || mStore.meshOf(k) == meshes.mesh))
+		{
+			// a pack reads a single mesh's arrays, faces of another one
+			// in the same leaf are tested one by one
+			meshes.mesh = mStore.meshOf(k);
+			meshes.face[meshes.count++] = k - mStore.meshes().first[meshes.mesh];
+		}
+		else
+		{
+			mOthers.push_back(id);
+			++leaf.count;
+		}
+	}
+
+	if (spheres.count > 0)
+	{
+		leaf.spheres = static_cast<std::uint32_t>(mSpherePacks.size());
+		mSpherePacks.push_back(spheres);
+	}
+
+	if (triangles.count > 0)
+	{
+		leaf.triangles = static_cast<std::uint32_t>(mTrianglePacks.size());
+		mTrianglePacks.push_back(triangles);
+	}
+
+	if (meshes.count > 0)
+	{
+		for (std::uint32_t lane = meshes.count; lane < 8; ++lane)
+			meshes.face[lane] = meshes.face[0];
+		leaf.meshes = static_cast<std::uint32_t>(mMeshPacks.size());
+		mMeshPacks.push_back(meshes);
+	}
+
+	mLeaves.push_back(leaf);
+	return ~static_cast<std::int32_t>(mLeaves.size() - 1);
+}
+
+std::uint32_t BVH::meshFace(MeshPack const& pack, int lane) const
+{
+	return PrimitiveStore::makeId(PrimitiveStore::Type::Mesh, mStore.meshes().first[pack.mesh] + pack.face[lane]);
+}
+
+std::uint32_t BVH::leafSize(BVH8Leaf const& leaf) const
+{
+	return (leaf.spheres != noPack ? mSpherePacks[leaf.spheres].count : 0) +
+		(leaf.triangles != noPack ? mTrianglePacks[leaf.triangles].count : 0) +
+		(leaf.meshes != noPack ? mMeshPacks[leaf.meshes].count : 0) + leaf.count;
+}
+
+BBox BVH::getBBox() const
+{
+	return mNodes.empty() ? BBox{} : mNodes[0].bounds;
+}
+
+std::size_t BVH::numNodes() const
+{
+	return mNodes.size();
+}
+
+std::size_t BVH::memoryUsed() const
+{
+	return mStore.memoryUsed() + bytesHeld(mPrimitives) + bytesHeld(mBounds) + bytesHeld(mOrder) +
+		bytesHeld(mNodes) + bytesHeld(mFirst) + bytesHeld(mCount) + bytesHeld(mWideNodes) +
+		bytesHeld(mLeaves) + bytesHeld(mSpherePacks) + bytesHeld(mTrianglePacks) + bytesHeld(mMeshPacks) +
+		bytesHeld(mOthers);
+}
+
+PrimitiveStore const& BVH::getStore() const
+{
+	return mStore;
+}
+
+void BVH::build(std::uint32_t node, std::uint32_t begin, std::uint32_t end,
+	std::size_t depth, ThreadPool* pool)
+{
+	BBox bounds, centroids;
+	for (std::uint32_t i = begin; i < end; ++i)
+	{
+		BBox const& box = mBounds[mOrder[i]];
+		bounds.expand(box);
+		centroids.expand(box.centroid());
+	}
+
+	mNodes[node].bounds = bounds;
+
+	std::uint32_t mid{ end };
+	if (end - begin > 1 && depth < maxDepth)
+		mid = partitionSAH(centroids, begin, end, bounds.surfaceArea());
+
+	if (mid == end)
+	{
+		mNodes[node].offset = begin;
+		mNodes[node].count = end - begin;
+		return;
+	}
+
+	std::uint32_t left = mNodeCount.fetch_add(2);
+	mNodes[node].offset = left;
+	mNodes[node].count = 0;
+
+	// large subtrees are handed to the pool, the rest recurse in place
+	if (pool != nullptr && end - mid > parallelThreshold)
+		pool->submit([this, left, mid, end, depth, pool] {
+			build(left + 1, mid, end, depth + 1, pool);
+		});
+	else
+		build(left + 1, mid, end, depth + 1, pool);
+
+	build(left, begin, mid, depth + 1, pool);
+}
+
+std::uint32_t BVH::partitionSAH(BBox const& centroids,
+	std::uint32_t begin,
+	std::uint32_t end,
+	float parentArea)
+{
+	std::uint32_t count{ end - begin };
+
+	atlas::math::Vector extent = centroids.max - centroids.min;
+	int axis{ 0 };
+	if (extent.y > extent[axis])
+		axis = 1;
+	if (extent.z > extent[axis])
+		axis = 2;
+
+	// every centroid in the same spot, no split will separate them
+	if (extent[axis] <= 0.0f)
+		return end;
+
+	float lo{ centroids.min[axis] };
+	float scale{ numBins / extent[axis] };
+	auto binOf = [&](std::uint32_t prim) {
+		float c = mBounds[prim].centroid()[axis];
+		return std::min(numBins - 1, static_cast<std::size_t>((c - lo) * scale));
+	};
+
+	BBox binBounds[numBins];
+	std::uint32_t binCount[numBins]{};
+	for (std::uint32_t i = begin; i < end; ++i)
+	{
+		std::size_t b = binOf(mOrder[i]);
+		binBounds[b].expand(mBounds[mOrder[i]]);
+		++binCount[b];
+	}
+
+	// sweep from the right to get the cost of everything above each plane
+	float rightCost[numBins]{};
+	BBox acc;
+	std::uint32_t accCount{ 0 };
+	for (std::size_t b = numBins - 1; b > 0; --b)
+	{
+		acc.expand(binBounds[b]);
+		accCount += binCount[b];
+		rightCost[b] = accCount * acc.surfaceArea();
+	}
+
+	float bestCost{ std::numeric_limits<float>::max() };
+	std::size_t bestSplit{ 0 };
+	acc = BBox{};
+	accCount = 0;
+	for (std::size_t b = 0; b < numBins - 1; ++b)
+	{
+		acc.expand(binBounds[b]);
+		accCount += binCount[b];
+
+		if (accCount == 0 || accCount == count)
+			continue;
+
+		float cost = accCount * acc.surfaceArea() + rightCost[b + 1];
+		if (cost < bestCost)
+		{
+			bestCost = cost;
+			bestSplit = b;
+		}
+	}
+
+	// unit cost for a traversal step and for a primitive test
+	float splitCost = 1.0f + bestCost / parentArea;
+	if (bestCost == std::numeric_limits<float>::max() ||
+		(count <= maxLeafSize && splitCost >= static_cast<float>(count)))
+		return end;
+
+	auto it = std::partition(mOrder.begin() + begin, mOrder.begin() + end,
+		[&](std::uint32_t prim) { return binOf(prim) <= bestSplit; });
+
+	return static_cast<std::uint32_t>(it - mOrder.begin());
+}
+
+bool BVH::hit(atlas::math::Ray<atlas::math::Vector> const& ray, ShadeRec& sr) const
+{
+	Hit hit{ sr.t, Hit::none };
+
+	if (!closestHit(ray, hit))
+		return false;
+
+	mStore.fillShadeRec(hit, ray, sr);
+	return true;
+}
+
+bool BVH::closestHit(atlas::math::Ray<atlas::math::Vector> const& ray, Hit& hit) const
+{
+	switch (mTraversal)
+	{
+	case Traversal::Binary:
+		return hitBinary(ray, hit);
+	case Traversal::WideAVX2:
+		return hitWide<true>(ray, hit);
+	default:
+		return hitWide<false>(ray, hit);
+	}
+}
+
+bool BVH::hitBinary(atlas::math::Ray<atlas::math::Vector> const& ray, Hit& hit) const
+{
+	float tStart{ hit.t };
+
+	mStore.closestHitUnbounded(ray, hit);
+
+	if (mNodes.empty())
+		return hit.t < tStart;
+
+	struct Entry
+	{
+		std::uint32_t node;
+		float t;
+	};
+
+	Entry stack[maxDepth + 4];
+	std::size_t top{ 0 };
+
+	atlas::math::Vector invDir = 1.0f / ray.d;
+	float tEntry;
+
+	if (!mNodes[0].bounds.intersect(ray.o, invDir, hit.t, tEntry))
+		return hit.t < tStart;
+
+	stack[top++] = { 0, tEntry };
+
+	while (top > 0)
+	{
+		Entry entry = stack[--top];
+
+		// a closer hit was found since this node was pushed
+		if (entry.t > hit.t)
+			continue;
+
+		Node const& node = mNodes[entry.node];
+
+		if (node.count > 0)
+		{
+			Telemetry::count(Counter::PrimitiveTests, node.count);
+			for (std::uint32_t i = node.offset; i < node.offset + node.count; ++i)
+				mStore.intersect(mPrimitives[i], ray, hit);
+			continue;
+		}
+
+		Telemetry::count(Counter::NodeTests);
+		float tLeft, tRight;
+		bool hitLeft = mNodes[node.offset].bounds.intersect(ray.o, invDir, hit.t, tLeft);
+		bool hitRight = mNodes[node.offset + 1].bounds.intersect(ray.o, invDir, hit.t, tRight);
+
+		// push the far child first so the near one is visited next
+		if (hitLeft && hitRight)
+		{
+			if (tLeft <= tRight)
+			{
+				stack[top++] = { node.offset + 1, tRight };
+				stack[top++] = { node.offset, tLeft };
+			}
+			else
+			{
+				stack[top++] = { node.offset, tLeft };
+				stack[top++] = { node.offset + 1, tRight };
+			}
+		}
+		else if (hitLeft)
+		{
+			stack[top++] = { node.offset, tLeft };
+		}
+		else if (hitRight)
+		{
+			stack[top++] = { node.offset + 1, tRight };
+		}
+	}
+
+	return hit.t < tStart;
+}
+
+bool BVH::occluded(atlas::math::Ray<atlas::math::Vector> const& ray, float tMax) const
+{
+	std::uint32_t occluder{ Hit::none };
+	return occluded(ray, tMax, occluder);
+}
+
+bool BVH::occluded(atlas::math::Ray<atlas::math::Vector> const& ray,
+	float tMax,
+	std::uint32_t& lastOccluder) const
+{
+	// neighbouring shadow rays are usually stopped by the same primitive
+	if (lastOccluder != Hit::none && mStore.occludes(lastOccluder, ray, tMax))
+	{
+		Telemetry::count(Counter::ShadowCacheHits);
+		return true;
+	}
+
+	switch (mTraversal)
+	{
+	case Traversal::Binary:
+		return occludedBinary(ray, tMax, lastOccluder);
+	case Traversal::WideAVX2:
+		return occludedWide<true>(ray, tMax, lastOccluder);
+	default:
+		return occludedWide<false>(ray, tMax, lastOccluder);
+	}
+}
+
+bool BVH::occludedBinary(atlas::math::Ray<atlas::math::Vector> const& ray,
+	float tMax,
+	std::uint32_t& occluder) const
+{
+	if (!mNodes.empty())
+	{
+		// any blocker will do, so children are visited in stored order
+		std::uint32_t stack[maxDepth + 4];
+		std::size_t top{ 0 };
+
+		atlas::math::Vector invDir = 1.0f / ray.d;
+		float tEntry;
+
+		if (mNodes[0].bounds.intersect(ray.o, invDir, tMax, tEntry))
+			stack[top++] = 0;
+
+		while (top > 0)
+		{
+			Node const& node = mNodes[stack[--top]];
+
+			if (node.count > 0)
+			{
+				Telemetry::count(Counter::PrimitiveTests, node.count);
+				for (std::uint32_t i = node.offset; i < node.offset + node.count; ++i)
+				{
+					if (mStore.occludes(mPrimitives[i], ray, tMax))
+					{
+						occluder = mPrimitives[i];
+						return true;
+					}
+				}
+				continue;
+			}
+
+			Telemetry::count(Counter::NodeTests);
+			if (mNodes[node.offset + 1].bounds.intersect(ray.o, invDir, tMax, tEntry))
+				stack[top++] = node.offset + 1;
+			if (mNodes[node.offset].bounds.intersect(ray.o, invDir, tMax, tEntry))
+				stack[top++] = node.offset;
+		}
+	}
+
+	return mStore.occludedUnbounded(ray, tMax, occluder);
+}
+
+// ***** 8-wide BVH kernels *****
+
+bool cpuHasAVX2()
+{
+	static bool const hasAVX2 = [] {
+#if RT_X86 && defined(_MSC_VER) && !defined(__clang__)
+		int info[4];
+		__cpuid(info, 1);
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		bool avx = (info[2] & (1 << 28)) != 0;
+		if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+			return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#elif RT_X86
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") != 0;
+#else
+		return false;
+#endif
+	}();
+
+	return hasAVX2;
+}
+
+static int lowestBit(unsigned mask)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return static_cast<int>(index);
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// Ray in the form the 8-wide kernels want it. near[a] selects the row of
+// BVH8Node::bounds holding the entry plane for axis a, near[a] ^ 1 the exit.
+struct WideRay
+{
+	float o[3];
+	float d[3];
+	float inv[3];
+	int near[3];
+};
+
+static unsigned intersectNode8Scalar(BVH8Node const& node, WideRay const& ray,
+	float tMax, float* tEntry)
+{
+	unsigned mask{ 0 };
+
+	for (int i = 0; i < 8; ++i)
+	{
+		float tNear{ 0.0f };
+		float tFar{ tMax };
+
+		for (int a = 0; a < 3; ++a)
+		{
+			float t0 = (node.bounds[ray.near[a]][i] - ray.o[a]) * ray.inv[a];
+			float t1 = (node.bounds[ray.near[a] ^ 1][i] - ray.o[a]) * ray.inv[a];
+			tNear = std::max(tNear, t0);
+			tFar = std::min(tFar, t1);
+		}
+
+		tEntry[i] = tNear;
+		if (tNear <= tFar)
+			mask |= 1u << i;
+	}
+
+	return mask;
+}
+
+// The leaf kernels mirror Sphere::intersectRay, Triangle::intersectRay and
+// TriangleMesh::intersectFace and return the lane of the closest hit nearer
+// than tBest, or -1.
+
+static int intersectSpheres8Scalar(SpherePack const& pack, WideRay const& ray, float& tBest)
+{
+	const float kEpsilon{ 0.01f };
+	const float a = ray.d[0] * ray.d[0] + ray.d[1] * ray.d[1] + ray.d[2] * ray.d[2];
+	int lane{ -1 };
+
+	for (std::uint32_t i = 0; i < pack.count; ++i)
+	{
+		float tx = ray.o[0] - pack.cx[i];
+		float ty = ray.o[1] - pack.cy[i];
+		float tz = ray.o[2] - pack.cz[i];
+		float b = 2.0f * (ray.d[0] * tx + ray.d[1] * ty + ray.d[2] * tz);
+		float c = tx * tx + ty * ty + tz * tz - pack.r2[i];
+		float disc = (b * b) - (4.0f * a * c);
+
+		if (disc < 0.0f)
+			continue;
+
+		float e = std::sqrt(disc);
+		float t = (-b - e) / (2.0f * a);
+		if (t < kEpsilon)
+			t = (-b + e) / (2.0f * a);
+
+		if (t >= kEpsilon && t < tBest)
+		{
+			tBest = t;
+			lane = static_cast<int>(i);
+		}
+	}
+
+	return lane;
+}
+
+static int intersectTriangles8Scalar(TrianglePack const& pack, WideRay const& ray, float& tBest)
+{
+	int lane{ -1 };
+
+	for (std::uint32_t i = 0; i < pack.count; ++i)
+	{
+		atlas::math::Vector n{ pack.nx[i], pack.ny[i], pack.nz[i] };
+		atlas::math::Point a{ pack.ax[i], pack.ay[i], pack.az[i] };
+		atlas::math::Point b{ pack.bx[i], pack.by[i], pack.bz[i] };
+		atlas::math::Point c{ pack.cx[i], pack.cy[i], pack.cz[i] };
+		atlas::math::Point o{ ray.o[0], ray.o[1], ray.o[2] };
+		atlas::math::Vector d{ ray.d[0], ray.d[1], ray.d[2] };
+
+		float denom = glm::dot(n, d);
+		if (std::fabs(denom) <= 0.0001f)
+			continue;
+
+		float t = glm::dot(a - o, n) / denom;
+		if (t < 0.0f || t >= tBest)
+			continue;
+
+		atlas::math::Point p = o + t * d;
+		if (glm::dot(n, glm::cross(b - a, p - a)) > 0 &&
+			glm::dot(n, glm::cross(c - b, p - b)) > 0 &&
+			glm::dot(n, glm::cross(a - c, p - c)) > 0)
+		{
+			tBest = t;
+			lane = static_cast<int>(i);
+		}
+	}
+
+	return lane;
+}
+
+static int intersectMeshFaces8Scalar(MeshPack const& pack, TriangleMesh const& mesh,
+	WideRay const& ray, float& tBest)
+{
+	atlas::math::Ray<atlas::math::Vector> r{ { ray.o[0], ray.o[1], ray.o[2] }, { ray.d[0], ray.d[1], ray.d[2] } };
+	int lane{ -1 };
+
+	for (std::uint32_t i = 0; i < pack.count; ++i)
+	{
+		float t, u, v;
+		if (mesh.intersectFace(pack.face[i], r, t, u, v) && t < tBest)
+		{
+			tBest = t;
+			lane = static_cast<int>(i);
+		}
+	}
+
+	return lane;
+}
+
+#if RT_X86
+
+RT_TARGET_AVX2 static unsigned intersectNode8AVX2(BVH8Node const& node, WideRay const& ray,
+	float tMax, float* tEntry)
+{
+	__m256 tNear = _mm256_setzero_ps();
+	__m256 tFar = _mm256_set1_ps(tMax);
+
+	for (int a = 0; a < 3; ++a)
+	{
+		__m256 o = _mm256_set1_ps(ray.o[a]);
+		__m256 inv = _mm256_set1_ps(ray.inv[a]);
+		__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray.near[a]]), o), inv);
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray.near[a] ^ 1]), o), inv);
+
+		// max/min return the second operand on NaN, which keeps the interval
+		tNear = _mm256_max_ps(t0, tNear);
+		tFar = _mm256_min_ps(t1, tFar);
+	}
+
+	_mm256_store_ps(tEntry, tNear);
+	return static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ)));
+}
+
+// lane with the smallest t among the lanes set in mask
+static int closestLane(float const* t, unsigned mask, float& tBest)
+{
+	int lane{ -1 };
+
+	for (; mask != 0; mask &= mask - 1)
+	{
+		int i{ lowestBit(mask) };
+		if (t[i] < tBest)
+		{
+			tBest = t[i];
+			lane = i;
+		}
+	}
+
+	return lane;
+}
+
+RT_TARGET_AVX2 static int intersectSpheres8AVX2(SpherePack const& pack, WideRay const& ray, float& tBest)
+{
+	__m256 const zero = _mm256_setzero_ps();
+	__m256 const epsilon = _mm256_set1_ps(0.01f);
+
+	__m256 dx = _mm256_set1_ps(ray.d[0]);
+	__m256 dy = _mm256_set1_ps(ray.d[1]);
+	__m256 dz = _mm256_set1_ps(ray.d[2]);
+	float a = ray.d[0] * ray.d[0] + ray.d[1] * ray.d[1] + ray.d[2] * ray.d[2];
+
+	__m256 tx = _mm256_sub_ps(_mm256_set1_ps(ray.o[0]), _mm256_load_ps(pack.cx));
+	__m256 ty = _mm256_sub_ps(_mm256_set1_ps(ray.o[1]), _mm256_load_ps(pack.cy));
+	__m256 tz = _mm256_sub_ps(_mm256_set1_ps(ray.o[2]), _mm256_load_ps(pack.cz));
+
+	__m256 b = _mm256_mul_ps(_mm256_set1_ps(2.0f),
+		_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, tx), _mm256_mul_ps(dy, ty)), _mm256_mul_ps(dz, tz)));
+	__m256 c = _mm256_sub_ps(
+		_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, tx), _mm256_mul_ps(ty, ty)), _mm256_mul_ps(tz, tz)),
+		_mm256_load_ps(pack.r2));
+	__m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_set1_ps(4.0f * a), c));
+
+	__m256 valid = _mm256_cmp_ps(disc, zero, _CMP_GE_OQ);
+	__m256 e = _mm256_sqrt_ps(_mm256_max_ps(disc, zero));
+	__m256 negB = _mm256_sub_ps(zero, b);
+	__m256 t0 = _mm256_div_ps(_mm256_sub_ps(negB, e), _mm256_set1_ps(2.0f * a));
+	__m256 t1 = _mm256_div_ps(_mm256_add_ps(negB, e), _mm256_set1_ps(2.0f * a));
+	__m256 t = _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, epsilon, _CMP_GE_OQ));
+
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, epsilon, _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(tBest), _CMP_LT_OQ));
+
+	alignas(32) float ts[8];
+	_mm256_store_ps(ts, t);
+	return closestLane(ts, static_cast<unsigned>(_mm256_movemask_ps(valid)), tBest);
+}
+
+RT_TARGET_AVX2 static __m256 dot8(__m256 x0, __m256 y0, __m256 z0, __m256 x1, __m256 y1, __m256 z1)
+{
+	return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x0, x1), _mm256_mul_ps(y0, y1)), _mm256_mul_ps(z0, z1));
+}
+
+// n . ((q - p) x (x - p)) > 0, i.e. x lies on the inner side of edge p -> q
+RT_TARGET_AVX2 static __m256 insideEdge8(__m256 nx, __m256 ny, __m256 nz,
+	__m256 px, __m256 py, __m256 pz,
+	__m256 qx, __m256 qy, __m256 qz,
+	__m256 xx, __m256 xy, __m256 xz)
+{
+	__m256 ex = _mm256_sub_ps(qx, px), ey = _mm256_sub_ps(qy, py), ez = _mm256_sub_ps(qz, pz);
+	__m256 cx = _mm256_sub_ps(xx, px), cy = _mm256_sub_ps(xy, py), cz = _mm256_sub_ps(xz, pz);
+	__m256 kx = _mm256_sub_ps(_mm256_mul_ps(ey, cz), _mm256_mul_ps(ez, cy));
+	__m256 ky = _mm256_sub_ps(_mm256_mul_ps(ez, cx), _mm256_mul_ps(ex, cz));
+	__m256 kz = _mm256_sub_ps(_mm256_mul_ps(ex, cy), _mm256_mul_ps(ey, cx));
+	return _mm256_cmp_ps(dot8(nx, ny, nz, kx, ky, kz), _mm256_setzero_ps(), _CMP_GT_OQ);
+}
+
+RT_TARGET_AVX2 static int intersectTriangles8AVX2(TrianglePack const& pack, WideRay const& ray, float& tBest)
+{
+	__m256 const zero = _mm256_setzero_ps();
+
+	__m256 ox = _mm256_set1_ps(ray.o[0]);
+	__m256 oy = _mm256_set1_ps(ray.o[1]);
+	__m256 oz = _mm256_set1_ps(ray.o[2]);
+	__m256 dx = _mm256_set1_ps(ray.d[0]);
+	__m256 dy = _mm256_set1_ps(ray.d[1]);
+	__m256 dz = _mm256_set1_ps(ray.d[2]);
+
+	__m256 nx = _mm256_load_ps(pack.nx);
+	__m256 ny = _mm256_load_ps(pack.ny);
+	__m256 nz = _mm256_load_ps(pack.nz);
+	__m256 ax = _mm256_load_ps(pack.ax);
+	__m256 ay = _mm256_load_ps(pack.ay);
+	__m256 az = _mm256_load_ps(pack.az);
+
+	__m256 denom = dot8(nx, ny, nz, dx, dy, dz);
+	__m256 absDenom = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), denom);
+	__m256 valid = _mm256_cmp_ps(absDenom, _mm256_set1_ps(0.0001f), _CMP_GT_OQ);
+
+	__m256 t = _mm256_div_ps(dot8(_mm256_sub_ps(ax, ox), _mm256_sub_ps(ay, oy), _mm256_sub_ps(az, oz), nx, ny, nz), denom);
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(tBest), _CMP_LT_OQ));
+
+	if (_mm256_movemask_ps(valid) == 0)
+		return -1;
+
+	__m256 px = _mm256_add_ps(ox, _mm256_mul_ps(t, dx));
+	__m256 py = _mm256_add_ps(oy, _mm256_mul_ps(t, dy));
+	__m256 pz = _mm256_add_ps(oz, _mm256_mul_ps(t, dz));
+
+	__m256 bx = _mm256_load_ps(pack.bx);
+	__m256 by = _mm256_load_ps(pack.by);
+	__m256 bz = _mm256_load_ps(pack.bz);
+	__m256 cx = _mm256_load_ps(pack.cx);
+	__m256 cy = _mm256_load_ps(pack.cy);
+	__m256 cz = _mm256_load_ps(pack.cz);
+
+	valid = _mm256_and_ps(valid, insideEdge8(nx, ny, nz, ax, ay, az, bx, by, bz, px, py, pz));
+	valid = _mm256_and_ps(valid, insideEdge8(nx, ny, nz, bx, by, bz, cx, cy, cz, px, py, pz));
+	valid = _mm256_and_ps(valid, insideEdge8(nx, ny, nz, cx, cy, cz, ax, ay, az, px, py, pz));
+
+	alignas(32) float ts[8];
+	_mm256_store_ps(ts, t);
+	return closestLane(ts, static_cast<unsigned>(_mm256_movemask_ps(valid)), tBest);
+}
+
+// the faces' first vertex and edges are gathered from the mesh's arrays
+RT_TARGET_AVX2 static int intersectMeshFaces8AVX2(MeshPack const& pack, TriangleMesh const& mesh,
+	WideRay const& ray, float& tBest)
+{
+	__m256 const zero = _mm256_setzero_ps();
+
+	__m256i face = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(pack.face));
+	__m256i vertex = _mm256_i32gather_epi32(reinterpret_cast<int const*>(mesh.indexData()),
+		_mm256_mullo_epi32(face, _mm256_set1_epi32(3)), 4);
+	__m256i a = _mm256_mullo_epi32(vertex, _mm256_set1_epi32(3));
+	__m256i e = _mm256_mullo_epi32(face, _mm256_set1_epi32(6));
+
+	float const* vertices = mesh.vertexData();
+	float const* edges = mesh.edgeData();
+	__m256 ax = _mm256_i32gather_ps(vertices, a, 4);
+	__m256 ay = _mm256_i32gather_ps(vertices + 1, a, 4);
+	__m256 az = _mm256_i32gather_ps(vertices + 2, a, 4);
+	__m256 e1x = _mm256_i32gather_ps(edges, e, 4);
+	__m256 e1y = _mm256_i32gather_ps(edges + 1, e, 4);
+	__m256 e1z = _mm256_i32gather_ps(edges + 2, e, 4);
+	__m256 e2x = _mm256_i32gather_ps(edges + 3, e, 4);
+	__m256 e2y = _mm256_i32gather_ps(edges + 4, e, 4);
+	__m256 e2z = _mm256_i32gather_ps(edges + 5, e, 4);
+
+	__m256 dx = _mm256_set1_ps(ray.d[0]);
+	__m256 dy = _mm256_set1_ps(ray.d[1]);
+	__m256 dz = _mm256_set1_ps(ray.d[2]);
+
+	// p = d x e2, det = e1 . p
+	__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+	__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+	__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+	__m256 det = dot8(e1x, e1y, e1z, px, py, pz);
+	__m256 absDet = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), det);
+	__m256 valid = _mm256_cmp_ps(absDet, _mm256_set1_ps(1e-12f), _CMP_GE_OQ);
+	__m256 inv = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+
+	__m256 sx = _mm256_sub_ps(_mm256_set1_ps(ray.o[0]), ax);
+	__m256 sy = _mm256_sub_ps(_mm256_set1_ps(ray.o[1]), ay);
+	__m256 sz = _mm256_sub_ps(_mm256_set1_ps(ray.o[2]), az);
+	__m256 u = _mm256_mul_ps(dot8(sx, sy, sz, px, py, pz), inv);
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+
+	if (_mm256_movemask_ps(valid) == 0)
+		return -1;
+
+	// q = s x e1
+	__m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+	__m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+	__m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+	__m256 v = _mm256_mul_ps(dot8(dx, dy, dz, qx, qy, qz), inv);
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+
+	__m256 t = _mm256_mul_ps(dot8(e2x, e2y, e2z, qx, qy, qz), inv);
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(tBest), _CMP_LT_OQ));
+
+	alignas(32) float ts[8];
+	_mm256_store_ps(ts, t);
+	return closestLane(ts, static_cast<unsigned>(_mm256_movemask_ps(valid)), tBest);
+}
+
+#else
+
+static unsigned intersectNode8AVX2(BVH8Node const& node, WideRay const& ray, float tMax, float* tEntry)
+{
+	return intersectNode8Scalar(node, ray, tMax, tEntry);
+}
+
+static int intersectSpheres8AVX2(SpherePack const& pack, WideRay const& ray, float& tBest)
+{
+	return intersectSpheres8Scalar(pack, ray, tBest);
+}
+
+static int intersectTriangles8AVX2(TrianglePack const& pack, WideRay const& ray, float& tBest)
+{
+	return intersectTriangles8Scalar(pack, ray, tBest);
+}
+
+static int intersectMeshFaces8AVX2(MeshPack const& pack, TriangleMesh const& mesh, WideRay const& ray, float& tBest)
+{
+	return intersectMeshFaces8Scalar(pack, mesh, ray, tBest);
+}
+
+#endif
+
+template <bool avx2>
+bool BVH::hitWide(atlas::math::Ray<atlas::math::Vector> const& ray, Hit& hit) const
+{
+	float tStart{ hit.t };
+
+	mStore.closestHitUnbounded(ray, hit);
+
+	if (mWideNodes.empty())
+		return hit.t < tStart;
+
+	WideRay wide;
+	for (int a = 0; a < 3; ++a)
+	{
+		wide.o[a] = ray.o[a];
+		wide.d[a] = ray.d[a];
+		wide.inv[a] = 1.0f / ray.d[a];
+		// by inv, so a -0 component (inv -inf) takes the max slab first
+		wide.near[a] = wide.inv[a] >= 0.0f ? 2 * a : 2 * a + 1;
+	}
+
+	struct Entry
+	{
+		std::int32_t child;
+		float t;
+	};
+
+	Entry stack[8 * (maxDepth + 1)];
+	std::size_t top{ 0 };
+	stack[top++] = { 0, 0.0f };
+
+	while (top > 0)
+	{
+		Entry entry = stack[--top];
+		if (entry.t > hit.t)
+			continue;
+
+		if (entry.child >= 0)
+		{
+			Telemetry::count(Counter::NodeTests);
+			alignas(32) float tEntry[8];
+			unsigned mask = avx2
+				? intersectNode8AVX2(mWideNodes[entry.child], wide, hit.t, tEntry)
+				: intersectNode8Scalar(mWideNodes[entry.child], wide, hit.t, tEntry);
+
+			// push far to near so the nearest child is popped first
+			Entry hits[8];
+			std::size_t numHits{ 0 };
+			for (; mask != 0; mask &= mask - 1)
+			{
+				int i{ lowestBit(mask) };
+				Entry e{ mWideNodes[entry.child].child[i], tEntry[i] };
+				std::size_t j{ numHits++ };
+				for (; j > 0 && hits[j - 1].t < e.t; --j)
+					hits[j] = hits[j - 1];
+				hits[j] = e;
+			}
+
+			for (std::size_t i = 0; i < numHits; ++i)
+				stack[top++] = hits[i];
+
+			continue;
+		}
+
+		BVH8Leaf const& leaf = mLeaves[~entry.child];
+		Telemetry::count(Counter::PrimitiveTests, leafSize(leaf));
+
+		if (leaf.spheres != noPack)
+		{
+			SpherePack const& pack = mSpherePacks[leaf.spheres];
+			int lane = avx2 ? intersectSpheres8AVX2(pack, wide, hit.t)
+			                : intersectSpheres8Scalar(pack, wide, hit.t);
+			if (lane >= 0)
+				hit.primitive = pack.primitive[lane];
+		}
+
+		if (leaf.triangles != noPack)
+		{
+			TrianglePack const& pack = mTrianglePacks[leaf.triangles];
+			int lane = avx2 ? intersectTriangles8AVX2(pack, wide, hit.t)
+			                : intersectTriangles8Scalar(pack, wide, hit.t);
+			if (lane >= 0)
+				hit.primitive = pack.primitive[lane];
+		}
+
+		if (leaf.meshes != noPack)
+		{
+			MeshPack const& pack = mMeshPacks[leaf.meshes];
+			TriangleMesh const& mesh = *mStore.meshes().mesh[pack.mesh];
+			int lane = avx2 ? intersectMeshFaces8AVX2(pack, mesh, wide, hit.t)
+			                : intersectMeshFaces8Scalar(pack, mesh, wide, hit.t);
+			if (lane >= 0)
+				hit.primitive = meshFace(pack, lane);
+		}
+
+		for (std::uint32_t i = leaf.first; i < leaf.first + leaf.count; ++i)
+			mStore.intersect(mOthers[i], ray, hit);
+	}
+
+	return hit.t < tStart;
+}
+
+template <bool avx2>
+bool BVH::occludedWide(atlas::math::Ray<atlas::math::Vector> const& ray,
+	float tMax,
+	std::uint32_t& occluder) const
+{
+	if (!mWideNodes.empty())
+	{
+		WideRay wide;
+		for (int a = 0; a < 3; ++a)
+		{
+			wide.o[a] = ray.o[a];
+			wide.d[a] = ray.d[a];
+			wide.inv[a] = 1.0f / ray.d[a];
+			wide.near[a] = wide.inv[a] >= 0.0f ? 2 * a : 2 * a + 1;
+		}
+
+		std::int32_t stack[8 * (maxDepth + 1)];
+		std::size_t top{ 0 };
+		stack[top++] = 0;
+
+		while (top > 0)
+		{
+			std::int32_t child = stack[--top];
+
+			// any blocker will do, so children are pushed without sorting
+			if (child >= 0)
+			{
+				Telemetry::count(Counter::NodeTests);
+				alignas(32) float tEntry[8];
+				unsigned mask = avx2
+					? intersectNode8AVX2(mWideNodes[child], wide, tMax, tEntry)
+					: intersectNode8Scalar(mWideNodes[child], wide, tMax, tEntry);
+
+				for (; mask != 0; mask &= mask - 1)
+					stack[top++] = mWideNodes[child].child[lowestBit(mask)];
+
+				continue;
+			}
+
+			BVH8Leaf const& leaf = mLeaves[~child];
+			Telemetry::count(Counter::PrimitiveTests, leafSize(leaf));
+			float t{ tMax };
+
+			if (leaf.spheres != noPack)
+			{
+				SpherePack const& pack = mSpherePacks[leaf.spheres];
+				int lane = avx2 ? intersectSpheres8AVX2(pack, wide, t)
+				                : intersectSpheres8Scalar(pack, wide, t);
+				if (lane >= 0)
+				{
+					occluder = pack.primitive[lane];
+					return true;
+				}
+			}
+
+			if (leaf.triangles != noPack)
+			{
+				TrianglePack const& pack = mTrianglePacks[leaf.triangles];
+				int lane = avx2 ? intersectTriangles8AVX2(pack, wide, t)
+				                : intersectTriangles8Scalar(pack, wide, t);
+				if (lane >= 0)
+				{
+					occluder = pack.primitive[lane];
+					return true;
+				}
+			}
+
+			if (leaf.meshes != noPack)
+			{
+				MeshPack const& pack = mMeshPacks[leaf.meshes];
+				TriangleMesh const& mesh = *mStore.meshes().mesh[pack.mesh];
+				int lane = avx2 ? intersectMeshFaces8AVX2(pack, mesh, wide, t)
+				                : intersectMeshFaces8Scalar(pack, mesh, wide, t);
+				if (lane >= 0)
+				{
+					occluder = meshFace(pack, lane);
+					return true;
+				}
+			}
+
+			for (std::uint32_t i = leaf.first; i < leaf.first + leaf.count; ++i)
+			{
+				if (mStore.occludes(mOthers[i], ray, tMax))
+				{
+					occluder = mOthers[i];
+					return true;
+				}
+			}
+		}
+	}
+
+	return mStore.occludedUnbounded(ray, tMax, occluder);
+}
+
+// ***** Regular function members *****
+Regular::Regular(int numSamples, std::uint32_t seed) : Sampler{numSamples, seed}
+{}
+
+atlas::math::Point Regular::sampleUnitSquare([[maybe_unused]] std::uint64_t pixel,
+                                             std::uint32_t index,
+                                             [[maybe_unused]] std::uint32_t dimension) const
+{
+    std::uint32_t n = static_cast<std::uint32_t>(glm::sqrt(static_cast<float>(mNumSamples)));
+    std::uint32_t cell = index % (n * n);
+
+    return atlas::math::Point{(cell % n + 0.5f) / n, (cell / n + 0.5f) / n, 0.0f};
+}
+
+void Regular::sampleUnitSquares(std::uint64_t const* pixels,
+                                std::uint32_t const* indices,
+                                std::size_t count,
+                                std::uint32_t dimension,
+                                float* x,
+                                float* y) const
+{
+    sampleEach<Regular>(pixels, indices, count, dimension, x, y);
+}
+
+// ***** Random function members *****
+Random::Random(int numSamples, std::uint32_t seed) : Sampler{numSamples, seed}
+{}
+
+atlas::math::Point Random::sampleUnitSquare(std::uint64_t pixel,
+                                            std::uint32_t index,
+                                            std::uint32_t dimension) const
+{
+    return atlas::math::Point{random(pixel, index, 2 * dimension),
+                              random(pixel, index, 2 * dimension + 1),
+                              0.0f};
+}
+
+void Random::sampleUnitSquares(std::uint64_t const* pixels,
+                               std::uint32_t const* indices,
+                               std::size_t count,
+                               std::uint32_t dimension,
+                               float* x,
+                               float* y) const
+{
+    sampleEach<Random>(pixels, indices, count, dimension, x, y);
+}
+
+// ***** Jitter function members *****
+
+Jitter::Jitter(int numSamples, std::uint32_t seed) : Sampler{ numSamples, seed }
+{}
+
+atlas::math::Point Jitter::sampleUnitSquare(std::uint64_t pixel,
+	std::uint32_t index,
+	std::uint32_t dimension) const
+{
+	std::uint32_t n = static_cast<std::uint32_t>(glm::sqrt(static_cast<float>(mNumSamples)));
+	std::uint32_t cell = index % (n * n);
+
+	float rx = random(pixel, index, 2 * dimension);
+	float ry = random(pixel, index, 2 * dimension + 1);
+
+	return atlas::math::Point{ (cell % n + rx) / n, (cell / n + ry) / n, 0.0f };
+}
+
+void Jitter::sampleUnitSquares(std::uint64_t const* pixels,
+	std::uint32_t const* indices,
+	std::size_t count,
+	std::uint32_t dimension,
+	float* x,
+	float* y) const
+{
+	sampleEach<Jitter>(pixels, indices, count, dimension, x, y);
+}
+
+// ***** Low-discrepancy sampler tables *****
+
+static std::uint32_t reverseBits(std::uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Laine-Karras style hash that only propagates bits upwards; on reversed
+// bits it becomes a nested uniform (Owen) scramble
+static std::uint32_t nestedUniformScramble(std::uint32_t x, std::uint32_t seed)
+{
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverseBits(x);
+}
+
+// 32-bit fixed point fraction to a float strictly below 1
+static float fractionToFloat(std::uint32_t x)
+{
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+// generator matrices of the first two Sobol dimensions, column k is the
+// contribution of index bit k
+struct SobolTables
+{
+    std::uint32_t matrix[2][32];
+};
+
+static SobolTables const& sobolTables()
+{
+    static SobolTables const tables = [] {
+        SobolTables t{};
+        std::uint32_t v{ 1u << 31 };
+        for (int k = 0; k < 32; ++k)
+        {
+            t.matrix[0][k] = 1u << (31 - k);
+            t.matrix[1][k] = v;
+            v ^= v >> 1;
+        }
+        return t;
+    }();
+
+    return tables;
+}
+
+static std::uint32_t sobol(std::uint32_t index, int dimension)
+{
+    std::uint32_t const* matrix = sobolTables().matrix[dimension];
+    std::uint32_t x{ 0 };
+
+    for (int k = 0; index != 0; index >>= 1, ++k)
+    {
+        if (index & 1u)
+            x ^= matrix[k];
+    }
+
+    return x;
+}
+
+// first primes with a fixed digit permutation each (0 stays 0 so the
+// radical inverse needs no tail correction)
+struct HaltonTables
+{
+    static constexpr std::size_t numBases{ 32 };
+
+    std::uint32_t primes[numBases];
+    std::vector<std::uint16_t> permutations[numBases];
+};
+
+static HaltonTables const& haltonTables()
+{
+    static HaltonTables const tables = [] {
+        HaltonTables t{};
+        std::mt19937 generator(0x4a17u);
+
+        std::uint32_t candidate{ 2 };
+        for (std::size_t b = 0; b < HaltonTables::numBases; ++candidate)
+        {
+            bool prime{ true };
+            for (std::uint32_t d = 2; d * d <= candidate && prime; ++d)
+                prime = candidate % d != 0;
+
+            if (!prime)
+                continue;
+
+            t.primes[b] = candidate;
+            t.permutations[b].resize(candidate);
+            for (std::uint32_t d = 0; d < candidate; ++d)
+                t.permutations[b][d] = static_cast<std::uint16_t>(d);
+            std::shuffle(t.permutations[b].begin() + 1, t.permutations[b].end(), generator);
+            ++b;
+        }
+
+        return t;
+    }();
+
+    return tables;
+}
+
+static float scrambledRadicalInverse(std::size_t base, std::uint32_t index)
+{
+    HaltonTables const& tables = haltonTables();
+    std::uint32_t b = tables.primes[base];
+    std::vector<std::uint16_t> const& permutation = tables.permutations[base];
+
+    double inverse{ 1.0 / b };
+    double scale{ inverse };
+    double result{ 0.0 };
+
+    for (; index != 0; index /= b, scale *= inverse)
+        result += permutation[index % b] * scale;
+
+    return std::min(static_cast<float>(result), 0x1.fffffep-1f);
+}
+
+// A few progressive multi-jittered (0,2) sequences generated once with the
+// stochastic construction of Christensen, Kensler and Kilpatrick: every
+// prefix of 2^k samples is stratified in all 2^k elementary intervals.
+struct PMJ02Tables
+{
+    static constexpr std::uint32_t numSets{ 8 };
+    static constexpr std::uint32_t numSamples{ 1024 };
+
+    std::vector<atlas::math::Point> sets[numSets];
+};
+
+class PMJ02Generator
+{
+public:
+    explicit PMJ02Generator(std::uint32_t seed) : mGenerator(seed), mUniform(0.0f, 1.0f)
+    {}
+
+    std::vector<atlas::math::Point> generate(std::uint32_t count)
+    {
+        mSamples.assign(count, atlas::math::Point{});
+        mSamples[0] = { mUniform(mGenerator), mUniform(mGenerator), 0.0f };
+
+        for (std::uint32_t n = 1; n < count; n *= 4)
+        {
+            extendEven(n);
+            if (2 * n < count)
+                extendOdd(2 * n);
+        }
+
+        return mSamples;
+    }
+
+private:
+    // n samples (a power of four) become 2n: each new sample goes into the
+    // sub-quadrant diagonally opposite its parent
+    void extendEven(std::uint32_t n)
+    {
+        std::uint32_t grid = static_cast<std::uint32_t>(std::lround(std::sqrt(n)));
+        markOccupiedStrata(n);
+
+        for (std::uint32_t s = 0; s < n; ++s)
+        {
+            Cell cell = cellOf(mSamples[s], grid);
+            mSamples[n + s] = generatePoint(cell, 1 - cell.xhalf, 1 - cell.yhalf, grid, n);
+        }
+    }
+
+    // n samples (twice a power of four) become 2n: the remaining two
+    // sub-quadrants of each parent are filled in random order
+    void extendOdd(std::uint32_t n)
+    {
+        std::uint32_t grid = static_cast<std::uint32_t>(std::lround(std::sqrt(n / 2)));
+        markOccupiedStrata(n);
+
+        std::vector<int> xhalves(n / 2), yhalves(n / 2);
+        for (std::uint32_t s = 0; s < n / 2; ++s)
+        {
+            Cell cell = cellOf(mSamples[s], grid);
+            if (mUniform(mGenerator) > 0.5f)
+                cell.xhalf = 1 - cell.xhalf;
+            else
+                cell.yhalf = 1 - cell.yhalf;
+
+            xhalves[s] = cell.xhalf;
+            yhalves[s] = cell.yhalf;
+            mSamples[n + s] = generatePoint(cell, cell.xhalf, cell.yhalf, grid, n);
+        }
+
+        for (std::uint32_t s = 0; s < n / 2; ++s)
+        {
+            Cell cell = cellOf(mSamples[s], grid);
+            mSamples[n + n / 2 + s] = generatePoint(cell, 1 - xhalves[s], 1 - yhalves[s], grid, n);
+        }
+    }
+
+    struct Cell
+    {
+        int i, j, xhalf, yhalf;
+    };
+
+    static Cell cellOf(atlas::math::Point const& p, std::uint32_t grid)
+    {
+        int i = static_cast<int>(grid * p.x);
+        int j = static_cast<int>(grid * p.y);
+        return { i, j, static_cast<int>(2 * (grid * p.x - i)), static_cast<int>(2 * (grid * p.y - j)) };
+    }
+
+    // random point in the given sub-quadrant that lands in an empty stratum
+    // of every elementary interval shape for 2n samples
+    atlas::math::Point generatePoint(Cell const& cell, int xhalf, int yhalf,
+                                     std::uint32_t grid, std::uint32_t n)
+    {
+        atlas::math::Point p{};
+        do
+        {
+            p.x = (cell.i + 0.5f * (xhalf + mUniform(mGenerator))) / grid;
+            p.y = (cell.j + 0.5f * (yhalf + mUniform(mGenerator))) / grid;
+        } while (isOccupied(p, 2 * n));
+
+        markOccupied(p, 2 * n);
+        return p;
+    }
+
+    void markOccupiedStrata(std::uint32_t n)
+    {
+        std::uint32_t strata{ 2 * n };
+        std::size_t shapes{ 1 };
+        for (std::uint32_t x = strata; x > 1; x /= 2)
+            ++shapes;
+
+        mOccupied.assign(shapes, std::vector<bool>(strata, false));
+        for (std::uint32_t s = 0; s < n; ++s)
+            markOccupied(mSamples[s], strata);
+    }
+
+    void markOccupied(atlas::math::Point const& p, std::uint32_t strata)
+    {
+        std::size_t shape{ 0 };
+        for (std::uint32_t xdivs = strata, ydivs = 1; xdivs > 0; xdivs /= 2, ydivs *= 2, ++shape)
+            mOccupied[shape][stratum(p, xdivs, ydivs)] = true;
+    }
+
+    bool isOccupied(atlas::math::Point const& p, std::uint32_t strata) const
+    {
+        std::size_t shape{ 0 };
+        for (std::uint32_t xdivs = strata, ydivs = 1; xdivs > 0; xdivs /= 2, ydivs *= 2, ++shape)
+        {
+            if (mOccupied[shape][stratum(p, xdivs, ydivs)])
+                return true;
+        }
+
+        return false;
+    }
+
+    static std::size_t stratum(atlas::math::Point const& p, std::uint32_t xdivs, std::uint32_t ydivs)
+    {
+        return static_cast<std::size_t>(p.y * ydivs) * xdivs + static_cast<std::size_t>(p.x * xdivs);
+    }
+
+    std::mt19937 mGenerator;
+    std::uniform_real_distribution<float> mUniform;
+    std::vector<atlas::math::Point> mSamples;
+    std::vector<std::vector<bool>> mOccupied;
+};
+
+static PMJ02Tables const& pmj02Tables()
+{
+    static PMJ02Tables const tables = [] {
+        PMJ02Tables t{};
+        for (std::uint32_t set = 0; set < PMJ02Tables::numSets; ++set)
+            t.sets[set] = PMJ02Generator{ 0x9e37u + set }.generate(PMJ02Tables::numSamples);
+        return t;
+    }();
+
+    return tables;
+}
+
+// ***** Halton function members *****
+Halton::Halton(int numSamples, std::uint32_t seed) : Sampler{ numSamples, seed }
+{
+	haltonTables();
+}
+
+atlas::math::Point Halton::sampleUnitSquare(std::uint64_t pixel,
+	std::uint32_t index,
+	std::uint32_t dimension) const
+{
+	if (dimension >= HaltonTables::numBases / 2)
+		return atlas::math::Point{ random(pixel, index, 2 * dimension), random(pixel, index, 2 * dimension + 1), 0.0f };
+
+	std::size_t base = 2 * dimension;
+	float x = scrambledRadicalInverse(base, index);
+	float y = scrambledRadicalInverse(base + 1, index);
+
+	// Cranley-Patterson rotation decorrelates neighbouring pixels
+	x += random(pixel, 0, 2 * dimension);
+	y += random(pixel, 0, 2 * dimension + 1);
+
+	return atlas::math::Point{ x >= 1.0f ? x - 1.0f : x, y >= 1.0f ? y - 1.0f : y, 0.0f };
+}
+
+void Halton::sampleUnitSquares(std::uint64_t const* pixels,
+	std::uint32_t const* indices,
+	std::size_t count,
+	std::uint32_t dimension,
+	float* x,
+	float* y) const
+{
+	sampleEach<Halton>(pixels, indices, count, dimension, x, y);
+}
+
+// ***** Sobol function members *****
+Sobol::Sobol(int numSamples, std::uint32_t seed) : Sampler{ numSamples, seed }
+{
+	sobolTables();
+}
+
+atlas::math::Point Sobol::sampleUnitSquare(std::uint64_t pixel,
+	std::uint32_t index,
+	std::uint32_t dimension) const
+{
+	// shuffled and Owen-scrambled per pixel and dimension, after Burley 2020
+	std::uint32_t seed = hash(mSeed, pixel, 0, dimension);
+	std::uint32_t i = nestedUniformScramble(index, seed);
+
+	std::uint32_t x = nestedUniformScramble(sobol(i, 0), pcgHash(seed ^ 0x1u));
+	std::uint32_t y = nestedUniformScramble(sobol(i, 1), pcgHash(seed ^ 0x2u));
+
+	return atlas::math::Point{ fractionToFloat(x), fractionToFloat(y), 0.0f };
+}
+
+void Sobol::sampleUnitSquares(std::uint64_t const* pixels,
+	std::uint32_t const* indices,
+	std::size_t count,
+	std::uint32_t dimension,
+	float* x,
+	float* y) const
+{
+	sampleEach<Sobol>(pixels, indices, count, dimension, x, y);
+}
+
+// ***** PMJ02 function members *****
+PMJ02::PMJ02(int numSamples, std::uint32_t seed) : Sampler{ numSamples, seed }
+{
+	pmj02Tables();
+}
+
+atlas::math::Point PMJ02::sampleUnitSquare(std::uint64_t pixel,
+	std::uint32_t index,
+	std::uint32_t dimension) const
+{
+	PMJ02Tables const& tables = pmj02Tables();
+
+	// pick a table per pixel, dimension and block of samples, then xor the
+	// binary digits; a digital shift keeps the (0,2) stratification
+	std::uint32_t block = index / PMJ02Tables::numSamples;
+	std::uint32_t h = hash(mSeed, pixel, block, dimension);
+	atlas::math::Point const& p =
+		tables.sets[h % PMJ02Tables::numSets][index % PMJ02Tables::numSamples];
+
+	std::uint32_t x = static_cast<std::uint32_t>(p.x * 4294967296.0) ^ pcgHash(h ^ 0x1u);
+	std::uint32_t y = static_cast<std::uint32_t>(p.y * 4294967296.0) ^ pcgHash(h ^ 0x2u);
+
+	return atlas::math::Point{ fractionToFloat(x), fractionToFloat(y), 0.0f };
+}
+
+void PMJ02::sampleUnitSquares(std::uint64_t const* pixels,
+	std::uint32_t const* indices,
+	std::size_t count,
+	std::uint32_t dimension,
+	float* x,
+	float* y) const
+{
+	sampleEach<PMJ02>(pixels, indices, count, dimension, x, y);
+}
+
+// ***** SceneFile function members *****
+// binary header; the record arrays follow at 64-byte aligned offsets in
+// the order of SceneTable
+struct SceneFileHeader
+{
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t byteOrder;
+	SceneSettings settings;
+	std::uint64_t offset[5];
+	std::uint64_t count[5];
+};
+
+enum SceneTable
+{
+	materialTable,
+	lightTable,
+	sphereTable,
+	planeTable,
+	triangleTable
+};
+
+static char const sceneMagic[8]{ 'R', 'T', 'S', 'C', 'E', 'N', 'E', '1' };
+static std::uint32_t const sceneByteOrder{ 0x01020304 };
+
+static_assert(sizeof(SceneSettings) == 22 * 4);
+static_assert(sizeof(SceneMaterial) == 5 * 4);
+static_assert(sizeof(SceneLight) == 9 * 4);
+static_assert(sizeof(SceneSphere) == 5 * 4);
+static_assert(sizeof(ScenePlane) == 7 * 4);
+static_assert(sizeof(SceneTriangle) == 10 * 4);
+
+static char const* const samplerNames[]{ "regular", "random", "jitter", "halton", "sobol", "pmj02" };
+static char const* const toneMapNames[]{ "clamp", "maxnormalise", "reinhard", "aces" };
+static char const* const encodingNames[]{ "linear", "srgb" };
+
+static std::shared_ptr<Sampler> makeSampler(SamplerType type, int numSamples, std::uint32_t seed)
+{
+	switch (type)
+	{
+	case SamplerType::Regular:
+		return std::make_shared<Regular>(numSamples, seed);
+	case SamplerType::Random:
+		return std::make_shared<Random>(numSamples, seed);
+	case SamplerType::Halton:
+		return std::make_shared<Halton>(numSamples, seed);
+	case SamplerType::Sobol:
+		return std::make_shared<Sobol>(numSamples, seed);
+	case SamplerType::PMJ02:
+		return std::make_shared<PMJ02>(numSamples, seed);
+	default:
+		return std::make_shared<Jitter>(numSamples, seed);
+	}
+}
+
+SceneFile::~SceneFile()
+{
+	unmap();
+}
+
+std::string const& SceneFile::getError() const
+{
+	return mError;
+}
+
+SceneSettings& SceneFile::settings()
+{
+	return mSettings;
+}
+
+SceneSettings const& SceneFile::settings() const
+{
+	return mSettings;
+}
+
+bool SceneFile::fail(std::string const& error)
+{
+	mError = error;
+	return false;
+}
+
+bool SceneFile::load(std::string const& filename)
+{
+	ScopedTimer timer{ Phase::Setup };
+	TraceScope trace{ "scene load" };
+	unmap();
+	mSettings = SceneSettings{};
+	mMaterials.clear();
+	mLights.clear();
+	mSpheres.clear();
+	mPlanes.clear();
+	mTriangles.clear();
+	mError.clear();
+
+	char magic[sizeof(sceneMagic)]{};
+	std::ifstream file{ filename, std::ios::binary };
+	if (!file)
+		return fail("cannot open " + filename);
+	file.read(magic, sizeof(magic));
+	file.close();
+
+	bool loaded{ std::memcmp(magic, sceneMagic, sizeof(magic)) == 0 ?
+		loadBinary(filename) : loadText(filename) };
+
+	return loaded && validate();
+}
+
+bool SceneFile::loadBinary(std::string const& filename)
+{
+#if RT_POSIX
+	int file = open(filename.c_str(), O_RDONLY);
+	if (file < 0)
+		return fail("cannot open " + filename);
+
+	struct stat info{};
+	void* data = MAP_FAILED;
+	if (fstat(file, &info) == 0 && info.st_size > 0)
+	{
+		mMapSize = static_cast<std::size_t>(info.st_size);
+		data = mmap(nullptr, mMapSize, PROT_READ, MAP_PRIVATE, file, 0);
+	}
+	close(file);
+
+	if (data == MAP_FAILED)
+		return fail("cannot map " + filename);
+	mMap = data;
+#else
+	std::ifstream file{ filename, std::ios::binary | std::ios::ate };
+	mBuffer.resize(static_cast<std::size_t>(file.tellg()));
+	file.seekg(0);
+	if (!file.read(reinterpret_cast<char*>(mBuffer.data()), static_cast<std::streamsize>(mBuffer.size())))
+		return fail("cannot read " + filename);
+	mMap = mBuffer.data();
+	mMapSize = mBuffer.size();
+#endif
+
+	SceneFileHeader header{};
+	if (mMapSize < sizeof(header))
+		return fail(filename + " is truncated");
+	std::memcpy(&header, mMap, sizeof(header));
+
+	if (header.version != 1)
+		return fail(filename + " has unknown version " + std::to_string(header.version));
+	if (header.byteOrder != sceneByteOrder)
+		return fail(filename + " was written with another byte order");
+
+	// a table is usable in place if it is aligned and inside the file
+	unsigned char const* base = static_cast<unsigned char const*>(mMap);
+	auto table = [this, &header, base](SceneTable t, auto& records) {
+		using Record = std::remove_cv_t<std::remove_pointer_t<decltype(records.data)>>;
+		std::uint64_t offset{ header.offset[t] };
+		std::uint64_t count{ header.count[t] };
+		if (offset % alignof(Record) != 0 || offset > mMapSize || count > (mMapSize - offset) / sizeof(Record))
+			return false;
+		records.data = reinterpret_cast<Record const*>(base + offset);
+		records.size = static_cast<std::size_t>(count);
+		return true;
+	};
+
+	if (!table(materialTable, mMappedMaterials) ||
+		!table(lightTable, mMappedLights) ||
+		!table(sphereTable, mMappedSpheres) ||
+		!table(planeTable, mMappedPlanes) ||
+		!table(triangleTable, mMappedTriangles))
+		return fail(filename + " is truncated");
+
+	mSettings = header.settings;
+	return true;
+}
+
+// cursor over the current line of a text scene file
+struct SceneLine
+{
+	char const* p;
+	char const* end;
+
+	// at the end of the line or a comment
+	bool done()
+	{
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+			++p;
+		return p == end || *p == '#';
+	}
+
+	bool word(std::string_view& w)
+	{
+		if (done())
+			return false;
+		char const* start{ p };
+		while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '#')
+			++p;
+		w = std::string_view{ start, static_cast<std::size_t>(p - start) };
+		return true;
+	}
+
+	// strtof stops at the newline ending the line, the whole file ends in
+	// the string's terminator
+	bool number(float& v)
+	{
+		if (done())
+			return false;
+		char* next{ nullptr };
+		v = std::strtof(p, &next);
+		if (next == p || next > end)
+			return false;
+		p = next;
+		return true;
+	}
+
+	// integers are read as such, through a float those above 2^24 would
+	// come back rounded
+	bool number(std::uint32_t& v)
+	{
+		if (done() || *p == '-' || *p == '+')
+			return false;
+		char* next{ nullptr };
+		errno = 0;
+		unsigned long n{ std::strtoul(p, &next, 10) };
+		if (next == p || next > end || errno == ERANGE || n > 0xffffffffUL)
+			return false;
+		if (next < end && *next != ' ' && *next != '\t' && *next != '\r' && *next != '#')
+			return false;
+		v = static_cast<std::uint32_t>(n);
+		p = next;
+		return true;
+	}
+
+	template <std::size_t n>
+	bool numbers(float (&v)[n])
+	{
+		for (float& x : v)
+		{
+			if (!number(x))
+				return false;
+		}
+		return true;
+	}
+
+	template <std::size_t n>
+	bool name(char const* const (&names)[n], std::uint32_t& v)
+	{
+		std::string_view w;
+		if (!word(w))
+			return false;
+		for (std::size_t i = 0; i < n; ++i)
+		{
+			if (w == names[i])
+			{
+				v = static_cast<std::uint32_t>(i);
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+bool SceneFile::loadText(std::string const& filename)
+{
+	std::string text;
+	{
+		std::ifstream file{ filename, std::ios::binary | std::ios::ate };
+		text.resize(static_cast<std::size_t>(file.tellg()));
+		file.seekg(0);
+		if (!file.read(text.data(), static_cast<std::streamsize>(text.size())))
+			return fail("cannot read " + filename);
+	}
+
+	char const* p{ text.data() };
+	char const* end{ p + text.size() };
+	for (std::size_t lineNumber = 1; p < end; ++lineNumber)
+	{
+		char const* eol = static_cast<char const*>(std::memchr(p, '\n', static_cast<std::size_t>(end - p)));
+		if (eol == nullptr)
+			eol = end;
+
+		SceneLine line{ p, eol };
+		p = eol + 1;
+
+		std::string_view key;
+		if (!line.word(key))
+			continue;
+
+		bool ok{ false };
+		SceneSettings& s{ mSettings };
+		if (key == "image")
+		{
+			ok = line.number(s.width) && line.number(s.height);
+		}
+		else if (key == "background")
+		{
+			ok = line.numbers(s.background);
+		}
+		else if (key == "sampler")
+		{
+			s.seed = 0;
+			ok = line.name(samplerNames, s.sampler) && line.number(s.numSamples) &&
+				(line.done() || line.number(s.seed));
+		}
+		else if (key == "camera")
+		{
+			ok = line.numbers(s.eye) && line.numbers(s.lookAt) && line.numbers(s.up) &&
+				line.number(s.distance) && line.number(s.zoom);
+		}
+		else if (key == "output")
+		{
+			ok = line.number(s.exposure) && line.name(toneMapNames, s.toneMap) &&
+				line.name(encodingNames, s.encoding);
+		}
+		else if (key == "material")
+		{
+			SceneMaterial m{};
+			ok = line.number(m.ka) && line.number(m.kd) && line.numbers(m.colour);
+			mMaterials.push_back(m);
+		}
+		else if (key == "ambient" || key == "point")
+		{
+			SceneLight l{};
+			l.type = static_cast<std::uint32_t>(key == "point" ? LightType::Point : LightType::Ambient);
+			ok = line.number(l.radiance) && line.numbers(l.colour);
+			if (ok && key == "point")
+			{
+				std::string_view flag;
+				ok = line.numbers(l.location) && (line.done() || (line.word(flag) && flag == "shadows"));
+				l.shadows = !flag.empty();
+			}
+			mLights.push_back(l);
+		}
+		else if (key == "sphere")
+		{
+			SceneSphere sphere{};
+			ok = line.numbers(sphere.centre) && line.number(sphere.radius) && line.number(sphere.material);
+			mSpheres.push_back(sphere);
+		}
+		else if (key == "plane")
+		{
+			ScenePlane plane{};
+			ok = line.numbers(plane.point) && line.numbers(plane.normal) && line.number(plane.material);
+			mPlanes.push_back(plane);
+		}
+		else if (key == "triangle")
+		{
+			SceneTriangle triangle{};
+			ok = line.numbers(triangle.a) && line.numbers(triangle.b) && line.numbers(triangle.c) &&
+				line.number(triangle.material);
+			mTriangles.push_back(triangle);
+		}
+
+		if (!ok || !line.done())
+			return fail(filename + ":" + std::to_string(lineNumber) + ": cannot read '" + std::string{ key } + "' line");
+	}
+
+	return true;
+}
+
+bool SceneFile::validate()
+{
+	if (mSettings.sampler > static_cast<std::uint32_t>(SamplerType::PMJ02) ||
+		mSettings.toneMap > static_cast<std::uint32_t>(ToneMap::ACES) ||
+		mSettings.encoding > static_cast<std::uint32_t>(Encoding::sRGB))
+		return fail("unknown sampler, tone map or encoding");
+
+	for (SceneLight const& light : lights())
+	{
+		if (light.type > static_cast<std::uint32_t>(LightType::Point))
+			return fail("unknown light type " + std::to_string(light.type));
+	}
+
+	// one pass per kind; a single scan over millions of indices costs
+	// about a millisecond
+	std::size_t numMaterials{ materials().size };
+	auto check = [this, numMaterials](auto const& records, char const* kind) {
+		for (std::size_t i = 0; i < records.size; ++i)
+		{
+			if (records[i].material >= numMaterials)
+			{
+				return fail(std::string{ kind } + " " + std::to_string(i) + " uses material " +
+					std::to_string(records[i].material) + " of " + std::to_string(numMaterials));
+			}
+		}
+		return true;
+	};
+
+	return check(spheres(), "sphere") && check(planes(), "plane") && check(triangles(), "triangle");
+}
+
+bool SceneFile::saveText(std::string const& filename) const
+{
+	// fmt writes the shortest text that reads back as the same float
+	SceneSettings const& s{ mSettings };
+	std::string text;
+	auto out = std::back_inserter(text);
+
+	fmt::format_to(out, "image {} {}\n", s.width, s.height);
+	fmt::format_to(out, "background {} {} {}\n", s.background[0], s.background[1], s.background[2]);
+	fmt::format_to(out, "sampler {} {} {}\n", samplerNames[s.sampler], s.numSamples, s.seed);
+	fmt::format_to(out, "camera {} {} {}  {} {} {}  {} {} {}  {} {}\n",
+		s.eye[0], s.eye[1], s.eye[2], s.lookAt[0], s.lookAt[1], s.lookAt[2],
+		s.up[0], s.up[1], s.up[2], s.distance, s.zoom);
+	fmt::format_to(out, "output {} {} {}\n\n", s.exposure, toneMapNames[s.toneMap], encodingNames[s.encoding]);
+
+	for (SceneMaterial const& m : materials())
+		fmt::format_to(out, "material {} {} {} {} {}\n", m.ka, m.kd, m.colour[0], m.colour[1], m.colour[2]);
+
+	for (SceneLight const& l : lights())
+	{
+		if (l.type == static_cast<std::uint32_t>(LightType::Ambient))
+		{
+			fmt::format_to(out, "ambient {} {} {} {}\n", l.radiance, l.colour[0], l.colour[1], l.colour[2]);
+		}
+		else
+		{
+			fmt::format_to(out, "point {} {} {} {} {} {} {}{}\n", l.radiance, l.colour[0], l.colour[1],
+				l.colour[2], l.location[0], l.location[1], l.location[2], l.shadows ? " shadows" : "");
+		}
+	}
+
+	for (SceneSphere const& p : spheres())
+		fmt::format_to(out, "sphere {} {} {} {} {}\n", p.centre[0], p.centre[1], p.centre[2], p.radius, p.material);
+
+	for (ScenePlane const& p : planes())
+	{
+		fmt::format_to(out, "plane {} {} {} {} {} {} {}\n", p.point[0], p.point[1], p.point[2],
+			p.normal[0], p.normal[1], p.normal[2], p.material);
+	}
+
+	for (SceneTriangle const& p : triangles())
+	{
+		fmt::format_to(out, "triangle {} {} {} {} {} {} {} {} {} {}\n", p.a[0], p.a[1], p.a[2],
+			p.b[0], p.b[1], p.b[2], p.c[0], p.c[1], p.c[2], p.material);
+	}
+
+	std::ofstream file{ filename, std::ios::binary };
+	if (!file.write(text.data(), static_cast<std::streamsize>(text.size())))
+	{
+		mError = "cannot write " + filename;
+		return false;
+	}
+	return true;
+}
+
+bool SceneFile::saveBinary(std::string const& filename) const
+{
+	SceneFileHeader header{};
+	std::memcpy(header.magic, sceneMagic, sizeof(sceneMagic));
+	header.version = 1;
+	header.byteOrder = sceneByteOrder;
+	header.settings = mSettings;
+
+	std::pair<void const*, std::size_t> tables[5]{
+		{ materials().data, materials().size * sizeof(SceneMaterial) },
+		{ lights().data, lights().size * sizeof(SceneLight) },
+		{ spheres().data, spheres().size * sizeof(SceneSphere) },
+		{ planes().data, planes().size * sizeof(ScenePlane) },
+		{ triangles().data, triangles().size * sizeof(SceneTriangle) }
+	};
+	std::size_t counts[5]{ materials().size, lights().size, spheres().size, planes().size, triangles().size };
+
+	std::uint64_t offset{ sizeof(header) };
+	for (std::size_t t = 0; t < 5; ++t)
+	{
+		offset = (offset + 63) & ~std::uint64_t{ 63 };
+		header.offset[t] = offset;
+		header.count[t] = counts[t];
+		offset += tables[t].second;
+	}
+
+	std::ofstream file{ filename, std::ios::binary };
+	file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+
+	char const padding[64]{};
+	std::uint64_t written{ sizeof(header) };
+	for (std::size_t t = 0; t < 5; ++t)
+	{
+		file.write(padding, static_cast<std::streamsize>(header.offset[t] - written));
+		file.write(static_cast<char const*>(tables[t].first), static_cast<std::streamsize>(tables[t].second));
+		written = header.offset[t] + tables[t].second;
+	}
+
+	if (!file.flush())
+	{
+		mError = "cannot write " + filename;
+		return false;
+	}
+	return true;
+}
+
+std::uint32_t SceneFile::addMaterial(SceneMaterial const& material)
+{
+	detach();
+	mMaterials.push_back(material);
+	return static_cast<std::uint32_t>(mMaterials.size() - 1);
+}
+
+void SceneFile::addLight(SceneLight const& light)
+{
+	detach();
+	mLights.push_back(light);
+}
+
+void SceneFile::addSphere(SceneSphere const& sphere)
+{
+	detach();
+	mSpheres.push_back(sphere);
+}
+
+void SceneFile::addPlane(ScenePlane const& plane)
+{
+	detach();
+	mPlanes.push_back(plane);
+}
+
+void SceneFile::addTriangle(SceneTriangle const& triangle)
+{
+	detach();
+	mTriangles.push_back(triangle);
+}
+
+SceneRecords<SceneMaterial> SceneFile::materials() const
+{
+	return mMap ? mMappedMaterials : SceneRecords<SceneMaterial>{ mMaterials.data(), mMaterials.size() };
+}
+
+SceneRecords<SceneLight> SceneFile::lights() const
+{
+	return mMap ? mMappedLights : SceneRecords<SceneLight>{ mLights.data(), mLights.size() };
+}
+
+SceneRecords<SceneSphere> SceneFile::spheres() const
+{
+	return mMap ? mMappedSpheres : SceneRecords<SceneSphere>{ mSpheres.data(), mSpheres.size() };
+}
+
+SceneRecords<ScenePlane> SceneFile::planes() const
+{
+	return mMap ? mMappedPlanes : SceneRecords<ScenePlane>{ mPlanes.data(), mPlanes.size() };
+}
+
+SceneRecords<SceneTriangle> SceneFile::triangles() const
+{
+	return mMap ? mMappedTriangles : SceneRecords<SceneTriangle>{ mTriangles.data(), mTriangles.size() };
+}
+
+void SceneFile::detach()
+{
+	if (!mMap)
+		return;
+
+	mMaterials.assign(mMappedMaterials.begin(), mMappedMaterials.end());
+	mLights.assign(mMappedLights.begin(), mMappedLights.end());
+	mSpheres.assign(mMappedSpheres.begin(), mMappedSpheres.end());
+	mPlanes.assign(mMappedPlanes.begin(), mMappedPlanes.end());
+	mTriangles.assign(mMappedTriangles.begin(), mMappedTriangles.end());
+	unmap();
+}
+
+void SceneFile::unmap()
+{
+#if RT_POSIX
+	if (mMap)
+		munmap(const_cast<void*>(mMap), mMapSize);
+#endif
+	mBuffer.clear();
+	mBuffer.shrink_to_fit();
+	mMap = nullptr;
+	mMapSize = 0;
+	mMappedMaterials = {};
+	mMappedLights = {};
+	mMappedSpheres = {};
+	mMappedPlanes = {};
+	mMappedTriangles = {};
+}
+
+std::shared_ptr<World> SceneFile::makeWorld(Pinhole& camera, std::size_t numThreads) const
+{
+	using atlas::math::Point;
+	ScopedTimer timer{ Phase::Setup };
+	TraceScope trace{ "make world" };
+
+	SceneSettings const& s{ mSettings };
+	std::shared_ptr<World> world{ std::make_shared<World>() };
+
+	world->width = s.width;
+	world->height = s.height;
+	world->background = { s.background[0], s.background[1], s.background[2] };
+	world->sampler = makeSampler(static_cast<SamplerType>(s.sampler), static_cast<int>(s.numSamples), s.seed);
+	world->exposure = s.exposure;
+	world->toneMap = static_cast<ToneMap>(s.toneMap);
+	world->encoding = static_cast<Encoding>(s.encoding);
+	world->numThreads = numThreads;
+
+	// Matte always asks for the ambient light, so a scene without one gets
+	// a black one
+	std::shared_ptr<Ambient> black{ std::make_shared<Ambient>() };
+	black->scaleRadiance(0);
+	world->ambient = black;
+
+	for (SceneLight const& l : lights())
+	{
+		Colour colour{ l.colour[0], l.colour[1], l.colour[2] };
+		if (l.type == static_cast<std::uint32_t>(LightType::Ambient))
+		{
+			std::shared_ptr<Ambient> ambient{ std::make_shared<Ambient>() };
+			ambient->scaleRadiance(l.radiance);
+			ambient->setColour(colour);
+			world->ambient = ambient;
+		}
+		else
+		{
+			std::shared_ptr<PointLight> point{ std::make_shared<PointLight>() };
+			point->scaleRadiance(l.radiance);
+			point->setColour(colour);
+			point->setLocation({ l.location[0], l.location[1], l.location[2] });
+			point->setShadows(l.shadows != 0);
+			world->lights.push_back(point);
+		}
+	}
+
+	// surface i of the store is material i of the file
+	PrimitiveStore store{};
+	for (SceneMaterial const& m : materials())
+	{
+		Colour colour{ m.colour[0], m.colour[1], m.colour[2] };
+		std::shared_ptr<Matte> matte{ std::make_shared<Matte>() };
+		matte->set_ka(m.ka);
+		matte->set_kd(m.kd);
+		matte->set_cd(colour);
+		store.addSurface(colour, matte);
+	}
+
+	store.reserve(spheres().size, planes().size, triangles().size);
+	for (SceneSphere const& p : spheres())
+		store.addSphere(Point{ p.centre[0], p.centre[1], p.centre[2] }, p.radius, p.material);
+	for (ScenePlane const& p : planes())
+		store.addPlane(Point{ p.point[0], p.point[1], p.point[2] }, Normal{ p.normal[0], p.normal[1], p.normal[2] }, p.material);
+	for (SceneTriangle const& p : triangles())
+	{
+		store.addTriangle(Point{ p.a[0], p.a[1], p.a[2] }, Point{ p.b[0], p.b[1], p.b[2] },
+			Point{ p.c[0], p.c[1], p.c[2] }, p.material);
+	}
+
+	world->bvh = std::make_shared<BVH>(std::move(store), world->numThreads);
+
+	camera.setEye({ s.eye[0], s.eye[1], s.eye[2] });
+	camera.setLookAt({ s.lookAt[0], s.lookAt[1], s.lookAt[2] });
+	camera.setUpVector({ s.up[0], s.up[1], s.up[2] });
+	camera.setDistance(s.distance);
+	camera.setZoom(s.zoom);
+	camera.computeUVW();
+
+	return world;
+}
+
+// ******* Scenes *******
+
+std::shared_ptr<World> makeShadingScene()
+{
+    ScopedTimer timer{Phase::Setup};
+    TraceScope trace{"scene setup"};
+    std::shared_ptr<World> world{std::make_shared<World>()};
+
+    world->width      = 600;
+    world->height     = 600;
+    world->background = {0, 0, 0};
+    world->sampler    = std::make_shared<Jitter>(4);
+
+	std::shared_ptr<Ambient> ambient{ std::make_shared<Ambient>() };
+	ambient->scaleRadiance(1.5f);
+	ambient->setColour({ 1,1,1 });
+	world->ambient = ambient;
+
+	std::shared_ptr<PointLight> pointlight{ std::make_shared<PointLight>() };
+	pointlight->setLocation({ -300,150,150 });
+	pointlight->scaleRadiance(1.5f);
+	pointlight->setShadows(true);
+	ambient->setColour({ 1,1,1 });
+
+	world->lights.push_back(pointlight);
+
+	std::shared_ptr<Matte> matte0{ std::make_shared<Matte>() };
+	matte0->set_ka(25);
+	matte0->set_kd(65);
+	matte0->set_cd({1,0,0});
+
+	std::shared_ptr<Matte> matte1{std::make_shared<Matte>() };
+	matte1->set_ka(25);
+	matte1->set_kd(65);
+	matte1->set_cd({ 0,0,1 });
+
+	std::shared_ptr<Matte> matte2{ std::make_shared<Matte>() };
+	matte2->set_ka(25);
+	matte2->set_kd(65);
+	matte2->set_cd({ 0,1,0 });
+
+	std::shared_ptr<Matte> matte3{ std::make_shared<Matte>() };
+	matte3->set_ka(25);
+	matte3->set_kd(65);
+	matte3->set_cd({ 1,1,1 });
+
+	std::shared_ptr<Matte> matte4{ std::make_shared<Matte>() };
+	matte4->set_ka(25);
+	matte4->set_kd(65);
+	matte4->set_cd({ 0,0,0 });
+
+    world->scene.push_back(
+        std::make_shared<Sphere>(atlas::math::Point{0, 0, -600}, 128.0f));
+    world->scene[0]->setColour({1, 0, 0});
+	world->scene[0]->setMaterial(matte0);
+
+    world->scene.push_back(
+        std::make_shared<Sphere>(atlas::math::Point{128, 32, -700}, 64.0f));
+    world->scene[1]->setColour({0, 0, 1});
+	world->scene[1]->setMaterial(matte1);
+
+    world->scene.push_back(
+        std::make_shared<Sphere>(atlas::math::Point{-128, 32, -700}, 64.0f));
+    world->scene[2]->setColour({0, 1, 0});
+	world->scene[2]->setMaterial(matte2);
+	
+	world->scene.push_back(
+		std::make_shared<Plane>(atlas::math::Point{ 0, 0, -800 }, atlas::math::Point{ 0, 2, 1 }));
+	world->scene[3]->setColour({0.2, 0.2, 0.2});
+	world->scene[3]->setMaterial(matte3);
+
+	world->scene.push_back(
+		std::make_shared<Plane>(atlas::math::Point{ 0, 0, -800 }, atlas::math::Point{ 0, -2, 1 }));
+	world->scene[4]->setColour({ 0.1, 0.1, 0.1 });
+	world->scene[4]->setMaterial(matte3);
+
+	world->scene.push_back(
+		std::make_shared<Triangle>(atlas::math::Point{ -50,0,-200 },
+			atlas::math::Point{ 50,0,-200 },
+			atlas::math::Point{ 0,50,-200 }));
+	world->scene[5]->setColour({ 0, 0, 0});
+	world->scene[5]->setMaterial(matte4);
+
+    return world;
+}
+
+void renderCheckerboardLab(std::size_t side, std::size_t squareDims, std::vector<Colour>& image)
+{
+	image.assign(side * side, Colour{ 0, 0, 0 });
+	for (std::size_t y = 0; y < side; ++y)
+	{
+		for (std::size_t x = 0; x < side; ++x)
+		{
+			if ((x / squareDims + y / squareDims) % 2 == 1)
+				image[x + y * side] = { 1, 1, 1 };
+		}
+	}
+}
+
+std::size_t renderSphereLab(std::size_t side, std::vector<Colour>& image)
+{
+	float const s{ side / 512.0f };
+	Sphere object{ { 256 * s, 256 * s, 0 }, 128 * s };
+	object.setColour({ 1, 0, 0 });
+
+	image.resize(side * side);
+	atlas::math::Ray<atlas::math::Vector> ray{ { 0, 0, 0 }, { 0, 0, -1 } };
+	ShadeRec trace_data{};
+	std::size_t hits{ 0 };
+	for (std::size_t y = 0; y < side; ++y)
+	{
+		for (std::size_t x = 0; x < side; ++x)
+		{
+			ray.o = { x + 0.5f, y + 0.5f, 0 };
+			trace_data.t = std::numeric_limits<float>::max();
+			trace_data.color = { 0, 0, 0 };
+			hits += object.hit(ray, trace_data) ? 1 : 0;
+			image[x + y * side] = trace_data.color;
+		}
+	}
+
+	return hits;
+}
+
+std::shared_ptr<World> makeCameraLabScene(std::size_t side, Pinhole& camera)
+{
+	std::shared_ptr<World> world{ std::make_shared<World>() };
+	world->width = side;
+	world->height = side;
+	world->background = { 0, 0, 0 };
+	world->sampler = std::make_shared<Random>(16, 83);
+	world->ambient = std::make_shared<Ambient>();
+
+	Colour const colours[]{ { 1, 0, 0 }, { 0, 0, 1 } };
+	world->scene.push_back(std::make_shared<Sphere>(atlas::math::Point{ 64, 64, 0 }, 128.0f));
+	world->scene.push_back(std::make_shared<Sphere>(atlas::math::Point{ 128, 128, 64 }, 64.0f));
+	for (std::size_t i = 0; i < 2; ++i)
+	{
+		std::shared_ptr<Matte> flat{ std::make_shared<Matte>() };
+		flat->set_ka(1.0f);
+		flat->set_kd(0.0f);
+		flat->set_cd(colours[i]);
+		world->scene[i]->setColour(colours[i]);
+		world->scene[i]->setMaterial(flat);
+	}
+
+	camera.setEye({ 150.0f, 150.0f, 500.0f });
+	camera.setZoom(side / 600.0f);
+	camera.computeUVW();
+
+	return world;
+}
+
+void generateScene(SceneSpec const& spec, SceneFile& scene)
+{
+	using atlas::math::Point;
+	using atlas::math::Vector;
+	ScopedTimer timer{ Phase::Setup };
+	TraceScope trace{ "generate scene" };
+
+	std::mt19937 generator(spec.seed);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	std::normal_distribution<float> gaussian(0.0f, 1.0f);
+
+	// looking down -z at the box, as the shading scene does
+	SceneSettings& settings = scene.settings();
+	settings.eye[2] = 1.0f;
+	settings.lookAt[2] = -1.0f;
+	settings.distance = 500.0f;
+
+	Point const centre{ 0.0f, 0.0f, -1000.0f };
+	float const half{ 400.0f };
+	auto inBox = [&](float scale) {
+		return Vector{ unit(generator) - 0.5f, unit(generator) - 0.5f, unit(generator) - 0.5f } * (2.0f * scale);
+	};
+
+	std::size_t total{ spec.spheres + spec.triangles + 8 * spec.meshes };
+	float const size{ half / std::cbrt(static_cast<float>(std::max<std::size_t>(total, 1))) };
+
+	std::size_t numClusters{ static_cast<std::size_t>(std::cbrt(static_cast<double>(total))) + 1 };
+	float const spread{ 0.25f * half / std::cbrt(static_cast<float>(numClusters)) };
+	std::vector<Point> clusters;
+	if (spec.layout == SceneLayout::Clustered)
+	{
+		for (std::size_t i = 0; i < numClusters; ++i)
+			clusters.push_back(centre + inBox(half));
+	}
+
+	// uneven puts a quarter of each axis' range within 6% of the hot spot
+	Point const hotSpot{ centre + Vector{ -150.0f, -100.0f, 100.0f } };
+	auto place = [&]() -> Point {
+		switch (spec.layout)
+		{
+		case SceneLayout::Clustered:
+			return clusters[generator() % clusters.size()] +
+				spread * Vector{ gaussian(generator), gaussian(generator), gaussian(generator) };
+		case SceneLayout::Uneven:
+		{
+			Vector offset{ inBox(1.0f) };
+			for (int k = 0; k < 3; ++k)
+				offset[k] = std::copysign(std::pow(2.0f * std::fabs(offset[k]), 4.0f), offset[k]) * half;
+			return hotSpot + offset;
+		}
+		default:
+			return centre + inBox(half);
+		}
+	};
+
+	std::size_t numMaterials{ std::max<std::size_t>(spec.materials, 1) };
+	for (std::size_t m = 0; m < numMaterials; ++m)
+		scene.addMaterial({ 0.25f, 0.65f, { unit(generator), unit(generator), unit(generator) } });
+	auto material = [&] { return static_cast<std::uint32_t>(generator() % numMaterials); };
+
+	scene.addLight({ static_cast<std::uint32_t>(LightType::Ambient), 0, 1.0f, { 1, 1, 1 }, { 0, 0, 0 } });
+	for (std::size_t i = 0; i < spec.lights; ++i)
+	{
+		Point p{ centre + inBox(2.0f * half) };
+		scene.addLight({ static_cast<std::uint32_t>(LightType::Point), 1, 1.5f / spec.lights,
+			{ 0.5f + 0.5f * unit(generator), 0.5f + 0.5f * unit(generator), 0.5f + 0.5f * unit(generator) },
+			{ p.x, p.y, std::min(p.z, -200.0f) } });
+	}
+
+	for (std::size_t i = 0; i < spec.spheres; ++i)
+	{
+		Point p{ place() };
+		scene.addSphere({ { p.x, p.y, p.z }, size * (0.25f + 0.5f * unit(generator)), material() });
+	}
+
+	auto addTriangle = [&](Point const& a, Point const& b, Point const& c, std::uint32_t m) {
+		scene.addTriangle({ { a.x, a.y, a.z }, { b.x, b.y, b.z }, { c.x, c.y, c.z }, m });
+	};
+
+	for (std::size_t i = 0; i < spec.triangles; ++i)
+	{
+		Point p{ place() };
+		addTriangle(p, p + inBox(size), p + inBox(size), material());
+	}
+
+	// octahedra turned at random, wound so every face points outwards
+	for (std::size_t i = 0; i < spec.meshes; ++i)
+	{
+		Vector axis{ glm::normalize(inBox(1.0f) + Vector{ 0, 1e-3f, 0 }) };
+		Transform placement{ Transform::translate(place()) *
+			Transform::rotate(axis, 6.28318531f * unit(generator)) *
+			Transform::scale(Vector{ size * (0.5f + 0.5f * unit(generator)) }) };
+
+		std::uint32_t m{ material() };
+		for (int octant = 0; octant < 8; ++octant)
+		{
+			Vector s{ octant & 1 ? -1.0f : 1.0f, octant & 2 ? -1.0f : 1.0f, octant & 4 ? -1.0f : 1.0f };
+			Point x{ placement.point({ s.x, 0, 0 }) };
+			Point y{ placement.point({ 0, s.y, 0 }) };
+			Point z{ placement.point({ 0, 0, s.z }) };
+			if (s.x * s.y * s.z > 0.0f)
+				addTriangle(x, y, z, m);
+			else
+				addTriangle(x, z, y, m);
+		}
+	}
+
+	// backdrops one behind another past the box, tilted at random
+	for (std::size_t i = 0; i < spec.planes; ++i)
+	{
+		Vector n{ glm::normalize(Vector{ 0.2f * gaussian(generator), 0.2f * gaussian(generator), 1.0f }) };
+		scene.addPlane({ { 0.0f, 0.0f, -1500.0f - 100.0f * i }, { n.x, n.y, n.z }, material() });
+	}
+}
+
+static char const* const sceneLayoutNames[]{ "uniform", "clustered", "uneven" };
+
+char const* sceneLayoutName(SceneLayout layout)
+{
+	return sceneLayoutNames[static_cast<std::size_t>(layout)];
+}
+
+bool parseSceneLayout(std::string const& name, SceneLayout& layout)
+{
+	for (std::size_t i = 0; i < std::size(sceneLayoutNames); ++i)
+	{
+		if (name == sceneLayoutNames[i])
+		{
+			layout = static_cast<SceneLayout>(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+SceneSpec mixedSceneSpec(SceneLayout layout, std::size_t count, std::uint32_t seed)
+{
+	SceneSpec spec{};
+	spec.seed = seed;
+	spec.layout = layout;
+	spec.spheres = count * 4 / 10;
+	spec.meshes = count / 80;
+	spec.triangles = count - spec.spheres - 8 * spec.meshes;
+	spec.planes = 1;
+	spec.materials = 16;
+	spec.lights = 4;
+	return spec;
+}
+
+// ******* Command Line and Output *******
+
+bool parseArgument(char const* text, std::size_t max, std::size_t& value)
+{
+	// strtoull would skip leading space and take a sign
+	if (*text < '0' || *text > '9')
+		return false;
+
+	char* end{ nullptr };
+	errno = 0;
+	unsigned long long n{ std::strtoull(text, &end, 10) };
+	if (*end != '\0' || errno == ERANGE || n > max)
+		return false;
+
+	value = static_cast<std::size_t>(n);
+	return true;
+}
+
+bool parseArgument(char const* text, double max, double& value)
+{
+	if ((*text < '0' || *text > '9') && *text != '.')
+		return false;
+
+	char* end{ nullptr };
+	errno = 0;
+	double x{ std::strtod(text, &end) };
+	if (*end != '\0' || errno == ERANGE || !(x <= max))
+		return false;
+
+	value = x;
+	return true;
+}
+
+void saveToFile(std::string const& filename,
+                std::size_t width,
+                std::size_t height,
+                std::vector<Colour> const& image)
+{
+    std::vector<unsigned char> data(image.size() * 3);
+
+    for (std::size_t i{0}, k{0}; i < image.size(); ++i, k += 3)
+    {
+        Colour pixel = glm::clamp(image[i], 0.0f, 1.0f);
+        data[k + 0]  = static_cast<unsigned char>(pixel.r * 255 + 0.5f);
+        data[k + 1]  = static_cast<unsigned char>(pixel.g * 255 + 0.5f);
+        data[k + 2]  = static_cast<unsigned char>(pixel.b * 255 + 0.5f);
+    }
+
+    saveToFile(filename, width, height, data);
+}
+
+// ***** ImageWriter function members *****
+ImageWriter::ImageWriter(std::string const& filename, std::size_t width, std::size_t height) :
+    mFile{filename, std::ios::binary},
+    mWidth{width},
+    mHeight{height},
+    mRowsWritten{0},
+    mBMP{filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".bmp") == 0}
+{
+    if (!mFile)
+        return;
+
+    if (!mBMP)
+    {
+        mFile << "P6\n" << width << " " << height << "\n255\n";
+        return;
+    }
+
+    // BITMAPINFOHEADER with a negative height stores rows top-down
+    std::uint64_t rowSize{(3 * width + 3) & ~std::uint64_t{3}};
+    std::uint64_t fileSize{54 + rowSize * height};
+    if (fileSize > std::numeric_limits<std::uint32_t>::max() ||
+        width > static_cast<std::size_t>(std::numeric_limits<std::int32_t>::max()) ||
+        height > static_cast<std::size_t>(std::numeric_limits<std::int32_t>::max()))
+    {
+        mFile.setstate(std::ios::failbit);
+        return;
+    }
+
+    unsigned char header[54]{'B', 'M'};
+    auto put32 = [&header](std::size_t offset, std::uint32_t value) {
+        for (std::size_t i{0}; i < 4; ++i)
+            header[offset + i] = static_cast<unsigned char>(value >> (8 * i));
+    };
+
+    put32(2, static_cast<std::uint32_t>(fileSize));
+    put32(10, 54);
+    put32(14, 40);
+    put32(18, static_cast<std::uint32_t>(width));
+    put32(22, static_cast<std::uint32_t>(-static_cast<std::int32_t>(height)));
+    header[26] = 1;
+    header[28] = 24;
+    put32(34, static_cast<std::uint32_t>(rowSize * height));
+
+    mFile.write(reinterpret_cast<char const*>(header), sizeof(header));
+}
+
+bool ImageWriter::good() const
+{
+    return static_cast<bool>(mFile);
+}
+
+bool ImageWriter::writeRows(unsigned char const* pixels, std::size_t rows)
+{
+    ScopedTimer timer{Phase::Encode};
+    TraceScope trace{"write rows"};
+    if (!mFile || mRowsWritten + rows > mHeight)
+        return false;
+
+    if (!mBMP)
+    {
+        mFile.write(reinterpret_cast<char const*>(pixels),
+                    static_cast<std::streamsize>(3 * mWidth * rows));
+    }
+    else
+    {
+        // BGR, each row padded to 4 bytes
+        std::vector<char> row((3 * mWidth + 3) & ~std::size_t{3}, 0);
+        for (std::size_t r{0}; r < rows; ++r)
+        {
+            unsigned char const* in = pixels + 3 * mWidth * r;
+            for (std::size_t c{0}; c < mWidth; ++c)
+            {
+                row[3 * c + 0] = static_cast<char>(in[3 * c + 2]);
+                row[3 * c + 1] = static_cast<char>(in[3 * c + 1]);
+                row[3 * c + 2] = static_cast<char>(in[3 * c + 0]);
+            }
+            mFile.write(row.data(), static_cast<std::streamsize>(row.size()));
+        }
+    }
+
+    mRowsWritten += rows;
+    return static_cast<bool>(mFile);
+}
+
+bool ImageWriter::finish()
+{
+    mFile.flush();
+    return mFile && mRowsWritten == mHeight;
+}
+
+// ***** Checkpoint function members *****
+// file header: a magic string, then the key a checkpoint has to match to be
+// resumed; the two slots follow at checkpointHeaderSize
+struct CheckpointKey
+{
+    char magic[8];
+    std::uint64_t width;
+    std::uint64_t height;
+    std::uint64_t sampler;
+    std::uint32_t seed;
+    std::uint32_t numSamples;
+};
+
+static std::size_t const checkpointHeaderSize{64};
+
+static_assert(sizeof(CheckpointKey) <= checkpointHeaderSize);
+static_assert(sizeof(Colour) == 3 * sizeof(float));
+
+// FNV-1a, names the sampler type in the key
+static std::uint64_t hashName(char const* name)
+{
+    std::uint64_t hash{14695981039346656037ull};
+    for (; *name != '\0'; ++name)
+    {
+        hash ^= static_cast<unsigned char>(*name);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+Checkpoint::Checkpoint(std::string const& filename,
+                       std::size_t width,
+                       std::size_t height,
+                       Sampler const& sampler) :
+    mFilename{filename},
+    mPixels{width * height},
+    mSize{0},
+    mData{nullptr},
+    mFile{-1}
+{
+    CheckpointKey key{};
+    std::memcpy(key.magic, "RTCKPT01", sizeof(key.magic));
+    key.width      = width;
+    key.height     = height;
+    key.sampler    = hashName(typeid(sampler).name());
+    key.seed       = sampler.getSeed();
+    key.numSamples = static_cast<std::uint32_t>(sampler.getNumSamples());
+
+    mSize = slotOffset(2);
+
+#if RT_POSIX
+    mFile = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (mFile < 0)
+        return;
+
+    // a file of another size holds some other render; truncating it first
+    // leaves the new one zeroed
+    struct stat info{};
+    bool sameSize{fstat(mFile, &info) == 0 && static_cast<std::size_t>(info.st_size) == mSize};
+    if (!sameSize && (ftruncate(mFile, 0) != 0 || ftruncate(mFile, static_cast<off_t>(mSize)) != 0))
+        return;
+
+    void* data = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFile, 0);
+    if (data == MAP_FAILED)
+        return;
+    mData = static_cast<unsigned char*>(data);
+#else
+    mBuffer.assign(mSize, 0);
+    std::ifstream in{filename, std::ios::binary | std::ios::ate};
+    bool sameSize{in && static_cast<std::size_t>(in.tellg()) == mSize};
+    if (sameSize)
+    {
+        in.seekg(0);
+        sameSize = static_cast<bool>(in.read(reinterpret_cast<char*>(mBuffer.data()),
+                                             static_cast<std::streamsize>(mSize)));
+    }
+    in.close();
+
+    if (!sameSize)
+    {
+        mBuffer.assign(mSize, 0);
+        std::ofstream out{filename, std::ios::binary | std::ios::trunc};
+        if (!out.write(reinterpret_cast<char const*>(mBuffer.data()),
+                       static_cast<std::streamsize>(mSize)))
+            return;
+    }
+    mData = mBuffer.data();
+#endif
+
+    if (std::memcmp(mData, &key, sizeof(key)) == 0)
+        return;
+
+    // a checkpoint of another render: take the file over with both slots
+    // invalid
+    Slot empty{};
+    std::memcpy(mData, &key, sizeof(key));
+    std::memcpy(mData + slotOffset(0), &empty, sizeof(empty));
+    std::memcpy(mData + slotOffset(1), &empty, sizeof(empty));
+    if (!sync(0, mSize))
+        mData = nullptr;
+}
+
+Checkpoint::~Checkpoint()
+{
+#if RT_POSIX
+    if (mData != nullptr)
+        munmap(mData, mSize);
+    if (mFile >= 0)
+        close(mFile);
+#endif
+}
+
+bool Checkpoint::good() const
+{
+    return mData != nullptr;
+}
+
+std::size_t Checkpoint::slotOffset(std::size_t slot) const
+{
+    // slots start on 64-byte boundaries
+    std::size_t slotSize{sizeof(Slot) + mPixels * (sizeof(Colour) + sizeof(std::uint32_t))};
+    slotSize = (slotSize + 63) & ~std::size_t{63};
+    return checkpointHeaderSize + slot * slotSize;
+}
+
+Checkpoint::Slot Checkpoint::readSlot(std::size_t slot) const
+{
+    Slot header{};
+    std::memcpy(&header, mData + slotOffset(slot), sizeof(header));
+    return header;
+}
+
+bool Checkpoint::sync(std::size_t offset, std::size_t size)
+{
+#if RT_POSIX
+    // msync wants a page-aligned start
+    std::size_t page{static_cast<std::size_t>(sysconf(_SC_PAGESIZE))};
+    std::size_t begin{offset - offset % page};
+    return msync(mData + begin, offset + size - begin, MS_SYNC) == 0;
+#else
+    std::fstream file{mFilename, std::ios::binary | std::ios::in | std::ios::out};
+    file.seekp(static_cast<std::streamoff>(offset));
+    file.write(reinterpret_cast<char const*>(mData + offset), static_cast<std::streamsize>(size));
+    file.flush();
+    return static_cast<bool>(file);
+#endif
+}
+
+std::uint32_t Checkpoint::load(std::vector<Colour>& sum, std::vector<std::uint32_t>& counts) const
+{
+    sum.assign(mPixels, Colour{0, 0, 0});
+    counts.assign(mPixels, 0);
+    if (!good())
+        return 0;
+
+    Slot slots[2]{readSlot(0), readSlot(1)};
+    int newest{-1};
+    for (int i{0}; i < 2; ++i)
+    {
+        if (slots[i].valid == 1 && (newest < 0 || slots[i].generation > slots[newest].generation))
+            newest = i;
+    }
+    if (newest < 0)
+        return 0;
+
+    unsigned char const* data = mData + slotOffset(static_cast<std::size_t>(newest)) + sizeof(Slot);
+    std::memcpy(sum.data(), data, mPixels * sizeof(Colour));
+    std::memcpy(counts.data(), data + mPixels * sizeof(Colour), mPixels * sizeof(std::uint32_t));
+    return slots[newest].samplesDone;
+}
+
+bool Checkpoint::save(std::uint32_t samplesDone,
+                      std::vector<Colour> const& sum,
+                      std::vector<std::uint32_t> const& counts)
+{
+    TraceScope trace{"checkpoint"};
+    if (!good() || sum.size() != mPixels || counts.size() != mPixels)
+        return false;
+
+    // overwrite the older or invalid slot, never the newest valid one
+    Slot slots[2]{readSlot(0), readSlot(1)};
+    std::size_t target{slots[0].valid == 1 &&
+                       (slots[1].valid != 1 || slots[0].generation > slots[1].generation)};
+    Slot header{std::max(slots[0].generation, slots[1].generation) + 1, samplesDone, 0};
+
+    std::size_t offset{slotOffset(target)};
+    std::size_t dataSize{mPixels * (sizeof(Colour) + sizeof(std::uint32_t))};
+    unsigned char* data = mData + offset + sizeof(Slot);
+
+    std::memcpy(mData + offset, &header, sizeof(header));
+    if (!sync(offset, sizeof(header)))
+        return false;
+
+    std::memcpy(data, sum.data(), mPixels * sizeof(Colour));
+    std::memcpy(data + mPixels * sizeof(Colour), counts.data(), mPixels * sizeof(std::uint32_t));
+    if (!sync(offset + sizeof(Slot), dataSize))
+        return false;
+
+    header.valid = 1;
+    std::memcpy(mData + offset, &header, sizeof(header));
+    return sync(offset, sizeof(header));
+}
+
+void saveToFile(std::string const& filename,
+                std::size_t width,
+                std::size_t height,
+                std::vector<unsigned char> const& pixels)
+{
+    ScopedTimer timer{Phase::Encode};
+    TraceScope trace{"save"};
+    stbi_write_bmp(filename.c_str(),
+                   static_cast<int>(width),
+                   static_cast<int>(height),
+                   3,
+                   pixels.data());
+}
+
+void saveSampleHeatmap(std::string const& filename,
+                       std::size_t width,
+                       std::size_t height,
+                       std::vector<std::uint32_t> const& counts)
+{
+    std::uint32_t maxCount{1};
+    for (std::uint32_t n : counts)
+        maxCount = std::max(maxCount, n);
+
+    std::vector<Colour> image(counts.size());
+    for (std::size_t i{0}; i < counts.size(); ++i)
+    {
+        float v    = static_cast<float>(counts[i]) / maxCount;
+        image[i]   = Colour{v, v, v};
+    }
+
+    saveToFile(filename, width, height, image);
+}
@@ -9,8 +9,29 @@
 #include <stb_image.h>
 #include <stb_image_write.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <limits>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <typeinfo>
+#include <utility>
 #include <vector>
 
 #define M_PI 3.14159265358979323846;
@@ -25,14 +46,170 @@ void saveToFile(std::string const& filename,
                 std::size_t height,
                 std::vector<Colour> const& image);
 
+void saveToFile(std::string const& filename,
+                std::size_t width,
+                std::size_t height,
+                std::vector<unsigned char> const& pixels);
+
+// writes the per-pixel sample counts as a black (few) to white (many) image
+void saveSampleHeatmap(std::string const& filename,
+                       std::size_t width,
+                       std::size_t height,
+                       std::vector<std::uint32_t> const& counts);
+
+// reads a whole unsigned decimal command line argument no greater than max,
+// false for anything else
+bool parseArgument(char const* text, std::size_t max, std::size_t& value);
+
+// the same for a decimal number from 0 to max
+bool parseArgument(char const* text, double max, double& value);
+
+// Writes 8-bit RGB images a band of rows at a time, top row first, so the
+// whole image never has to be in memory. Files ending in .bmp are written
+// as top-down BMP (up to 4 GB), anything else as binary PPM.
+class ImageWriter
+{
+public:
+    ImageWriter(std::string const& filename, std::size_t width, std::size_t height);
+
+    bool good() const;
+
+    // rows * width * 3 bytes of RGB
+    bool writeRows(unsigned char const* pixels, std::size_t rows);
+
+    // true once every row has been written
+    bool finish();
+
+private:
+    std::ofstream mFile;
+    std::size_t mWidth;
+    std::size_t mHeight;
+    std::size_t mRowsWritten;
+    bool mBMP;
+};
+
 // Declarations
 class BRDF;
+class BVH;
 class Camera;
 class Material;
 class Light;
+class LightSampler;
+class PrimitiveStore;
+struct ShadowCache;
 class Shape;
 class Sampler;
 
+// Accumulated radiance and per-pixel sample counts of a progressive render,
+// kept in a memory-mapped file so a killed render can pick up where it
+// stopped. The file holds two slots saved alternately: a save marks the
+// older slot invalid, fills it, syncs it and only then marks it valid, so a
+// kill part-way through leaves the newer slot intact. Samplers are stateless,
+// so their whole state is the seed, the sample count and the sample index
+// the render had reached.
+class Checkpoint
+{
+public:
+    Checkpoint(std::string const& filename,
+               std::size_t width,
+               std::size_t height,
+               Sampler const& sampler);
+    ~Checkpoint();
+
+    Checkpoint(Checkpoint const&) = delete;
+    Checkpoint& operator=(Checkpoint const&) = delete;
+
+    bool good() const;
+
+    // samples per pixel taken so far, with sum and counts filled from the
+    // newest valid slot; 0 (and both zeroed) if there is none
+    std::uint32_t load(std::vector<Colour>& sum, std::vector<std::uint32_t>& counts) const;
+
+    bool save(std::uint32_t samplesDone,
+              std::vector<Colour> const& sum,
+              std::vector<std::uint32_t> const& counts);
+
+private:
+    struct Slot
+    {
+        std::uint64_t generation;
+        std::uint32_t samplesDone;
+        std::uint32_t valid;
+    };
+
+    std::size_t slotOffset(std::size_t slot) const;
+    Slot readSlot(std::size_t slot) const;
+    bool sync(std::size_t offset, std::size_t size);
+
+    std::string mFilename;
+    std::size_t mPixels;
+    std::size_t mSize;
+    unsigned char* mData;
+
+    // mapped file descriptor, or -1 with mBuffer mirroring the file where
+    // memory mapping is not available
+    int mFile;
+    std::vector<unsigned char> mBuffer;
+};
+
+struct ProgressiveSettings
+{
+	// sampler indices rendered per pass
+	int samplesPerPass{ 4 };
+
+	// written after every pass when not empty
+	std::string previewFile;
+
+	// saved every checkpointSeconds and after the last pass when not empty,
+	// and resumed from when it matches the render
+	std::string checkpointFile;
+	double checkpointSeconds{ 60.0 };
+};
+
+// How far a time-budgeted render got. Its levels run coarse to fine: one
+// sample on every 16th, 8th, 4th, 2nd pixel in each direction and then on
+// every pixel, after which each level doubles the samples per pixel up to
+// the sampler's count.
+struct Refinement
+{
+	// levels finished, 0 when the coarsest grid was cut short
+	int level;
+
+	// pixel spacing and samples per pixel of the last level finished
+	std::size_t stride;
+	std::uint32_t samples;
+};
+
+// Rectangle of pixels [x0, x1) x [y0, y1) rendered as one unit of work
+struct Tile
+{
+	std::size_t x0, y0, x1, y1;
+};
+
+struct TileStats
+{
+	Tile tile;
+	double milliseconds;
+	std::size_t thread;
+};
+
+// Tone-map operators applied after exposure. MaxNormalise divides each
+// channel by its maximum over the image (when above 1), so it has to wait
+// for every tile; the others work per pixel.
+enum class ToneMap
+{
+	Clamp,
+	MaxNormalise,
+	Reinhard,
+	ACES
+};
+
+enum class Encoding
+{
+	Linear,
+	sRGB
+};
+
 struct World
 {
 	std::size_t width{ 0 }, height{ 0 };
@@ -42,6 +219,44 @@ struct World
     std::vector<Colour> image;
     std::vector<std::shared_ptr<Light>> lights;
     std::shared_ptr<Light> ambient;
+
+	// built from scene on first render, reset it after editing scene
+	std::shared_ptr<BVH> bvh;
+
+	// render settings, 0 threads means one per hardware thread
+	std::size_t tileSize{ 32 };
+	std::size_t numThreads{ 0 };
+
+	// first row held in image, pixels and sampleCounts; streaming renders
+	// keep one band of rows at a time, full renders start at 0
+	std::size_t imageY0{ 0 };
+
+	// post-process turning image (radiance) into 8-bit RGB pixels
+	float exposure{ 1.0f };
+	ToneMap toneMap{ ToneMap::MaxNormalise };
+	Encoding encoding{ Encoding::Linear };
+	bool dither{ false };
+	std::vector<unsigned char> pixels;
+
+	// adaptive sampling, off while adaptiveMinSamples is 0: every pixel takes
+	// adaptiveMinSamples, then keeps sampling until the standard error of its
+	// luminance falls below adaptiveThreshold times its mean, or the sampler's
+	// sample count is reached. Best with a progressive sampler (Sobol, PMJ02)
+	int adaptiveMinSamples{ 0 };
+	float adaptiveThreshold{ 0.01f };
+
+	// many-light mode, off while lightSamples is 0: each shading point draws
+	// lightSamples lights from lightSampler instead of visiting every light
+	int lightSamples{ 0 };
+
+	// built from lights on first render in many-light mode, reset it after
+	// editing lights
+	std::shared_ptr<LightSampler> lightSampler;
+
+	// samples taken per pixel by the last render, and timings of the tiles
+	// of its last band or pass (all of them for renderScene)
+	std::vector<std::uint32_t> sampleCounts;
+	std::vector<TileStats> tileStats;
 };
 
 struct ShadeRec
@@ -51,13 +266,382 @@ struct ShadeRec
     float t;
     atlas::math::Normal normal;
     atlas::math::Ray<atlas::math::Vector> ray;
-    std::shared_ptr<Material> material;
-    std::shared_ptr<World> world;
+
+    // non-owning, all outlive every ShadeRec made while rendering
+    Material* material{ nullptr };
+    World const* world{ nullptr };
+    ShadowCache* shadows{ nullptr };
+
+    // sample being traced, shading draws its own sampler dimensions from it
+    std::uint64_t pixel{ 0 };
+    std::uint32_t sample{ 0 };
+};
+
+// Closest hit found so far during traversal; the ShadeRec is only filled in
+// for the final one
+struct Hit
+{
+	static constexpr std::uint32_t none{ std::numeric_limits<std::uint32_t>::max() };
+
+	float t;
+	std::uint32_t primitive;
+};
+
+// Last primitive that blocked each light, tested before a full traversal
+// since neighbouring shadow rays are usually stopped by the same one. Each
+// render thread owns one
+struct ShadowCache
+{
+	std::vector<std::uint32_t> lastOccluder;
+};
+
+// Axis-aligned bounding box
+struct BBox
+{
+	atlas::math::Point min{ std::numeric_limits<float>::max() };
+	atlas::math::Point max{ std::numeric_limits<float>::lowest() };
+
+	void expand(atlas::math::Point const& p);
+	void expand(BBox const& box);
+
+	atlas::math::Point centroid() const;
+	float surfaceArea() const;
+
+	// slab test against [0, tMax), tEntry receives the distance to the box
+	bool intersect(atlas::math::Point const& origin,
+	               atlas::math::Vector const& invDir,
+	               float tMax,
+	               float& tEntry) const;
+};
+
+// Affine transform: a linear part with columns x, y and z, then a
+// translation t
+struct Transform
+{
+	atlas::math::Vector x{ 1, 0, 0 };
+	atlas::math::Vector y{ 0, 1, 0 };
+	atlas::math::Vector z{ 0, 0, 1 };
+	atlas::math::Vector t{ 0, 0, 0 };
+
+	static Transform translate(atlas::math::Vector const& offset);
+	static Transform scale(atlas::math::Vector const& factors);
+
+	// counter-clockwise about a unit axis
+	static Transform rotate(atlas::math::Vector const& axis, float radians);
+
+	// other applied first, then this
+	Transform operator*(Transform const& other) const;
+	Transform inverse() const;
+
+	atlas::math::Point point(atlas::math::Point const& p) const;
+	atlas::math::Vector vector(atlas::math::Vector const& v) const;
+
+	// the transposed linear part applied to n; called on the inverse of a
+	// transform it takes normals through that transform, unnormalised
+	atlas::math::Normal normal(atlas::math::Normal const& n) const;
+
+	BBox bounds(BBox const& box) const;
+};
+
+
+// Work-stealing thread pool: every worker owns a deque, pops its own work
+// from the back and steals from the front of the others when it runs dry.
+
+class ThreadPool
+{
+public:
+	explicit ThreadPool(std::size_t numThreads = 0);
+	~ThreadPool();
+
+	ThreadPool(ThreadPool const&) = delete;
+	ThreadPool& operator=(ThreadPool const&) = delete;
+
+	std::size_t size() const;
+
+	void submit(std::function<void()> task);
+
+	// blocks until every submitted task has finished, running tasks on the
+	// calling thread while it waits
+	void wait();
+
+	// index of the calling worker, or size() when called from outside the pool
+	std::size_t currentWorker() const;
+
+private:
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	bool popTask(std::size_t worker, std::function<void()>& task);
+	void runTask(std::function<void()>& task);
+	void workerLoop(std::size_t worker);
+
+	std::vector<std::unique_ptr<Queue>> mQueues;
+	std::vector<std::thread> mThreads;
+	std::mutex mMutex;
+	std::condition_variable mWake;
+	std::condition_variable mDone;
+	std::atomic<std::size_t> mQueued;
+	std::atomic<std::size_t> mPending;
+	std::atomic<std::size_t> mNext;
+	bool mStop;
 };
 
+// Render telemetry: per-thread counters and phase timers summed into a JSON
+// report. Built in unless RT_TELEMETRY is defined to 0, which it is by
+// default with NDEBUG; then every hook below is an empty inline function
+// and ScopedTimer an empty object.
+#ifndef RT_TELEMETRY
+#ifdef NDEBUG
+#define RT_TELEMETRY 0
+#else
+#define RT_TELEMETRY 1
+#endif
+#endif
+
+enum class Counter : std::size_t
+{
+	PrimaryRays,
+	ShadowRays,
+	ShadowCacheHits, // shadow rays stopped by the light's last occluder
+	NodeTests,       // BVH nodes tested, eight boxes at a time when wide
+	PrimitiveTests,  // primitives tested in BVH leaves
+	ShapeQueries,    // calls into opaque Shapes kept in the flat store
+	ShadeCalls,
+	Count
+};
+
+// Timers of different phases nest: an inner phase's time is taken out of
+// the one around it, so the phases add up to the time measured
+enum class Phase : std::size_t
+{
+	Setup,  // building or loading a scene
+	Build,  // acceleration structures
+	Render,
+	Encode, // writing images
+	Count
+};
+
+class Telemetry
+{
+public:
+#if RT_TELEMETRY
+	static void count(Counter counter, std::uint64_t n = 1)
+	{
+		std::atomic<std::uint64_t>& value = block().counters[static_cast<std::size_t>(counter)];
+		value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	static void addTime(Phase phase, std::chrono::nanoseconds time);
+
+	// counters and phase times summed over every thread, as JSON
+	static std::string report();
+
+	// zeroes everything; counts from threads still running may be lost
+	static void reset();
+#else
+	static void count(Counter, std::uint64_t = 1) {}
+	static void addTime(Phase, std::chrono::nanoseconds) {}
+	static std::string report() { return "{ \"telemetry\": false }\n"; }
+	static void reset() {}
+#endif
+
+	static bool writeReport(std::string const& filename);
+
+#if RT_TELEMETRY
+private:
+	// one per thread while it runs, reused by later threads so the totals
+	// keep what exited threads counted
+	struct Block
+	{
+		std::atomic<std::uint64_t> counters[static_cast<std::size_t>(Counter::Count)];
+		std::atomic<std::uint64_t> nanoseconds[static_cast<std::size_t>(Phase::Count)];
+		std::atomic<std::uint64_t> calls[static_cast<std::size_t>(Phase::Count)];
+		bool inUse;
+	};
+
+	struct Registry
+	{
+		std::mutex mutex;
+		std::vector<std::unique_ptr<Block>> blocks;
+	};
+
+	static Block& block()
+	{
+		return mThreadBlock != nullptr ? *mThreadBlock : attach();
+	}
+
+	static Block& attach();
+	static void detach();
+
+	static inline thread_local Block* mThreadBlock{ nullptr };
+	static inline Registry mRegistry;
+#endif
+};
+
+// Adds the time until it goes out of scope to a phase
+class ScopedTimer
+{
+public:
+#if RT_TELEMETRY
+	explicit ScopedTimer(Phase phase);
+	~ScopedTimer();
+
+	ScopedTimer(ScopedTimer const&) = delete;
+	ScopedTimer& operator=(ScopedTimer const&) = delete;
+
+private:
+	Phase mPhase;
+	std::chrono::steady_clock::time_point mStart;
+	std::chrono::nanoseconds mInner;
+	ScopedTimer* mOuter;
+
+	static inline thread_local ScopedTimer* mInnermost{ nullptr };
+#else
+	explicit ScopedTimer(Phase) {}
+#endif
+};
+
+// Timeline of render work in Chrome trace-event JSON, for Perfetto or
+// chrome://tracing. While tracing is on, each TraceScope records one event
+// into a ring buffer owned by the calling thread, overwriting the oldest
+// once it is full. Only a thread's first event takes a lock. Buffers
+// outlive their threads and go to the next thread that starts, so a short
+// lived pool's workers share tracks with the ones before them.
+class Tracer
+{
+public:
+	// clears any previous trace and starts recording, keeping the last
+	// eventsPerThread events (rounded up to a power of two) of each thread.
+	// Call it while no other thread is tracing
+	static void start(std::size_t eventsPerThread = std::size_t{ 1 } << 16);
+	static void stop();
+
+	static bool enabled()
+	{
+		return mEnabled.load(std::memory_order_relaxed);
+	}
+
+	// x and y are shown as arguments when not negative
+	static void record(char const* name,
+	                   std::chrono::steady_clock::time_point start,
+	                   std::chrono::steady_clock::time_point end,
+	                   std::int32_t x = -1,
+	                   std::int32_t y = -1);
+
+	// the events recorded since start; call it once traced work is done
+	static bool write(std::string const& filename);
+
+private:
+	struct Event
+	{
+		char const* name;
+		std::int64_t start; // nanoseconds since start()
+		std::int64_t duration;
+		std::int32_t x;
+		std::int32_t y;
+	};
+
+	struct Buffer
+	{
+		std::vector<Event> events;
+		std::atomic<std::uint64_t> written;
+		std::size_t track;
+		bool inUse;
+	};
+
+	struct Registry
+	{
+		std::mutex mutex;
+		std::vector<std::unique_ptr<Buffer>> buffers;
+		std::chrono::steady_clock::time_point epoch;
+	};
+
+	static Buffer& attach();
+	static void detach();
+
+	static inline std::atomic<bool> mEnabled{ false };
+	static inline thread_local Buffer* mThreadBuffer{ nullptr };
+	static inline Registry mRegistry;
+
+	// events per buffer, set by start under the registry's mutex
+	static inline std::size_t mCapacity{ std::size_t{ 1 } << 16 };
+};
+
+// Records its lifetime as an event named name while tracing is on; name
+// must outlive the trace
+class TraceScope
+{
+public:
+	explicit TraceScope(char const* name, std::int32_t x = -1, std::int32_t y = -1);
+	~TraceScope();
+
+	TraceScope(TraceScope const&) = delete;
+	TraceScope& operator=(TraceScope const&) = delete;
+
+private:
+	char const* mName;
+	std::int32_t mX;
+	std::int32_t mY;
+	bool mActive;
+	std::chrono::steady_clock::time_point mStart;
+};
+
+std::vector<Tile> makeTiles(std::size_t width, std::size_t height, std::size_t tileSize);
+
+void printTileStats(std::vector<TileStats> const& stats);
+
+// encoded value in [0, 255] for linear values i / (size - 1) in [0, 1]
+std::vector<float> makeEncodingLUT(Encoding encoding, std::size_t size = 4096);
+
+// exposure and tone map of one tile of world.image, scaled per channel,
+// then encoding through lut, dithering and quantisation into world.pixels
+void postProcessTile(World& world,
+                     Tile const& tile,
+                     Colour const& scale,
+                     std::vector<float> const& lut);
+
+// Primary rays as structure of arrays, so cameras can build and normalise
+// a batch of directions at once. The caller fills in the pixel and sampler
+// index of the first count rays, Camera::generateRays their origins and
+// unit directions; every lane is computed, those past count are unused
+struct RayBatch
+{
+	static constexpr std::size_t capacity{ 16 };
+
+	alignas(32) float ox[capacity];
+	alignas(32) float oy[capacity];
+	alignas(32) float oz[capacity];
+	alignas(32) float dx[capacity];
+	alignas(32) float dy[capacity];
+	alignas(32) float dz[capacity];
+
+	std::uint32_t row[capacity];
+	std::uint32_t column[capacity];
+	std::uint32_t sample[capacity];
+	std::size_t count;
+
+	atlas::math::Ray<atlas::math::Vector> ray(std::size_t i) const;
+};
+
+// Rays of a tile for sampler indices [firstSample, firstSample + numSamples)
+// of every pixel, row by row with each pixel's samples together
+struct TileRays
+{
+	Tile tile;
+	std::uint32_t firstSample;
+	std::uint32_t numSamples;
+	std::vector<RayBatch> batches;
+
+	atlas::math::Ray<atlas::math::Vector> ray(std::size_t r, std::size_t c, std::uint32_t j) const;
+};
 
 // Abstract classes defining the interfaces for concrete entities
 
+// Cameras only map samples to rays; tracing, sampling strategy and
+// post-processing are shared by every camera through the render functions
 class Camera
 {
 public:
@@ -65,7 +649,28 @@ public:
 
 	virtual ~Camera() = default;
 
-	virtual void renderScene(std::shared_ptr<World> world) const = 0;
+	virtual void renderScene(std::shared_ptr<World> world) const;
+
+	// renders bands of whole rows straight into writer, keeping about
+	// memoryBudget bytes of image data alive; max-normalise takes its
+	// maximum from a low-resolution preview instead of the full image
+	bool renderStreaming(std::shared_ptr<World> world,
+	                     ImageWriter& writer,
+	                     std::size_t memoryBudget) const;
+
+	// renders settings.samplesPerPass samples per pixel at a time into an
+	// accumulation buffer, post-processing the running average into
+	// world->pixels after each pass; false if a checkpoint or preview could
+	// not be written
+	bool renderProgressive(std::shared_ptr<World> world,
+	                       ProgressiveSettings const& settings) const;
+
+	// renders coarse to fine until budget runs out, checking the clock
+	// before every sample; pixels not reached take the nearest coarser
+	// sample, then the image is post-processed into world->pixels. Time
+	// for that last step, measured on one tile first, comes out of budget
+	Refinement renderTimed(std::shared_ptr<World> world,
+	                       std::chrono::steady_clock::duration budget) const;
 
 	void setEye(atlas::math::Point const& eye);
 
@@ -75,35 +680,142 @@ public:
 
 	void computeUVW();
 
+	// magnifies the image, pixels span 1 / zoom units of the view plane
+	void setZoom(float zoom);
+
+	// origins and unit directions of batch's rays; a zero direction marks a
+	// sample that sees nothing, which stays black
+	virtual void generateRays(World const& world, RayBatch& batch) const = 0;
+
+	// copy of the camera, previews render one at a lower zoom
+	virtual std::unique_ptr<Camera> clone() const = 0;
+
 protected:
+	// view-plane points of batch's samples, in pixels from the image
+	// centre; lanes past batch.count are 0
+	void pixelPoints(World const& world, RayBatch const& batch, float* x, float* y) const;
+
 	atlas::math::Point mEye;
 	atlas::math::Point mLookAt;
 	atlas::math::Point mUp;
 	atlas::math::Vector mU, mV, mW;
+	float mZoom;
+
+private:
+	// renders rows [y0, y1) into world's buffers and post-processes them;
+	// a null scale normalises by the maximum of these rows
+	// takes sampler indices [firstSample, firstSample + numSamples)
+	void renderRows(std::shared_ptr<World> const& world,
+	                std::size_t y0,
+	                std::size_t y1,
+	                std::uint32_t firstSample,
+	                int numSamples,
+	                ThreadPool& pool,
+	                std::vector<ShadowCache>& shadowCaches,
+	                Colour const* scale) const;
+
+	// per-channel maximum radiance (at least 1) of a small preview render
+	Colour previewMaximum(std::shared_ptr<World> const& world) const;
+
+	// renders one tile into world->image and returns its per-channel maximum;
+	// shadows belongs to the calling thread
+	Colour renderTile(std::shared_ptr<World> const& world,
+	                  Tile const& tile,
+	                  std::uint32_t firstSample,
+	                  int numSamples,
+	                  ShadowCache& shadows) const;
+
+	// rays of tile for sampler indices [firstSample, firstSample + numSamples)
+	void generateTileRays(World const& world,
+	                      Tile const& tile,
+	                      std::uint32_t firstSample,
+	                      std::uint32_t numSamples,
+	                      TileRays& rays) const;
+
+	// radiance of one sample through pixel (r, c)
+	Colour samplePixel(World const& world,
+	                   std::size_t r,
+	                   std::size_t c,
+	                   std::uint32_t sample,
+	                   ShadowCache& shadows) const;
+
+	// radiance along a primary ray of sample index sample in pixel
+	Colour trace(World const& world,
+	             atlas::math::Ray<atlas::math::Vector> const& ray,
+	             std::uint64_t pixel,
+	             std::uint32_t sample,
+	             ShadowCache& shadows) const;
 };
 
+// Samplers are stateless: every sample is a pure function of the seed, the
+// pixel, the sample index and the dimension, computed with a counter-based
+// hash. Any thread can draw any sample without shared state, and a given
+// seed always produces the same image.
 class Sampler
 {
 public:
-    Sampler(int numSamples, int numSets);
+    Sampler(int numSamples, std::uint32_t seed);
     virtual ~Sampler() = default;
 
     int getNumSamples() const;
 
-    void setupShuffledIndeces();
-
-    virtual void generateSamples() = 0;
-
-    atlas::math::Point sampleUnitSquare();
+    void setSeed(std::uint32_t seed);
+    std::uint32_t getSeed() const;
+
+    // dimensions the renderer draws from: the camera's first, so lights can
+    // take as many as they need after them
+    static constexpr std::uint32_t pixelDimension{ 0 };
+    static constexpr std::uint32_t lensDimension{ 1 };
+    static constexpr std::uint32_t firstLightDimension{ 2 };
+
+    // sample index of pixel in [0, 1)^2; each dimension is an independent
+    // 2D pattern
+    virtual atlas::math::Point sampleUnitSquare(std::uint64_t pixel,
+                                                std::uint32_t index,
+                                                std::uint32_t dimension = 0) const = 0;
+
+    // sampleUnitSquare of count (pixel, index) pairs in one call, into x
+    // and y; the samplers here override it with sampleEach, so it costs one
+    // virtual call a batch instead of one a sample
+    virtual void sampleUnitSquares(std::uint64_t const* pixels,
+                                   std::uint32_t const* indices,
+                                   std::size_t count,
+                                   std::uint32_t dimension,
+                                   float* x,
+                                   float* y) const;
+
+    // uniform number in [0, 1) from the same counter-based stream
+    float random(std::uint64_t pixel, std::uint32_t index, std::uint32_t dimension) const;
+
+    // counter-based hash of (seed, pixel, index, dimension), PCG output mix
+    // chained over the key words
+    static std::uint32_t hash(std::uint32_t seed,
+                              std::uint64_t pixel,
+                              std::uint32_t index,
+                              std::uint32_t dimension);
 
 protected:
-    std::vector<atlas::math::Point> mSamples;
-    std::vector<int> mShuffledIndeces;
+    // sampleUnitSquares through S's own sampleUnitSquare, called by name so
+    // it can inline
+    template <typename S>
+    void sampleEach(std::uint64_t const* pixels,
+                    std::uint32_t const* indices,
+                    std::size_t count,
+                    std::uint32_t dimension,
+                    float* x,
+                    float* y) const
+    {
+        S const& sampler{ static_cast<S const&>(*this) };
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            atlas::math::Point p{ sampler.S::sampleUnitSquare(pixels[i], indices[i], dimension) };
+            x[i] = p.x;
+            y[i] = p.y;
+        }
+    }
 
     int mNumSamples;
-    int mNumSets;
-    unsigned long mCount;
-    int mJump;
+    std::uint32_t mSeed;
 };
 
 class Shape
@@ -117,6 +829,25 @@ public:
     virtual bool hit(atlas::math::Ray<atlas::math::Vector> const& ray,
                      ShadeRec& sr) const = 0;
 
+    // bounds used by the acceleration structure, unbounded shapes are tested
+    // against every ray instead
+    virtual BBox getBBox() const = 0;
+    virtual bool isBounded() const;
+
+    // distance-only queries for shapes kept opaque in the flat store:
+    // closestHit lowers t to a nearer intersection and returns true if
+    // there was one, occluded is true if anything intersects ray in
+    // [0, tMax). Both default to hit with a scratch record
+    virtual bool closestHit(atlas::math::Ray<atlas::math::Vector> const& ray,
+                            float& t) const;
+    virtual bool occluded(atlas::math::Ray<atlas::math::Vector> const& ray,
+                          float tMax) const;
+
+    // adds the shape's geometry to the flat store rendering runs on, shape
+    // is its index in the scene; shapes without a flat form are added as
+    // opaque primitives that are still tested through hit
+    virtual void flatten(PrimitiveStore& store, std::uint32_t shape) const;
+
     void setColour(Colour const& col);
 
     Colour getColour() const;
@@ -194,6 +925,9 @@ class Matte : public Material {
 		void set_cd(const Colour& c);
 		virtual Colour shade(ShadeRec& sr);
 	private:
+		// diffuse reflection of light j, zero when it faces away or is blocked
+		Colour direct(ShadeRec& sr, atlas::math::Vector const& wo, std::size_t j) const;
+
 		std::shared_ptr<Lambertian> ambient_brdf;
 		std::shared_ptr<Lambertian> diffuse_brdf;
 };
@@ -211,6 +945,20 @@ public:
     void scaleRadiance(float b);
     void setColour(Colour const& c);
 
+    void setShadows(bool shadows);
+    bool castsShadows() const;
+
+    // emitted power and extent, used to pick lights in many-light mode; the
+    // base light has no position so its box is unbounded
+    virtual float power() const;
+    virtual BBox getBBox() const;
+
+    // true if anything blocks ray before it reaches the light; lastOccluder
+    // is tested first and receives the blocker found
+    virtual bool inShadow(atlas::math::Ray<atlas::math::Vector> const& ray,
+                          ShadeRec const& sr,
+                          std::uint32_t& lastOccluder) const;
+
 protected:
     Colour mColour;
     float mRadiance;
@@ -239,10 +987,76 @@ public:
 	void setColour(Colour const& c);
 	void setLocation(atlas::math::Point location);
 
+	bool inShadow(atlas::math::Ray<atlas::math::Vector> const& ray,
+	              ShadeRec const& sr,
+	              std::uint32_t& lastOccluder) const;
+
+	BBox getBBox() const;
+
 private:
 	atlas::math::Point mLocation;
 };
 
+// Draws one light at a time for many-light shading. Power picks lights in
+// proportion to their power through an alias table. Hierarchy walks a
+// bounding tree over the lights, weighing each subtree by its power and by
+// how well it can face the shading point, so lights behind the surface are
+// skipped. PointLight has no distance falloff, so distance plays no part.
+// Every light that can contribute keeps a non-zero probability and sample
+// returns it, so dividing by pdf keeps the estimate unbiased.
+class LightSampler
+{
+public:
+	enum class Strategy
+	{
+		Power,
+		Hierarchy
+	};
+
+	static constexpr std::uint32_t none{ std::numeric_limits<std::uint32_t>::max() };
+
+	explicit LightSampler(std::vector<std::shared_ptr<Light>> const& lights,
+	                      Strategy strategy = Strategy::Hierarchy);
+
+	// index into the lights for u in [0, 1), or none when no light can reach
+	// the point; pdf receives the probability of the choice
+	std::uint32_t sample(atlas::math::Point const& p,
+	                     Normal const& n,
+	                     float u,
+	                     float& pdf) const;
+
+	Strategy getStrategy() const;
+
+	// interior nodes have count == 0 and children at offset and offset + 1,
+	// leaves hold the single light mOrder[offset]
+	struct Node
+	{
+		BBox bounds;
+		float power;
+		std::uint32_t offset;
+		std::uint32_t count;
+	};
+
+private:
+	void build(std::uint32_t node, std::uint32_t begin, std::uint32_t end);
+
+	// upper bound on what the subtree can add at p
+	float importance(Node const& node, atlas::math::Point const& p, Normal const& n) const;
+
+	std::vector<BBox> mBounds;
+	std::vector<float> mPower;
+
+	// alias table, bucket i keeps light i with mProbability[i] and gives the
+	// rest to mAlias[i]
+	std::vector<float> mProbability;
+	std::vector<std::uint32_t> mAlias;
+	float mTotalPower;
+
+	std::vector<Node> mNodes;
+	std::vector<std::uint32_t> mOrder;
+	Strategy mStrategy;
+};
+
 
 // CAMERAS
 
@@ -253,14 +1067,69 @@ public:
 	Pinhole();
 
 	void setDistance(float distance);
-	void setZoom(float zoom);
 
 	atlas::math::Vector rayDirection(atlas::math::Point const& p) const;
-	void renderScene(std::shared_ptr<World> world) const;
+	void generateRays(World const& world, RayBatch& batch) const;
+	std::unique_ptr<Camera> clone() const;
+
+	// renders a StaticScene on the calling thread with sampler's own
+	// sampleUnitSquare, into world's image and pixels at world's size and
+	// post-process settings; world's shapes, lights and sampler are unused
+	template <typename Scene, typename SamplerType>
+	void renderStatic(Scene const& scene, SamplerType const& sampler, World& world) const;
 
 private:
 	float mDistance;
-	float mZoom;
+};
+
+// Parallel rays along -w, from the view plane through the eye
+class Orthographic : public Camera
+{
+public:
+	Orthographic();
+
+	void generateRays(World const& world, RayBatch& batch) const;
+	std::unique_ptr<Camera> clone() const;
+};
+
+// Pinhole with a lens of some radius: rays leave from a point on the lens
+// and pass through where the pinhole ray meets the focal plane, so only
+// that plane is sharp. Lens samples come from Sampler::lensDimension
+class ThinLens : public Camera
+{
+public:
+	ThinLens();
+
+	void setDistance(float distance);
+	void setFocalDistance(float focalDistance);
+	void setLensRadius(float lensRadius);
+
+	void generateRays(World const& world, RayBatch& batch) const;
+	std::unique_ptr<Camera> clone() const;
+
+private:
+	float mDistance;
+	float mFocalDistance;
+	float mLensRadius;
+};
+
+// Equidistant fisheye: the angle from -w grows linearly with the distance
+// from the image centre, reaching half the field of view at the edge of
+// the disc fitting the image's shorter side. Samples outside it see
+// nothing. The field of view takes the place of zoom, which is unused
+class Fisheye : public Camera
+{
+public:
+	Fisheye();
+
+	// full field of view across the disc, up to 360 degrees
+	void setFieldOfView(float degrees);
+
+	void generateRays(World const& world, RayBatch& batch) const;
+	std::unique_ptr<Camera> clone() const;
+
+private:
+	float mHalfAngle;
 };
 
 
@@ -268,6 +1137,92 @@ private:
 
 
 
+// ray intersections shared by the Shape classes, the flat PrimitiveStore and
+// the kernel benchmarks; true with the distance in tMin on a hit
+inline bool intersectPlane(atlas::math::Point const& point,
+	Normal const& normal,
+	atlas::math::Ray<atlas::math::Vector> const& ray,
+	float& tMin)
+{
+	float denom{ glm::dot(normal, ray.d) };
+
+	if (std::fabs(denom) > 0.0001f) {
+		tMin = glm::dot(point - ray.o, normal) / denom;
+		if (tMin >= 0) return true;
+	}
+
+	return false;
+}
+
+inline bool intersectTriangle(atlas::math::Point const& a,
+	atlas::math::Point const& b,
+	atlas::math::Point const& c,
+	atlas::math::Vector const& normal,
+	atlas::math::Ray<atlas::math::Vector> const& ray,
+	float& tMin)
+{
+	float denom{ glm::dot(normal, ray.d) };
+
+	if (std::fabs(denom) > 0.0001f) {
+		tMin = glm::dot(a - ray.o, normal) / denom;
+		if (tMin >= 0) {
+			atlas::math::Vector P = ray.o + tMin * ray.d;
+
+			atlas::math::Vector e1 = b - a;
+			atlas::math::Vector e2 = c - b;
+			atlas::math::Vector e3 = a - c;
+
+			atlas::math::Vector c1 = P - a;
+			atlas::math::Vector c2 = P - b;
+			atlas::math::Vector c3 = P - c;
+
+			if (glm::dot(normal, glm::cross(e1, c1)) > 0 &&
+				glm::dot(normal, glm::cross(e2, c2)) > 0 &&
+				glm::dot(normal, glm::cross(e3, c3)) > 0)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+inline bool intersectSphere(atlas::math::Point const& centre,
+	float radiusSqr,
+	atlas::math::Ray<atlas::math::Vector> const& ray,
+	float& tMin)
+{
+    const auto tmp{ray.o - centre};
+    const auto a{glm::dot(ray.d, ray.d)};
+    const auto b{2.0f * glm::dot(ray.d, tmp)};
+    const auto c{glm::dot(tmp, tmp) - radiusSqr};
+    const auto disc{(b * b) - (4.0f * a * c)};
+
+    if (atlas::core::geq(disc, 0.0f))
+    {
+        const float kEpsilon{0.01f};
+        const float e{std::sqrt(disc)};
+        const float denom{2.0f * a};
+
+        // Look at the negative root first
+        float t = (-b - e) / denom;
+        if (atlas::core::geq(t, kEpsilon))
+        {
+            tMin = t;
+            return true;
+        }
+
+        // Now the positive root
+        t = (-b + e) / denom;
+        if (atlas::core::geq(t, kEpsilon))
+        {
+            tMin = t;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 class Plane : public Shape
 {
 public:
@@ -275,6 +1230,10 @@ public:
 
 	bool hit(atlas::math::Ray<atlas::math::Vector> const& ray, ShadeRec& trace_data) const;
 
+	BBox getBBox() const;
+	bool isBounded() const;
+	void flatten(PrimitiveStore& store, std::uint32_t shape) const;
+
 protected:
 	bool intersectRay(atlas::math::Ray<atlas::math::Vector> const& ray,
 		float& tMin) const;
@@ -291,6 +1250,9 @@ public:
 
 	bool hit(atlas::math::Ray<atlas::math::Vector> const& ray, ShadeRec& trace_data) const;
 
+	BBox getBBox() const;
+	void flatten(PrimitiveStore& store, std::uint32_t shape) const;
+
 protected:
 	bool intersectRay(atlas::math::Ray<atlas::math::Vector> const& ray,
 		float& tMin) const;
@@ -298,6 +1260,7 @@ protected:
 	atlas::math::Point mA;
 	atlas::math::Point mB;
 	atlas::math::Point mC;
+	Normal mNormal;
 };
 
 class Sphere : public Shape
@@ -308,6 +1271,9 @@ public:
     bool hit(atlas::math::Ray<atlas::math::Vector> const& ray,
              ShadeRec& sr) const;
 
+    BBox getBBox() const;
+    void flatten(PrimitiveStore& store, std::uint32_t shape) const;
+
 private:
     bool intersectRay(atlas::math::Ray<atlas::math::Vector> const& ray,
                       float& tMin) const;
@@ -317,6 +1283,457 @@ private:
     float mRadiusSqr;
 };
 
+// Triangles sharing indexed vertex and normal arrays, with a material index
+// per face: about 40 bytes a flat face with the shared vertices, in a
+// handful of allocations. Faces keep their edges precomputed; the store and
+// the BVH refer to these arrays rather than copying the triangles out, and
+// only meshes with vertex normals hold normals and their indices.
+class TriangleMesh : public Shape
+{
+public:
+	static constexpr std::uint32_t none{ std::numeric_limits<std::uint32_t>::max() };
+
+	struct Face
+	{
+		std::uint32_t vertex[3];
+		std::uint32_t normal[3]; // all none when the face has no normals
+		std::uint32_t material;  // index into the mesh's materials
+	};
+
+	TriangleMesh(std::vector<atlas::math::Point> vertices,
+	             std::vector<Normal> normals,
+	             std::vector<Face> const& faces);
+
+	// reads the vertices, normals, faces and usemtl groups of an OBJ file.
+	// The file is split into chunks at line ends that numThreads threads
+	// parse in place, without copying lines into strings. Faces take
+	// material indices in order of first use of their usemtl name, the
+	// names go to materialNames; faces before any usemtl get none. Null if
+	// the file cannot be read, has no faces or refers to missing vertices.
+	static std::shared_ptr<TriangleMesh> loadOBJ(std::string const& filename,
+	                                             std::vector<std::string>* materialNames = nullptr,
+	                                             std::size_t numThreads = 0);
+
+	// material of the faces with index i; faces with no material here
+	// use the mesh's own
+	void setMaterials(std::vector<std::shared_ptr<Material>> const& materials);
+
+	std::size_t numVertices() const;
+	std::size_t numFaces() const;
+
+	// bytes held by the mesh's arrays
+	std::size_t memoryUsed() const;
+
+	bool hit(atlas::math::Ray<atlas::math::Vector> const& ray, ShadeRec& sr) const;
+
+	BBox getBBox() const;
+	void flatten(PrimitiveStore& store, std::uint32_t shape) const;
+
+	// Moller-Trumbore with the face's precomputed edges, u and v weight
+	// its second and third vertex
+	bool intersectFace(std::size_t face,
+	                   atlas::math::Ray<atlas::math::Vector> const& ray,
+	                   float& t,
+	                   float& u,
+	                   float& v) const;
+
+	// unit shading normal at u, v, interpolated from the vertex normals
+	// when the face has them
+	Normal faceNormal(std::size_t face, float u, float v) const;
+
+	// index into the mesh's materials, or none
+	std::uint32_t faceMaterial(std::size_t face) const;
+	BBox faceBBox(std::size_t face) const;
+
+	// the shared arrays as read by the wide kernels: three floats a vertex,
+	// three vertex indices a face and the six components of its edges
+	float const* vertexData() const;
+	std::uint32_t const* indexData() const;
+	float const* edgeData() const;
+
+protected:
+	bool intersectRay(atlas::math::Ray<atlas::math::Vector> const& ray,
+		float& tMin) const;
+
+private:
+	std::vector<atlas::math::Point> mVertices;
+	std::vector<std::uint32_t> mIndices;
+
+	// b - a and c - a of face i at 2i and 2i + 1
+	std::vector<atlas::math::Vector> mEdges;
+
+	// empty unless some face has vertex normals, those of face i at 3i
+	// (none for faces without)
+	std::vector<Normal> mNormals;
+	std::vector<std::uint32_t> mNormalIndices;
+
+	// empty unless some face has a material
+	std::vector<std::uint32_t> mFaceMaterials;
+
+	std::vector<std::shared_ptr<Material>> mMaterials;
+	BBox mBounds;
+};
+
+// A prototype placed in the scene by an affine transform. The prototype is a
+// BVH over shapes in its own object space and may be shared by any number of
+// instances, so memory grows with the prototypes rather than the copies.
+// Rays are taken into object space without renormalising, which keeps t the
+// same in both spaces. The scene's BVH holds instances as opaque primitives,
+// giving a two-level hierarchy, and prototypes may hold instances in turn.
+class Instance : public Shape
+{
+public:
+	Instance(std::shared_ptr<BVH const> prototype, Transform const& transform);
+
+	// a material set on the instance replaces the prototype's materials and
+	// colours
+	bool hit(atlas::math::Ray<atlas::math::Vector> const& ray, ShadeRec& sr) const;
+	bool closestHit(atlas::math::Ray<atlas::math::Vector> const& ray, float& t) const;
+	bool occluded(atlas::math::Ray<atlas::math::Vector> const& ray, float tMax) const;
+
+	BBox getBBox() const;
+	bool isBounded() const;
+
+	std::shared_ptr<BVH const> const& getPrototype() const;
+	Transform const& getTransform() const;
+
+protected:
+	bool intersectRay(atlas::math::Ray<atlas::math::Vector> const& ray,
+		float& tMin) const;
+
+private:
+	atlas::math::Ray<atlas::math::Vector> toObject(atlas::math::Ray<atlas::math::Vector> const& ray) const;
+
+	std::shared_ptr<BVH const> mPrototype;
+	Transform mTransform;
+	Transform mInverse;
+	BBox mBounds;
+	bool mBounded;
+};
+
+
+
+// ACCELERATION STRUCTURES
+
+
+
+// Flat copy of a scene with every primitive type kept in its own contiguous
+// structure-of-arrays, so intersection loops run per type without pointer
+// chasing or virtual calls. Primitives are named by an id holding the type in
+// the top three bits and the index within that type below.
+class PrimitiveStore
+{
+public:
+	enum class Type : std::uint32_t
+	{
+		Sphere,
+		Plane,
+		Triangle,
+		Mesh,
+		Other
+	};
+
+	struct Spheres
+	{
+		std::vector<float> cx, cy, cz, radius, r2;
+		std::vector<std::uint32_t> shape;
+	};
+
+	struct Planes
+	{
+		std::vector<float> px, py, pz, nx, ny, nz;
+		std::vector<std::uint32_t> shape;
+	};
+
+	// the normal is cross(a - b, a - c) as Triangle computes it, or its
+	// unit length for triangles with vertex normals. Those have an index
+	// into vertexNormals (three per triangle) in smooth, which stays empty
+	// until the first one is added and holds Hit::none for the others.
+	struct Triangles
+	{
+		std::vector<float> ax, ay, az, bx, by, bz, cx, cy, cz, nx, ny, nz;
+		std::vector<std::uint32_t> shape;
+		std::vector<std::uint32_t> smooth;
+		std::vector<Normal> vertexNormals;
+	};
+
+	// faces of TriangleMeshes, left in the meshes' own arrays. Mesh i has
+	// the faces from first[i] on in the type's index space; faces with a
+	// material take its shape from surfaces, starting at firstSurface[i],
+	// and the others the mesh's shape
+	struct Meshes
+	{
+		std::vector<TriangleMesh const*> mesh;
+		std::vector<std::uint32_t> first, shape, firstSurface;
+		std::vector<std::uint32_t> surfaces;
+		std::uint32_t numFaces{ 0 };
+	};
+
+	PrimitiveStore() = default;
+	explicit PrimitiveStore(std::vector<std::shared_ptr<Shape>> const& scene);
+
+	static std::uint32_t makeId(Type type, std::uint32_t index);
+	static Type typeOf(std::uint32_t id);
+	static std::uint32_t indexOf(std::uint32_t id);
+
+	void addSphere(atlas::math::Point const& centre, float radius, std::uint32_t shape);
+	void addPlane(atlas::math::Point const& point, Normal const& normal, std::uint32_t shape);
+	void addTriangle(atlas::math::Point const& a,
+	                 atlas::math::Point const& b,
+	                 atlas::math::Point const& c,
+	                 std::uint32_t shape);
+
+	// shading normal interpolated from one normal per vertex
+	void addTriangle(atlas::math::Point const& a,
+	                 atlas::math::Point const& b,
+	                 atlas::math::Point const& c,
+	                 Normal const& na,
+	                 Normal const& nb,
+	                 Normal const& nc,
+	                 std::uint32_t shape);
+	void addOther(std::uint32_t shape);
+
+	// every face of mesh, which must outlive the store, with surfaces[i]
+	// the shape of the faces using the mesh's material i
+	void addMesh(TriangleMesh const& mesh, std::vector<std::uint32_t> const& surfaces, std::uint32_t shape);
+
+	// surface data for primitives added without a Shape, returns the shape
+	// index to add them with
+	std::uint32_t addSurface(Colour const& colour, std::shared_ptr<Material> const& material);
+
+	void reserve(std::size_t spheres, std::size_t planes, std::size_t triangles);
+
+	// bytes held by the store's arrays, not counting the shapes it refers to
+	std::size_t memoryUsed() const;
+
+	// true when every primitive has finite bounds
+	bool isBounded() const;
+
+	// ids of every primitive with finite bounds
+	std::vector<std::uint32_t> boundedPrimitives() const;
+	BBox getBBox(std::uint32_t id) const;
+
+	// closest hit over all primitives, one loop per type; hit is updated
+	// and true returned when something closer than hit.t is found
+	bool closestHit(atlas::math::Ray<atlas::math::Vector> const& ray, Hit& hit) const;
+
+	// closest hit over the unbounded primitives only
+	bool closestHitUnbounded(atlas::math::Ray<atlas::math::Vector> const& ray, Hit& hit) const;
+
+	// closest hit against a single primitive
+	bool intersect(std::uint32_t id, atlas::math::Ray<atlas::math::Vector> const& ray, Hit& hit) const;
+
+	// any-hit queries: true if something intersects ray in [0, tMax), the
+	// first blocker found goes to occluder
+	bool occludes(std::uint32_t id, atlas::math::Ray<atlas::math::Vector> const& ray, float tMax) const;
+	bool occludedUnbounded(atlas::math::Ray<atlas::math::Vector> const& ray,
+	                       float tMax,
+	                       std::uint32_t& occluder) const;
+	bool occluded(atlas::math::Ray<atlas::math::Vector> const& ray,
+	              float tMax,
+	              std::uint32_t& occluder) const;
+
+	// surface data for a hit, computed once per ray
+	void fillShadeRec(Hit const& hit,
+	                  atlas::math::Ray<atlas::math::Vector> const& ray,
+	                  ShadeRec& sr) const;
+
+	// closestHit followed by fillShadeRec
+	bool hit(atlas::math::Ray<atlas::math::Vector> const& ray, ShadeRec& sr) const;
+
+	Spheres const& spheres() const;
+	Planes const& planes() const;
+	Triangles const& triangles() const;
+	Meshes const& meshes() const;
+
+	// mesh holding face index i of the Mesh type
+	std::uint32_t meshOf(std::uint32_t i) const;
+
+private:
+	Spheres mSpheres;
+	Planes mPlanes;
+	Triangles mTriangles;
+	Meshes mMeshes;
+	std::vector<std::uint32_t> mOthers;
+
+	// indices into mOthers of the shapes without bounds, which every ray
+	// is tested against
+	std::vector<std::uint32_t> mUnbounded;
+
+	// per scene shape
+	std::vector<std::shared_ptr<Shape>> mScene;
+	std::vector<Colour> mColours;
+	std::vector<Material*> mMaterials;
+
+	// keeps the materials of addSurface alive, Shapes own the others
+	std::vector<std::shared_ptr<Material>> mSurfaces;
+};
+
+// Node of the collapsed 8-wide hierarchy. Child bounds are stored as
+// structure of arrays so all eight boxes are tested at once. Children >= 0
+// are nodes, negative children are leaves (~child), unused slots have
+// inverted bounds so they never hit.
+struct alignas(32) BVH8Node
+{
+	float bounds[6][8]; // min x, max x, min y, max y, min z, max z
+	std::int32_t child[8];
+};
+
+// Up to eight spheres of a leaf in SoA form
+struct alignas(32) SpherePack
+{
+	float cx[8], cy[8], cz[8], r2[8];
+	std::uint32_t primitive[8];
+	std::uint32_t count;
+};
+
+// Up to eight triangles of a leaf with their normal and edges precomputed
+struct alignas(32) TrianglePack
+{
+	float ax[8], ay[8], az[8];
+	float bx[8], by[8], bz[8];
+	float cx[8], cy[8], cz[8];
+	float nx[8], ny[8], nz[8];
+	std::uint32_t primitive[8];
+	std::uint32_t count;
+};
+
+// Up to eight faces of one mesh in a leaf, read through the mesh's arrays.
+// Unused lanes repeat the first face, which can never win over it.
+struct MeshPack
+{
+	std::uint32_t face[8];
+	std::uint32_t mesh; // index into the store's meshes
+	std::uint32_t count;
+};
+
+// Leaf of the 8-wide hierarchy; primitives that have no SIMD kernel are
+// tested one by one through PrimitiveStore::hit
+struct BVH8Leaf
+{
+	std::uint32_t spheres;   // index into the sphere packs or noPack
+	std::uint32_t triangles; // index into the triangle packs or noPack
+	std::uint32_t meshes;    // index into the mesh packs or noPack
+	std::uint32_t first;     // range of other primitives
+	std::uint32_t count;
+};
+
+bool cpuHasAVX2();
+
+// Bounding volume hierarchy over the bounded primitives of a scene, built as
+// a binary tree with the binned surface area heuristic and then collapsed
+// into an 8-wide tree for traversal. Unbounded primitives (planes) are kept
+// aside and tested against every ray.
+class BVH
+{
+public:
+	enum class Traversal
+	{
+		Binary,
+		WideScalar,
+		WideAVX2
+	};
+
+	BVH(std::vector<std::shared_ptr<Shape>> const& scene, std::size_t numThreads = 0);
+	explicit BVH(PrimitiveStore store, std::size_t numThreads = 0);
+
+	// closest hit, returns true if sr was updated
+	bool hit(atlas::math::Ray<atlas::math::Vector> const& ray, ShadeRec& sr) const;
+
+	// closest hit without surface data, returns true if hit was updated
+	bool closestHit(atlas::math::Ray<atlas::math::Vector> const& ray, Hit& hit) const;
+
+	// any-hit query for shadow rays: true if something intersects ray in
+	// [0, tMax), stopping at the first blocker found
+	bool occluded(atlas::math::Ray<atlas::math::Vector> const& ray, float tMax) const;
+
+	// as above, testing lastOccluder first and storing the blocker in it
+	bool occluded(atlas::math::Ray<atlas::math::Vector> const& ray,
+	              float tMax,
+	              std::uint32_t& lastOccluder) const;
+
+	BBox getBBox() const;
+	std::size_t numNodes() const;
+
+	// bytes held by the BVH's arrays and its store
+	std::size_t memoryUsed() const;
+
+	PrimitiveStore const& getStore() const;
+
+	// defaults to the widest traversal the CPU supports, WideAVX2 falls back
+	// to WideScalar on hosts without AVX2
+	void setTraversal(Traversal traversal);
+	Traversal getTraversal() const;
+
+	// interior nodes have count == 0 and children at offset and offset + 1,
+	// leaves reference mPrimitives[offset, offset + count)
+	struct Node
+	{
+		BBox bounds;
+		std::uint32_t offset;
+		std::uint32_t count;
+	};
+
+private:
+	static constexpr std::size_t numBins{ 16 };
+	static constexpr std::size_t maxLeafSize{ 4 };
+	static constexpr std::size_t maxDepth{ 60 };
+	static constexpr std::size_t parallelThreshold{ 4096 };
+
+	static constexpr std::uint32_t noPack{ std::numeric_limits<std::uint32_t>::max() };
+
+	void build(std::uint32_t node, std::uint32_t begin, std::uint32_t end,
+	           std::size_t depth, ThreadPool* pool);
+
+	std::int32_t collapse(std::uint32_t node);
+	std::int32_t makeLeaf(std::uint32_t first, std::uint32_t count);
+
+	// primitives tested when a ray reaches leaf
+	std::uint32_t leafSize(BVH8Leaf const& leaf) const;
+
+	// store id of the face in a mesh pack's lane
+	std::uint32_t meshFace(MeshPack const& pack, int lane) const;
+
+	bool hitBinary(atlas::math::Ray<atlas::math::Vector> const& ray, Hit& hit) const;
+
+	template <bool avx2>
+	bool hitWide(atlas::math::Ray<atlas::math::Vector> const& ray, Hit& hit) const;
+
+	bool occludedBinary(atlas::math::Ray<atlas::math::Vector> const& ray,
+	                    float tMax,
+	                    std::uint32_t& occluder) const;
+
+	template <bool avx2>
+	bool occludedWide(atlas::math::Ray<atlas::math::Vector> const& ray,
+	                  float tMax,
+	                  std::uint32_t& occluder) const;
+
+	// returns the split position, or end when a leaf is cheaper
+	std::uint32_t partitionSAH(BBox const& centroids,
+	                           std::uint32_t begin,
+	                           std::uint32_t end,
+	                           float parentArea);
+
+	PrimitiveStore mStore;
+	std::vector<std::uint32_t> mPrimitives;
+	std::vector<BBox> mBounds;
+	std::vector<std::uint32_t> mOrder;
+	std::vector<Node> mNodes;
+	std::atomic<std::uint32_t> mNodeCount;
+
+	// subtree primitive ranges, only needed while collapsing
+	std::vector<std::uint32_t> mFirst;
+	std::vector<std::uint32_t> mCount;
+
+	std::vector<BVH8Node> mWideNodes;
+	std::vector<BVH8Leaf> mLeaves;
+	std::vector<SpherePack> mSpherePacks;
+	std::vector<TrianglePack> mTrianglePacks;
+	std::vector<MeshPack> mMeshPacks;
+	std::vector<std::uint32_t> mOthers;
+	Traversal mTraversal;
+};
+
 
 
 // SAMPLES
@@ -326,23 +1743,508 @@ private:
 class Regular : public Sampler
 {
 public:
-    Regular(int numSamples, int numSets);
-
-    void generateSamples();
+    Regular(int numSamples, std::uint32_t seed = 0);
+
+    atlas::math::Point sampleUnitSquare(std::uint64_t pixel,
+                                        std::uint32_t index,
+                                        std::uint32_t dimension = 0) const;
+    void sampleUnitSquares(std::uint64_t const* pixels,
+                           std::uint32_t const* indices,
+                           std::size_t count,
+                           std::uint32_t dimension,
+                           float* x,
+                           float* y) const;
 };
 
 class Random : public Sampler
 {
 public:
-    Random(int numSamples, int numSets);
-
-    void generateSamples();
+    Random(int numSamples, std::uint32_t seed = 0);
+
+    atlas::math::Point sampleUnitSquare(std::uint64_t pixel,
+                                        std::uint32_t index,
+                                        std::uint32_t dimension = 0) const;
+    void sampleUnitSquares(std::uint64_t const* pixels,
+                           std::uint32_t const* indices,
+                           std::size_t count,
+                           std::uint32_t dimension,
+                           float* x,
+                           float* y) const;
 };
 
 class Jitter : public Sampler
 {
 public:
-	Jitter(int numSamples, int numSets);
+	Jitter(int numSamples, std::uint32_t seed = 0);
+
+	atlas::math::Point sampleUnitSquare(std::uint64_t pixel,
+	                                    std::uint32_t index,
+	                                    std::uint32_t dimension = 0) const;
+	void sampleUnitSquares(std::uint64_t const* pixels,
+	                       std::uint32_t const* indices,
+	                       std::size_t count,
+	                       std::uint32_t dimension,
+	                       float* x,
+	                       float* y) const;
+};
+
+// Low-discrepancy patterns. Their tables are built once on first use and
+// shared read-only by every thread.
+
+// one pair of prime bases a dimension up to 15; dimensions past the table
+// are plain random rather than reusing bases, which would correlate them
+class Halton : public Sampler
+{
+public:
+	Halton(int numSamples, std::uint32_t seed = 0);
+
+	atlas::math::Point sampleUnitSquare(std::uint64_t pixel,
+	                                    std::uint32_t index,
+	                                    std::uint32_t dimension = 0) const;
+	void sampleUnitSquares(std::uint64_t const* pixels,
+	                       std::uint32_t const* indices,
+	                       std::size_t count,
+	                       std::uint32_t dimension,
+	                       float* x,
+	                       float* y) const;
+};
+
+// Owen-scrambled Sobol (0,2) sequence
+class Sobol : public Sampler
+{
+public:
+	Sobol(int numSamples, std::uint32_t seed = 0);
+
+	atlas::math::Point sampleUnitSquare(std::uint64_t pixel,
+	                                    std::uint32_t index,
+	                                    std::uint32_t dimension = 0) const;
+	void sampleUnitSquares(std::uint64_t const* pixels,
+	                       std::uint32_t const* indices,
+	                       std::size_t count,
+	                       std::uint32_t dimension,
+	                       float* x,
+	                       float* y) const;
+};
+
+// progressive multi-jittered (0,2) sequence
+class PMJ02 : public Sampler
+{
+public:
+	PMJ02(int numSamples, std::uint32_t seed = 0);
+
+	atlas::math::Point sampleUnitSquare(std::uint64_t pixel,
+	                                    std::uint32_t index,
+	                                    std::uint32_t dimension = 0) const;
+	void sampleUnitSquares(std::uint64_t const* pixels,
+	                       std::uint32_t const* indices,
+	                       std::size_t count,
+	                       std::uint32_t dimension,
+	                       float* x,
+	                       float* y) const;
+};
+
+
+// SCENE FILES
+
+
+
+enum class SamplerType : std::uint32_t
+{
+	Regular,
+	Random,
+	Jitter,
+	Halton,
+	Sobol,
+	PMJ02
+};
+
+enum class LightType : std::uint32_t
+{
+	Ambient,
+	Point
+};
+
+// Records of a scene file, laid out exactly as in its binary form: every
+// member is 4 bytes, so there is no padding to differ between compilers.
+// Enums are stored as their underlying values.
+struct SceneSettings
+{
+	std::uint32_t width{ 600 }, height{ 600 };
+	float background[3]{ 0, 0, 0 };
+
+	std::uint32_t sampler{ static_cast<std::uint32_t>(SamplerType::Jitter) };
+	std::uint32_t numSamples{ 4 };
+	std::uint32_t seed{ 0 };
+
+	// pinhole camera, the defaults match Pinhole's
+	float eye[3]{ 0, 0, 500 };
+	float lookAt[3]{ 0, 0, 0 };
+	float up[3]{ 0, 1, 0 };
+	float distance{ 750 };
+	float zoom{ 1 };
+
+	float exposure{ 1 };
+	std::uint32_t toneMap{ static_cast<std::uint32_t>(ToneMap::MaxNormalise) };
+	std::uint32_t encoding{ static_cast<std::uint32_t>(Encoding::Linear) };
+};
+
+// Matte surface, colour is both the shape colour and the diffuse colour
+struct SceneMaterial
+{
+	float ka, kd;
+	float colour[3];
+};
+
+// location is unused by ambient lights
+struct SceneLight
+{
+	std::uint32_t type;
+	std::uint32_t shadows;
+	float radiance;
+	float colour[3];
+	float location[3];
+};
+
+struct SceneSphere
+{
+	float centre[3];
+	float radius;
+	std::uint32_t material;
+};
+
+struct ScenePlane
+{
+	float point[3];
+	float normal[3];
+	std::uint32_t material;
+};
+
+struct SceneTriangle
+{
+	float a[3], b[3], c[3];
+	std::uint32_t material;
+};
+
+// read-only run of records, either owned by a SceneFile or in its mapping
+template <typename T>
+struct SceneRecords
+{
+	T const* data{ nullptr };
+	std::size_t size{ 0 };
+
+	T const* begin() const { return data; }
+	T const* end() const { return data + size; }
+	T const& operator[](std::size_t i) const { return data[i]; }
+};
+
+// A scene as stored on disk, in one of two forms holding the same records.
+//
+// The text form has one record per line, '#' starts a comment:
+//
+//     image <width> <height>
+//     background <r> <g> <b>
+//     sampler <regular|random|jitter|halton|sobol|pmj02> <samples> [<seed>]
+//     camera <eye x y z> <look-at x y z> <up x y z> <distance> <zoom>
+//     output <exposure> <clamp|maxnormalise|reinhard|aces> <linear|srgb>
+//     material <ka> <kd> <r> <g> <b>
+//     ambient <radiance> <r> <g> <b>
+//     point <radiance> <r> <g> <b> <x> <y> <z> [shadows]
+//     sphere <x> <y> <z> <radius> <material>
+//     plane <x> <y> <z> <normal x y z> <material>
+//     triangle <a x y z> <b x y z> <c x y z> <material>
+//
+// Materials are numbered from 0 in the order they appear. The binary form
+// is a header followed by each kind of record as a packed array; loading it
+// maps the file and uses the arrays in place, with no per-record work
+// beyond checking material indices.
+class SceneFile
+{
+public:
+	SceneFile() = default;
+	~SceneFile();
+
+	SceneFile(SceneFile const&) = delete;
+	SceneFile& operator=(SceneFile const&) = delete;
+
+	// reads either form, telling them apart by the binary header
+	bool load(std::string const& filename);
+
+	bool saveText(std::string const& filename) const;
+	bool saveBinary(std::string const& filename) const;
+
+	// why the last load or save failed
+	std::string const& getError() const;
+
+	SceneSettings& settings();
+	SceneSettings const& settings() const;
+
+	// adding to a loaded binary scene copies its records out of the mapping
+	std::uint32_t addMaterial(SceneMaterial const& material);
+	void addLight(SceneLight const& light);
+	void addSphere(SceneSphere const& sphere);
+	void addPlane(ScenePlane const& plane);
+	void addTriangle(SceneTriangle const& triangle);
+
+	SceneRecords<SceneMaterial> materials() const;
+	SceneRecords<SceneLight> lights() const;
+	SceneRecords<SceneSphere> spheres() const;
+	SceneRecords<ScenePlane> planes() const;
+	SceneRecords<SceneTriangle> triangles() const;
+
+	// world, BVH and camera set up from the records; primitives go straight
+	// into the BVH's store without Shape objects, so world->scene is empty.
+	// numThreads goes to the BVH build and world->numThreads
+	std::shared_ptr<World> makeWorld(Pinhole& camera, std::size_t numThreads = 0) const;
+
+private:
+	bool loadBinary(std::string const& filename);
+	bool loadText(std::string const& filename);
+	bool fail(std::string const& error);
+
+	// false if a record is out of range: an unknown enum value or a
+	// primitive naming a material that does not exist
+	bool validate();
+
+	// copies mapped records into the vectors and drops the mapping
+	void detach();
+	void unmap();
+
+	SceneSettings mSettings{};
+	std::vector<SceneMaterial> mMaterials;
+	std::vector<SceneLight> mLights;
+	std::vector<SceneSphere> mSpheres;
+	std::vector<ScenePlane> mPlanes;
+	std::vector<SceneTriangle> mTriangles;
+
+	// a loaded binary file, mapped where possible or read into mBuffer;
+	// the records then live here instead of in the vectors
+	void const* mMap{ nullptr };
+	std::size_t mMapSize{ 0 };
+	std::vector<unsigned char> mBuffer;
+	SceneRecords<SceneMaterial> mMappedMaterials;
+	SceneRecords<SceneLight> mMappedLights;
+	SceneRecords<SceneSphere> mMappedSpheres;
+	SceneRecords<ScenePlane> mMappedPlanes;
+	SceneRecords<SceneTriangle> mMappedTriangles;
+
+	mutable std::string mError;
+};
+
+// Where generateScene puts primitives: evenly through the scene box, in
+// gaussian clusters, or packed ever more densely towards one point
+enum class SceneLayout : std::uint32_t
+{
+	Uniform,
+	Clustered,
+	Uneven
+};
+
+// Contents of a generated scene. Primitives fill a box 800 units across in
+// front of the camera, sized so their density stays about the same as the
+// count grows; a mesh is a closed octahedron of 8 triangles. Materials are
+// mattes of random colour, lights split the same total radiance
+struct SceneSpec
+{
+	std::uint32_t seed{ 1 };
+	SceneLayout layout{ SceneLayout::Uniform };
+
+	std::size_t spheres{ 0 };
+	std::size_t triangles{ 0 };
+	std::size_t meshes{ 0 };
+	std::size_t planes{ 0 };
+	std::size_t materials{ 8 };
+	std::size_t lights{ 1 };
+};
+
+// adds spec's materials, lights and primitives to scene and aims its camera
+// at them; a spec always gives the same scene
+void generateScene(SceneSpec const& spec, SceneFile& scene);
+
+// a layout's name on the command line, and the layout named name (false if
+// there is none)
+char const* sceneLayoutName(SceneLayout layout);
+bool parseSceneLayout(std::string const& name, SceneLayout& layout);
+
+// count primitives: 40% spheres, 10% in meshes and the rest loose
+// triangles, with a backdrop, 16 materials and 4 point lights
+SceneSpec mixedSceneSpec(SceneLayout layout, std::size_t count, std::uint32_t seed);
+
+// the scene rendered by this lab
+std::shared_ptr<World> makeShadingScene();
+
+// the 01_Checkerboard lab: white and black squares of side squareDims,
+// black at the top left
+void renderCheckerboardLab(std::size_t side, std::size_t squareDims, std::vector<Colour>& image);
+
+// the 02_Sphere lab: one flat red sphere under orthographic rays, scaled
+// from 512x512 to side; returns how many rays hit
+std::size_t renderSphereLab(std::size_t side, std::vector<Colour>& image);
+
+// the 03_Camera lab: two flat spheres at 16 random samples a pixel, zoomed
+// to keep its 600x600 framing; an ambient-only matte stands in for their
+// flat colours
+std::shared_ptr<World> makeCameraLabScene(std::size_t side, Pinhole& camera);
+
+
+
+// STATIC SCENES
+
+
+
+// Matte material and point light as plain values, shaded as Matte and
+// PointLight are: ka cd times the ambient light, plus kd cd / pi times the
+// radiance and the cosine for every light that is not blocked
+struct StaticMatte
+{
+	float ka;
+	float kd;
+	Colour cd;
+};
+
+struct StaticPointLight
+{
+	atlas::math::Point location;
+	Colour radiance;
+	bool shadows;
+};
+
+// A scene fixed at build time: concrete shapes held by value in a tuple,
+// with one StaticMatte per shape and numLights point lights. hit expands
+// into a qualified call per shape, and Sphere, Plane and Triangle call
+// their own intersectRay directly, so no part of a trace goes through a
+// vtable and the compiler is free to inline all of it; shading needs no
+// Material or Light objects and nothing is allocated. Shape materials set
+// with setMaterial are ignored.
+template <std::size_t numLights, typename... Shapes>
+class StaticScene
+{
+public:
+	using Ray = atlas::math::Ray<atlas::math::Vector>;
+
+	StaticScene(Colour const& ambient,
+	            std::array<StaticPointLight, numLights> const& lights,
+	            std::array<StaticMatte, sizeof...(Shapes)> const& materials,
+	            Shapes const&... shapes) :
+		mAmbient{ ambient },
+		mLights{ lights },
+		mMaterials{ materials },
+		mShapes{ shapes... }
+	{}
+
+	// closest hit, shape receives the index of the shape hit
+	bool hit(Ray const& ray, ShadeRec& sr, std::size_t& shape) const
+	{
+		return hitShapes(ray, sr, shape, std::index_sequence_for<Shapes...>{});
+	}
+
+	// true if any shape intersects ray in [0, tMax)
+	bool occluded(Ray const& ray, float tMax) const
+	{
+		return std::apply([&](Shapes const&... shapes) {
+			return (blocks(shapes, ray, tMax) || ...);
+		}, mShapes);
+	}
+
+	// radiance leaving the hit in sr on the given shape
+	Colour shade(ShadeRec const& sr, std::size_t shape) const
+	{
+		StaticMatte const& m = mMaterials[shape];
+		Colour L{ m.ka * m.cd * mAmbient };
+
+		for (StaticPointLight const& light : mLights)
+		{
+			atlas::math::Vector wi = glm::normalize(light.location - sr.hit_point);
+			float ndotwi = glm::dot(sr.normal, wi);
+			if (ndotwi <= 0.0f)
+				continue;
+
+			if (light.shadows)
+			{
+				// start just off the surface, as Matte does
+				Ray shadowRay{ sr.hit_point + 0.01f * glm::normalize(sr.normal), wi };
+				if (occluded(shadowRay, glm::length(light.location - shadowRay.o)))
+					continue;
+			}
+
+			L += m.kd * m.cd / 3.14159265f * light.radiance * ndotwi;
+		}
+
+		return L;
+	}
 
-	void generateSamples();
+private:
+	template <std::size_t... I>
+	bool hitShapes(Ray const& ray, ShadeRec& sr, std::size_t& shape, std::index_sequence<I...>) const
+	{
+		bool found{ false };
+		auto test = [&](auto const& s, std::size_t index) {
+			using S = std::decay_t<decltype(s)>;
+			float t{ sr.t };
+			if (s.S::hit(ray, sr) && sr.t < t)
+			{
+				shape = index;
+				found = true;
+			}
+		};
+		(test(std::get<I>(mShapes), I), ...);
+		return found;
+	}
+
+	template <typename S>
+	static bool blocks(S const& s, Ray const& ray, float tMax)
+	{
+		ShadeRec probe{};
+		probe.t = tMax;
+		return s.S::hit(ray, probe) && probe.t < tMax;
+	}
+
+	Colour mAmbient;
+	std::array<StaticPointLight, numLights> mLights;
+	std::array<StaticMatte, sizeof...(Shapes)> mMaterials;
+	std::tuple<Shapes...> mShapes;
 };
+
+template <typename Scene, typename SamplerType>
+void Pinhole::renderStatic(Scene const& scene, SamplerType const& sampler, World& world) const
+{
+	std::size_t count{ world.width * world.height };
+	world.imageY0 = 0;
+	world.image.assign(count, Colour{ 0, 0, 0 });
+	world.sampleCounts.assign(count, static_cast<std::uint32_t>(sampler.getNumSamples()));
+	world.pixels.assign(3 * count, 0);
+
+	float avg{ 1.0f / sampler.getNumSamples() };
+	Colour max{ 1, 1, 1 };
+	for (std::size_t r{ 0 }; r < world.height; ++r)
+	{
+		for (std::size_t c{ 0 }; c < world.width; ++c)
+		{
+			Colour pixelAverage{ 0, 0, 0 };
+			for (int j{ 0 }; j < sampler.getNumSamples(); ++j)
+			{
+				std::uint64_t pixel{ r * world.width + c };
+				atlas::math::Point samplePoint{ sampler.SamplerType::sampleUnitSquare(pixel, static_cast<std::uint32_t>(j)) };
+				atlas::math::Point pixelPoint{};
+				pixelPoint.x = c - 0.5f * world.width + samplePoint.x;
+				pixelPoint.y = r - 0.5f * world.height + samplePoint.y;
+
+				ShadeRec sr{};
+				sr.t = std::numeric_limits<float>::max();
+				std::size_t shape{ 0 };
+				if (scene.hit({ mEye, rayDirection(pixelPoint) }, sr, shape))
+					pixelAverage += scene.shade(sr, shape);
+			}
+
+			Colour pix{ pixelAverage * avg };
+			max.r = std::max(max.r, pix.r);
+			max.g = std::max(max.g, pix.g);
+			max.b = std::max(max.b, pix.b);
+			world.image[r * world.width + c] = pix;
+		}
+	}
+
+	Colour scale{ world.exposure };
+	if (world.toneMap == ToneMap::MaxNormalise)
+		scale = scale / max;
+	postProcessTile(world, Tile{ 0, 0, world.width, world.height }, scale, makeEncodingLUT(world.encoding));
+}
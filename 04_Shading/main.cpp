@@ -1,654 +1,249 @@
 #include "lab.hpp"
 
-// ******* Function Member Implementation *******
-
-// ***** Shape function members *****
-Shape::Shape() : mColour{0, 0, 0}
-{}
-
-void Shape::setColour(Colour const& col)
-{
-    mColour = col;
-}
-
-Colour Shape::getColour() const
-{
-    return mColour;
-}
-
-void Shape::setMaterial(std::shared_ptr<Material> const& material)
-{
-    mMaterial = material;
-}
-
-std::shared_ptr<Material> Shape::getMaterial() const
-{
-    return mMaterial;
-}
-
-// ***** Camera function members *****
-Camera::Camera() :
-	mEye{ 0.0f, 0.0f, 500.0f },
-	mLookAt{ 0.0f },
-	mUp{ 0.0f, 1.0f, 0.0f },
-	mU{ 1.0f, 0.0f, 0.0f },
-	mV{ 0.0f, 1.0f, 0.0f },
-	mW{ 0.0f, 0.0f, 1.0f }
-{}
-
-void Camera::setEye(atlas::math::Point const& eye)
-{
-	mEye = eye;
-}
-
-void Camera::setLookAt(atlas::math::Point const& lookAt)
-{
-	mLookAt = lookAt;
-}
-
-void Camera::setUpVector(atlas::math::Vector const& up)
-{
-	mUp = up;
-}
+// ******* Driver Code *******
 
-void Camera::computeUVW()
+int main(int argc, char* argv[])
 {
-	mW = glm::normalize(mEye - mLookAt);
-	mU = glm::normalize(glm::cross(mUp, mW));
-	mV = glm::cross(mW, mU);
-
-	if (areEqual(mEye.x, mLookAt.x) && areEqual(mEye.z, mLookAt.z) &&
-		mEye.y > mLookAt.y)
+	// --stats file and --trace file, ahead of any other command line: run
+	// it, then write the telemetry report or a Chrome trace to file on exit
+	static std::string statsFile;
+	static std::string traceFile;
+	while (argc > 2 && (std::string{ argv[1] } == "--stats" || std::string{ argv[1] } == "--trace"))
 	{
-		mU = { 0.0f, 0.0f, 1.0f };
-		mV = { 1.0f, 0.0f, 0.0f };
-		mW = { 0.0f, 1.0f, 0.0f };
+		(std::string{ argv[1] } == "--stats" ? statsFile : traceFile) = argv[2];
+		argc -= 2;
+		argv += 2;
 	}
 
-	if (areEqual(mEye.x, mLookAt.x) && areEqual(mEye.z, mLookAt.z) &&
-		mEye.y < mLookAt.y)
+	if (!statsFile.empty())
+		std::atexit([] { Telemetry::writeReport(statsFile); });
+
+	if (!traceFile.empty())
 	{
-		mU = { 1.0f, 0.0f, 0.0f };
-		mV = { 0.0f, 0.0f, 1.0f };
-		mW = { 0.0f, -1.0f, 0.0f };
+		Tracer::start();
+		std::atexit([] { Tracer::write(traceFile); });
 	}
-}
-
-// ***** Sampler function members *****
-Sampler::Sampler(int numSamples, int numSets) :
-    mNumSamples{numSamples}, mNumSets{numSets}, mCount{0}, mJump{0}
-{
-    mSamples.reserve(mNumSets * mNumSamples);
-    setupShuffledIndeces();
-}
-
-int Sampler::getNumSamples() const
-{
-    return mNumSamples;
-}
-
-void Sampler::setupShuffledIndeces()
-{
-    mShuffledIndeces.reserve(mNumSamples * mNumSets);
-    std::vector<int> indices;
-
-    std::random_device d;
-    std::mt19937 generator(d());
-
-    for (int j = 0; j < mNumSamples; ++j)
-    {
-        indices.push_back(j);
-    }
-
-    for (int p = 0; p < mNumSets; ++p)
-    {
-        std::shuffle(indices.begin(), indices.end(), generator);
-
-        for (int j = 0; j < mNumSamples; ++j)
-        {
-            mShuffledIndeces.push_back(indices[j]);
-        }
-    }
-}
-
-atlas::math::Point Sampler::sampleUnitSquare()
-{
-    if (mCount % mNumSamples == 0)
-    {
-        atlas::math::Random<int> engine;
-        mJump = (engine.getRandomMax() % mNumSets) * mNumSamples;
-    }
-
-    return mSamples[mJump + mShuffledIndeces[mJump + mCount++ % mNumSamples]];
-}
-
-
-
-// ***** BRDF function members *****
-
-Lambertian::Lambertian() : kd{ 1 }, cd{ 1 }
-{}
-
-Lambertian::Lambertian(float k, float c) : kd{ k }, cd{c}
-{}
-
-void Lambertian::set_kd(float ka) {
-	kd = ka;
-}
-void Lambertian::set_cd(Colour c) {
-	cd = c;
-}
 
-Colour Lambertian::fn([[maybe_unused]] ShadeRec const& sr,
-	[[maybe_unused]] atlas::math::Vector const& reflected,
-	[[maybe_unused]] atlas::math::Vector const& incoming) const {
-	return kd * cd / (float) M_PI;
-}
-Colour Lambertian::rho([[maybe_unused]] ShadeRec const& sr,
-	[[maybe_unused]] atlas::math::Vector const& reflected) const {
-	return kd * cd;
-}
-
-
-
-// ***** Material function members *****
-
-Matte::Matte() :
-	Material(),
-	ambient_brdf(new Lambertian),
-	diffuse_brdf(new Lambertian)
-{}
-
-void Matte::set_ka(const float ka) {
-	ambient_brdf->set_kd(ka);
-}
-
-void Matte::set_kd(const float kd) {
-	diffuse_brdf->set_kd(kd);
-}
+	// --generate layout primitives out [seed]: writes a generated scene for
+	// --scene, binary when out ends in .scb
+	if (argc > 1 && std::string{ argv[1] } == "--generate")
+	{
+		std::size_t count{ 0 };
+		std::size_t seed{ 1 };
+		if (argc < 5 || argc > 6 ||
+			!parseArgument(argv[3], std::numeric_limits<std::uint32_t>::max(), count) || count == 0 ||
+			(argc > 5 && !parseArgument(argv[5], std::numeric_limits<std::uint32_t>::max(), seed)))
+		{
+			fmt::print("usage: --generate <layout> <primitives> <out> [seed]\n");
+			return -1;
+		}
 
-void Matte::set_cd(const Colour& c) {
-	ambient_brdf->set_cd(c);
-	diffuse_brdf->set_cd(c);
-}
+		SceneLayout layout{};
+		if (!parseSceneLayout(argv[2], layout))
+		{
+			fmt::print("unknown layout {}\n", argv[2]);
+			return -1;
+		}
 
-Colour Matte::shade(ShadeRec& sr) {
-	atlas::math::Vector wo = -sr.ray.d;
-	Colour L = ambient_brdf->rho(sr, wo) * sr.world->ambient->L(sr);
-	size_t numLights = sr.world->lights.size();
+		SceneFile scene{};
+		generateScene(mixedSceneSpec(layout, count, static_cast<std::uint32_t>(seed)), scene);
 
-	for (int j = 0; j < numLights; j++) {
-		atlas::math::Vector wi = sr.world->lights[j]->getDirection(sr);
-		float ndotwi = glm::dot(sr.normal, wi);
+		std::string out{ argv[4] };
+		bool binary{ out.size() >= 4 && out.compare(out.size() - 4, 4, ".scb") == 0 };
+		if (!(binary ? scene.saveBinary(out) : scene.saveText(out)))
+		{
+			fmt::print("{}\n", scene.getError());
+			return -1;
+		}
 
-		if (ndotwi > 0.0f)
-			L += diffuse_brdf->fn(sr, wo, wi) * sr.world->lights[j]->L(sr) * ndotwi;
+		return 0;
 	}
-	return L;
-}
-
-
-
-
-// ***** Light function members *****
-Light::Light() :
-	mColour{ 1,1,1 },
-	mRadiance{ 1 },
-	mShadows{ false }
-{}
-
-Colour Light::L([[maybe_unused]] ShadeRec& sr)
-{
-    return Colour{0.0f};
-}
-
-void Light::scaleRadiance([[maybe_unused]] float b)
-{}
-
-void Light::setColour([[maybe_unused]] Colour const& c)
-{}
-
-// ***** Ambient function members *****
-
-Ambient::Ambient() 
-	: Light()
-{
-	scaleRadiance({ 1.0 });
-	setColour({ 1,1,1 });
-}
-
-void Ambient::scaleRadiance(float b) {
-	mRadiance = b;
-}
-
-void Ambient::setColour(Colour const& c) {
-	mColour = c;
-}
-
-atlas::math::Vector Ambient::getDirection([[maybe_unused]] ShadeRec& sr) {
-	return (atlas::math::Vector({ 0,0,0 }));
-}
-
-Colour Ambient::L([[maybe_unused]] ShadeRec& sr) {
-	return mRadiance * mColour;
-}
-
-// ***** PointLight function members *****
-
-PointLight::PointLight()
-	: Light(), mLocation{0,0,0}
-{
-	scaleRadiance({ 1.0 });
-	setColour({ 1,1,1 });
-}
-
-void PointLight::scaleRadiance(float b) {
-	mRadiance = b;
-}
 
-void PointLight::setColour(Colour const& c) {
-	mColour = c;
-}
-
-atlas::math::Vector PointLight::getDirection(ShadeRec& sr) {
-	return glm::normalize(mLocation - sr.hit_point);
-}
-
-Colour PointLight::L([[maybe_unused]] ShadeRec& sr) {
-	return mRadiance * mColour;
-}
-
-void PointLight::setLocation(atlas::math::Point location) {
-	mLocation = location;
-}
-
-// ***** Plane function members *****
-
-Plane::Plane(atlas::math::Point point, Normal normal) :
-	mPoint{ point }, mNormal{ normal }
-{}
-
-bool Plane::hit(atlas::math::Ray<atlas::math::Vector> const& ray,
-	ShadeRec& sr) const
-{
-	float t{ std::numeric_limits<float>::max() };
-	bool intersect{ intersectRay(ray, t) };
-
-	// update ShadeRec info about new closest hit
-	if (intersect && t < sr.t)
+	// --obj file: renders an OBJ mesh framed by its bounding box, a matte
+	// colour per usemtl name
+	if (argc > 2 && std::string{ argv[1] } == "--obj")
 	{
-		sr.normal = mNormal;
-		sr.ray = ray;
-		sr.color = mColour;
-		sr.t = t;
-		sr.material = mMaterial;
-	}
-
-	return intersect;
-
-}
+		std::vector<std::string> names;
+		std::shared_ptr<TriangleMesh> mesh{ TriangleMesh::loadOBJ(argv[2], &names) };
+		if (!mesh)
+		{
+			fmt::print("could not read {}\n", argv[2]);
+			return -1;
+		}
 
-bool Plane::intersectRay(atlas::math::Ray<atlas::math::Vector> const& ray,
-	float& tMin) const {
-	float denom{ glm::dot(mNormal, ray.d) };
+		std::shared_ptr<World> world{ std::make_shared<World>() };
+		world->width = 600;
+		world->height = 600;
+		world->background = { 0, 0, 0 };
+		world->sampler = std::make_shared<Jitter>(4);
 
-	if (std::fabs(denom) > 0.0001f) {
-		tMin = glm::dot(mPoint - ray.o, mNormal) / denom;
-		if (tMin >= 0) return true;
+		Colour const palette[]{ { 0.8f, 0.8f, 0.8f }, { 0.8f, 0.3f, 0.2f }, { 0.2f, 0.5f, 0.8f },
+			{ 0.3f, 0.7f, 0.3f }, { 0.8f, 0.7f, 0.2f }, { 0.6f, 0.3f, 0.7f } };
+		std::vector<std::shared_ptr<Material>> materials;
+		for (std::size_t i = 0; i <= names.size(); ++i)
+		{
+			std::shared_ptr<Matte> matte{ std::make_shared<Matte>() };
+			matte->set_ka(0.25f);
+			matte->set_kd(0.65f);
+			matte->set_cd(palette[i % std::size(palette)]);
+			materials.push_back(matte);
+		}
+		mesh->setMaterial(materials.back());
+		materials.pop_back();
+		mesh->setMaterials(materials);
+		mesh->setColour({ 1, 1, 1 });
+		world->scene.push_back(mesh);
+
+		// the view is 0.8 wide at unit distance, keep the bounding sphere in it
+		BBox bounds{ mesh->getBBox() };
+		atlas::math::Point centre{ bounds.centroid() };
+		float radius{ std::max(glm::length(bounds.max - bounds.min) / 2.0f, 1e-3f) };
+
+		std::shared_ptr<Ambient> ambient{ std::make_shared<Ambient>() };
+		ambient->scaleRadiance(1.0f);
+		ambient->setColour({ 1, 1, 1 });
+		world->ambient = ambient;
+
+		std::shared_ptr<PointLight> light{ std::make_shared<PointLight>() };
+		light->setLocation(centre + atlas::math::Vector{ -2, 2, 3 } * radius);
+		light->scaleRadiance(1.5f);
+		light->setShadows(true);
+		world->lights.push_back(light);
+
+		Pinhole camera{};
+		camera.setEye(centre + atlas::math::Vector{ 0, 0, 2.9f * radius });
+		camera.setLookAt(centre);
+		camera.computeUVW();
+		camera.renderScene(world);
+
+		saveToFile("raytrace.bmp", world->width, world->height, world->pixels);
+		return 0;
 	}
 
-	return false;
-}
-
-// ***** Triangle function members *****
-
-Triangle::Triangle(atlas::math::Point a, atlas::math::Point b, atlas::math::Point c) :
-	mA{ a }, mB{ b }, mC{c}
-{}
-
-bool Triangle::hit(atlas::math::Ray<atlas::math::Vector> const& ray,
-	ShadeRec& sr) const
-{
-	float t{ std::numeric_limits<float>::max() };
-	bool intersect{ intersectRay(ray, t) };
-
-	// update ShadeRec info about new closest hit
-	if (intersect && t < sr.t)
+	// --convert in out: rewrites a scene file, binary when out ends in .scb
+	if (argc > 3 && std::string{ argv[1] } == "--convert")
 	{
-		sr.normal = glm::cross((mA - mB), (mA - mC));
-		sr.ray = ray;
-		sr.color = mColour;
-		sr.t = t;
-		sr.material = mMaterial;
-	}
-
-	return intersect;
-}
-
-bool Triangle::intersectRay(atlas::math::Ray<atlas::math::Vector> const& ray,
-	float& tMin) const {
-	atlas::math::Vector normal = glm::cross(mA - mB, mA - mC);
-	float denom{ glm::dot(normal, ray.d) };
+		SceneFile scene{};
+		std::string out{ argv[3] };
+		bool binary{ out.size() >= 4 && out.compare(out.size() - 4, 4, ".scb") == 0 };
+		if (!scene.load(argv[2]) || !(binary ? scene.saveBinary(out) : scene.saveText(out)))
+		{
+			fmt::print("{}\n", scene.getError());
+			return -1;
+		}
 
-	if (std::fabs(denom) > 0.0001f) {
-		tMin = glm::dot(mA - ray.o, normal) / denom;
-		if (tMin >= 0) {
-			atlas::math::Vector P = ray.o + tMin * ray.d;
+		return 0;
+	}
 
-			atlas::math::Vector e1 = mB - mA;
-			atlas::math::Vector e2 = mC - mB;
-			atlas::math::Vector e3 = mA - mC;
+	// --scene file: renders a scene file to raytrace.bmp
+	if (argc > 2 && std::string{ argv[1] } == "--scene")
+	{
+		SceneFile scene{};
+		if (!scene.load(argv[2]))
+		{
+			fmt::print("{}\n", scene.getError());
+			return -1;
+		}
 
-			atlas::math::Vector c1 = P - mA;
-			atlas::math::Vector c2 = P - mB;
-			atlas::math::Vector c3 = P - mC;
+		Pinhole camera{};
+		std::shared_ptr<World> world{ scene.makeWorld(camera) };
+		camera.renderScene(world);
 
-			if (glm::dot(normal, glm::cross(e1, c1)) > 0 &&
-				glm::dot(normal, glm::cross(e2, c2)) > 0 &&
-				glm::dot(normal, glm::cross(e3, c3)) > 0)
-				return true;
-		}
+		saveToFile("raytrace.bmp", world->width, world->height, world->pixels);
+		return 0;
 	}
 
-	return false;
-}
+    std::shared_ptr<World> world{makeShadingScene()};
 
-// ***** Sphere function members *****
-Sphere::Sphere(atlas::math::Point center, float radius) :
-    mCentre{center}, mRadius{radius}, mRadiusSqr{radius * radius}
-{}
+	// --timed milliseconds: as much of a 256 sample render as fits in the
+	// budget
+	if (argc > 1 && std::string{ argv[1] } == "--timed")
+	{
+		// at most a day, far from overflowing the clock's nanoseconds
+		std::size_t budget{ 0 };
+		if (argc != 3 || !parseArgument(argv[2], 24 * 60 * 60 * 1000, budget))
+		{
+			fmt::print("usage: --timed <milliseconds>\n");
+			return -1;
+		}
 
-bool Sphere::hit(atlas::math::Ray<atlas::math::Vector> const& ray,
-                 ShadeRec& sr) const
-{
-    atlas::math::Vector tmp = ray.o - mCentre;
-    float t{std::numeric_limits<float>::max()};
-    bool intersect{intersectRay(ray, t)};
-
-    // update ShadeRec info about new closest hit
-    if (intersect && t < sr.t)
-    {
-        sr.normal   = (tmp + t * ray.d) / mRadius;
-        sr.ray      = ray;
-        sr.color    = mColour;
-        sr.t        = t;
-        sr.material = mMaterial;
-    }
-
-    return intersect;
-}
+		world->sampler = std::make_shared<Sobol>(256);
 
-bool Sphere::intersectRay(atlas::math::Ray<atlas::math::Vector> const& ray,
-                          float& tMin) const
-{
-    const auto tmp{ray.o - mCentre};
-    const auto a{glm::dot(ray.d, ray.d)};
-    const auto b{2.0f * glm::dot(ray.d, tmp)};
-    const auto c{glm::dot(tmp, tmp) - mRadiusSqr};
-    const auto disc{(b * b) - (4.0f * a * c)};
-
-    if (atlas::core::geq(disc, 0.0f))
-    {
-        const float kEpsilon{0.01f};
-        const float e{std::sqrt(disc)};
-        const float denom{2.0f * a};
-
-        // Look at the negative root first
-        float t = (-b - e) / denom;
-        if (atlas::core::geq(t, kEpsilon))
-        {
-            tMin = t;
-            return true;
-        }
-
-        // Now the positive root
-        t = (-b + e);
-        if (atlas::core::geq(t, kEpsilon))
-        {
-            tMin = t;
-            return true;
-        }
-    }
-
-    return false;
-}
+		Pinhole camera{};
+		camera.setEye({ 0, 0, 1 });
+		camera.computeUVW();
 
-// ***** Pinhole function members *****
-Pinhole::Pinhole() : Camera{}, mDistance{ 750.0f }, mZoom{ 1.0f }
-{}
+		auto start = std::chrono::steady_clock::now();
+		Refinement reached{ camera.renderTimed(world, std::chrono::milliseconds{ budget }) };
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
 
-void Pinhole::setDistance(float distance)
-{
-	mDistance = distance;
-}
+		fmt::print("{:.1f} ms, reached level {} ({} pixel spacing, {} samples per pixel)\n",
+			elapsed.count(), reached.level, reached.stride, reached.samples);
 
-void Pinhole::setZoom(float zoom)
-{
-	mZoom = zoom;
-}
-
-atlas::math::Vector Pinhole::rayDirection(atlas::math::Point const& p) const
-{
-	const auto dir = p.x * mU + p.y * mV - (mDistance * mZoom) * mW;
-	return glm::normalize(dir);
-}
-
-void Pinhole::renderScene(std::shared_ptr<World> world) const
-{
-	using atlas::math::Point;
-	using atlas::math::Ray;
-	using atlas::math::Vector;
+		saveToFile("raytrace.bmp", world->width, world->height, world->pixels);
+		return 0;
+	}
 
-	float max_r{ 1 };
-	float max_g{ 1 };
-	float max_b{ 1 };
+	// --progressive [checkpoint seconds]: 256 samples in passes of 4 with
+	// preview.ppm after every pass; a killed run resumes from raytrace.ckpt
+	if (argc > 1 && std::string{ argv[1] } == "--progressive")
+	{
+		world->sampler = std::make_shared<Sobol>(256);
 
-	Point samplePoint{}, pixelPoint{};
-	Ray<atlas::math::Vector> ray{};
+		ProgressiveSettings settings{};
+		settings.previewFile = "preview.ppm";
+		settings.checkpointFile = "raytrace.ckpt";
+		if (argc > 3 ||
+			(argc > 2 && !parseArgument(argv[2], std::numeric_limits<double>::max(), settings.checkpointSeconds)))
+		{
+			fmt::print("usage: --progressive [checkpoint seconds]\n");
+			return -1;
+		}
 
-	ray.o = mEye;
-	float avg{ 1.0f / world->sampler->getNumSamples() };
+		Pinhole camera{};
+		camera.setEye({ 0, 0, 1 });
+		camera.computeUVW();
 
-	for (int r{ 0 }; r < world->height; ++r)
-	{
-		for (int c{ 0 }; c < world->width; ++c)
+		if (!camera.renderProgressive(world, settings))
 		{
-			Colour pixelAverage{ 0, 0, 0 };
-
-			for (int j = 0; j < world->sampler->getNumSamples(); ++j)
-			{
-				ShadeRec trace_data{};
-				trace_data.world = world;
-				trace_data.t = std::numeric_limits<float>::max();
-				samplePoint = world->sampler->sampleUnitSquare();
-				pixelPoint.x = c - 0.5f * world->width + samplePoint.x;
-				pixelPoint.y = r - 0.5f * world->height + samplePoint.y;
-				ray.d = rayDirection(pixelPoint);
-				bool hit{};
-
-				for (auto obj : world->scene)
-				{
-					hit |= obj->hit(ray, trace_data);
-				}
-
-				if (hit)
-				{
-					if (trace_data.material != NULL)
-						pixelAverage += trace_data.material->shade(trace_data);
-				}
-			}
-
-			float pix_r = pixelAverage.r * avg;
-			float pix_g = pixelAverage.g * avg;
-			float pix_b = pixelAverage.b * avg;
-
-			if (pix_r > max_r)
-				max_r = pix_r;
-			if (pix_g > max_g)
-				max_g = pix_g;
-			if (pix_b > max_b)
-				max_b = pix_b;
-
-			world->image.push_back({ pix_r,
-									pix_g,
-									pix_b });
+			fmt::print("could not write raytrace.ckpt or preview.ppm\n");
+			return -1;
 		}
-	}
 
-	int temp = 0;
-	for (Colour col : world->image) {
-		world->image[temp] = { col[0] / max_r, col[1] / max_g, col[2] / max_b };
-		temp++;
+		saveToFile("raytrace.bmp", world->width, world->height, world->pixels);
+		return 0;
 	}
-}
-
-// ***** Regular function members *****
-Regular::Regular(int numSamples, int numSets) : Sampler{numSamples, numSets}
-{
-    generateSamples();
-}
-
-void Regular::generateSamples()
-{
-    int n = static_cast<int>(glm::sqrt(static_cast<float>(mNumSamples)));
-
-    for (int j = 0; j < mNumSets; ++j)
-    {
-        for (int p = 0; p < n; ++p)
-        {
-            for (int q = 0; q < n; ++q)
-            {
-                mSamples.push_back(
-                    atlas::math::Point{(q + 0.5f) / n, (p + 0.5f) / n, 0.0f});
-            }
-        }
-    }
-}
-
-// ***** Random function members *****
-Random::Random(int numSamples, int numSets) : Sampler{numSamples, numSets}
-{
-    generateSamples();
-}
 
-void Random::generateSamples()
-{
-    atlas::math::Random<float> engine;
-    for (int p = 0; p < mNumSets; ++p)
-    {
-        for (int q = 0; q < mNumSamples; ++q)
-        {
-            mSamples.push_back(atlas::math::Point{
-                engine.getRandomOne(), engine.getRandomOne(), 0.0f});
-        }
-    }
-}
-
-// ***** Jitter function members *****
-
-Jitter::Jitter(int numSamples, int numSets) : Sampler{ numSamples, numSets }
-{
-	generateSamples();
-}
-
-void Jitter::generateSamples()
-{
-	int n = static_cast<int>(glm::sqrt(static_cast<float>(mNumSamples)));
-
-	for (int j = 0; j < mNumSets; ++j)
+	// --stream width height [budget MB]: renders in bands straight to
+	// raytrace.ppm, zoomed to keep the 600x600 framing
+	if (argc > 1 && std::string{ argv[1] } == "--stream")
 	{
-		for (int p = 0; p < n; ++p)
+		std::size_t const maxSide{ std::numeric_limits<std::uint32_t>::max() };
+		std::size_t budget{ 256 };
+		if (argc < 4 || argc > 5 ||
+			!parseArgument(argv[2], maxSide, world->width) || world->width == 0 ||
+			!parseArgument(argv[3], maxSide, world->height) || world->height == 0 ||
+			(argc > 4 && !parseArgument(argv[4], std::numeric_limits<std::size_t>::max() >> 20, budget)))
 		{
-			for (int q = 0; q < n; ++q)
-			{
-				float rx = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
-				float ry = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
-				mSamples.push_back(
-					atlas::math::Point{ (q + rx) / n, (p + ry) / n, 0.0f });
-			}
+			fmt::print("usage: --stream <width> <height> [budget MB], width and height above 0\n");
+			return -1;
 		}
-	}
-}
+		budget <<= 20;
 
-// ******* Driver Code *******
+		Pinhole camera{};
+		camera.setEye({ 0, 0, 1 });
+		camera.setZoom(std::min(world->width, world->height) / 600.0f);
+		camera.computeUVW();
 
-int main()
-{
-    std::shared_ptr<World> world{std::make_shared<World>()};
-
-    world->width      = 600;
-    world->height     = 600;
-    world->background = {0, 0, 0};
-    world->sampler    = std::make_shared<Jitter>(4, 83);
-
-	std::shared_ptr<Ambient> ambient{ std::make_shared<Ambient>() };
-	ambient->scaleRadiance(1.5f);
-	ambient->setColour({ 1,1,1 });
-	world->ambient = ambient;
-
-	std::shared_ptr<PointLight> pointlight{ std::make_shared<PointLight>() };
-	pointlight->setLocation({ -300,150,150 });
-	pointlight->scaleRadiance(1.5f);
-	ambient->setColour({ 1,1,1 });
-
-	world->lights.push_back(pointlight);
-
-	std::shared_ptr<Matte> matte0{ std::make_shared<Matte>() };
-	matte0->set_ka(25);
-	matte0->set_kd(65);
-	matte0->set_cd({1,0,0});
-
-	std::shared_ptr<Matte> matte1{std::make_shared<Matte>() };
-	matte1->set_ka(25);
-	matte1->set_kd(65);
-	matte1->set_cd({ 0,0,1 });
-
-	std::shared_ptr<Matte> matte2{ std::make_shared<Matte>() };
-	matte2->set_ka(25);
-	matte2->set_kd(65);
-	matte2->set_cd({ 0,1,0 });
-
-	std::shared_ptr<Matte> matte3{ std::make_shared<Matte>() };
-	matte3->set_ka(25);
-	matte3->set_kd(65);
-	matte3->set_cd({ 1,1,1 });
-
-	std::shared_ptr<Matte> matte4{ std::make_shared<Matte>() };
-	matte4->set_ka(25);
-	matte4->set_kd(65);
-	matte4->set_cd({ 0,0,0 });
-
-    world->scene.push_back(
-        std::make_shared<Sphere>(atlas::math::Point{0, 0, -600}, 128.0f));
-    world->scene[0]->setColour({1, 0, 0});
-	world->scene[0]->setMaterial(matte0);
-
-    world->scene.push_back(
-        std::make_shared<Sphere>(atlas::math::Point{128, 32, -700}, 64.0f));
-    world->scene[1]->setColour({0, 0, 1});
-	world->scene[1]->setMaterial(matte1);
-
-    world->scene.push_back(
-        std::make_shared<Sphere>(atlas::math::Point{-128, 32, -700}, 64.0f));
-    world->scene[2]->setColour({0, 1, 0});
-	world->scene[2]->setMaterial(matte2);
-	
-	world->scene.push_back(
-		std::make_shared<Plane>(atlas::math::Point{ 0, 0, -800 }, atlas::math::Point{ 0, 2, 1 }));
-	world->scene[3]->setColour({0.2, 0.2, 0.2});
-	world->scene[3]->setMaterial(matte3);
-
-	world->scene.push_back(
-		std::make_shared<Plane>(atlas::math::Point{ 0, 0, -800 }, atlas::math::Point{ 0, -2, 1 }));
-	world->scene[4]->setColour({ 0.1, 0.1, 0.1 });
-	world->scene[4]->setMaterial(matte3);
-
-	world->scene.push_back(
-		std::make_shared<Triangle>(atlas::math::Point{ -50,0,-200 },
-			atlas::math::Point{ 50,0,-200 },
-			atlas::math::Point{ 0,50,-200 }));
-	world->scene[5]->setColour({ 0, 0, 0});
-	world->scene[5]->setMaterial(matte4);
+		ImageWriter writer{ "raytrace.ppm", world->width, world->height };
+		if (!writer.good() || !camera.renderStreaming(world, writer, budget))
+		{
+			fmt::print("could not write raytrace.ppm\n");
+			return -1;
+		}
+
+		return 0;
+	}
 
 	// set up camera
 	Pinhole camera{};
@@ -659,31 +254,22 @@ int main()
 	
 	camera.computeUVW();
 
+	// --adaptive: 16 to 256 samples per pixel, see World::adaptiveMinSamples
+	bool adaptive{ argc > 1 && std::string{ argv[1] } == "--adaptive" };
+	if (adaptive)
+	{
+		world->sampler = std::make_shared<Sobol>(256);
+		world->adaptiveMinSamples = 16;
+	}
+
 	camera.renderScene(world);
+	printTileStats(world->tileStats);
 
-    saveToFile("raytrace.bmp", world->width, world->height, world->image);
+    saveToFile("raytrace.bmp", world->width, world->height, world->pixels);
+
+	if (adaptive)
+		saveSampleHeatmap("samples.bmp", world->width, world->height, world->sampleCounts);
 
     return 0;
 }
 
-void saveToFile(std::string const& filename,
-                std::size_t width,
-                std::size_t height,
-                std::vector<Colour> const& image)
-{
-    std::vector<unsigned char> data(image.size() * 3);
-
-    for (std::size_t i{0}, k{0}; i < image.size(); ++i, k += 3)
-    {
-        Colour pixel = image[i];
-        data[k + 0]  = static_cast<unsigned char>(pixel.r * 255);
-        data[k + 1]  = static_cast<unsigned char>(pixel.g * 255);
-        data[k + 2]  = static_cast<unsigned char>(pixel.b * 255);
-    }
-
-    stbi_write_bmp(filename.c_str(),
-                   static_cast<int>(width),
-                   static_cast<int>(height),
-                   3,
-                   data.data());
-}
\ No newline at end of file
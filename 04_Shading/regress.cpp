@@ -0,0 +1,470 @@
+#include "lab.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RT_POSIX 1
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#else
+#define RT_POSIX 0
+#endif
+
+// ******* Regression Tests *******
+
+// a render of the regression suite as 8-bit RGB rows
+struct RegressionImage
+{
+	std::size_t width;
+	std::size_t height;
+	std::vector<unsigned char> pixels;
+};
+
+// what a scene's renders measured: the image, the best of three wall times
+// and the peak memory they took beyond what the process already held, -1
+// where that cannot be measured
+struct RegressionRun
+{
+	RegressionImage image;
+	double milliseconds;
+	double megabytes;
+};
+
+// limits of one scene, read from budgets.txt: RMSE in 8-bit levels, the
+// percentage of pixels more than 8 levels off in some channel, the best of
+// three wall times in calibration renders, and the peak memory in MB
+struct RegressionBudget
+{
+	std::string name;
+	double rmse;
+	double differing;
+	double time;
+	double megabytes;
+};
+
+static std::size_t const regressionSide{ 160 };
+
+// every scene of the suite with the render producing it, fixed seeds
+// throughout
+static std::vector<std::pair<std::string, std::function<RegressionImage()>>> regressionScenes()
+{
+	auto fromColours = [](std::vector<Colour> const& image) {
+		RegressionImage result{ regressionSide, regressionSide, std::vector<unsigned char>(3 * image.size()) };
+		for (std::size_t i = 0; i < image.size(); ++i)
+		{
+			Colour pixel = glm::clamp(image[i], 0.0f, 1.0f);
+			result.pixels[3 * i + 0] = static_cast<unsigned char>(pixel.r * 255 + 0.5f);
+			result.pixels[3 * i + 1] = static_cast<unsigned char>(pixel.g * 255 + 0.5f);
+			result.pixels[3 * i + 2] = static_cast<unsigned char>(pixel.b * 255 + 0.5f);
+		}
+		return result;
+	};
+
+	auto fromWorld = [](World const& world) {
+		return RegressionImage{ world.width, world.height, world.pixels };
+	};
+
+	auto stress = [fromWorld](SceneLayout layout) {
+		return [fromWorld, layout] {
+			SceneFile scene{};
+			generateScene(mixedSceneSpec(layout, 20000, 7), scene);
+			scene.settings().width = regressionSide;
+			scene.settings().height = regressionSide;
+			scene.settings().zoom = regressionSide / 600.0f;
+
+			Pinhole camera{};
+			std::shared_ptr<World> world{ scene.makeWorld(camera) };
+			camera.renderScene(world);
+			return fromWorld(*world);
+		};
+	};
+
+	return {
+		{ "checkerboard", [fromColours] {
+			std::vector<Colour> image;
+			renderCheckerboardLab(regressionSide, 16, image);
+			return fromColours(image);
+		} },
+		{ "sphere", [fromColours] {
+			std::vector<Colour> image;
+			renderSphereLab(regressionSide, image);
+			return fromColours(image);
+		} },
+		{ "camera", [fromWorld] {
+			Pinhole camera{};
+			std::shared_ptr<World> world{ makeCameraLabScene(regressionSide, camera) };
+			camera.renderScene(world);
+			return fromWorld(*world);
+		} },
+		{ "shading", [fromWorld] {
+			std::shared_ptr<World> world{ makeShadingScene() };
+			world->width = regressionSide;
+			world->height = regressionSide;
+
+			Pinhole camera{};
+			camera.setEye({ 0, 0, 1 });
+			camera.setZoom(regressionSide / 600.0f);
+			camera.computeUVW();
+			camera.renderScene(world);
+			return fromWorld(*world);
+		} },
+		{ "stress-uniform", stress(SceneLayout::Uniform) },
+		{ "stress-clustered", stress(SceneLayout::Clustered) },
+		{ "stress-uneven", stress(SceneLayout::Uneven) },
+	};
+}
+
+static bool readRegressionBudgets(std::string const& filename, std::vector<RegressionBudget>& budgets)
+{
+	std::ifstream file{ filename };
+	if (!file)
+		return false;
+
+	std::string name;
+	while (file >> name)
+	{
+		if (name[0] == '#')
+		{
+			std::getline(file, name);
+			continue;
+		}
+
+		RegressionBudget budget{ name, 0.0, 0.0, 0.0, 0.0 };
+		if (!(file >> budget.rmse >> budget.differing >> budget.time >> budget.megabytes))
+			return false;
+		budgets.push_back(budget);
+	}
+
+	return true;
+}
+
+static bool writeRegressionImage(std::string const& filename, RegressionImage const& image)
+{
+	ImageWriter writer{ filename, image.width, image.height };
+	return writer.good() && writer.writeRows(image.pixels.data(), image.height) && writer.finish();
+}
+
+// the unit of the time budgets: the first lab's sphere at eight times the
+// suite's side, code that changes to the renderer leave alone
+static RegressionImage calibrationRender()
+{
+	std::vector<Colour> image;
+	renderSphereLab(8 * regressionSide, image);
+	return RegressionImage{ 8 * regressionSide, 8 * regressionSide, {} };
+}
+
+static RegressionRun timeRegressionRenders(std::function<RegressionImage()> const& render)
+{
+	using Clock = std::chrono::steady_clock;
+	using Milliseconds = std::chrono::duration<double, std::milli>;
+
+	RegressionRun run{ {}, std::numeric_limits<double>::max(), -1.0 };
+	for (int i = 0; i < 3; ++i)
+	{
+		auto start = Clock::now();
+		run.image = render();
+		run.milliseconds = std::min(run.milliseconds, Milliseconds{ Clock::now() - start }.count());
+	}
+	return run;
+}
+
+#if RT_POSIX
+static bool readAll(int file, void* data, std::size_t size)
+{
+	char* p{ static_cast<char*>(data) };
+	while (size > 0)
+	{
+		ssize_t n{ read(file, p, size) };
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= static_cast<std::size_t>(n);
+	}
+	return true;
+}
+
+static bool writeAll(int file, void const* data, std::size_t size)
+{
+	char const* p{ static_cast<char const*>(data) };
+	while (size > 0)
+	{
+		ssize_t n{ write(file, p, size) };
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= static_cast<std::size_t>(n);
+	}
+	return true;
+}
+#endif
+
+// times render and, on POSIX, measures its peak memory: the renders run in
+// a child process whose peak resident set (ru_maxrss) starts from its own
+// few pages rather than the parent's, so it grows by what the renders
+// touch. Elsewhere they run here with the memory left unmeasured. False if
+// the child fails
+static bool measureRegression(std::function<RegressionImage()> const& render, RegressionRun& run)
+{
+#if RT_POSIX
+	struct Header
+	{
+		std::uint64_t width, height, bytes;
+		double milliseconds, megabytes;
+	};
+
+	int pipes[2];
+	if (pipe(pipes) != 0)
+		return false;
+
+	// or the child flushes a copy of anything still buffered
+	std::fflush(stdout);
+	pid_t child{ fork() };
+	if (child == 0)
+	{
+		close(pipes[0]);
+		rusage before{};
+		getrusage(RUSAGE_SELF, &before);
+		RegressionRun result{ timeRegressionRenders(render) };
+		rusage after{};
+		getrusage(RUSAGE_SELF, &after);
+
+		// kilobytes, bytes on macOS
+#if defined(__APPLE__)
+		double const unit{ 1.0 };
+#else
+		double const unit{ 1024.0 };
+#endif
+		Header header{ result.image.width, result.image.height, result.image.pixels.size(), result.milliseconds,
+			static_cast<double>(after.ru_maxrss - before.ru_maxrss) * unit / (1 << 20) };
+		bool sent{ writeAll(pipes[1], &header, sizeof(header)) &&
+			writeAll(pipes[1], result.image.pixels.data(), result.image.pixels.size()) };
+		_exit(sent ? 0 : 1);
+	}
+
+	close(pipes[1]);
+	Header header{};
+	bool ok{ child > 0 && readAll(pipes[0], &header, sizeof(header)) };
+	if (ok)
+	{
+		run = { { header.width, header.height, std::vector<unsigned char>(header.bytes) },
+			header.milliseconds, header.megabytes };
+		ok = readAll(pipes[0], run.image.pixels.data(), run.image.pixels.size());
+	}
+	close(pipes[0]);
+
+	int status{ 0 };
+	if (child > 0)
+		waitpid(child, &status, 0);
+	return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#else
+	run = timeRegressionRenders(render);
+	return true;
+#endif
+}
+
+// saves a scene whose integers do not fit a float's 24 bits of mantissa,
+// the seed and a material index, in both file forms to the temporary
+// directory and loads it back. Returns what did not survive, empty when
+// everything did
+static std::string checkSceneRoundTrip()
+{
+	std::error_code error;
+	std::filesystem::path const dir{ std::filesystem::temp_directory_path(error) };
+	if (error)
+		return " no temporary directory: " + error.message();
+
+	// a random name, so runs at the same time do not share files
+	std::string const stem{ fmt::format("shading-roundtrip-{:08x}", std::random_device{}()) };
+
+	SceneFile scene{};
+	scene.settings().seed = 123456789;
+	scene.settings().numSamples = 16777217;
+	for (std::uint32_t m = 0; m < 3; ++m)
+		scene.addMaterial({ 0.25f, 0.65f, { 1, 1, 1 } });
+	scene.addSphere({ { 0, 0, 0 }, 1.0f, 2 });
+
+	std::string problems;
+	for (std::string const& extension : { std::string{ ".scn" }, std::string{ ".scb" } })
+	{
+		std::string const filename{ (dir / (stem + extension)).string() };
+		bool saved{ extension == ".scn" ? scene.saveText(filename) : scene.saveBinary(filename) };
+
+		// the loaded scene maps the binary file, it goes before the file
+		{
+			SceneFile loaded{};
+			if (!saved || !loaded.load(filename))
+			{
+				problems += " " + extension + " " + (saved ? loaded.getError() : scene.getError());
+			}
+			else if (loaded.settings().seed != scene.settings().seed ||
+				loaded.settings().numSamples != scene.settings().numSamples ||
+				loaded.spheres().size != 1 || loaded.spheres()[0].material != 2)
+			{
+				problems += fmt::format(" {} seed {} samples {}", extension, loaded.settings().seed,
+					loaded.settings().numSamples);
+			}
+		}
+		std::remove(filename.c_str());
+	}
+	return problems;
+}
+
+// checks the scene file round trip, times the calibration render, then
+// renders every scene, keeping the fastest of three runs, and checks it
+// against dir/<name>.ppm and the budgets in dir/budgets.txt; a failing
+// render is left in dir/<name>.fail.ppm. With update the references and
+// budgets are rewritten from this build instead: default tolerances, twice
+// the time plus 20 ms (in calibration renders of this run) and a quarter
+// more memory. Returns the exit code
+static int runRegression(std::string const& dir, bool update)
+{
+	std::string const budgetFile{ dir + "/budgets.txt" };
+	std::vector<RegressionBudget> budgets;
+	if (!update && !readRegressionBudgets(budgetFile, budgets))
+	{
+		fmt::print("could not read {}\n", budgetFile);
+		return -1;
+	}
+
+	// times are compared as multiples of this, so budgets hold on faster
+	// and slower hosts alike
+	RegressionRun calibration{};
+	if (!measureRegression(calibrationRender, calibration) || calibration.milliseconds <= 0.0)
+	{
+		fmt::print("calibration render failed\n");
+		return -1;
+	}
+
+	fmt::print("calibration render {:.1f} ms\n", calibration.milliseconds);
+	fmt::print("{:<18} {:>8} {:>9} {:>16} {:>16}\n", "scene", "rmse", "differ %", "time (budget)", "peak MB (budget)");
+
+	std::size_t failures{ 0 };
+	std::string roundTrip{ checkSceneRoundTrip() };
+	fmt::print("{:<18} {:>8} {:>9} {:>16} {:>16}  {}\n", "scene-file", "-", "-", "-", "-",
+		roundTrip.empty() ? "ok" : "FAIL" + roundTrip);
+	failures += roundTrip.empty() ? 0 : 1;
+
+	std::string updated{ "# scene  max rmse  max differing %  max time (calibration renders)  max peak MB\n" };
+	for (auto const& [name, render] : regressionScenes())
+	{
+		RegressionRun run{};
+		if (!measureRegression(render, run))
+		{
+			fmt::print("{:<18} render failed\n", name);
+			if (update)
+				return -1;
+			++failures;
+			continue;
+		}
+
+		RegressionImage const& image{ run.image };
+		double time{ run.milliseconds / calibration.milliseconds };
+		std::string reference{ dir + "/" + name + ".ppm" };
+
+		if (update)
+		{
+			if (!writeRegressionImage(reference, image))
+			{
+				fmt::print("could not write {}\n", reference);
+				return -1;
+			}
+
+			fmt::print("{:<18} {:>8} {:>9} {:>16.2f} {:>16.2f}\n", name, "-", "-", time, run.megabytes);
+			updated += fmt::format("{} 1.0 0.5 {:.2f} {:.2f}\n", name,
+				std::ceil(100.0 * (2.0 * time + 20.0 / calibration.milliseconds)) / 100.0,
+				std::ceil(125.0 * std::max(run.megabytes, 0.0) + 1.0) / 100.0);
+			continue;
+		}
+
+		auto budget = std::find_if(budgets.begin(), budgets.end(),
+			[&name = name](RegressionBudget const& b) { return b.name == name; });
+
+		int width{ 0 }, height{ 0 }, channels{ 0 };
+		unsigned char* expected = stbi_load(reference.c_str(), &width, &height, &channels, 3);
+
+		std::string problems;
+		double rmse{ 0.0 };
+		double differing{ 0.0 };
+		if (expected == nullptr || budget == budgets.end())
+		{
+			problems = expected == nullptr ? "no reference" : "no budget";
+		}
+		else if (static_cast<std::size_t>(width) != image.width || static_cast<std::size_t>(height) != image.height)
+		{
+			problems = "size";
+		}
+		else
+		{
+			std::size_t pixels{ image.width * image.height };
+			std::size_t off{ 0 };
+			for (std::size_t i = 0; i < pixels; ++i)
+			{
+				int worst{ 0 };
+				for (std::size_t k = 3 * i; k < 3 * i + 3; ++k)
+				{
+					int d{ image.pixels[k] - expected[k] };
+					rmse += d * d;
+					worst = std::max(worst, std::abs(d));
+				}
+				off += worst > 8 ? 1 : 0;
+			}
+			rmse = std::sqrt(rmse / (3 * pixels));
+			differing = 100.0 * off / pixels;
+
+			if (rmse > budget->rmse || differing > budget->differing)
+				problems += " image";
+			if (time > budget->time)
+				problems += " time";
+			if (run.megabytes > budget->megabytes)
+				problems += " memory";
+		}
+
+		if (expected != nullptr)
+			stbi_image_free(expected);
+
+		// an unmeasured peak (-1) prints as such and never fails
+		bool known{ budget != budgets.end() };
+		std::string timing{ known ? fmt::format("{:.2f} ({:.2f})", time, budget->time) : "-" };
+		std::string memory{ known && run.megabytes >= 0.0 ?
+			fmt::format("{:.2f} ({:.2f})", run.megabytes, budget->megabytes) : "-" };
+		fmt::print("{:<18} {:>8.3f} {:>9.3f} {:>16} {:>16}  {}\n", name, rmse, differing, timing, memory,
+			problems.empty() ? "ok" : "FAIL" + problems);
+
+		if (!problems.empty())
+		{
+			++failures;
+			writeRegressionImage(dir + "/" + name + ".fail.ppm", image);
+		}
+	}
+
+	if (update)
+	{
+		std::ofstream file{ budgetFile };
+		file << updated;
+		if (!file)
+		{
+			fmt::print("could not write {}\n", budgetFile);
+			return -1;
+		}
+		return 0;
+	}
+
+	fmt::print("{} failed\n", failures);
+	return failures > 0 ? 1 : 0;
+}
+
+// ******* Driver Code *******
+
+// --regress [dir], --regress-update [dir]: checks the lab and stress
+// scenes against the reference images and budgets in dir (regress), or
+// rewrites those from this build; no arguments is --regress
+int main(int argc, char* argv[])
+{
+	bool update{ argc > 1 && std::string{ argv[1] } == "--regress-update" };
+	if (argc > 3 || (argc > 1 && !update && std::string{ argv[1] } != "--regress"))
+	{
+		fmt::print("usage: --regress [dir] | --regress-update [dir]\n");
+		return -1;
+	}
+
+	return runRegression(argc > 2 ? argv[2] : "regress", update);
+}